@@ -1,154 +1,669 @@
+/**
+ * bloomd-bench is a load generator for bloomd. Each thread
+ * drives a set of connections, pipelining up to a fixed depth
+ * of requests on each. Requests are a mix of check, set and
+ * multi commands, with the filters and keys drawn from Zipf
+ * distributions to model skewed popularity.
+ *
+ * With a target rate, the load is open loop: requests are
+ * scheduled at fixed intervals regardless of how fast the
+ * server responds, and latency is measured from the scheduled
+ * time, so a stalled server is not hidden by the client
+ * backing off. Without a rate, each connection keeps its
+ * pipeline full, which measures the peak throughput.
+ */
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
-static int NUM_THREADS = 1;
-static int NUM_KEYS = 1000000;
-static char* HOST = "127.0.0.1";
-static int PORT = 8673;
-static char *FILTER_NAME = "foobar%d";
+/**
+ * The request types, and their commands
+ */
+#define REQ_CHECK 0
+#define REQ_SET 1
+#define REQ_MULTI 2
+#define NUM_REQ_TYPES 3
+static const char *REQ_NAMES[] = {"check", "set", "multi", "all"};
+static const char *REQ_CMDS[] = {"c", "s", "m"};
+
+/**
+ * The latency histogram is log-linear, like an HDR histogram.
+ * Values below 2^HIST_SUB_BITS are exact, and above that each
+ * power of two is split into 2^(HIST_SUB_BITS-1) buckets, which
+ * bounds the error to about 1.5%. Values are in microseconds.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_SHIFT 40
+#define HIST_BUCKETS (HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_HALF_COUNT)
+
+/**
+ * Size of the connection input buffer
+ */
+#define IN_BUF_SIZE 65536
 
+/**
+ * Stores a latency histogram
+ */
 typedef struct {
-    int conn_fd;
-    char filter_name[32];
-    char cmd_buf[128];
-} conn_info;
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram;
+
+/**
+ * A request that has been sent, and is waiting on a response
+ */
+typedef struct {
+    uint64_t intended;  // When the request was scheduled, in nsec
+    int type;
+} request;
+
+/**
+ * A connection to bloomd. Requests are appended to the output
+ * buffer, and the responses are matched to the pending requests
+ * in order, since each command has a single line response.
+ */
+typedef struct {
+    int fd;
+    char *out;
+    int out_len;
+    int out_off;
+    int out_size;
+    char in[IN_BUF_SIZE];
+    int in_len;
+    request *pending;   // Ring of depth requests
+    int pending_head;
+    int pending_count;
+} bench_conn;
+
+/**
+ * Per-thread state and results
+ */
+typedef struct {
+    int id;
+    pthread_t thread;
+    bench_conn *conns;
+    int num_conns;
+    uint64_t rng;
+    histogram hist[NUM_REQ_TYPES];
+    uint64_t errors;
+    int failed;
+} bench_thread;
+
+/**
+ * A Zipf distribution over [0, n). The CDF is precomputed,
+ * and sampled with a binary search. Uniform if s is 0.
+ */
+typedef struct {
+    uint64_t n;
+    double s;
+    double *cdf;
+} zipf_dist;
+
+/**
+ * The benchmark options
+ */
+static char *HOST = "127.0.0.1";
+static int PORT = 8673;
+static int NUM_THREADS = 1;
+static int NUM_CONNS = 1;
+static int DEPTH = 1;
+static uint64_t NUM_FILTERS = 1;
+static double FILTER_ZIPF = 0;
+static uint64_t NUM_KEYS = 1000000;
+static double KEY_ZIPF = 0;
+static int MIX[NUM_REQ_TYPES] = {80, 20, 0};
+static int MULTI_KEYS = 10;
+static double RATE = 0;
+static double DURATION = 10;
+static char *FILTER_PREFIX = "bench";
+static uint64_t SEED = 0;
+
+static zipf_dist FILTERS;
+static zipf_dist KEYS;
+
+// Used to start all the threads at once
+static pthread_mutex_t START_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t START_COND = PTHREAD_COND_INITIALIZER;
+static int READY = 0;
+static uint64_t START_TIME = 0;
+
+
+/**
+ * Returns the monotonic time in nanoseconds
+ */
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * xorshift64* generator, one per thread
+ */
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+// Returns a uniform double in [0, 1)
+static double next_unit(uint64_t *state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Prepares a Zipf distribution
+ */
+static void zipf_init(zipf_dist *z, uint64_t n, double s) {
+    z->n = n;
+    z->s = s;
+    z->cdf = NULL;
+    if (s == 0) return;
 
-int connect_fd(conn_info *info) {
+    z->cdf = malloc(n * sizeof(double));
+    double sum = 0;
+    for (uint64_t i=0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        z->cdf[i] = sum;
+    }
+    for (uint64_t i=0; i < n; i++) {
+        z->cdf[i] /= sum;
+    }
+}
+
+/**
+ * Samples a Zipf distribution. Rank 0 is the most popular.
+ */
+static uint64_t zipf_sample(zipf_dist *z, uint64_t *rng) {
+    if (!z->cdf) return next_rand(rng) % z->n;
+    double u = next_unit(rng);
+    uint64_t low = 0, high = z->n - 1;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (z->cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Maps a value to its histogram bucket
+ */
+static int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_SHIFT) return HIST_BUCKETS - 1;
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT +
+        (int)((value >> shift) - HIST_HALF_COUNT);
+}
+
+/**
+ * Returns the highest value that maps to a bucket
+ */
+static uint64_t hist_bucket_value(int bucket) {
+    if (bucket < HIST_SUB_COUNT) return bucket;
+    int shift = (bucket - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    uint64_t top = (bucket - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(histogram *h, uint64_t value) {
+    h->counts[hist_bucket(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+static void hist_merge(histogram *into, histogram *h) {
+    for (int i=0; i < HIST_BUCKETS; i++) into->counts[i] += h->counts[i];
+    into->total += h->total;
+    into->sum += h->sum;
+    if (h->max > into->max) into->max = h->max;
+}
+
+/**
+ * Returns the value at a percentile
+ */
+static uint64_t hist_percentile(histogram *h, double percentile) {
+    if (!h->total) return 0;
+    uint64_t target = (uint64_t)ceil(h->total * percentile / 100.0);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = hist_bucket_value(i);
+            return (value < h->max) ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Connects to bloomd
+ * @return The fd, or -1 on error.
+ */
+static int connect_bloomd() {
     struct sockaddr_in addr;
     bzero(&addr, sizeof(addr));
     addr.sin_family = PF_INET;
     addr.sin_port = htons(PORT);
-    inet_pton(PF_INET, HOST, &addr.sin_addr);
+    if (inet_pton(PF_INET, HOST, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address '%s'!\n", HOST);
+        return -1;
+    }
 
-    info->conn_fd = socket(PF_INET, SOCK_STREAM, 0);
-    return connect(info->conn_fd, (struct sockaddr*)&addr, sizeof(addr));
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Failed to connect to %s:%d! %s\n", HOST, PORT, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    return fd;
 }
 
-int timediff(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
+/**
+ * Creates the filters, if they do not exist
+ * @return 0 on success.
+ */
+static int create_filters() {
+    int fd = connect_bloomd();
+    if (fd < 0) return 1;
+    FILE *fh = fdopen(fd, "r+");
+
+    char line[256];
+    for (uint64_t i=0; i < NUM_FILTERS; i++) {
+        fprintf(fh, "create %s%llu\n", FILTER_PREFIX, (unsigned long long)i);
+        fflush(fh);
+        if (!fgets(line, sizeof(line), fh)) {
+            fprintf(stderr, "Connection closed while creating filters!\n");
+            fclose(fh);
+            return 1;
+        }
+        if (strcmp(line, "Done\n") && strcmp(line, "Exists\n")) {
+            fprintf(stderr, "Failed to create filter %s%llu: %s",
+                    FILTER_PREFIX, (unsigned long long)i, line);
+            fclose(fh);
+            return 1;
+        }
+    }
+    fclose(fh);
+    return 0;
 }
 
-void *thread_main(void *in) {
-    printf("Thread started.");
-    conn_info info;
-    int sets = 0;
-    int checks = 0;
+/**
+ * Appends a random request to a connection
+ */
+static void add_request(bench_thread *t, bench_conn *conn, uint64_t intended) {
+    // Pick the type
+    int total = MIX[REQ_CHECK] + MIX[REQ_SET] + MIX[REQ_MULTI];
+    int pick = next_rand(&t->rng) % total;
+    int type = REQ_CHECK;
+    while (pick >= MIX[type]) pick -= MIX[type++];
 
-    // Generate a filter name
-    char *buf = (char*)&info.filter_name;
-    sprintf(buf, FILTER_NAME, rand());
-    printf("Using filter: %s\n", buf);
+    // Make room for the command
+    int keys = (type == REQ_MULTI) ? MULTI_KEYS : 1;
+    int max_len = strlen(FILTER_PREFIX) + 32 + keys * 24;
+    if (conn->out_off == conn->out_len) conn->out_off = conn->out_len = 0;
+    if (conn->out_len + max_len > conn->out_size) {
+        conn->out_size = (conn->out_len + max_len) * 2;
+        conn->out = realloc(conn->out, conn->out_size);
+    }
 
-    struct timeval start_connect, start_create, start_set, start_check, end;
-    char out_buf[16];
-    int num, sent, len;
+    // Build the command
+    char *buf = conn->out + conn->out_len;
+    int len = sprintf(buf, "%s %s%llu", REQ_CMDS[type], FILTER_PREFIX,
+            (unsigned long long)zipf_sample(&FILTERS, &t->rng));
+    for (int i=0; i < keys; i++) {
+        len += sprintf(buf + len, " key%llu",
+                (unsigned long long)zipf_sample(&KEYS, &t->rng));
+    }
+    buf[len++] = '\n';
+    conn->out_len += len;
 
-    // Connect
-    gettimeofday(&start_connect, NULL);
-    int res = connect_fd(&info);
-    if (res) {
-        printf("Failed to connect!");
-        return NULL;
-    }
-    gettimeofday(&end, NULL);
-    printf("Connect: %d msec\n", timediff(&start_connect, &end));
-
-    // Make filer
-    gettimeofday(&start_create, NULL);
-
-    len = sprintf((char*)&info.cmd_buf, "create %s\n", buf);
-    send(info.conn_fd, info.cmd_buf, len, 0);
-    num = recv(info.conn_fd, (char*)&out_buf, 5, 0);
-    if (strcmp(out_buf, "Done\n") != 0) {
-        printf("Failed to create filter!");
-        return NULL;
-   }
-
-    gettimeofday(&end, NULL);
-    printf("Create: %d msec\n", timediff(&start_create, &end));
-
-    // Set
-    gettimeofday(&start_set, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "set %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send!");
-            return NULL;
+    // Track it
+    request *r = conn->pending + (conn->pending_head + conn->pending_count) % DEPTH;
+    r->intended = intended;
+    r->type = type;
+    conn->pending_count++;
+}
+
+/**
+ * Writes as much of the output buffer as possible
+ * @return 0 on success.
+ */
+static int write_conn(bench_conn *conn) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t res = write(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off);
+        if (res > 0) {
+            conn->out_off += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        } else {
+            return 1;
         }
     }
+    return 0;
+}
+
+/**
+ * Reads the responses, and completes the pending requests
+ * @return 0 on success.
+ */
+static int read_conn(bench_thread *t, bench_conn *conn, uint64_t end) {
+    ssize_t res = read(conn->fd, conn->in + conn->in_len, IN_BUF_SIZE - conn->in_len);
+    if (res == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (res <= 0) return 1;
+    conn->in_len += res;
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        num = recv(info.conn_fd, (char*)out_buf, 1, 0);
-        if (num == -1) {
-            printf("Failed to read!");
-            return NULL;
+    uint64_t now = now_nsec();
+    char *line = conn->in;
+    char *newline;
+    while ((newline = memchr(line, '\n', conn->in_len - (line - conn->in)))) {
+        if (!conn->pending_count) {
+            fprintf(stderr, "Unexpected response: %.*s\n", (int)(newline - line), line);
+            return 1;
         }
-        if (out_buf[0] == 'Y') {
-            sets++;
-            recv(info.conn_fd, (char*)out_buf, 3, 0); // Yes\n
-        } else {
-            recv(info.conn_fd, (char*)out_buf, 2, 0); // No\n
+
+        // Complete the oldest request
+        request *r = conn->pending + conn->pending_head;
+        conn->pending_head = (conn->pending_head + 1) % DEPTH;
+        conn->pending_count--;
+        if (strncmp(line, "Yes", 3) && strncmp(line, "No", 2)) {
+            t->errors++;
+        } else if (now <= end) {
+            hist_record(t->hist + r->type, (now - r->intended) / 1000);
         }
+        line = newline + 1;
     }
-    gettimeofday(&end, NULL);
-    printf("Set: %d msec. Num: %d\n", timediff(&start_set, &end), sets);
-
-    // Check
-    gettimeofday(&start_check, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "check %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send! (check)");
-            return NULL;
-        }
+
+    // Keep any partial response
+    conn->in_len -= line - conn->in;
+    memmove(conn->in, line, conn->in_len);
+    if (conn->in_len == IN_BUF_SIZE) {
+        fprintf(stderr, "Response too long!\n");
+        return 1;
     }
+    return 0;
+}
+
+/**
+ * Polls the connections. The timeout is in nanoseconds, since
+ * at high rates requests are due more often than every msec.
+ */
+static int wait_conns(struct pollfd *fds, int num, uint64_t timeout) {
+#ifdef __linux__
+    struct timespec ts = {timeout / 1000000000, timeout % 1000000000};
+    return ppoll(fds, num, &ts, NULL);
+#else
+    return poll(fds, num, (timeout + 999999) / 1000000);
+#endif
+}
+
+/**
+ * Entry point for the benchmark threads
+ */
+static void* thread_main(void *in) {
+    bench_thread *t = in;
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        num = recv(info.conn_fd, (char*)out_buf, 1, 0);
-        if (num == -1) {
-            printf("Failed to read! (check)");
-            return NULL;
+    // Connect
+    for (int i=0; i < t->num_conns; i++) {
+        bench_conn *conn = t->conns + i;
+        conn->fd = connect_bloomd();
+        if (conn->fd < 0) {
+            t->failed = 1;
+            t->num_conns = i;
+            break;
         }
-        if (out_buf[0] == 'Y') {
-            checks++;
-            recv(info.conn_fd, (char*)out_buf, 3, 0); // Yes\n
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+        conn->pending = calloc(DEPTH, sizeof(request));
+    }
+
+    // Wait for everybody to be connected
+    pthread_mutex_lock(&START_LOCK);
+    READY++;
+    pthread_cond_broadcast(&START_COND);
+    while (!START_TIME) pthread_cond_wait(&START_COND, &START_LOCK);
+    uint64_t start = START_TIME;
+    pthread_mutex_unlock(&START_LOCK);
+    if (t->failed) return NULL;
+
+    // Each thread schedules its share of the rate
+    uint64_t end = start + (uint64_t)(DURATION * 1e9);
+    uint64_t interval = (RATE > 0) ? (uint64_t)(1e9 * NUM_THREADS / RATE) : 0;
+    uint64_t next_send = start;
+    int next_conn = 0;
+    struct pollfd *fds = calloc(t->num_conns, sizeof(struct pollfd));
+
+    uint64_t now;
+    while ((now = now_nsec()) < end) {
+        // Issue requests
+        if (!interval) {
+            for (int i=0; i < t->num_conns; i++) {
+                bench_conn *conn = t->conns + i;
+                while (conn->pending_count < DEPTH) add_request(t, conn, now);
+            }
         } else {
-            recv(info.conn_fd, (char*)out_buf, 2, 0); // No\n
+            // Requests that can not be sent stay scheduled, so
+            // their latency includes the time spent waiting
+            while (next_send <= now && next_send < end) {
+                int i, found = 0;
+                for (i=0; i < t->num_conns; i++) {
+                    bench_conn *conn = t->conns + (next_conn + i) % t->num_conns;
+                    if (conn->pending_count < DEPTH) {
+                        add_request(t, conn, next_send);
+                        found = 1;
+                        break;
+                    }
+                }
+                if (!found) break;
+                next_conn = (next_conn + i + 1) % t->num_conns;
+                next_send += interval;
+            }
+        }
+
+        // Send everything at once
+        for (int i=0; i < t->num_conns; i++) {
+            if (write_conn(t->conns + i)) {
+                fprintf(stderr, "Failed to write to bloomd! %s\n", strerror(errno));
+                t->failed = 1;
+                goto DONE;
+            }
+            fds[i].fd = t->conns[i].fd;
+            fds[i].events = POLLIN;
+            if (t->conns[i].out_off < t->conns[i].out_len) fds[i].events |= POLLOUT;
+        }
+
+        // Wait for responses, or the next scheduled request
+        uint64_t timeout = 100000000;
+        if (interval) {
+            now = now_nsec();
+            timeout = (next_send > now) ? next_send - now : 0;
+            if (timeout > 100000000) timeout = 100000000;
+        }
+        if (wait_conns(fds, t->num_conns, timeout) < 0 && errno != EINTR) {
+            t->failed = 1;
+            break;
+        }
+        for (int i=0; i < t->num_conns; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (read_conn(t, t->conns + i, end)) {
+                    fprintf(stderr, "Connection to bloomd closed!\n");
+                    t->failed = 1;
+                    goto DONE;
+                }
+            }
         }
     }
-    gettimeofday(&end, NULL);
-    printf("Check: %d msec. Num: %d\n", timediff(&start_check, &end), checks);
 
+DONE:
+    free(fds);
+    for (int i=0; i < t->num_conns; i++) {
+        close(t->conns[i].fd);
+        free(t->conns[i].out);
+        free(t->conns[i].pending);
+    }
     return NULL;
 }
 
+/**
+ * Prints a row of the latency table
+ */
+static void print_row(const char *name, histogram *h, double secs) {
+    printf("%-6s %12llu %10.0f %8.0f %8llu %8llu %8llu %8llu %8llu %8llu\n",
+            name, (unsigned long long)h->total, h->total / secs,
+            (h->total) ? (double)h->sum / h->total : 0,
+            (unsigned long long)hist_percentile(h, 50),
+            (unsigned long long)hist_percentile(h, 90),
+            (unsigned long long)hist_percentile(h, 99),
+            (unsigned long long)hist_percentile(h, 99.9),
+            (unsigned long long)hist_percentile(h, 99.99),
+            (unsigned long long)h->max);
+}
+
+static void show_usage() {
+    printf("usage: bloomd-bench [options]\n\
+\n\
+    -H host      bloomd address. Defaults to 127.0.0.1\n\
+    -p port      bloomd port. Defaults to 8673\n\
+    -t threads   Client threads. Defaults to 1\n\
+    -c conns     Total connections, spread over the threads. Defaults to 1\n\
+    -d depth     Requests pipelined per connection. Defaults to 1\n\
+    -f filters   Number of filters. Defaults to 1\n\
+    -F zipf      Zipf exponent of the filter popularity. Defaults to 0, uniform\n\
+    -k keys      Number of distinct keys. Defaults to 1000000\n\
+    -K zipf      Zipf exponent of the key popularity. Defaults to 0, uniform\n\
+    -m c:s:m     Ratio of check, set and multi requests. Defaults to 80:20:0\n\
+    -b keys      Keys per multi request. Defaults to 10\n\
+    -r rate      Target requests per second, open loop. Defaults to 0,\n\
+                 which keeps every pipeline full\n\
+    -D secs      Duration of the run. Defaults to 10\n\
+    -P prefix    Filter name prefix. Defaults to bench\n\
+    -s seed      Random seed. Defaults to the time\n\
+    -h           Show this help\n");
+}
+
 int main(int argc, char **argv) {
-    // Read random seed
-    int randfh = open("/dev/random", O_RDONLY);
-    unsigned seed = 0;
-    read(randfh, &seed, sizeof(seed));
-    close(randfh);
+    int c;
+    while ((c = getopt(argc, argv, "H:p:t:c:d:f:F:k:K:m:b:r:D:P:s:h")) != -1) {
+        switch (c) {
+            case 'H': HOST = optarg; break;
+            case 'p': PORT = atoi(optarg); break;
+            case 't': NUM_THREADS = atoi(optarg); break;
+            case 'c': NUM_CONNS = atoi(optarg); break;
+            case 'd': DEPTH = atoi(optarg); break;
+            case 'f': NUM_FILTERS = strtoull(optarg, NULL, 10); break;
+            case 'F': FILTER_ZIPF = atof(optarg); break;
+            case 'k': NUM_KEYS = strtoull(optarg, NULL, 10); break;
+            case 'K': KEY_ZIPF = atof(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d", MIX, MIX + 1, MIX + 2) != 3) {
+                    fprintf(stderr, "Invalid mix '%s'!\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b': MULTI_KEYS = atoi(optarg); break;
+            case 'r': RATE = atof(optarg); break;
+            case 'D': DURATION = atof(optarg); break;
+            case 'P': FILTER_PREFIX = optarg; break;
+            case 's': SEED = strtoull(optarg, NULL, 10); break;
+            case 'h': show_usage(); return 0;
+            default: show_usage(); return 1;
+        }
+    }
+    if (NUM_THREADS < 1 || NUM_CONNS < NUM_THREADS || DEPTH < 1 || !NUM_FILTERS ||
+            !NUM_KEYS || MULTI_KEYS < 1 || DURATION <= 0 || RATE < 0 ||
+            MIX[0] < 0 || MIX[1] < 0 || MIX[2] < 0 || MIX[0] + MIX[1] + MIX[2] == 0) {
+        fprintf(stderr, "Invalid options! There must be at least one connection per thread.\n");
+        return 1;
+    }
+    if (!SEED) SEED = time(NULL);
+
+    printf("Target: %s:%d. Threads: %d. Connections: %d. Depth: %d.\n",
+            HOST, PORT, NUM_THREADS, NUM_CONNS, DEPTH);
+    printf("Filters: %llu (zipf %.2f). Keys: %llu (zipf %.2f). Mix: %d:%d:%d. Multi keys: %d.\n",
+            (unsigned long long)NUM_FILTERS, FILTER_ZIPF, (unsigned long long)NUM_KEYS,
+            KEY_ZIPF, MIX[0], MIX[1], MIX[2], MULTI_KEYS);
+    if (RATE > 0) printf("Rate: %.0f requests/sec, open loop.\n", RATE);
+    else printf("Rate: unlimited, closed loop.\n");
+
+    // Prepare the filters and distributions
+    if (create_filters()) return 1;
+    zipf_init(&FILTERS, NUM_FILTERS, FILTER_ZIPF);
+    zipf_init(&KEYS, NUM_KEYS, KEY_ZIPF);
+
+    // Start the threads, spreading the connections
+    bench_thread *threads = calloc(NUM_THREADS, sizeof(bench_thread));
+    for (int i=0; i < NUM_THREADS; i++) {
+        bench_thread *t = threads + i;
+        t->id = i;
+        t->num_conns = NUM_CONNS / NUM_THREADS + (i < NUM_CONNS % NUM_THREADS);
+        t->conns = calloc(t->num_conns, sizeof(bench_conn));
+        t->rng = SEED * 0x9E3779B97F4A7C15ULL + i + 1;
+        pthread_create(&t->thread, NULL, thread_main, t);
+    }
+
+    // Start once everybody is connected
+    pthread_mutex_lock(&START_LOCK);
+    while (READY < NUM_THREADS) pthread_cond_wait(&START_COND, &START_LOCK);
+    START_TIME = now_nsec();
+    pthread_cond_broadcast(&START_COND);
+    pthread_mutex_unlock(&START_LOCK);
 
-    srand(seed);
-    pthread_t t[NUM_THREADS];
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_create(&t[i], NULL, thread_main, NULL);
+    // Merge the results
+    histogram *totals = calloc(NUM_REQ_TYPES + 1, sizeof(histogram));
+    uint64_t errors = 0;
+    int failed = 0;
+    for (int i=0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (int j=0; j < NUM_REQ_TYPES; j++) {
+            hist_merge(totals + j, threads[i].hist + j);
+            hist_merge(totals + NUM_REQ_TYPES, threads[i].hist + j);
+        }
+        errors += threads[i].errors;
+        failed |= threads[i].failed;
+        free(threads[i].conns);
     }
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_join(t[i], NULL);
+
+    // Report
+    double secs = (now_nsec() - START_TIME) / 1e9;
+    if (secs > DURATION) secs = DURATION;
+    printf("\nDuration: %.2f sec. Errors: %llu.\n\n", secs, (unsigned long long)errors);
+    printf("%-6s %12s %10s %8s %8s %8s %8s %8s %8s %8s\n", "", "requests", "req/sec",
+            "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    for (int i=0; i <= NUM_REQ_TYPES; i++) {
+        if (i < NUM_REQ_TYPES && !MIX[i]) continue;
+        print_row(REQ_NAMES[i], totals + i, secs);
     }
-    return 0;
+    printf("\nLatencies are in microseconds.\n");
+
+    free(totals);
+    free(threads);
+    free(FILTERS.cdf);
+    free(KEYS.cdf);
+    return (failed) ? 1 : 0;
 }
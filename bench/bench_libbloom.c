@@ -0,0 +1,567 @@
+/**
+ * bench_libbloom measures the hot paths of libbloom in isolation:
+ * hashing, bf_add and bf_contains on hits and misses, sbf_contains
+ * and sbf_add as layers accumulate, the bitmap modes, and flushing.
+ * Filters range from sizes that fit in L1 to far larger than the
+ * last level cache, since the cost of a check is dominated by the
+ * k random memory accesses once the filter stops fitting.
+ *
+ * Filters are pre-filled to a load factor by setting random bits
+ * at the density that many keys would produce, which is much
+ * faster than adding them, and then the hit keys are added.
+ *
+ * On Linux, the cache and TLB misses per operation are read with
+ * perf_event_open. They are omitted if the counters can not be
+ * opened, for example in containers or when perf_event_paranoid
+ * is too restrictive.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "bitmap.h"
+#include "bloom.h"
+#include "sbf.h"
+
+/**
+ * Keys are stored in fixed size slots
+ */
+#define KEY_LEN 24
+
+/**
+ * The false positive rate used to size the filters
+ */
+#define FP_PROB 1e-4
+
+/**
+ * The SBF layers grow from a small initial capacity,
+ * so that twelve layers still fit in memory.
+ */
+#define SBF_INIT_CAPACITY 10000
+#define SBF_SCALE_SIZE 2
+#define SBF_PROB_REDUCTION 0.9
+
+/**
+ * The hardware counters read per benchmark
+ */
+#define NUM_COUNTERS 3
+static const char *COUNTER_NAMES[] = {"L1d/op", "LLC/op", "dTLB/op"};
+
+/**
+ * A pool of keys, used round robin
+ */
+typedef struct {
+    char *keys;
+    uint64_t num;
+} key_pool;
+
+/**
+ * The state of a benchmark. Only the
+ * fields used by the operation are set.
+ */
+typedef struct {
+    bloom_bloomfilter *bf;
+    bloom_sbf *sbf;
+    key_pool *pool;
+    uint32_t k_num;
+} bench_ctx;
+
+/**
+ * Runs ops operations, and returns a value
+ * derived from the results so that they
+ * can not be optimized away.
+ */
+typedef uint64_t(*bench_op)(bench_ctx *ctx, uint64_t ops);
+
+/**
+ * The benchmark options
+ */
+static uint64_t NUM_OPS = 1000000;
+static uint64_t MAX_SIZE = 256 * 1048576ULL;
+static uint64_t MODE_SIZE = 64 * 1048576ULL;
+static double LOAD = 0.5;
+static char *DATA_DIR = "/tmp";
+static char *GROUPS = "hash,bloom,sbf,mode,flush";
+
+// The filter sizes, from L1 resident to far larger than the LLC
+static const uint64_t SIZES[] = {16384, 262144, 4194304, 33554432, 268435456, 1073741824};
+static const int SBF_LAYERS[] = {1, 2, 4, 8, 12};
+
+static int COUNTER_FDS[NUM_COUNTERS] = {-1, -1, -1};
+static uint64_t RNG = 0x9E3779B97F4A7C15ULL;
+static volatile uint64_t SINK;
+
+
+/**
+ * Returns the monotonic time in nanoseconds
+ */
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * xorshift64* generator
+ */
+static uint64_t next_rand() {
+    RNG ^= RNG >> 12;
+    RNG ^= RNG << 25;
+    RNG ^= RNG >> 27;
+    return RNG * 2685821657736338717ULL;
+}
+
+/**
+ * Opens the hardware counters, if available
+ */
+static void open_counters() {
+#ifdef __linux__
+    uint64_t configs[] = {
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    };
+    uint32_t types[] = {PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+    for (int i=0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        COUNTER_FDS[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void start_counters() {
+#ifdef __linux__
+    for (int i=0; i < NUM_COUNTERS; i++) {
+        if (COUNTER_FDS[i] < 0) continue;
+        ioctl(COUNTER_FDS[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(COUNTER_FDS[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/**
+ * Stops the counters, and reads them. Unavailable
+ * counters are set to -1.
+ */
+static void stop_counters(int64_t *counts) {
+    for (int i=0; i < NUM_COUNTERS; i++) {
+        counts[i] = -1;
+#ifdef __linux__
+        if (COUNTER_FDS[i] < 0) continue;
+        ioctl(COUNTER_FDS[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value;
+        if (read(COUNTER_FDS[i], &value, sizeof(value)) == sizeof(value)) {
+            counts[i] = value;
+        }
+#endif
+    }
+}
+
+/**
+ * Creates a pool of keys, with a prefix
+ */
+static void make_pool(key_pool *pool, char *prefix, uint64_t num) {
+    pool->num = (num) ? num : 1;
+    pool->keys = malloc(pool->num * KEY_LEN);
+    for (uint64_t i=0; i < pool->num; i++) {
+        snprintf(pool->keys + i * KEY_LEN, KEY_LEN, "%s%llu", prefix, (unsigned long long)i);
+    }
+}
+
+static inline char* pool_key(key_pool *pool, uint64_t i) {
+    return pool->keys + (i % pool->num) * KEY_LEN;
+}
+
+/**
+ * Pre-fills a filter as if count keys were added. Random bits
+ * are set at the expected density of the keys that are not in
+ * the hit pool, and then the hit pool is added.
+ */
+static void fill_filter(bloom_bloomfilter *bf, uint64_t count, key_pool *hits) {
+    uint64_t random = (count > hits->num) ? count - hits->num : 0;
+    double density = 1 - exp(-(double)bf->header->k_num * random / bf->bitmap_size);
+    uint64_t threshold = density * 65536;
+
+    unsigned char *bits = bf->map->mmap + sizeof(bloom_filter_header);
+    uint64_t len = bf->map->size - sizeof(bloom_filter_header);
+    for (uint64_t i=0; i < len; i += 2) {
+        uint64_t r = next_rand();
+        unsigned int word = 0;
+        for (int j=0; j < 16; j++) {
+            if (((r >> ((j % 4) * 16)) & 0xffff) < threshold) word |= 1 << j;
+            if (j % 4 == 3) r = next_rand();
+        }
+        bits[i] = word & 0xff;
+        if (i + 1 < len) bits[i + 1] = word >> 8;
+    }
+    for (uint64_t i=0; i < hits->num && i < count; i++) {
+        bf_add(bf, pool_key(hits, i));
+    }
+    bf->header->count = count;
+}
+
+/**
+ * Creates a filter of a given size on a bitmap
+ * @return The filter, or NULL on error.
+ */
+static bloom_bloomfilter* make_filter(uint64_t bytes, bitmap_mode mode, char *path,
+        uint64_t *capacity) {
+    bloom_filter_params params = {bytes - sizeof(bloom_filter_header), 0, 0, FP_PROB};
+    bf_capacity_for_size_prob(&params);
+    bf_ideal_k_num(&params);
+    *capacity = params.capacity;
+
+    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
+    int res;
+    if (mode == ANONYMOUS) {
+        res = bitmap_from_file(-1, bytes, ANONYMOUS, map);
+    } else {
+        unlink(path);
+        res = bitmap_from_filename(path, bytes, 1, mode | ((mode == PERSISTENT) ? NEW_BITMAP : 0), map);
+    }
+    if (res) {
+        fprintf(stderr, "Failed to create a %llu byte bitmap! Err: %d\n",
+                (unsigned long long)bytes, res);
+        free(map);
+        return NULL;
+    }
+
+    bloom_bloomfilter *bf = calloc(1, sizeof(bloom_bloomfilter));
+    bf_from_bitmap(map, params.k_num, 1, bf);
+    return bf;
+}
+
+static void close_filter(bloom_bloomfilter *bf) {
+    bloom_bitmap *map = bf->map;
+    bf_close(bf);
+    free(bf);
+    free(map);
+}
+
+/**
+ * The benchmarked operations
+ */
+static uint64_t op_hashes(bench_ctx *ctx, uint64_t ops) {
+    uint64_t hashes[64];
+    uint64_t sum = 0;
+    for (uint64_t i=0; i < ops; i++) {
+        bf_compute_hashes(ctx->k_num, pool_key(ctx->pool, i), hashes);
+        sum += hashes[ctx->k_num - 1];
+    }
+    return sum;
+}
+
+static uint64_t op_bf_add(bench_ctx *ctx, uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i=0; i < ops; i++) sum += bf_add(ctx->bf, pool_key(ctx->pool, i));
+    return sum;
+}
+
+static uint64_t op_bf_contains(bench_ctx *ctx, uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i=0; i < ops; i++) sum += bf_contains(ctx->bf, pool_key(ctx->pool, i));
+    return sum;
+}
+
+static uint64_t op_sbf_add(bench_ctx *ctx, uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i=0; i < ops; i++) sum += sbf_add(ctx->sbf, pool_key(ctx->pool, i));
+    return sum;
+}
+
+static uint64_t op_sbf_contains(bench_ctx *ctx, uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i=0; i < ops; i++) sum += sbf_contains(ctx->sbf, pool_key(ctx->pool, i));
+    return sum;
+}
+
+/**
+ * Formats a byte size
+ */
+static char* format_size(uint64_t bytes, char *buf) {
+    if (bytes >= 1073741824) sprintf(buf, "%lluGB", (unsigned long long)(bytes >> 30));
+    else if (bytes >= 1048576) sprintf(buf, "%lluMB", (unsigned long long)(bytes >> 20));
+    else sprintf(buf, "%lluKB", (unsigned long long)(bytes >> 10));
+    return buf;
+}
+
+/**
+ * Runs and reports a benchmark
+ */
+static void measure(char *name, char *size, bench_op op, bench_ctx *ctx, uint64_t ops) {
+    if (!ops) return;
+    int64_t counts[NUM_COUNTERS];
+    start_counters();
+    uint64_t start = now_nsec();
+    SINK += op(ctx, ops);
+    uint64_t nsec = now_nsec() - start;
+    stop_counters(counts);
+
+    printf("%-28s %10s %10llu %9.1f %9.2f", name, size, (unsigned long long)ops,
+            (double)nsec / ops, ops * 1e3 / nsec);
+    for (int i=0; i < NUM_COUNTERS; i++) {
+        if (counts[i] < 0) printf(" %9s", "-");
+        else printf(" %9.3f", (double)counts[i] / ops);
+    }
+    printf("\n");
+}
+
+static void print_header(char *title) {
+    printf("\n%-28s %10s %10s %9s %9s", title, "size", "ops", "ns/op", "Mops/s");
+    for (int i=0; i < NUM_COUNTERS; i++) printf(" %9s", COUNTER_NAMES[i]);
+    printf("\n");
+}
+
+/**
+ * Hashing, for typical values of k
+ */
+static void bench_hashes(key_pool *keys) {
+    print_header("hash");
+    uint32_t k_nums[] = {4, 7, 14};
+    char name[64];
+    for (int i=0; i < 3; i++) {
+        bench_ctx ctx = {NULL, NULL, keys, k_nums[i]};
+        sprintf(name, "bf_compute_hashes k=%u", k_nums[i]);
+        measure(name, "-", op_hashes, &ctx, NUM_OPS);
+    }
+}
+
+/**
+ * Adds and checks on a filter that is already loaded
+ */
+static void bench_filter(bloom_bloomfilter *bf, uint64_t capacity, char *label, char *size,
+        key_pool *hits, key_pool *misses, key_pool *adds) {
+    char name[64];
+    bench_ctx ctx = {bf, NULL, hits, bf->header->k_num};
+    sprintf(name, "bf_contains hit%s", label);
+    measure(name, size, op_bf_contains, &ctx, NUM_OPS);
+
+    ctx.pool = misses;
+    sprintf(name, "bf_contains miss%s", label);
+    measure(name, size, op_bf_contains, &ctx, NUM_OPS);
+
+    // Only add new keys, up to the capacity
+    uint64_t room = capacity - bf->header->count;
+    ctx.pool = adds;
+    sprintf(name, "bf_add%s", label);
+    measure(name, size, op_bf_add, &ctx, (room < NUM_OPS) ? room : NUM_OPS);
+}
+
+/**
+ * Filters from L1 resident to larger than the LLC
+ */
+static void bench_bloom(key_pool *misses, key_pool *adds) {
+    print_header("bloom");
+    char size[32];
+    for (unsigned i=0; i < sizeof(SIZES) / sizeof(uint64_t); i++) {
+        if (SIZES[i] > MAX_SIZE) break;
+        uint64_t capacity;
+        bloom_bloomfilter *bf = make_filter(SIZES[i], ANONYMOUS, NULL, &capacity);
+        if (!bf) break;
+
+        key_pool hits;
+        uint64_t count = capacity * LOAD;
+        make_pool(&hits, "hit", (count < NUM_OPS) ? count : NUM_OPS);
+        fill_filter(bf, count, &hits);
+        bench_filter(bf, capacity, "", format_size(SIZES[i], size), &hits, misses, adds);
+
+        free(hits.keys);
+        close_filter(bf);
+    }
+}
+
+/**
+ * SBFs with a growing number of layers. A miss checks every
+ * layer, and the hits are in the oldest layer, which is checked
+ * last. Every layer but the newest is full.
+ */
+static void bench_sbf(key_pool *misses, key_pool *adds) {
+    print_header("sbf");
+    char name[64], size[32];
+    for (unsigned i=0; i < sizeof(SBF_LAYERS) / sizeof(int); i++) {
+        bloom_sbf_params params = {SBF_INIT_CAPACITY, FP_PROB, SBF_SCALE_SIZE, SBF_PROB_REDUCTION};
+        bloom_sbf sbf;
+        if (sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf)) break;
+
+        // Mark the newest layer full to add another
+        key_pool grow;
+        make_pool(&grow, "grow", SBF_LAYERS[i]);
+        for (int j=1; j < SBF_LAYERS[i]; j++) {
+            sbf.filters[0]->header->count = sbf.capacities[0];
+            sbf_add(&sbf, pool_key(&grow, j));
+        }
+        free(grow.keys);
+
+        key_pool hits, none = {NULL, 0};
+        uint64_t oldest = sbf.capacities[sbf.num_filters - 1];
+        make_pool(&hits, "hit", (oldest < NUM_OPS) ? oldest : NUM_OPS);
+        for (uint32_t j=0; j < sbf.num_filters; j++) {
+            if (j == 0) fill_filter(sbf.filters[j], sbf.capacities[j] * LOAD, &none);
+            else if (j == sbf.num_filters - 1) fill_filter(sbf.filters[j], sbf.capacities[j], &hits);
+            else fill_filter(sbf.filters[j], sbf.capacities[j], &none);
+        }
+
+        sprintf(name, "%d layers", SBF_LAYERS[i]);
+        format_size(sbf_total_byte_size(&sbf), size);
+        bench_ctx ctx = {NULL, &sbf, &hits, 0};
+        char label[128];
+        sprintf(label, "sbf_contains hit %s", name);
+        measure(label, size, op_sbf_contains, &ctx, NUM_OPS);
+
+        ctx.pool = misses;
+        sprintf(label, "sbf_contains miss %s", name);
+        measure(label, size, op_sbf_contains, &ctx, NUM_OPS);
+
+        uint64_t room = sbf.capacities[0] - sbf.filters[0]->header->count;
+        ctx.pool = adds;
+        sprintf(label, "sbf_add %s", name);
+        measure(label, size, op_sbf_add, &ctx, (room < NUM_OPS) ? room : NUM_OPS);
+
+        free(hits.keys);
+        sbf_close(&sbf);
+    }
+}
+
+/**
+ * The same filter in each of the bitmap modes
+ */
+static void bench_modes(key_pool *misses, key_pool *adds) {
+    print_header("mode");
+    bitmap_mode modes[] = {ANONYMOUS, PERSISTENT, SHARED};
+    char *labels[] = {" anonymous", " persistent", " shared"};
+    char path[1024], size[32];
+    snprintf(path, sizeof(path), "%s/bench_libbloom.data", DATA_DIR);
+    for (int i=0; i < 3; i++) {
+        uint64_t capacity;
+        bloom_bloomfilter *bf = make_filter(MODE_SIZE, modes[i], path, &capacity);
+        if (!bf) continue;
+
+        key_pool hits;
+        uint64_t count = capacity * LOAD;
+        make_pool(&hits, "hit", (count < NUM_OPS) ? count : NUM_OPS);
+        fill_filter(bf, count, &hits);
+        bench_filter(bf, capacity, labels[i], format_size(MODE_SIZE, size), &hits, misses, adds);
+
+        free(hits.keys);
+        close_filter(bf);
+        unlink(path);
+    }
+}
+
+/**
+ * Times a flush, after dirtying some of the pages
+ */
+static void measure_flush(bloom_bloomfilter *bf, char *name, uint64_t stride) {
+    uint64_t bits = bf->map->size * 8;
+    for (uint64_t bit=sizeof(bloom_filter_header) * 8; bit < bits; bit += stride) {
+        bitmap_setbit(bf->map, bit);
+    }
+    uint64_t dirty = bitmap_dirty_bytes(bf->map);
+
+    uint64_t start = now_nsec();
+    int res = bf_flush(bf);
+    uint64_t nsec = now_nsec() - start;
+    if (res) {
+        fprintf(stderr, "Failed to flush! Err: %d\n", res);
+        return;
+    }
+    printf("%-28s %10.1f %10.2f %10.1f\n", name, dirty / 1048576.0, nsec / 1e6,
+            (dirty / 1048576.0) / (nsec / 1e9));
+}
+
+/**
+ * Flush throughput of the file backed modes, with every
+ * page dirty, and with one page in sixteen dirty.
+ */
+static void bench_flush() {
+    printf("\n%-28s %10s %10s %10s\n", "flush", "dirty MB", "msec", "MB/s");
+    bitmap_mode modes[] = {PERSISTENT, SHARED};
+    char *labels[] = {"persistent", "shared"};
+    char path[1024], name[64];
+    snprintf(path, sizeof(path), "%s/bench_libbloom.data", DATA_DIR);
+    for (int i=0; i < 2; i++) {
+        uint64_t capacity;
+        bloom_bloomfilter *bf = make_filter(MODE_SIZE, modes[i], path, &capacity);
+        if (!bf) continue;
+        bf_flush(bf);
+
+        sprintf(name, "bf_flush %s full", labels[i]);
+        measure_flush(bf, name, 4096 * 8);
+        sprintf(name, "bf_flush %s sparse", labels[i]);
+        measure_flush(bf, name, 16 * 4096 * 8);
+
+        close_filter(bf);
+        unlink(path);
+    }
+}
+
+static void show_usage() {
+    printf("usage: bench_libbloom [options]\n\
+\n\
+    -n ops       Operations per benchmark. Defaults to 1000000\n\
+    -s MB        Largest filter size. Defaults to 256\n\
+    -m MB        Filter size for the mode and flush benchmarks. Defaults to 64\n\
+    -l load      Fraction of the capacity filled. Defaults to 0.5\n\
+    -d dir       Directory for the file backed bitmaps. Defaults to /tmp\n\
+    -b groups    Comma separated benchmarks to run, from\n\
+                 hash,bloom,sbf,mode,flush. Defaults to all\n\
+    -h           Show this help\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "n:s:m:l:d:b:h")) != -1) {
+        switch (c) {
+            case 'n': NUM_OPS = strtoull(optarg, NULL, 10); break;
+            case 's': MAX_SIZE = strtoull(optarg, NULL, 10) * 1048576ULL; break;
+            case 'm': MODE_SIZE = strtoull(optarg, NULL, 10) * 1048576ULL; break;
+            case 'l': LOAD = atof(optarg); break;
+            case 'd': DATA_DIR = optarg; break;
+            case 'b': GROUPS = optarg; break;
+            case 'h': show_usage(); return 0;
+            default: show_usage(); return 1;
+        }
+    }
+    if (!NUM_OPS || !MODE_SIZE || LOAD <= 0 || LOAD > 1) {
+        fprintf(stderr, "Invalid options!\n");
+        return 1;
+    }
+
+    open_counters();
+    if (COUNTER_FDS[0] < 0 && COUNTER_FDS[1] < 0 && COUNTER_FDS[2] < 0) {
+        printf("Hardware counters are not available.\n");
+    }
+
+    // The miss and add pools are shared
+    key_pool misses, adds;
+    make_pool(&misses, "miss", NUM_OPS);
+    make_pool(&adds, "add", NUM_OPS);
+
+    if (strstr(GROUPS, "hash")) bench_hashes(&misses);
+    if (strstr(GROUPS, "bloom")) bench_bloom(&misses, &adds);
+    if (strstr(GROUPS, "sbf")) bench_sbf(&misses, &adds);
+    if (strstr(GROUPS, "mode")) bench_modes(&misses, &adds);
+    if (strstr(GROUPS, "flush")) bench_flush();
+
+    free(misses.keys);
+    free(adds.keys);
+    return 0;
+}
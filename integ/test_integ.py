@@ -8,6 +8,7 @@ import tempfile
 import threading
 import time
 import random
+import struct
 
 try:
     import pytest
@@ -97,6 +98,28 @@ class TestInteg(object):
         assert "foobar2" in fh.readline()
         assert fh.readline() == "END\n"
 
+    def test_list_paging(self, servers):
+        "Tests lists with a limit, resuming after the last name"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar3\n")
+        server.sendall("create foobar1\n")
+        server.sendall("create foobar2\n")
+        server.sendall("create test5\n")
+        for _ in xrange(4):
+            assert fh.readline() == "Done\n"
+        server.sendall("list foo limit=2\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline().startswith("foobar1 ")
+        assert fh.readline().startswith("foobar2 ")
+        assert fh.readline() == "END\n"
+        server.sendall("list foo limit=2 after=foobar2\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline().startswith("foobar3 ")
+        assert fh.readline() == "END\n"
+        server.sendall("list limit=0\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
     def test_create(self, servers):
         "Tests creating a filter"
         server, _ = servers
@@ -277,6 +300,44 @@ class TestInteg(object):
             server.sendall("check foobar test%d\n" % x)
             assert fh.readline() == "Yes\n"
 
+    def test_pipelined(self, servers):
+        "Tests pipelining many commands in a single write"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("".join("check foobar test%d\n" % x for x in xrange(10000)))
+        for x in xrange(10000):
+            assert fh.readline() == "No\n"
+        server.sendall("list\n")
+        assert fh.readline() == "START\n"
+        assert "foobar" in fh.readline()
+        assert fh.readline() == "END\n"
+
+    def test_pipelined_mixed(self, servers):
+        "Tests pipelining runs of commands on the same and different filters"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\ncreate foobaz\n")
+        assert fh.readline() == "Done\n"
+        assert fh.readline() == "Done\n"
+        cmds = []
+        for x in xrange(100):
+            cmds.append("set foobar test%d\n" % x)
+            cmds.append("set foobar test%d\n" % x)
+            cmds.append("check foobaz test%d\n" % x)
+            cmds.append("check foobar test%d\n" % x)
+            cmds.append("check foobar \n")
+            cmds.append("check nope test%d\n" % x)
+        server.sendall("".join(cmds))
+        for x in xrange(100):
+            assert fh.readline() == "Yes\n"
+            assert fh.readline() == "No\n"
+            assert fh.readline() == "No\n"
+            assert fh.readline() == "Yes\n"
+            assert fh.readline() == "Client Error: Must provide filter name and key\n"
+            assert fh.readline() == "Filter does not exist\n"
+
     def test_concurrent_drop(self, servers):
         "Tests setting values and do a concurrent drop on the DB"
         server, server2 = servers
@@ -346,6 +407,35 @@ class TestInteg(object):
         t.start()
         loopset()
 
+    def test_stats(self, servers):
+        "Tests the stats command"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("stats\n")
+        assert fh.readline() == "START\n"
+        stats = {}
+        line = fh.readline()
+        while line != "END\n":
+            key, val = line.split()
+            stats[key] = int(val)
+            line = fh.readline()
+        assert stats["max_resident_bytes"] == 0
+        assert stats["evictions"] == 0
+        assert "resident_bytes" in stats
+        assert stats["flush_threads"] == 1
+        assert stats["flush_rate"] == 0
+        assert "flushes" in stats
+        assert "flush_queued" in stats
+        assert stats["warmup_pending"] == 0
+        assert "warmup_warmed" in stats
+
+    def test_stats_args(self, servers):
+        "Tests the stats command with arguments"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("stats foo\n")
+        assert fh.readline() == "Client Error: Unexpected arguments\n"
+
     def test_concurrent_create(self, servers):
         "Tests creating a filter with concurrent sets"
         server, server2 = servers
@@ -451,6 +541,77 @@ class TestInteg(object):
         assert "test:create:filter:with:long:prefix:2" in fh.readline()
         assert fh.readline() == "END\n"
 
+    def test_noreply(self, servers):
+        "Tests that no-reply mode only suppresses write successes"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("noreply\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("create foobar\n")
+        for x in xrange(1000):
+            server.sendall("set foobar test%d\n" % x)
+        server.sendall("bulk foobar test test1 test2\n")
+
+        # Errors are still reported
+        server.sendall("set nope test\n")
+        assert fh.readline() == "Filter does not exist\n"
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Exists\n"
+
+        # Reads are always answered
+        server.sendall("multi foobar test999 test blah\n")
+        assert fh.readline() == "Yes Yes No\n"
+
+        server.sendall("noreply off\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar test1\n")
+        assert fh.readline() == "No\n"
+
+    def test_binary(self, servers):
+        "Tests the binary protocol"
+        server, _ = servers
+        fh = server.makefile()
+
+        def request(opcode, name, keys=()):
+            body = name + "".join(struct.pack("!H", len(k)) + k for k in keys)
+            return struct.pack("!BBHII", opcode, len(name), 0, len(keys), len(body)) + body
+
+        def response():
+            status, count = struct.unpack("!B3xI", fh.read(8))
+            bits = fh.read((count + 7) / 8)
+            return status, [bool(ord(bits[i / 8]) & (1 << (i % 8))) for i in xrange(count)]
+
+        server.sendall("binary\n")
+        assert fh.readline() == "Done\n"
+        server.sendall(request(3, "foobar"))
+        assert response() == (0, [])
+        server.sendall(request(3, "foobar"))
+        assert response() == (2, [])
+        server.sendall(request(2, "foobar", ["test", "test1"]))
+        assert response() == (0, [True, True])
+        server.sendall(request(1, "foobar", ["test%d" % x for x in xrange(100)]))
+        assert response() == (0, [False, True] + [False] * 98)
+        server.sendall(request(1, "nope", ["test"]))
+        assert response() == (1, [])
+
+        # Refer to the filter by handle
+        server.sendall(request(8, "nope"))
+        assert response() == (1, [])
+        server.sendall(request(8, "foobar"))
+        status, count = struct.unpack("!B3xI", fh.read(8))
+        assert status == 0
+        handle = struct.pack("!I", count)
+        body = handle + struct.pack("!H", 4) + "test"
+        server.sendall(struct.pack("!BBHII", 1, 0, 0, 1, len(body)) + body)
+        assert response() == (0, [True])
+        server.sendall(struct.pack("!BBHII", 1, 0, 0, 0, 4) + struct.pack("!I", count + 1))
+        assert response() == (1, [])
+
+        # Malformed requests close the connection
+        server.sendall(struct.pack("!BBHII", 1, 6, 0, 1, 6) + "foobar")
+        assert response() == (5, [])
+        assert fh.read(1) == ""
+
 if __name__ == "__main__":
     sys.exit(pytest.main(args="-k TestInteg."))
 
@@ -954,6 +954,90 @@ int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback c
     return 0;
 }
 
+/**
+ * Compares the key of a leaf to a key, like memcmp.
+ * A key sorts before any longer key it is a prefix of.
+ */
+static int leaf_compare(art_leaf *l, unsigned char *key, int key_len) {
+    int len = min(l->key_len, key_len);
+    int res = memcmp(l->key, key, len);
+    if (res) return res;
+    return (int)l->key_len - key_len;
+}
+
+// Recursively iterates over the leaves that sort after a key
+static int recursive_iter_after(art_node *n, unsigned char *key, int key_len, art_callback cb, void *data) {
+    // Handle base cases
+    if (!n) return 0;
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+        if (leaf_compare(l, key, key_len) <= 0) return 0;
+        return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+    }
+
+    // Skip the node if all the leaves are before the key,
+    // or iterate over all of them if they are after it
+    if (leaf_compare(maximum(n), key, key_len) <= 0) return 0;
+    if (leaf_compare(minimum(n), key, key_len) > 0) return recursive_iter(n, cb, data);
+
+    int idx, res;
+    switch (n->type) {
+        case NODE4:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter_after(((art_node4*)n)->children[i], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE16:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter_after(((art_node16*)n)->children[i], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE48:
+            for (int i=0; i < 256; i++) {
+                idx = ((art_node48*)n)->keys[i];
+                if (!idx) continue;
+
+                res = recursive_iter_after(((art_node48*)n)->children[idx-1], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE256:
+            for (int i=0; i < 256; i++) {
+                if (!((art_node256*)n)->children[i]) continue;
+                res = recursive_iter_after(((art_node256*)n)->children[i], key, key_len, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        default:
+            abort();
+    }
+    return 0;
+}
+
+/**
+ * Iterates through the entries pairs in the map in order,
+ * starting with the first key that sorts after a given key.
+ * Subtrees before the key are skipped without visiting their
+ * leaves, so this can be used to resume an iteration.
+ * The call back gets a key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after. It need not be in the tree.
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
+    return recursive_iter_after(t->root, key, key_len, cb, data);
+}
+
 // Recursively copies a tree
 static art_node* recursive_copy(art_node *n) {
     // Handle the NULL nodes
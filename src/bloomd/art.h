@@ -165,6 +165,22 @@ int art_iter(art_tree *t, art_callback cb, void *data);
  */
 int art_iter_prefix(art_tree *t, unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
+/**
+ * Iterates through the entries pairs in the map in order,
+ * starting with the first key that sorts after a given key.
+ * Subtrees before the key are skipped without visiting their
+ * leaves, so this can be used to resume an iteration.
+ * The call back gets a key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after. It need not be in the tree.
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data);
+
 /**
  * Creates a copy of an ART tree. The two trees will
  * share the internal leaves, but will NOT share internal nodes.
@@ -1,8 +1,20 @@
 #include <unistd.h>
+#include <stdio.h>
+#include <limits.h>
+#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include "background.h"
 
 
+/**
+ * Name of the file in the data directory that
+ * records the hot filters, one per line.
+ */
+static const char* HOT_SET_FILE_NAME = "hotset";
+
+
 /**
  * This defines how log we sleep between loop ticks
  * in microseconds
@@ -23,12 +35,97 @@
 */
 #define PERIODIC_CHECKPOINT 16
 
+/**
+ * Collects a batch of cold filters to unmap, so that we
+ * can checkpoint between batches of a long scan.
+ */
+typedef struct {
+    int count;
+    char *names[PERIODIC_CHECKPOINT];
+} cold_batch;
+
+/**
+ * A filter queued to be flushed by the flush scheduler
+ */
+typedef struct {
+    char *filter_name;
+    uint64_t dirty_bytes;   // Estimated bytes to write
+    uint64_t waited;        // Flush intervals spent in the queue
+} flush_entry;
+
+/**
+ * The flush scheduler. On each flush interval, the dirty filters
+ * are merged into a queue ordered by priority, which the flush
+ * threads drain while staying within the flush rate. Filters that
+ * do not fit in the budget stay queued, and age, until they do.
+ * Each flush thread has its own, shared with its workers, since
+ * an embedding process may run several filter managers.
+ */
+typedef struct flush_scheduler {
+    pthread_mutex_t lock;       // Protects the scheduler
+    pthread_cond_t cond;        // Signaled when filters are queued
+    int should_run;             // Cleared to stop the flush threads
+
+    flush_entry *queue;         // Filters to flush, highest priority first
+    int queue_len;
+    int queue_next;             // Index of the next filter to flush
+    int queue_size;             // Allocated length of the queue
+
+    double budget;              // Bytes that may be written now, negative if owed
+    struct timeval refilled;    // When the budget was last refilled
+
+    bloom_flush_stats stats;
+    struct flush_scheduler *next;   // Next running scheduler
+} flush_scheduler;
+
+/**
+ * The warmup queue. The recorded hot set is loaded
+ * in rank order, and the warmup threads take the
+ * filters from the front. Each warmup thread has its own.
+ */
+typedef struct warmup_queue {
+    pthread_mutex_t lock;       // Protects the queue
+    char **names;               // The hot set, hottest first
+    int len;
+    int next;                   // Index of the next filter to warm
+    struct timeval started;     // When the warmup started
+    bloom_warmup_stats stats;
+    struct warmup_queue *next_queue;    // Next running warmup
+} warmup_queue;
+
+/**
+ * The running schedulers and warmups, so that the stats can be
+ * reported for the process. The counts of those that have stopped
+ * are kept in the totals.
+ */
+static pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static flush_scheduler *SCHEDULERS = NULL;
+static warmup_queue *WARMUPS = NULL;
+static bloom_flush_stats FLUSH_TOTALS;
+static bloom_warmup_stats WARMUP_TOTALS;
+
 static void* flush_thread_main(void *in);
+static void* flush_worker_main(void *in);
 static void* unmap_thread_main(void *in);
+static void* compress_thread_main(void *in);
+static void* hotset_thread_main(void *in);
+static void* warmup_thread_main(void *in);
+static void* warmup_worker_main(void *in);
+static int load_hot_filters(bloom_config *config, char ***names);
+static int cold_batch_cb(void *data, char *filter_name, bloom_filter *filter);
+static void dirty_bytes_cb(void *in, char *filter_name, bloom_filter *filter);
+static void schedule_flushes(flush_scheduler *sched, bloom_filtmgr *mgr, bloom_filter_list_head *head);
+static int next_flush(flush_scheduler *sched, flush_entry *entry);
+static void throttle_flush(flush_scheduler *sched, uint64_t rate, uint64_t bytes);
+static void add_flush_stats(bloom_flush_stats *total, bloom_flush_stats *stats);
+static void add_warmup_stats(bloom_warmup_stats *total, bloom_warmup_stats *stats);
+static int compare_flush_names(const void *a, const void *b);
+static int compare_flush_priority(const void *a, const void *b);
 typedef struct {
     bloom_config *config;
     bloom_filtmgr *mgr;
     int *should_run;
+    void *state;        // Shared by a thread and its workers
 } background_thread_args;
 
 /**
@@ -40,6 +137,7 @@ typedef struct {
     args->config = config;              \
     args->mgr = mgr;                    \
     args->should_run = should_run;      \
+    args->state = NULL;                 \
 }
 # define UNPACK_ARGS() {                \
     background_thread_args *args = in;  \
@@ -51,8 +149,10 @@ typedef struct {
 
 
 /**
- * Starts a flushing thread which on every
- * configured flush interval, flushes all the filters.
+ * Starts a flushing thread which on every configured flush
+ * interval, queues the filters changed since the last flush.
+ * The queue is drained by a pool of flush threads, with the
+ * most dirty and oldest filters first, within the flush rate.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -96,6 +196,170 @@ int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *shoul
     return 1;
 }
 
+/**
+ * Starts a compress thread which on every compress
+ * interval compresses the idle in-memory filters.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_compress_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not scheduled
+    if(config->compress_interval <= 0) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, compress_thread_main, args);
+    return 1;
+}
+
+/**
+ * Starts a hot set thread which on every hotset
+ * interval records the hot filters for the warmup.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_hotset_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not scheduled
+    if(config->hotset_interval <= 0) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, hotset_thread_main, args);
+    return 1;
+}
+
+
+/**
+ * Starts a warmup thread, which faults in the filters
+ * recorded as hot before the last shutdown, hottest first,
+ * using a pool of warmup_threads. The thread exits once
+ * they are all warmed, or memory runs out.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_warmup_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are disabled, or there is nothing to warm
+    if (config->warmup_threads <= 0) {
+        return 0;
+    }
+    char **names = NULL;
+    int len = load_hot_filters(config, &names);
+    if (len <= 0) {
+        free(names);
+        return 0;
+    }
+
+    // Queue the hot set
+    warmup_queue *queue = calloc(1, sizeof(warmup_queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->names = names;
+    queue->len = len;
+    queue->stats.pending = len;
+    gettimeofday(&queue->started, NULL);
+
+    pthread_mutex_lock(&STATS_LOCK);
+    queue->next_queue = WARMUPS;
+    WARMUPS = queue;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    args->state = queue;
+    pthread_create(t, NULL, warmup_thread_main, args);
+    return 1;
+}
+
+/**
+ * Returns the progress of the scheduled flushes,
+ * summed over the flush threads of the process.
+ * @arg stats Output, set to the current stats
+ */
+void flush_scheduler_stats(bloom_flush_stats *stats) {
+    pthread_mutex_lock(&STATS_LOCK);
+    *stats = FLUSH_TOTALS;
+    for (flush_scheduler *sched = SCHEDULERS; sched; sched = sched->next) {
+        pthread_mutex_lock(&sched->lock);
+        add_flush_stats(stats, &sched->stats);
+        pthread_mutex_unlock(&sched->lock);
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+/**
+ * Returns the progress of the warmup,
+ * summed over the warmups of the process.
+ * @arg stats Output, set to the current stats
+ */
+void warmup_stats(bloom_warmup_stats *stats) {
+    pthread_mutex_lock(&STATS_LOCK);
+    *stats = WARMUP_TOTALS;
+    for (warmup_queue *queue = WARMUPS; queue; queue = queue->next_queue) {
+        pthread_mutex_lock(&queue->lock);
+        add_warmup_stats(stats, &queue->stats);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+/**
+ * Records the filters that are in memory, hottest first,
+ * to the data directory. These are warmed on the next start.
+ * The file is replaced atomically, so a crash leaves the
+ * previous hot set in place.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @return 0 on success.
+ */
+int save_hot_filters(bloom_config *config, bloom_filtmgr *mgr) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_hot_filters(mgr, &head)) return -1;
+
+    char *path = join_path(config->data_dir, (char*)HOT_SET_FILE_NAME);
+    char *tmp_path;
+    int res = asprintf(&tmp_path, "%s.tmp", path);
+    assert(res != -1);
+
+    // Write out the names in rank order
+    res = -1;
+    FILE *f = fopen(tmp_path, "w");
+    if (f) {
+        for (bloom_filter_list *node = head->head; node; node = node->next) {
+            fprintf(f, "%s\n", node->filter_name);
+        }
+        res = (fflush(f) || fsync(fileno(f))) ? -1 : 0;
+        if (fclose(f)) res = -1;
+        if (!res) res = rename(tmp_path, path);
+    }
+    if (res) {
+        syslog(LOG_WARNING, "Failed to record the hot filters to '%s'!", path);
+        unlink(tmp_path);
+    }
+
+    filtmgr_cleanup_list(head);
+    free(tmp_path);
+    free(path);
+    return res;
+}
+
 
 static void* flush_thread_main(void *in) {
     bloom_config *config;
@@ -106,35 +370,114 @@ static void* flush_thread_main(void *in) {
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds.", config->flush_interval);
+    // Start the flush threads, with a full budget
+    flush_scheduler *sched = calloc(1, sizeof(flush_scheduler));
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+    sched->should_run = 1;
+    sched->budget = config->flush_rate;
+    gettimeofday(&sched->refilled, NULL);
+
+    pthread_mutex_lock(&STATS_LOCK);
+    sched->next = SCHEDULERS;
+    SCHEDULERS = sched;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    background_thread_args *args;
+    pthread_t *threads = calloc(config->flush_threads, sizeof(pthread_t));
+    for (int i=0; i < config->flush_threads; i++) {
+        PACK_ARGS();
+        args->state = sched;
+        pthread_create(&threads[i], NULL, flush_worker_main, args);
+    }
+
+    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds. Threads: %d.",
+            config->flush_interval, config->flush_threads);
     unsigned int ticks = 0;
     while (*should_run) {
+        filtmgr_client_offline(mgr);
         usleep(PERIODIC_TIME_USEC);
         filtmgr_client_checkpoint(mgr);
         if ((++ticks % SEC_TO_TICKS(config->flush_interval)) == 0 && *should_run) {
-            // List all the filters
+            // List the filters changed since the last flush
             syslog(LOG_INFO, "Scheduled flush started.");
             bloom_filter_list_head *head;
-            int res = filtmgr_list_filters(mgr, NULL, &head);
+            int res = filtmgr_list_dirty_filters(mgr, &head);
             if (res != 0) {
                 syslog(LOG_WARNING, "Failed to list filters for flushing!");
                 continue;
             }
+            syslog(LOG_INFO, "Dirty filter count: %d", head->size);
 
-            // Flush all, ignore errors since
-            // filters might get deleted in the process
-            bloom_filter_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                filtmgr_flush_filter(mgr, node->filter_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
-
-            // Cleanup
+            // Queue them for the flush threads
+            schedule_flushes(sched, mgr, head);
             filtmgr_cleanup_list(head);
         }
     }
+
+    // Stop the flush threads
+    pthread_mutex_lock(&sched->lock);
+    sched->should_run = 0;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    for (int i=0; i < config->flush_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Keep the counts, and drop the queue,
+    // the filters are flushed when closed
+    pthread_mutex_lock(&STATS_LOCK);
+    flush_scheduler **prev = &SCHEDULERS;
+    while (*prev != sched) prev = &(*prev)->next;
+    *prev = sched->next;
+    sched->stats.queued = sched->stats.queued_bytes = 0;
+    add_flush_stats(&FLUSH_TOTALS, &sched->stats);
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    for (int i=sched->queue_next; i < sched->queue_len; i++) {
+        free(sched->queue[i].filter_name);
+    }
+    free(sched->queue);
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->cond);
+    free(sched);
+    return NULL;
+}
+
+static void* flush_worker_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    flush_scheduler *sched = ((background_thread_args*)in)->state;
+    UNPACK_ARGS();
+    (void)should_run;
+
+    flush_entry entry;
+    while (next_flush(sched, &entry)) {
+        // Use a fresh estimate to charge the budget
+        filtmgr_client_checkpoint(mgr);
+        filtmgr_filter_cb(mgr, entry.filter_name, dirty_bytes_cb, &entry.dirty_bytes);
+        filtmgr_client_offline(mgr);
+        throttle_flush(sched, config->flush_rate, entry.dirty_bytes);
+
+        // Flush, ignore errors since the filter
+        // might get deleted in the process
+        filtmgr_client_checkpoint(mgr);
+        int res = filtmgr_flush_filter(mgr, entry.filter_name);
+        filtmgr_client_offline(mgr);
+
+        pthread_mutex_lock(&sched->lock);
+        sched->stats.active--;
+        if (res == 0) {
+            sched->stats.flushes++;
+            sched->stats.flushed_bytes += entry.dirty_bytes;
+        }
+        pthread_mutex_unlock(&sched->lock);
+        free(entry.filter_name);
+    }
+
+    filtmgr_client_leave(mgr);
     return NULL;
 }
 
@@ -150,33 +493,367 @@ static void* unmap_thread_main(void *in) {
     syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
     unsigned int ticks = 0;
     while (*should_run) {
+        filtmgr_client_offline(mgr);
         usleep(PERIODIC_TIME_USEC);
         filtmgr_client_checkpoint(mgr);
         if ((++ticks % SEC_TO_TICKS(config->cold_interval)) == 0 && *should_run) {
-            // List the cold filters
+            // Scan for the cold filters a batch at a time
             syslog(LOG_INFO, "Cold unmap started.");
-            bloom_filter_list_head *head;
-            int res = filtmgr_list_cold_filters(mgr, &head);
-            if (res != 0) {
-                continue;
-            }
+            unsigned long long cursor = 0;
+            unsigned int total = 0;
+            cold_batch batch;
+            int res;
+            do {
+                batch.count = 0;
+                res = filtmgr_iter_cold_filters(mgr, &cursor, cold_batch_cb, &batch);
 
-            // Close the filters, save memory
-            syslog(LOG_INFO, "Cold filter count: %d", head->size);
-            bloom_filter_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                syslog(LOG_INFO, "Unmapping filter '%s' for being cold.", node->filter_name);
-                filtmgr_unmap_filter(mgr, node->filter_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
+                // Close the filters, save memory
+                for (int i=0; i < batch.count; i++) {
+                    syslog(LOG_INFO, "Unmapping filter '%s' for being cold.", batch.names[i]);
+                    filtmgr_unmap_filter(mgr, batch.names[i]);
+                    free(batch.names[i]);
+                }
+                total += batch.count;
+                filtmgr_client_checkpoint(mgr);
+            } while (res && *should_run);
+            syslog(LOG_INFO, "Cold filter count: %u", total);
+        }
+    }
+    return NULL;
+}
 
-            // Cleanup
-            filtmgr_cleanup_list(head);
+static void* compress_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
+
+    syslog(LOG_INFO, "Compress thread started. Interval: %d seconds.", config->compress_interval);
+    unsigned int ticks = 0;
+    while (*should_run) {
+        filtmgr_client_offline(mgr);
+        usleep(PERIODIC_TIME_USEC);
+        filtmgr_client_checkpoint(mgr);
+        if ((++ticks % SEC_TO_TICKS(config->compress_interval)) == 0 && *should_run) {
+            int compressed = filtmgr_compress_idle_filters(mgr);
+            syslog(LOG_INFO, "Compressed idle filter count: %d", compressed);
+        }
+    }
+    return NULL;
+}
+
+static void* hotset_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
+
+    syslog(LOG_INFO, "Hot set thread started. Interval: %d seconds.", config->hotset_interval);
+    unsigned int ticks = 0;
+    while (*should_run) {
+        filtmgr_client_offline(mgr);
+        usleep(PERIODIC_TIME_USEC);
+        filtmgr_client_checkpoint(mgr);
+        if ((++ticks % SEC_TO_TICKS(config->hotset_interval)) == 0 && *should_run) {
+            // Record the hot set, in case we crash
+            save_hot_filters(config, mgr);
+        }
+    }
+    return NULL;
+}
+
+static void* warmup_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    warmup_queue *queue = ((background_thread_args*)in)->state;
+    UNPACK_ARGS();
+
+    // Start the warmup threads
+    syslog(LOG_INFO, "Warmup started. Filters: %d. Threads: %d.",
+            queue->len, config->warmup_threads);
+    background_thread_args *args;
+    pthread_t *threads = calloc(config->warmup_threads, sizeof(pthread_t));
+    for (int i=0; i < config->warmup_threads; i++) {
+        PACK_ARGS();
+        args->state = queue;
+        pthread_create(&threads[i], NULL, warmup_worker_main, args);
+    }
+    for (int i=0; i < config->warmup_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Keep the counts, and drop the queue
+    syslog(LOG_INFO, "Warmup finished. Warmed: %llu. Skipped: %llu. Time: %llu msec.",
+            (unsigned long long)queue->stats.warmed, (unsigned long long)queue->stats.skipped,
+            (unsigned long long)queue->stats.msec);
+    pthread_mutex_lock(&STATS_LOCK);
+    warmup_queue **prev = &WARMUPS;
+    while (*prev != queue) prev = &(*prev)->next_queue;
+    *prev = queue->next_queue;
+    queue->stats.pending = 0;
+    add_warmup_stats(&WARMUP_TOTALS, &queue->stats);
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    for (int i=0; i < queue->len; i++) {
+        free(queue->names[i]);
+    }
+    free(queue->names);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+    return NULL;
+}
+
+static void* warmup_worker_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    warmup_queue *queue = ((background_thread_args*)in)->state;
+    UNPACK_ARGS();
+
+    struct timeval now;
+    char *name;
+    int res;
+    while (1) {
+        // Take the next hottest filter
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next == queue->len || !*should_run) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
         }
+        name = queue->names[queue->next++];
+        queue->stats.pending--;
+        queue->stats.active++;
+        pthread_mutex_unlock(&queue->lock);
+
+        // Warm the filter, unless it would evict others.
+        // Fails if the filter was since dropped.
+        filtmgr_client_checkpoint(mgr);
+        if (config->max_resident_bytes &&
+                filtmgr_evictable_bytes(mgr) >= config->max_resident_bytes) {
+            res = -1;
+        } else {
+            res = filtmgr_prefault_filter(mgr, name);
+        }
+        filtmgr_client_offline(mgr);
+
+        gettimeofday(&now, NULL);
+        pthread_mutex_lock(&queue->lock);
+        queue->stats.active--;
+        if (res == 0) {
+            queue->stats.warmed++;
+        } else {
+            queue->stats.skipped++;
+        }
+        queue->stats.msec = (now.tv_sec - queue->started.tv_sec) * 1000 +
+            (now.tv_usec - queue->started.tv_usec) / 1000;
+        pthread_mutex_unlock(&queue->lock);
     }
+
+    filtmgr_client_leave(mgr);
     return NULL;
 }
 
+/**
+ * Loads the hot set recorded by save_hot_filters.
+ * @arg config The configuration
+ * @arg names Output, a malloc()'d array of the names,
+ * hottest first. The caller should free() them.
+ * @return The number of names, 0 if there is no hot set.
+ */
+static int load_hot_filters(bloom_config *config, char ***names) {
+    char *path = join_path(config->data_dir, (char*)HOT_SET_FILE_NAME);
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (!f) return 0;
+
+    // The names are folder names, so they are bounded
+    char line[NAME_MAX + 2];
+    int len = 0, size = 0;
+    while (fgets(line, sizeof(line), f)) {
+        int line_len = strlen(line);
+        if (line_len && line[line_len - 1] == '\n') line[--line_len] = '\0';
+        if (!line_len) continue;
+        if (len == size) {
+            size = (size) ? size * 2 : 64;
+            *names = realloc(*names, size * sizeof(char*));
+        }
+        (*names)[len++] = strdup(line);
+    }
+    fclose(f);
+    return len;
+}
+
+// Adds a cold filter to the batch, stops once it is full
+static int cold_batch_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter;
+    cold_batch *batch = data;
+    batch->names[batch->count++] = strdup(filter_name);
+    return batch->count == PERIODIC_CHECKPOINT;
+}
+
+// Estimates the bytes a flush will write
+static void dirty_bytes_cb(void *in, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(uint64_t*)in = bloomf_dirty_bytes(filter);
+}
+
+/**
+ * Merges the dirty filters into the flush queue. The filters
+ * still queued from earlier intervals age, and the queue is
+ * ordered by priority. Takes the names from the list.
+ */
+static void schedule_flushes(flush_scheduler *sched, bloom_filtmgr *mgr, bloom_filter_list_head *head) {
+    // Estimate the dirty bytes outside the lock
+    flush_entry *entries = malloc(head->size * sizeof(flush_entry));
+    int num = 0;
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        entries[num].filter_name = node->filter_name;
+        entries[num].dirty_bytes = 0;
+        entries[num].waited = 0;
+        node->filter_name = NULL;
+        filtmgr_filter_cb(mgr, entries[num].filter_name, dirty_bytes_cb, &entries[num].dirty_bytes);
+        if (!(++num % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+    }
+
+    pthread_mutex_lock(&sched->lock);
+
+    // Drop the flushed entries, and age the rest
+    int remain = sched->queue_len - sched->queue_next;
+    memmove(sched->queue, sched->queue + sched->queue_next, remain * sizeof(flush_entry));
+    for (int i=0; i < remain; i++) sched->queue[i].waited++;
+
+    // Append the new entries
+    if (remain + num > sched->queue_size) {
+        sched->queue_size = remain + num;
+        sched->queue = realloc(sched->queue, sched->queue_size * sizeof(flush_entry));
+    }
+    memcpy(sched->queue + remain, entries, num * sizeof(flush_entry));
+    sched->queue_len = remain + num;
+    sched->queue_next = 0;
+    free(entries);
+
+    // Merge the duplicates, keeping the oldest
+    flush_entry *queue = sched->queue;
+    qsort(queue, sched->queue_len, sizeof(flush_entry), compare_flush_names);
+    int len = 0;
+    for (int i=0; i < sched->queue_len; i++) {
+        if (len && strcmp(queue[len-1].filter_name, queue[i].filter_name) == 0) {
+            if (queue[i].waited > queue[len-1].waited) queue[len-1].waited = queue[i].waited;
+            if (queue[i].dirty_bytes > queue[len-1].dirty_bytes) queue[len-1].dirty_bytes = queue[i].dirty_bytes;
+            free(queue[i].filter_name);
+        } else {
+            queue[len++] = queue[i];
+        }
+    }
+    sched->queue_len = len;
+
+    // Order by priority
+    qsort(queue, len, sizeof(flush_entry), compare_flush_priority);
+    sched->stats.intervals++;
+    sched->stats.queued = len;
+    sched->stats.queued_bytes = 0;
+    for (int i=0; i < len; i++) sched->stats.queued_bytes += queue[i].dirty_bytes;
+
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+ * Waits for the next filter to flush.
+ * @arg sched The scheduler
+ * @arg entry Output, the filter to flush. The name must be freed.
+ * @return 1 if there is a filter, 0 if the flush threads should stop.
+ */
+static int next_flush(flush_scheduler *sched, flush_entry *entry) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->should_run && sched->queue_next == sched->queue_len) {
+        pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+    int res = sched->should_run;
+    if (res) {
+        *entry = sched->queue[sched->queue_next++];
+        sched->stats.queued--;
+        sched->stats.queued_bytes -= entry->dirty_bytes;
+        sched->stats.active++;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return res;
+}
 
+/**
+ * Charges a flush to the I/O budget, which is refilled at the
+ * flush rate, up to one second worth. If the budget is owed, we
+ * sleep until it is paid back, so the flushes are spread out.
+ * @arg sched The scheduler
+ * @arg rate The flush rate in bytes per second, 0 for no limit.
+ * @arg bytes The estimated bytes the flush will write
+ */
+static void throttle_flush(flush_scheduler *sched, uint64_t rate, uint64_t bytes) {
+    if (!rate) return;
+
+    pthread_mutex_lock(&sched->lock);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double elapsed = (now.tv_sec - sched->refilled.tv_sec) +
+        (now.tv_usec - sched->refilled.tv_usec) / 1e6;
+    sched->refilled = now;
+    sched->budget += elapsed * rate;
+    if (sched->budget > rate) sched->budget = rate;
+
+    sched->budget -= bytes;
+    uint64_t wait_usec = (sched->budget < 0) ? -sched->budget / rate * 1e6 : 0;
+    sched->stats.throttled_msec += wait_usec / 1000;
+    pthread_mutex_unlock(&sched->lock);
+
+    // Sleep in steps, so that we do not delay a shutdown
+    while (wait_usec && sched->should_run) {
+        uint64_t step = (wait_usec < PERIODIC_TIME_USEC) ? wait_usec : PERIODIC_TIME_USEC;
+        usleep(step);
+        wait_usec -= step;
+    }
+}
+
+// Orders flush entries by name
+static int compare_flush_names(const void *a, const void *b) {
+    return strcmp(((flush_entry*)a)->filter_name, ((flush_entry*)b)->filter_name);
+}
+
+/**
+ * Orders flush entries by priority, highest first. The priority
+ * grows with the dirty pages, and with each interval spent waiting,
+ * so that small filters are not starved by large ones.
+ */
+static int compare_flush_priority(const void *a, const void *b) {
+    const flush_entry *ea = a, *eb = b;
+    double pa = (ea->dirty_bytes + 4096.0) * (ea->waited + 1);
+    double pb = (eb->dirty_bytes + 4096.0) * (eb->waited + 1);
+    return (pa < pb) - (pa > pb);
+}
+
+// Adds the counts of a flush scheduler to the totals
+static void add_flush_stats(bloom_flush_stats *total, bloom_flush_stats *stats) {
+    total->intervals += stats->intervals;
+    total->queued += stats->queued;
+    total->queued_bytes += stats->queued_bytes;
+    total->active += stats->active;
+    total->flushes += stats->flushes;
+    total->flushed_bytes += stats->flushed_bytes;
+    total->throttled_msec += stats->throttled_msec;
+}
+
+// Adds the counts of a warmup to the totals
+static void add_warmup_stats(bloom_warmup_stats *total, bloom_warmup_stats *stats) {
+    total->pending += stats->pending;
+    total->active += stats->active;
+    total->warmed += stats->warmed;
+    total->skipped += stats->skipped;
+    total->msec += stats->msec;
+}
@@ -5,8 +5,34 @@
 #include "filter_manager.h"
 
 /**
- * Starts a flushing thread which on every
- * configured flush interval, flushes all the filters.
+ * Reports the progress of the flush scheduler
+ */
+typedef struct {
+    uint64_t intervals;         // Flush intervals started
+    uint64_t queued;            // Filters waiting to be flushed
+    uint64_t queued_bytes;      // Estimated bytes they will write
+    uint64_t active;            // Filters being flushed
+    uint64_t flushes;           // Filters flushed
+    uint64_t flushed_bytes;     // Estimated bytes written by the flushes
+    uint64_t throttled_msec;    // Time the flushes waited on the rate limit
+} bloom_flush_stats;
+
+/**
+ * Reports the progress of the warmup after a restart
+ */
+typedef struct {
+    uint64_t pending;           // Filters waiting to be warmed
+    uint64_t active;            // Filters being warmed
+    uint64_t warmed;            // Filters faulted in
+    uint64_t skipped;           // Filters since dropped, or that did not fit
+    uint64_t msec;              // Time spent warming
+} bloom_warmup_stats;
+
+/**
+ * Starts a flushing thread which on every configured flush
+ * interval, queues the filters changed since the last flush.
+ * The queue is drained by a pool of flush threads, with the
+ * most dirty and oldest filters first, within the flush rate.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -28,4 +54,66 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
  */
 int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *);
 
+/**
+ * Starts a compress thread which on every compress
+ * interval compresses the idle in-memory filters.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_compress_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Starts a hot set thread which on every hotset
+ * interval records the hot filters for the warmup.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_hotset_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Returns the progress of the scheduled flushes,
+ * summed over the flush threads of the process.
+ * @arg stats Output, set to the current stats
+ */
+void flush_scheduler_stats(bloom_flush_stats *stats);
+
+/**
+ * Starts a warmup thread, which faults in the filters
+ * recorded as hot before the last shutdown, hottest first,
+ * using a pool of warmup_threads. The thread exits once
+ * they are all warmed, or memory runs out.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_warmup_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Returns the progress of the warmup,
+ * summed over the warmups of the process.
+ * @arg stats Output, set to the current stats
+ */
+void warmup_stats(bloom_warmup_stats *stats);
+
+/**
+ * Records the filters that are in memory, hottest first,
+ * to the data directory. These are warmed on the next start.
+ * This is done on every hotset interval, and on shutdown.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @return 0 on success.
+ */
+int save_hot_filters(bloom_config *config, bloom_filtmgr *mgr);
+
 #endif
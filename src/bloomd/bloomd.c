@@ -19,6 +19,8 @@
 #include "networking.h"
 #include "filter_manager.h"
 #include "background.h"
+#include "handoff.h"
+#include "replication.h"
 
 // Simple struct that holds args for the workers
 typedef struct {
@@ -151,6 +153,24 @@ int main(int argc, char **argv) {
     // Log that we are starting up
     syslog(LOG_INFO, "Starting bloomd.");
 
+    // Take over from a running bloomd. This waits for it to
+    // flush and exit, before we load the filters it was using.
+    bloom_handoff *handoff = NULL;
+    if (config->handoff_socket) {
+        int handoff_res = handoff_request(config->handoff_socket, &handoff);
+        if (handoff_res < 0) {
+            syslog(LOG_ERR, "Failed to take over from the running bloomd!");
+            return 1;
+        }
+    }
+
+    // Replicas bootstrap from the primary before loading the filters
+    bloom_replication *repl;
+    if (init_replication(config, &SHOULD_RUN, &repl)) {
+        syslog(LOG_ERR, "Failed to initialize replication!");
+        return 1;
+    }
+
     // Initialize the filters
     bloom_filtmgr *mgr;
     int mgr_res = init_filter_manager(config, 1, &mgr);
@@ -159,15 +179,35 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // Warm the filters that were hot before we took over
+    if (handoff) {
+        filtmgr_client_checkpoint(mgr);
+        for (int i=0; i < handoff->num_hot; i++) {
+            filtmgr_prefault_filter(mgr, handoff->hot_filters[i]);
+        }
+        filtmgr_client_leave(mgr);
+        syslog(LOG_INFO, "Faulted in %d hot filters.", handoff->num_hot);
+    }
+
+    // Stream the changes to replicas, and from the primary
+    if (start_replication(repl, mgr)) {
+        syslog(LOG_ERR, "Failed to start replication!");
+        return 1;
+    }
+
     // Start the background tasks
-    int flush_on, unmap_on;
-    pthread_t flush_thread, unmap_thread;
+    int flush_on, unmap_on, compress_on, hotset_on, warmup_on;
+    pthread_t flush_thread, unmap_thread, compress_thread, hotset_thread, warmup_thread;
     flush_on = start_flush_thread(config, mgr, &SHOULD_RUN, &flush_thread);
     unmap_on = start_cold_unmap_thread(config, mgr, &SHOULD_RUN, &unmap_thread);
+    compress_on = start_compress_thread(config, mgr, &SHOULD_RUN, &compress_thread);
+    hotset_on = start_hotset_thread(config, mgr, &SHOULD_RUN, &hotset_thread);
+    warmup_on = start_warmup_thread(config, mgr, &SHOULD_RUN, &warmup_thread);
 
     // Initialize the networking
     bloom_networking *netconf = NULL;
-    int net_res = init_networking(config, mgr, &netconf);
+    int net_res = init_networking(config, mgr, handoff, &netconf);
+    if (handoff) handoff_free(handoff);
     if (net_res != 0) {
         syslog(LOG_ERR, "Failed to initialize bloomd networking!");
         return 1;
@@ -195,6 +235,18 @@ int main(int argc, char **argv) {
     // Shutdown the background tasks
     if (flush_on) pthread_join(flush_thread, NULL);
     if (unmap_on) pthread_join(unmap_thread, NULL);
+    if (compress_on) pthread_join(compress_thread, NULL);
+    if (hotset_on) pthread_join(hotset_thread, NULL);
+    if (warmup_on) pthread_join(warmup_thread, NULL);
+
+    // Disconnect the replicas and the primary. A replica that lost
+    // the primary exits with an error, so that it is restarted.
+    int exit_code = destroy_replication(repl);
+
+    // Record the hot filters for the next start
+    filtmgr_client_checkpoint(mgr);
+    save_hot_filters(config, mgr);
+    filtmgr_client_leave(mgr);
 
     // Cleanup the filters
     destroy_filter_manager(mgr);
@@ -204,7 +256,7 @@ int main(int argc, char **argv) {
     free(config);
 
     // Done
-    return 0;
+    return exit_code;
 }
 
 // Main entry point for the worker threads
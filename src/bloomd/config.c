@@ -4,7 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
 #include "config.h"
@@ -30,7 +32,24 @@ static const bloom_config DEFAULT_CONFIG = {
     3600,               // Cold after an hour
     0,                  // Persist to disk by default
     1,                  // Only a single worker thread by default
-    0                   // Do NOT use mmap by default
+    0,                  // Do NOT use mmap by default
+    0,                  // Accept on the main thread by default
+    0,                  // Do NOT pin workers to CPUs by default
+    NULL,               // No unix socket by default
+    0,                  // Any worker handles any filter by default
+    0,                  // Filter I/O runs on the workers by default
+    1,                  // Flush with a single thread by default
+    0,                  // Do NOT limit the flush rate by default
+    0,                  // Do NOT limit the resident filters by default
+    0,                  // Do NOT compress idle in-memory filters by default
+    0,                  // Do NOT pack small layers by default
+    1073741824,         // 1GB pack arenas
+    0,                  // Write through the page cache by default
+    NULL,               // No restart handoff by default
+    1,                  // Warm the hot filters with a single thread by default
+    300,                // Record the hot filters every 5 minutes
+    0,                  // Do NOT serve replicas by default
+    NULL                // Not a replica by default
 };
 
 /**
@@ -120,10 +139,38 @@ static int config_callback(void* user, const char* section, const char* name, co
          return value_to_int(value, &config->use_mmap);
     } else if (NAME_MATCH("workers")) {
          return value_to_int(value, &config->worker_threads);
+    } else if (NAME_MATCH("use_reuseport")) {
+         return value_to_int(value, &config->use_reuseport);
+    } else if (NAME_MATCH("cpu_affinity")) {
+         return value_to_int(value, &config->cpu_affinity);
+    } else if (NAME_MATCH("shard_filters")) {
+         return value_to_int(value, &config->shard_filters);
+    } else if (NAME_MATCH("io_threads")) {
+         return value_to_int(value, &config->io_threads);
+    } else if (NAME_MATCH("flush_threads")) {
+         return value_to_int(value, &config->flush_threads);
+    } else if (NAME_MATCH("compress_interval")) {
+         return value_to_int(value, &config->compress_interval);
+    } else if (NAME_MATCH("warmup_threads")) {
+         return value_to_int(value, &config->warmup_threads);
+    } else if (NAME_MATCH("hotset_interval")) {
+         return value_to_int(value, &config->hotset_interval);
+    } else if (NAME_MATCH("replication_port")) {
+         return value_to_int(value, &config->replication_port);
+    } else if (NAME_MATCH("use_direct_io")) {
+         return value_to_int(value, &config->use_direct_io);
 
     // Handle the int64 cases
     } else if (NAME_MATCH("initial_capacity")) {
          return value_to_int64(value, &config->initial_capacity);
+    } else if (NAME_MATCH("flush_rate")) {
+         return value_to_int64(value, &config->flush_rate);
+    } else if (NAME_MATCH("max_resident_bytes")) {
+         return value_to_int64(value, &config->max_resident_bytes);
+    } else if (NAME_MATCH("pack_layer_size")) {
+         return value_to_int64(value, &config->pack_layer_size);
+    } else if (NAME_MATCH("pack_arena_size")) {
+         return value_to_int64(value, &config->pack_arena_size);
 
     // Handle the double cases
     } else if (NAME_MATCH("default_probability")) {
@@ -138,6 +185,12 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("unix_socket")) {
+        config->unix_socket = strdup(value);
+    } else if (NAME_MATCH("handoff_socket")) {
+        config->handoff_socket = strdup(value);
+    } else if (NAME_MATCH("replicate_from")) {
+        config->replicate_from = strdup(value);
 
     // Unknown parameter?
     } else {
@@ -375,6 +428,145 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_use_reuseport(int use_reuseport) {
+    if (use_reuseport != 0 && use_reuseport != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_reuseport. Must be 0 or 1.");
+        return 1;
+    }
+#ifndef SO_REUSEPORT
+    if (use_reuseport) {
+        syslog(LOG_ERR,
+               "SO_REUSEPORT is not supported on this platform!");
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int sane_cpu_affinity(int cpu_affinity) {
+    if (cpu_affinity != 0 && cpu_affinity != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for cpu_affinity. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_unix_socket(char *unix_socket) {
+    if (!unix_socket) return 0;
+    struct sockaddr_un addr;
+    if (strlen(unix_socket) == 0 || strlen(unix_socket) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR,
+               "Unix socket path must be between 1 and %d characters!",
+               (int)sizeof(addr.sun_path) - 1);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_handoff_socket(char *handoff_socket) {
+    if (!handoff_socket) return 0;
+    struct sockaddr_un addr;
+    if (strlen(handoff_socket) == 0 || strlen(handoff_socket) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR,
+               "Handoff socket path must be between 1 and %d characters!",
+               (int)sizeof(addr.sun_path) - 1);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_shard_filters(int shard_filters) {
+    if (shard_filters != 0 && shard_filters != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for shard_filters. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_io_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR,
+               "Cannot have fewer than zero I/O threads!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_threads(int threads) {
+    if (threads < 1) {
+        syslog(LOG_ERR,
+               "Must have at least one flush thread!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_warmup_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR,
+               "Cannot have a negative number of warmup threads!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_hotset_interval(int intv) {
+    if (intv < 0) {
+        syslog(LOG_ERR, "Hot set interval cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replication_port(int port) {
+    if (port < 0 || port > 65535) {
+        syslog(LOG_ERR, "Replication port must be between 0 and 65535!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replicate_from(char *replicate_from) {
+    if (!replicate_from) return 0;
+    char *colon = strrchr(replicate_from, ':');
+    int port = (colon) ? atoi(colon + 1) : 0;
+    if (!colon || colon == replicate_from || port <= 0 || port > 65535) {
+        syslog(LOG_ERR,
+               "Illegal value for replicate_from. Must be host:port.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_compress_interval(int intv) {
+    if (intv < 0) {
+        syslog(LOG_ERR, "Compress interval cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_use_direct_io(int use_direct_io) {
+    if (use_direct_io != 0 && use_direct_io != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_direct_io. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_pack_sizes(uint64_t layer_size, uint64_t arena_size) {
+    if (layer_size > 0 && arena_size < 2 * layer_size) {
+        syslog(LOG_ERR,
+               "Pack arena size must be at least twice the pack layer size!");
+        return 1;
+    }
+    return 0;
+}
+
 
 /**
  * Validates the configuration
@@ -395,6 +587,20 @@ int validate_config(bloom_config *config) {
     res |= sane_in_memory(config->in_memory);
     res |= sane_use_mmap(config->use_mmap);
     res |= sane_worker_threads(config->worker_threads);
+    res |= sane_use_reuseport(config->use_reuseport);
+    res |= sane_cpu_affinity(config->cpu_affinity);
+    res |= sane_unix_socket(config->unix_socket);
+    res |= sane_shard_filters(config->shard_filters);
+    res |= sane_io_threads(config->io_threads);
+    res |= sane_flush_threads(config->flush_threads);
+    res |= sane_compress_interval(config->compress_interval);
+    res |= sane_pack_sizes(config->pack_layer_size, config->pack_arena_size);
+    res |= sane_use_direct_io(config->use_direct_io);
+    res |= sane_handoff_socket(config->handoff_socket);
+    res |= sane_warmup_threads(config->warmup_threads);
+    res |= sane_hotset_interval(config->hotset_interval);
+    res |= sane_replication_port(config->replication_port);
+    res |= sane_replicate_from(config->replicate_from);
 
     return res;
 }
@@ -22,6 +22,23 @@ typedef struct {
     int in_memory;
     int worker_threads;
     int use_mmap;
+    int use_reuseport;
+    int cpu_affinity;
+    char *unix_socket;
+    int shard_filters;
+    int io_threads;
+    int flush_threads;
+    uint64_t flush_rate;
+    uint64_t max_resident_bytes;
+    int compress_interval;
+    uint64_t pack_layer_size;
+    uint64_t pack_arena_size;
+    int use_direct_io;
+    char *handoff_socket;
+    int warmup_threads;
+    int hotset_interval;
+    int replication_port;
+    char *replicate_from;
 } bloom_config;
 
 /**
@@ -87,6 +104,20 @@ int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
 int sane_worker_threads(int threads);
+int sane_use_reuseport(int use_reuseport);
+int sane_cpu_affinity(int cpu_affinity);
+int sane_unix_socket(char *unix_socket);
+int sane_shard_filters(int shard_filters);
+int sane_io_threads(int threads);
+int sane_flush_threads(int threads);
+int sane_compress_interval(int intv);
+int sane_pack_sizes(uint64_t layer_size, uint64_t arena_size);
+int sane_use_direct_io(int use_direct_io);
+int sane_handoff_socket(char *handoff_socket);
+int sane_warmup_threads(int threads);
+int sane_hotset_interval(int intv);
+int sane_replication_port(int port);
+int sane_replicate_from(char *replicate_from);
 
 /**
  * Joins two strings as part of a path,
@@ -3,7 +3,10 @@
 #include <string.h>
 #include <regex.h>
 #include <assert.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 #include "conn_handler.h"
+#include "background.h"
 #include "handler_constants.c"
 
 /**
@@ -21,6 +24,163 @@
  */
 #define INTERNAL_ERROR() (handle_client_resp(handle->conn, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN))
 
+/**
+ * Invoked in any context with a bloom_conn_handler to check
+ * if the response to a successful write command should be
+ * suppressed, because the client has enabled no-reply mode.
+ */
+#define NO_REPLY(res) ((res) == 0 && handle->state && handle->state->no_reply)
+
+/**
+ * Invoked in any context with a bloom_conn_handler to check if
+ * writes must be rejected, because the filters are a replica
+ * which is only changed by the replication stream.
+ */
+#define READ_ONLY() (handle->config->replicate_from != NULL)
+
+/**
+ * Defines the maximum number of commands that are batched
+ * together when deferring to the worker owning a filter.
+ * Consecutive commands for the same worker are sent as a
+ * single batch, to amortize the cost of the handoff.
+ */
+#define MAX_DEFER_BATCH 128
+
+/**
+ * Used as the owner of commands that may block on disk,
+ * which are deferred to the I/O pool instead of a worker.
+ */
+#define IO_POOL_OWNER -2
+
+/**
+ * Filter names longer than this are never checked for
+ * residency. They are rejected on create, so the
+ * command is simply run by this worker.
+ */
+#define MAX_FILTER_NAME_LEN 200
+
+/**
+ * The number of filters each connection caches by name.
+ * Clients tend to send long runs of commands on the same
+ * filter, so only the most recent few are kept.
+ */
+#define FILTER_CACHE_SIZE 4
+
+/**
+ * The maximum number of filters a connection can open
+ * with the binary protocol
+ */
+#define MAX_OPEN_FILTERS 65536
+
+/**
+ * The list command streams its output in chunks of this
+ * size, so the memory used does not grow with the number
+ * of filters. A chunk is sent once it has less than
+ * LIST_LINE_MAX bytes free, which fits any single line.
+ */
+#define LIST_CHUNK_SIZE 65536
+#define LIST_LINE_MAX 512
+
+/**
+ * Used to decode the header of a binary request
+ */
+typedef struct {
+    uint8_t opcode;
+    uint8_t name_len;
+    uint32_t key_count;
+    uint32_t body_len;
+} bin_request;
+
+/**
+ * Used to walk the keys of a binary request. Keys are
+ * NULL terminated in place. Since the terminator overwrites
+ * the length prefix of the following key, we always read
+ * one length ahead.
+ */
+typedef struct {
+    char *cursor;       // Start of the next key
+    uint16_t next_len;  // Length of the next key
+    uint32_t remain;    // Number of keys remaining
+} bin_key_reader;
+
+/**
+ * Stores a command deferred to the worker owning the filter.
+ * The arguments are copied, since the input buffer is reused.
+ * Binary request bodies start at args+1, since terminating the
+ * last key may write to the byte preceding the body.
+ */
+typedef struct deferred_cmd {
+    struct deferred_cmd *next;
+    int binary;             // Is this a binary request
+    conn_cmd_type type;     // Text command type
+    bin_request req;        // Binary request header
+    int args_len;           // Length of args, -1 if there are no args
+    char args[];
+} deferred_cmd;
+
+/**
+ * Stores a text command line that has been read and parsed
+ */
+typedef struct {
+    char *buf;              // The command line
+    int buf_len;
+    int should_free;        // Must buf be freed
+    conn_cmd_type type;
+    char *args;             // The arguments, NULL if none
+    int args_len;
+} text_cmd;
+
+/**
+ * Classifies how likely a command is to block on disk
+ */
+typedef enum {
+    IO_NEVER,       // Never blocks, e.g. info
+    IO_IF_COLD,     // Blocks if the filter must be faulted in
+    IO_ALWAYS       // May always block, e.g. create or flush
+} io_class;
+
+/**
+ * Used to stream the output of the list command
+ */
+typedef struct {
+    bloom_conn_handler *handle;
+    unsigned long long limit;   // Remaining lines, 0 for no limit
+    int len;                    // Bytes used in buf
+    char buf[LIST_CHUNK_SIZE];
+} list_stream;
+
+/**
+ * A filter resolved by a connection. The handle is checked
+ * before each use, and resolved again by name if it is stale.
+ */
+typedef struct {
+    char *name;             // The filter name, NULL if unused
+    int name_len;
+    bloom_filter_handle handle;
+} filter_ref;
+
+/**
+ * The filters resolved by a connection, stored
+ * in the connection state.
+ */
+typedef struct {
+    filter_ref cache[FILTER_CACHE_SIZE];  // Recently used by name
+    int cache_next;                       // Next entry to replace
+    filter_ref *opened;                   // Opened with the binary protocol
+    uint32_t num_opened;
+    uint32_t max_opened;
+} conn_filters;
+
+/**
+ * Used to build a batch of commands for a single worker
+ */
+typedef struct {
+    deferred_cmd *head;
+    deferred_cmd *tail;
+    int owner;
+    int count;
+} cmd_batch;
+
 /* Static method declarations */
 static void handle_check_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_check_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
@@ -33,6 +193,29 @@ static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_le
 static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_noreply_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_binary_cmd(bloom_conn_handler *handle, char *args, int args_len);
+
+static int handle_text_client_connect(bloom_conn_handler *handle, cmd_batch *batch);
+static void handle_text_cmd(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int read_text_cmd(bloom_conn_handler *handle, text_cmd *cmd);
+static int handle_coalesced_text_cmds(bloom_conn_handler *handle, text_cmd *first, text_cmd *next);
+static deferred_cmd* handle_coalesced_deferred_cmds(bloom_conn_handler *handle, deferred_cmd *first);
+static char* coalesce_key(conn_cmd_type type, char *name, int name_len, conn_cmd_type cand_type, char *args, int args_len);
+static void handle_coalesced_keys(bloom_conn_handler *handle, conn_cmd_type type, char *filter_name, char **keys, int num_keys);
+static int handle_binary_client_connect(bloom_conn_handler *handle, cmd_batch *batch);
+static int handle_binary_request(bloom_conn_handler *handle, bin_request *req, char *body);
+static void handle_binary_resp(bloom_conn_handler *handle, bin_status status, uint32_t count, char *bitset);
+static void handle_binary_open(bloom_conn_handler *handle, char *filter_name);
+static int binary_name_size(bin_request *req);
+static filter_ref* binary_opened_filter(bloom_conn_handler *handle, char *body);
+
+static conn_filters* get_conn_filters(bloom_conn_state *state);
+static filter_ref* cached_filter_ref(bloom_conn_handler *handle, char *filter_name);
+static int filter_ref_keys(bloom_conn_handler *handle, filter_ref *ref, int is_write, char **keys, int num_keys, char *result);
+static int cached_check_keys(bloom_conn_handler *handle, char *filter_name, char **keys, int num_keys, char *result);
+static int cached_set_keys(bloom_conn_handler *handle, char *filter_name, char **keys, int num_keys, char *result);
 
 static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int num_keys, char *res_buf, int end_of_input);
 static inline void handle_client_resp(bloom_conn_info *conn, char* resp_mesg, int resp_len);
@@ -40,6 +223,19 @@ static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len)
 static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len);
 static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len);
 
+static int filter_owner(bloom_conn_handler *handle, char *name, int name_len);
+static int io_owner(bloom_conn_handler *handle, io_class cls, char *name, int name_len);
+static int text_cmd_owner(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int binary_cmd_owner(bloom_conn_handler *handle, bin_request *req, char *body);
+static int schedule_cmd(cmd_batch *batch, int owner);
+static void batch_append(cmd_batch *batch, int owner, deferred_cmd *cmd);
+static deferred_cmd* copy_text_cmd(conn_cmd_type type, char *args, int args_len);
+static deferred_cmd* copy_binary_cmd(bin_request *req, char *body);
+static void free_deferred_cmds(deferred_cmd *cmd);
+
+// Link to the MurmurHash3 implementation, used to pick filter owners
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
 /**
  * Invoked to initialize the conn handler layer.
  */
@@ -60,65 +256,363 @@ void init_conn_handler() {
  * @return 0 on success.
  */
 int handle_client_connect(bloom_conn_handler *handle) {
-    // Look for the next command line
-    char *buf, *arg_buf;
-    int buf_len, arg_buf_len, should_free;
-    int status;
-    arg_buf_len = 0;
-    while (1) {
-        status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
-        if (status == -1) break; // Return if no command is available
+    cmd_batch batch = {NULL, NULL, -1, 0};
+    int res = 0;
+
+    // Start with any command that was waiting on a deferred command
+    if (handle->state && handle->state->stash) {
+        deferred_cmd *cmd = handle->state->stash;
+        handle->state->stash = NULL;
+        int owner = (cmd->binary) ?
+            binary_cmd_owner(handle, &cmd->req, cmd->args + 1) :
+            text_cmd_owner(handle, cmd->type, (cmd->args_len < 0) ? NULL : cmd->args, cmd->args_len);
+        if (owner == -1) {
+            res = handle_deferred_command(handle, cmd);
+        } else {
+            batch_append(&batch, owner, cmd);
+        }
+    }
+
+    // Handle the rest of the input
+    if (!res) {
+        if (handle->state && handle->state->binary)
+            res = handle_binary_client_connect(handle, &batch);
+        else
+            res = handle_text_client_connect(handle, &batch);
+    }
 
-        // Determine the command type
-        conn_cmd_type type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
+    // Send any batched commands to the owning worker, or the I/O pool
+    if (batch.count) {
+        if (res)
+            free_deferred_cmds(batch.head);
+        else if (batch.owner == IO_POOL_OWNER)
+            defer_client_io(handle->conn, batch.head);
+        else
+            defer_client_command(handle->conn, batch.owner, batch.head);
+    }
+    return res;
+}
 
-        // Handle an error or unknown response
-        switch(type) {
-            case CHECK:
-                handle_check_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CHECK_MULTI:
-                handle_check_multi_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case SET:
-                handle_set_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case SET_MULTI:
-                handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CREATE:
-                handle_create_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case DROP:
-                handle_drop_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CLOSE:
-                handle_close_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CLEAR:
-                handle_clear_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case LIST:
-                handle_list_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case INFO:
-                handle_info_cmd(handle, arg_buf, arg_buf_len);
+
+/**
+ * Invoked by the networking layer to run commands that
+ * were deferred to this worker. The responses are sent
+ * using the provided connection, and the commands are freed.
+ * @arg handle The connection related information
+ * @arg cmds The deferred commands
+ * @return 0 on success, 1 if the connection should be closed.
+ */
+int handle_deferred_command(bloom_conn_handler *handle, void *cmds) {
+    int res = 0;
+    deferred_cmd *cmd = cmds;
+    while (cmd && !res) {
+        if (cmd->binary) {
+            res = handle_binary_request(handle, &cmd->req, cmd->args + 1);
+        } else if (cmd->type == CHECK || cmd->type == SET) {
+            cmd = handle_coalesced_deferred_cmds(handle, cmd);
+            continue;
+        } else {
+            handle_text_cmd(handle, cmd->type, (cmd->args_len < 0) ? NULL : cmd->args, cmd->args_len);
+        }
+        cmd = cmd->next;
+    }
+    free_deferred_cmds(cmds);
+    return res;
+}
+
+
+/**
+ * Invoked by the networking layer when a connection is
+ * closed, to release any connection state.
+ * @arg state The connection state
+ */
+void cleanup_conn_state(bloom_conn_state *state) {
+    free_deferred_cmds(state->stash);
+    state->stash = NULL;
+
+    // Release the resolved filters
+    conn_filters *filters = state->filters;
+    if (filters) {
+        for (int i=0; i < FILTER_CACHE_SIZE; i++) free(filters->cache[i].name);
+        for (uint32_t i=0; i < filters->num_opened; i++) free(filters->opened[i].name);
+        free(filters->opened);
+        free(filters);
+        state->filters = NULL;
+    }
+}
+
+
+/**
+ * Handles all the complete text commands in the input buffer.
+ * Commands for filters owned by another worker are batched, and
+ * processing stops at the first command that must wait on the batch.
+ * @arg handle The connection related information
+ * @arg batch The batch of deferred commands
+ * @return 0 on success.
+ */
+static int handle_text_client_connect(bloom_conn_handler *handle, cmd_batch *batch) {
+    text_cmd cmd, next;
+    int has_next = 0, owner;
+    while (1) {
+        // Use the command read ahead while coalescing, or
+        // look for the next command line
+        if (has_next) {
+            cmd = next;
+            has_next = 0;
+        } else if (read_text_cmd(handle, &cmd)) {
+            break; // Return if no command is available
+        }
+
+        // Run the command here, or defer it to the owning worker
+        owner = text_cmd_owner(handle, cmd.type, cmd.args, cmd.args_len);
+        switch (schedule_cmd(batch, owner)) {
+            case 0:
+                if (cmd.type == CHECK || cmd.type == SET)
+                    has_next = handle_coalesced_text_cmds(handle, &cmd, &next);
+                else
+                    handle_text_cmd(handle, cmd.type, cmd.args, cmd.args_len);
                 break;
-            case FLUSH:
-                handle_flush_cmd(handle, arg_buf, arg_buf_len);
+            case 1:
+                batch_append(batch, owner, copy_text_cmd(cmd.type, cmd.args, cmd.args_len));
                 break;
             default:
-                handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+                handle->state->stash = copy_text_cmd(cmd.type, cmd.args, cmd.args_len);
                 break;
         }
 
         // Make sure to free the command buffer if we need to
-        if (should_free) free(buf);
+        if (cmd.should_free) free(cmd.buf);
+
+        // Wait for the batch to complete
+        if (handle->state && handle->state->stash) break;
+
+        // Any remaining input must be handled as binary requests
+        if (handle->state && handle->state->binary) {
+            return handle_binary_client_connect(handle, batch);
+        }
     }
 
     return 0;
 }
 
+
+/**
+ * Reads and parses the next command line.
+ * @arg handle The connection related information
+ * @arg cmd Output, the parsed command
+ * @return 0 on success, -1 if no command is available.
+ */
+static int read_text_cmd(bloom_conn_handler *handle, text_cmd *cmd) {
+    int status = extract_to_terminator(handle->conn, '\n', &cmd->buf, &cmd->buf_len, &cmd->should_free);
+    if (status == -1) return -1;
+    cmd->args_len = 0;
+    cmd->type = determine_client_command(cmd->buf, cmd->buf_len, &cmd->args, &cmd->args_len);
+    return 0;
+}
+
+
+/**
+ * Handles a check or set command, coalescing it with the commands
+ * that immediately follow it in the input buffer, if they are of
+ * the same type and on the same filter. All the keys are probed in a
+ * single call into the filter manager, and each command gets its
+ * own response. Reading stops at the first command that cannot be
+ * coalesced, which is returned to the caller.
+ * @arg handle The connection related information
+ * @arg first The first command
+ * @arg next Output, the command read ahead that was not handled
+ * @return 1 if next was set, 0 otherwise.
+ */
+static int handle_coalesced_text_cmds(bloom_conn_handler *handle, text_cmd *first, text_cmd *next) {
+    // Let the regular handler deal with malformed commands
+    char *key;
+    int key_len;
+    if (!first->args || buffer_after_terminator(first->args, first->args_len, ' ', &key, &key_len)
+            || key_len <= 1) {
+        handle_text_cmd(handle, first->type, first->args, first->args_len);
+        return 0;
+    }
+    char *filter_name = first->args;
+    int name_len = key - filter_name - 1;
+
+    // Read ahead while the commands can be coalesced
+    char *key_buf[MULTI_OP_SIZE];
+    char *free_buf[MULTI_OP_SIZE];
+    int num_keys = 1, has_next = 0;
+    key_buf[0] = key;
+    while (num_keys < MULTI_OP_SIZE && !read_text_cmd(handle, next)) {
+        key = coalesce_key(first->type, filter_name, name_len, next->type, next->args, next->args_len);
+        if (!key) {
+            has_next = 1;
+            break;
+        }
+        key_buf[num_keys] = key;
+        free_buf[num_keys] = (next->should_free) ? next->buf : NULL;
+        num_keys++;
+    }
+
+    handle_coalesced_keys(handle, first->type, filter_name, (char**)&key_buf, num_keys);
+
+    // Free the coalesced command buffers
+    for (int i=1; i < num_keys; i++) {
+        if (free_buf[i]) free(free_buf[i]);
+    }
+    return has_next;
+}
+
+
+/**
+ * Handles a deferred check or set command, coalescing it with the
+ * following deferred commands of the same type on the same filter.
+ * @arg handle The connection related information
+ * @arg first The first command
+ * @return The first command that was not handled.
+ */
+static deferred_cmd* handle_coalesced_deferred_cmds(bloom_conn_handler *handle, deferred_cmd *first) {
+    // Let the regular handler deal with malformed commands
+    char *args = (first->args_len < 0) ? NULL : first->args;
+    char *key;
+    int key_len;
+    if (!args || buffer_after_terminator(args, first->args_len, ' ', &key, &key_len) || key_len <= 1) {
+        handle_text_cmd(handle, first->type, args, first->args_len);
+        return first->next;
+    }
+    int name_len = key - args - 1;
+
+    // Gather the commands that can be coalesced
+    char *key_buf[MULTI_OP_SIZE];
+    int num_keys = 1;
+    key_buf[0] = key;
+    deferred_cmd *cmd = first->next;
+    while (num_keys < MULTI_OP_SIZE && cmd && !cmd->binary) {
+        key = coalesce_key(first->type, args, name_len, cmd->type,
+                           (cmd->args_len < 0) ? NULL : cmd->args, cmd->args_len);
+        if (!key) break;
+        key_buf[num_keys++] = key;
+        cmd = cmd->next;
+    }
+
+    handle_coalesced_keys(handle, first->type, args, (char**)&key_buf, num_keys);
+    return cmd;
+}
+
+
+/**
+ * Checks if a command can be coalesced with a check or set command.
+ * It must be of the same type, on the same filter, with a key.
+ * @arg type The type of the first command
+ * @arg name The filter name of the first command
+ * @arg name_len The length of the name
+ * @arg cand_type The type of the candidate command
+ * @arg args The arguments of the candidate. Terminated in place on a match.
+ * @arg args_len The length of args, including the terminator
+ * @return The key of the candidate, or NULL if it cannot be coalesced.
+ */
+static char* coalesce_key(conn_cmd_type type, char *name, int name_len, conn_cmd_type cand_type, char *args, int args_len) {
+    // Need the name, a space and at least one key byte before the terminator
+    if (cand_type != type || !args || args_len <= name_len + 2) return NULL;
+    if (memcmp(args, name, name_len) || args[name_len] != ' ') return NULL;
+    args[name_len] = '\0';
+    return args + name_len + 1;
+}
+
+
+/**
+ * Checks or sets the keys of coalesced commands in a single call
+ * into the filter manager, and sends a response for each command.
+ * Sets may have their responses suppressed in no-reply mode.
+ * @arg handle The connection related information
+ * @arg type Either CHECK or SET
+ * @arg filter_name The name of the filter
+ * @arg keys The keys, one per command
+ * @arg num_keys The number of keys. Must not be more than MULTI_OP_SIZE.
+ */
+static void handle_coalesced_keys(bloom_conn_handler *handle, conn_cmd_type type, char *filter_name, char **keys, int num_keys) {
+    char result_buf[MULTI_OP_SIZE];
+    int is_write = (type == SET);
+    int res = (is_write) ?
+        cached_set_keys(handle, filter_name, keys, num_keys, (char*)&result_buf) :
+        cached_check_keys(handle, filter_name, keys, num_keys, (char*)&result_buf);
+    if (is_write && NO_REPLY(res)) return;
+
+    // Each command gets its own response line
+    char *resp_bufs[MULTI_OP_SIZE];
+    int resp_buf_lens[MULTI_OP_SIZE];
+    for (int i=0; i < num_keys; i++) {
+        if (res == 0 && result_buf[i]) {
+            resp_bufs[i] = (char*)YES_RESP;
+            resp_buf_lens[i] = YES_RESP_LEN;
+        } else if (res == 0) {
+            resp_bufs[i] = (char*)NO_RESP;
+            resp_buf_lens[i] = NO_RESP_LEN;
+        } else if (res == -1) {
+            resp_bufs[i] = (char*)FILT_NOT_EXIST;
+            resp_buf_lens[i] = FILT_NOT_EXIST_LEN;
+        } else if (res == -3) {
+            resp_bufs[i] = (char*)READ_ONLY_RESP;
+            resp_buf_lens[i] = READ_ONLY_RESP_LEN;
+        } else {
+            resp_bufs[i] = (char*)INTERNAL_ERR;
+            resp_buf_lens[i] = INTERNAL_ERR_LEN;
+        }
+    }
+    send_client_response(handle->conn, (char**)&resp_bufs, (int*)&resp_buf_lens, num_keys);
+}
+
+
+/**
+ * Dispatches a single text command to its handler.
+ */
+static void handle_text_cmd(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    switch(type) {
+        case CHECK:
+            handle_check_cmd(handle, args, args_len);
+            break;
+        case CHECK_MULTI:
+            handle_check_multi_cmd(handle, args, args_len);
+            break;
+        case SET:
+            handle_set_cmd(handle, args, args_len);
+            break;
+        case SET_MULTI:
+            handle_set_multi_cmd(handle, args, args_len);
+            break;
+        case CREATE:
+            handle_create_cmd(handle, args, args_len);
+            break;
+        case DROP:
+            handle_drop_cmd(handle, args, args_len);
+            break;
+        case CLOSE:
+            handle_close_cmd(handle, args, args_len);
+            break;
+        case CLEAR:
+            handle_clear_cmd(handle, args, args_len);
+            break;
+        case LIST:
+            handle_list_cmd(handle, args, args_len);
+            break;
+        case INFO:
+            handle_info_cmd(handle, args, args_len);
+            break;
+        case FLUSH:
+            handle_flush_cmd(handle, args, args_len);
+            break;
+        case STATS:
+            handle_stats_cmd(handle, args, args_len);
+            break;
+        case NO_REPLY:
+            handle_noreply_cmd(handle, args, args_len);
+            break;
+        case BINARY:
+            handle_binary_cmd(handle, args, args_len);
+            break;
+        default:
+            handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+            break;
+    }
+}
+
 /**
  * Periodic update is used to update our checkpoint with
  * the filter manager, so that vacuum progress can be made.
@@ -131,10 +625,11 @@ void periodic_update(bloom_conn_handler *handle) {
 /**
  * Internal method to handle a command that relies
  * on a filter name and a single key, responses are handled using
- * handle_multi_response.
+ * handle_multi_response. Writes may have their response suppressed
+ * if the client is in no-reply mode.
  */
 static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+        int(*keys_func)(bloom_conn_handler *, char*, char **, int, char*), int is_write) {
     #define CHECK_ARG_ERR() { \
         handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
         return; \
@@ -153,26 +648,28 @@ static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args
     char result_buf[1];
 
     // Call into the filter manager
-    int res = filtmgr_func(handle->mgr, args, (char**)&key_buf, 1, (char*)&result_buf);
+    int res = keys_func(handle, args, (char**)&key_buf, 1, (char*)&result_buf);
+    if (is_write && NO_REPLY(res)) return;
     handle_multi_response(handle, res, 1, (char*)&result_buf, 1);
 }
 
 static void handle_check_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_key_cmd(handle, args, args_len, filtmgr_check_keys);
+    handle_filt_key_cmd(handle, args, args_len, cached_check_keys, 0);
 }
 
 static void handle_set_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_key_cmd(handle, args, args_len, filtmgr_set_keys);
+    handle_filt_key_cmd(handle, args, args_len, cached_set_keys, 1);
 }
 
 
 /**
  * Internal method to handle a command that relies
  * on a filter name and multiple keys, responses are handled using
- * handle_multi_response.
+ * handle_multi_response. Writes may have their response suppressed
+ * if the client is in no-reply mode.
  */
 static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+        int(*keys_func)(bloom_conn_handler *, char*, char **, int, char*), int is_write) {
     #define CHECK_ARG_ERR() { \
         handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
         return; \
@@ -208,9 +705,11 @@ static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, in
         // If we have filled the buffer, check now
         if (index == MULTI_OP_SIZE) {
             //  Handle the keys now
-            int res = filtmgr_func(handle->mgr, args, (char**)&key_buf, index, (char*)&result_buf);
-            res = handle_multi_response(handle, res, index, (char*)&result_buf, !HAS_ANOTHER_KEY());
-            if (res) return;
+            int res = keys_func(handle, args, (char**)&key_buf, index, (char*)&result_buf);
+            if (!(is_write && NO_REPLY(res))) {
+                res = handle_multi_response(handle, res, index, (char*)&result_buf, !HAS_ANOTHER_KEY());
+                if (res) return;
+            }
 
             // Reset the index
             index = 0;
@@ -219,17 +718,18 @@ static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, in
 
     // Handle any remaining keys
     if (index) {
-        int res = filtmgr_func(handle->mgr, args, key_buf, index, result_buf);
+        int res = keys_func(handle, args, key_buf, index, result_buf);
+        if (is_write && NO_REPLY(res)) return;
         handle_multi_response(handle, res, index, (char*)&result_buf, 1);
     }
 }
 
 static void handle_check_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_multi_key_cmd(handle, args, args_len, filtmgr_check_keys);
+    handle_filt_multi_key_cmd(handle, args, args_len, cached_check_keys, 0);
 }
 
 static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_multi_key_cmd(handle, args, args_len, filtmgr_set_keys);
+    handle_filt_multi_key_cmd(handle, args, args_len, cached_set_keys, 1);
 }
 
 
@@ -237,6 +737,12 @@ static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int arg
  * Internal command used to handle filter creation.
  */
 static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // Replicas only create filters from the stream
+    if (READ_ONLY()) {
+        handle_client_resp(handle->conn, (char*)READ_ONLY_RESP, READ_ONLY_RESP_LEN);
+        return;
+    }
+
     // If we have no args, complain.
     if (!args) {
         handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
@@ -309,7 +815,8 @@ static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_l
     res = filtmgr_create_filter(handle->mgr, filter_name, config);
     switch (res) {
         case 0:
-            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            if (!NO_REPLY(res))
+                handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
             break;
         case -1:
             handle_client_resp(handle->conn, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
@@ -353,7 +860,8 @@ static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len
     int res = filtmgr_func(handle->mgr, args);
     switch (res) {
         case 0:
-            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            if (!NO_REPLY(res))
+                handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
             break;
         case -1:
             handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
@@ -368,6 +876,10 @@ static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len
 }
 
 static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (READ_ONLY()) {
+        handle_client_resp(handle->conn, (char*)READ_ONLY_RESP, READ_ONLY_RESP_LEN);
+        return;
+    }
     handle_filt_cmd(handle, args, args_len, filtmgr_drop_filter);
 }
 
@@ -376,69 +888,88 @@ static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_le
 }
 
 static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (READ_ONLY()) {
+        handle_client_resp(handle->conn, (char*)READ_ONLY_RESP, READ_ONLY_RESP_LEN);
+        return;
+    }
     handle_filt_cmd(handle, args, args_len, filtmgr_clear_filter);
 }
 
-// Callback invoked by list command to create an output
-// line for each filter. We hold a filter handle which we
-// can use to get some info about it
-static void list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
-    char **out = data;
-    int res;
-    res = asprintf(out, "%s %f %llu %llu %llu\n",
+// Sends the buffered list output
+static void list_stream_flush(list_stream *stream) {
+    char *buf = stream->buf;
+    send_client_response(stream->handle->conn, &buf, &stream->len, 1);
+    stream->len = 0;
+}
+
+// Callback invoked by list command to write the output
+// line for each filter. The filter can only be used to
+// get some info about it
+static int list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    list_stream *stream = data;
+    stream->len += snprintf(stream->buf + stream->len, LIST_CHUNK_SIZE - stream->len,
+            "%s %f %llu %llu %llu\n",
             filter_name,
             filter->filter_config.default_probability,
             (unsigned long long)bloomf_byte_size(filter),
             (unsigned long long)bloomf_capacity(filter),
             (unsigned long long)bloomf_size(filter));
-    assert(res != -1);
+    if (stream->len > LIST_CHUNK_SIZE - LIST_LINE_MAX) list_stream_flush(stream);
+
+    // Stop once we reach the limit
+    return (stream->limit && --stream->limit == 0);
 }
 
 static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    (void)args_len;
+    // Parse the prefix and any options
+    char *prefix = NULL, *after = NULL;
+    unsigned long long limit = 0;
+    char *param = args;
+    while (param) {
+        // Adds a zero terminator to the current param, scans forward
+        buffer_after_terminator(args, args_len, ' ', &args, &args_len);
+
+        // Check for the options, the prefix must come first
+        int match = 0;
+        if (!strncmp(param, "after=", 6)) {
+            after = param + 6;
+            match = 1;
+        } else if (!strncmp(param, "limit=", 6)) {
+            match = sscanf(param, "limit=%llu", &limit) == 1 && limit > 0;
+        } else if (!prefix && !after && !limit) {
+            prefix = param;
+            match = 1;
+        }
 
-    // List all the filters
-    bloom_filter_list_head *head;
-    int res = filtmgr_list_filters(handle->mgr, args, &head);
-    if (res != 0) {
-        INTERNAL_ERROR();
-        return;
-    }
+        // Check if there was no match
+        if (!match) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
 
-    // Allocate buffers for the responses
-    int num_out = (head->size+2);
-    char** output_bufs = malloc(num_out * sizeof(char*));
-    int* output_bufs_len = malloc(num_out * sizeof(int));
+        // Advance to the next param
+        param = args;
+    }
 
-    // Setup the START/END lines
-    output_bufs[0] = (char*)&START_RESP;
-    output_bufs_len[0] = START_RESP_LEN;
-    output_bufs[head->size+1] = (char*)&END_RESP;
-    output_bufs_len[head->size+1] = END_RESP_LEN;
+    // Stream the filters, a chunk at a time
+    list_stream *stream = malloc(sizeof(list_stream));
+    stream->handle = handle;
+    stream->limit = limit;
+    memcpy(stream->buf, START_RESP, START_RESP_LEN);
+    stream->len = START_RESP_LEN;
 
-    // Generate the responses
-    char *resp;
-    bloom_filter_list *node = head->head;
-    for (int i=0; i < head->size; i++) {
-        res = filtmgr_filter_cb(handle->mgr, node->filter_name, list_filter_cb, &resp);
-        if (res == 0) {
-            output_bufs[i+1] = resp;
-            output_bufs_len[i+1] = strlen(resp);
-        } else { // Skip this output
-            output_bufs[i+1] = NULL;
-            output_bufs_len[i+1] = 0;
-        }
-        node = node->next;
+    int res = filtmgr_iter_filters(handle->mgr, prefix, after, list_filter_cb, stream);
+    if (res < 0) {
+        free(stream);
+        INTERNAL_ERROR();
+        return;
     }
 
-    // Write the response
-    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
-
-    // Cleanup
-    for (int i=1; i <= head->size; i++) if(output_bufs[i]) free(output_bufs[i]);
-    free(output_bufs);
-    free(output_bufs_len);
-    filtmgr_cleanup_list(head);
+    // Finish the response
+    memcpy(stream->buf + stream->len, END_RESP, END_RESP_LEN);
+    stream->len += END_RESP_LEN;
+    list_stream_flush(stream);
+    free(stream);
 }
 
 
@@ -465,6 +996,7 @@ static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter)
 checks %llu\n\
 check_hits %llu\n\
 check_misses %llu\n\
+compressed %d\n\
 in_memory %d\n\
 page_ins %llu\n\
 page_outs %llu\n\
@@ -476,7 +1008,7 @@ size %llu\n\
 storage %llu\n",
     (unsigned long long)capacity, (unsigned long long)checks,
     (unsigned long long)counters->check_hits, (unsigned long long)counters->check_misses,
-    ((bloomf_is_proxied(filter)) ? 0 : 1),
+    bloomf_is_compressed(filter), ((bloomf_is_proxied(filter)) ? 0 : 1),
     (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
     filter->filter_config.default_probability,
     (unsigned long long)sets, (unsigned long long)counters->set_hits,
@@ -528,6 +1060,54 @@ static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len
     free(output[1]);
 }
 
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Report the memory use, and the progress of the flush scheduler and warmup
+    bloom_flush_stats stats;
+    flush_scheduler_stats(&stats);
+    bloom_warmup_stats warmup;
+    warmup_stats(&warmup);
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+    lens[1] = asprintf(&output[1], "max_resident_bytes %llu\n\
+resident_bytes %llu\n\
+evictions %llu\n\
+flush_threads %d\n\
+flush_rate %llu\n\
+flush_intervals %llu\n\
+flush_queued %llu\n\
+flush_queued_bytes %llu\n\
+flush_active %llu\n\
+flushes %llu\n\
+flush_bytes %llu\n\
+flush_throttled_msec %llu\n\
+warmup_pending %llu\n\
+warmup_active %llu\n\
+warmup_warmed %llu\n\
+warmup_skipped %llu\n\
+warmup_msec %llu\n",
+    (unsigned long long)handle->config->max_resident_bytes,
+    (unsigned long long)filtmgr_resident_bytes(handle->mgr),
+    (unsigned long long)filtmgr_evictions(handle->mgr),
+    handle->config->flush_threads, (unsigned long long)handle->config->flush_rate,
+    (unsigned long long)stats.intervals, (unsigned long long)stats.queued,
+    (unsigned long long)stats.queued_bytes, (unsigned long long)stats.active,
+    (unsigned long long)stats.flushes, (unsigned long long)stats.flushed_bytes,
+    (unsigned long long)stats.throttled_msec,
+    (unsigned long long)warmup.pending, (unsigned long long)warmup.active,
+    (unsigned long long)warmup.warmed, (unsigned long long)warmup.skipped,
+    (unsigned long long)warmup.msec);
+    assert(lens[1] != -1);
+
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+    free(output[1]);
+}
+
 
 static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len) {
     // If we have a specfic filter, use filt_cmd
@@ -553,13 +1133,493 @@ static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_le
     }
 
     // Respond
-    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+    if (!NO_REPLY(0))
+        handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
 
     // Cleanup
     filtmgr_cleanup_list(head);
 }
 
 
+/**
+ * Internal command used to toggle no-reply mode. While enabled,
+ * successful write commands (set, bulk, create, drop, close,
+ * clear and flush) generate no response, but errors are still
+ * reported. This allows bulk loaders to pipeline writes without
+ * waiting on the replies. The toggle itself is always acknowledged.
+ */
+static void handle_noreply_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+
+    // No arguments enables no-reply mode
+    int no_reply = 1;
+    if (args) {
+        if (strcmp(args, "on") == 0) {
+            no_reply = 1;
+        } else if (strcmp(args, "off") == 0) {
+            no_reply = 0;
+        } else {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    // Update the connection state and acknowledge
+    if (handle->state) handle->state->no_reply = no_reply;
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+
+/**
+ * Internal command used to switch the connection to the
+ * binary protocol. The switch is acknowledged with a text
+ * response, and all following requests must be binary.
+ */
+static void handle_binary_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+    if (!handle->state) {
+        INTERNAL_ERROR();
+        return;
+    }
+    handle->state->binary = 1;
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+
+/**
+ * Handles all the complete binary requests in the
+ * input buffer. A malformed request cannot be skipped,
+ * since the framing is lost, so the connection is closed.
+ * @arg handle The connection related information
+ * @return 0 on success, 1 if the connection should be closed.
+ */
+static int handle_binary_client_connect(bloom_conn_handler *handle, cmd_batch *batch) {
+    char header[BIN_REQ_HEADER_SIZE];
+    char *frame, *body;
+    int should_free, res, owner;
+    bin_request req;
+    uint32_t val;
+    while (1) {
+        // Wait until the complete header is available
+        if (peek_client_bytes(handle->conn, (char*)&header, BIN_REQ_HEADER_SIZE)) break;
+
+        // Decode the header
+        req.opcode = header[0];
+        req.name_len = header[1];
+        memcpy(&val, header+4, sizeof(uint32_t));
+        req.key_count = ntohl(val);
+        memcpy(&val, header+8, sizeof(uint32_t));
+        req.body_len = ntohl(val);
+
+        // Reject requests we can never satisfy
+        if (header[2] || header[3] || req.body_len > BIN_MAX_BODY_SIZE) {
+            handle_binary_resp(handle, BIN_CLIENT_ERR, 0, NULL);
+            return 1;
+        }
+
+        // Wait until the complete body is available
+        if (extract_client_bytes(handle->conn, BIN_REQ_HEADER_SIZE + req.body_len,
+                                 &frame, &should_free)) break;
+
+        // Run the request here, or defer it to the owning worker
+        res = 0;
+        body = frame + BIN_REQ_HEADER_SIZE;
+        owner = binary_cmd_owner(handle, &req, body);
+        switch (schedule_cmd(batch, owner)) {
+            case 0:
+                res = handle_binary_request(handle, &req, body);
+                break;
+            case 1:
+                batch_append(batch, owner, copy_binary_cmd(&req, body));
+                break;
+            default:
+                handle->state->stash = copy_binary_cmd(&req, body);
+                break;
+        }
+        if (should_free) free(frame);
+        if (res) return 1;
+
+        // Wait for the batch to complete
+        if (handle->state->stash) break;
+    }
+    return 0;
+}
+
+
+/**
+ * Validates the body of a binary request. Checks that the name
+ * and all the length prefixed keys exactly fill the body.
+ * @return 0 if valid, -1 otherwise.
+ */
+static int binary_validate_body(bin_request *req, char *body) {
+    int name_size = binary_name_size(req);
+    if (name_size > (int)req->body_len) return -1;
+    char *pos = body + name_size;
+    char *end = body + req->body_len;
+    uint16_t len;
+    for (uint32_t i=0; i < req->key_count; i++) {
+        if (end - pos < (int)sizeof(uint16_t)) return -1;
+        memcpy(&len, pos, sizeof(uint16_t));
+        len = ntohs(len);
+        pos += sizeof(uint16_t);
+        if (len == 0 || end - pos < len) return -1;
+        pos += len;
+    }
+    return (pos == end) ? 0 : -1;
+}
+
+
+/**
+ * Returns the size of the filter name or handle
+ * at the start of the request body.
+ */
+static int binary_name_size(bin_request *req) {
+    return (req->name_len) ? req->name_len : BIN_HANDLE_SIZE;
+}
+
+
+/**
+ * Returns the filter opened by the connection, for
+ * a request that refers to it by handle.
+ * @arg body The request body, starting with the handle
+ * @return The filter, or NULL if the handle is not open.
+ */
+static filter_ref* binary_opened_filter(bloom_conn_handler *handle, char *body) {
+    conn_filters *filters = (handle->state) ? handle->state->filters : NULL;
+    if (!filters) return NULL;
+    uint32_t id;
+    memcpy(&id, body, sizeof(uint32_t));
+    id = ntohl(id);
+    return (id < filters->num_opened) ? filters->opened + id : NULL;
+}
+
+
+/**
+ * Null terminates an element of the request body. The byte after the
+ * element is the start of the next length prefix, which must already
+ * be read. The last element has no following byte within the frame,
+ * so it is moved back over the byte preceding it, which is either
+ * part of its own length prefix or the decoded header.
+ * @return The start of the terminated element.
+ */
+static char* binary_terminate(char *elem, int len, int is_last) {
+    if (is_last) {
+        memmove(elem - 1, elem, len);
+        elem -= 1;
+    }
+    elem[len] = '\0';
+    return elem;
+}
+
+
+/**
+ * Reads the length prefix at the given position.
+ */
+static inline uint16_t binary_read_len(char *pos) {
+    uint16_t len;
+    memcpy(&len, pos, sizeof(uint16_t));
+    return ntohs(len);
+}
+
+
+/**
+ * Returns the next key from the reader, null terminated.
+ */
+static char* binary_next_key(bin_key_reader *reader) {
+    char *key = reader->cursor;
+    uint16_t len = reader->next_len;
+    reader->remain--;
+
+    // Read ahead the next length before we terminate
+    if (reader->remain) {
+        reader->next_len = binary_read_len(key + len);
+        reader->cursor = key + len + sizeof(uint16_t);
+    }
+    return binary_terminate(key, len, reader->remain == 0);
+}
+
+
+/**
+ * Handles a binary check or set request, responding with
+ * a bitset of the results.
+ */
+static void handle_binary_keys(bloom_conn_handler *handle, filter_ref *ref, bin_key_reader *reader,
+        uint32_t key_count, int is_write) {
+    char *key_buf[MULTI_OP_SIZE];
+    char result_buf[MULTI_OP_SIZE];
+    char *bitset = calloc(1, (key_count + 7) / 8 + 1);
+
+    // Process the keys in chunks, to bound the lock hold times
+    uint32_t done = 0;
+    while (done < key_count) {
+        int num = (key_count - done < MULTI_OP_SIZE) ? key_count - done : MULTI_OP_SIZE;
+        for (int i=0; i < num; i++) {
+            key_buf[i] = binary_next_key(reader);
+        }
+
+        int res = filter_ref_keys(handle, ref, is_write, (char**)&key_buf, num, (char*)&result_buf);
+        if (res) {
+            handle_binary_resp(handle, (res == -1) ? BIN_FILT_NOT_EXIST :
+                               (res == -3) ? BIN_READ_ONLY : BIN_INTERNAL_ERR, 0, NULL);
+            free(bitset);
+            return;
+        }
+
+        // Pack the results
+        for (int i=0; i < num; i++) {
+            if (result_buf[i]) bitset[(done+i) / 8] |= 1 << ((done+i) % 8);
+        }
+        done += num;
+    }
+
+    if (!(is_write && NO_REPLY(0))) {
+        handle_binary_resp(handle, BIN_OK, key_count, bitset);
+    }
+    free(bitset);
+}
+
+
+/**
+ * Handles a single binary request.
+ * @arg handle The connection related information
+ * @arg req The decoded request header
+ * @arg body The request body, modified in place
+ * @return 0 on success, 1 if the connection should be closed.
+ */
+static int handle_binary_request(bloom_conn_handler *handle, bin_request *req, char *body) {
+    if (binary_validate_body(req, body)) {
+        handle_binary_resp(handle, BIN_CLIENT_ERR, 0, NULL);
+        return 1;
+    }
+
+    // Setup the key reader
+    int name_size = binary_name_size(req);
+    bin_key_reader reader;
+    reader.remain = req->key_count;
+    if (reader.remain) {
+        reader.next_len = binary_read_len(body + name_size);
+        reader.cursor = body + name_size + sizeof(uint16_t);
+    }
+
+    // Terminate the filter name, or find the opened filter
+    char *filter_name;
+    filter_ref *ref = NULL;
+    if (req->name_len) {
+        filter_name = binary_terminate(body, req->name_len, reader.remain == 0);
+    } else if ((ref = binary_opened_filter(handle, body))) {
+        filter_name = ref->name;
+    } else {
+        handle_binary_resp(handle, BIN_FILT_NOT_EXIST, 0, NULL);
+        return 0;
+    }
+
+    // Only the key commands take keys
+    if (req->opcode != BIN_CHECK && req->opcode != BIN_SET && req->key_count) {
+        handle_binary_resp(handle, BIN_CLIENT_ERR, 0, NULL);
+        return 1;
+    }
+
+    // Replicas only change filters from the stream
+    if (READ_ONLY() && (req->opcode == BIN_SET || req->opcode == BIN_CREATE ||
+                req->opcode == BIN_DROP || req->opcode == BIN_CLEAR)) {
+        handle_binary_resp(handle, BIN_READ_ONLY, 0, NULL);
+        return 0;
+    }
+
+    int res = 0;
+    bin_status status;
+    switch (req->opcode) {
+        case BIN_CHECK:
+        case BIN_SET:
+            if (!ref) ref = cached_filter_ref(handle, filter_name);
+            handle_binary_keys(handle, ref, &reader, req->key_count, req->opcode == BIN_SET);
+            return 0;
+
+        case BIN_OPEN:
+            handle_binary_open(handle, filter_name);
+            return 0;
+
+        case BIN_CREATE:
+            if (regexec(&VALID_FILTER_NAMES_RE, filter_name, 0, NULL, 0) != 0) {
+                handle_binary_resp(handle, BIN_CLIENT_ERR, 0, NULL);
+                return 1;
+            }
+            res = filtmgr_create_filter(handle->mgr, filter_name, NULL);
+            switch (res) {
+                case 0: status = BIN_OK; break;
+                case -1: status = BIN_EXISTS; break;
+                case -3: status = BIN_DELETE_IN_PROGRESS; break;
+                default: status = BIN_INTERNAL_ERR; break;
+            }
+            break;
+
+        case BIN_DROP:
+        case BIN_CLOSE:
+        case BIN_CLEAR:
+        case BIN_FLUSH:
+            if (req->opcode == BIN_DROP)
+                res = filtmgr_drop_filter(handle->mgr, filter_name);
+            else if (req->opcode == BIN_CLOSE)
+                res = filtmgr_unmap_filter(handle->mgr, filter_name);
+            else if (req->opcode == BIN_CLEAR)
+                res = filtmgr_clear_filter(handle->mgr, filter_name);
+            else
+                res = filtmgr_flush_filter(handle->mgr, filter_name);
+            switch (res) {
+                case 0: status = BIN_OK; break;
+                case -1: status = BIN_FILT_NOT_EXIST; break;
+                case -2: status = BIN_FILT_NOT_PROXIED; break;
+                default: status = BIN_INTERNAL_ERR; break;
+            }
+            break;
+
+        default:
+            handle_binary_resp(handle, BIN_CLIENT_ERR, 0, NULL);
+            return 1;
+    }
+
+    // Respond to the filter commands
+    if (!NO_REPLY(res)) handle_binary_resp(handle, status, 0, NULL);
+    return 0;
+}
+
+
+/**
+ * Sends a binary response, with an optional result bitset.
+ * @arg handle The conn handle
+ * @arg status The response status
+ * @arg count The number of bits in the bitset
+ * @arg bitset The result bitset, or NULL if count is 0.
+ */
+static void handle_binary_resp(bloom_conn_handler *handle, bin_status status, uint32_t count, char *bitset) {
+    char header[BIN_RESP_HEADER_SIZE] = {0};
+    uint32_t val = htonl(count);
+    header[0] = status;
+    memcpy(header+4, &val, sizeof(uint32_t));
+
+    char *buffers[] = {(char*)&header, bitset};
+    int sizes[] = {BIN_RESP_HEADER_SIZE, (count + 7) / 8};
+    send_client_response(handle->conn, (char**)&buffers, (int*)&sizes, (count && bitset) ? 2 : 1);
+}
+
+
+/**
+ * Handles a binary open request. The filter is added to the
+ * filters opened by the connection, and the response count is
+ * the handle, which later requests can use in place of the name.
+ * Opening the same name again returns the same handle.
+ */
+static void handle_binary_open(bloom_conn_handler *handle, char *filter_name) {
+    bloom_filter_handle resolved;
+    if (filtmgr_get_handle(handle->mgr, filter_name, &resolved)) {
+        handle_binary_resp(handle, BIN_FILT_NOT_EXIST, 0, NULL);
+        return;
+    }
+
+    // Look for an existing handle
+    conn_filters *filters = get_conn_filters(handle->state);
+    uint32_t id = 0;
+    while (id < filters->num_opened && strcmp(filters->opened[id].name, filter_name)) id++;
+
+    // Add a new handle
+    if (id == filters->num_opened) {
+        if (id == MAX_OPEN_FILTERS) {
+            handle_binary_resp(handle, BIN_INTERNAL_ERR, 0, NULL);
+            return;
+        }
+        if (id == filters->max_opened) {
+            filters->max_opened = (filters->max_opened) ? filters->max_opened * 2 : 8;
+            filters->opened = realloc(filters->opened, filters->max_opened * sizeof(filter_ref));
+        }
+        filters->opened[id].name = strdup(filter_name);
+        filters->opened[id].name_len = strlen(filter_name);
+        filters->num_opened++;
+    }
+    filters->opened[id].handle = resolved;
+    handle_binary_resp(handle, BIN_OK, id, NULL);
+}
+
+
+/**
+ * Returns the filters resolved by a connection,
+ * allocating them on first use.
+ */
+static conn_filters* get_conn_filters(bloom_conn_state *state) {
+    if (!state->filters) state->filters = calloc(1, sizeof(conn_filters));
+    return state->filters;
+}
+
+
+/**
+ * Finds a filter in the cache of the connection. On a miss, the
+ * least recently added entry is replaced, and left to be resolved.
+ * @arg filter_name The name of the filter
+ * @return The cache entry for the filter.
+ */
+static filter_ref* cached_filter_ref(bloom_conn_handler *handle, char *filter_name) {
+    conn_filters *filters = get_conn_filters(handle->state);
+    int name_len = strlen(filter_name);
+    filter_ref *ref;
+    for (int i=0; i < FILTER_CACHE_SIZE; i++) {
+        ref = filters->cache + i;
+        if (ref->name_len == name_len && ref->name && !memcmp(ref->name, filter_name, name_len))
+            return ref;
+    }
+
+    // Replace the oldest entry
+    ref = filters->cache + filters->cache_next;
+    filters->cache_next = (filters->cache_next + 1) % FILTER_CACHE_SIZE;
+    free(ref->name);
+    ref->name = strdup(filter_name);
+    ref->name_len = name_len;
+    ref->handle.filter = NULL;
+    return ref;
+}
+
+
+/**
+ * Checks or sets keys in a resolved filter. The handle is
+ * resolved again by name if the filter manager has changed.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error, -3 if writes are not allowed.
+ */
+static int filter_ref_keys(bloom_conn_handler *handle, filter_ref *ref, int is_write, char **keys, int num_keys, char *result) {
+    if (is_write && READ_ONLY()) return -3;
+    if (!filtmgr_handle_valid(handle->mgr, &ref->handle) &&
+            filtmgr_get_handle(handle->mgr, ref->name, &ref->handle))
+        return -1;
+    return (is_write) ?
+        filtmgr_set_handle_keys(handle->mgr, &ref->handle, keys, num_keys, result) :
+        filtmgr_check_handle_keys(handle->mgr, &ref->handle, keys, num_keys, result);
+}
+
+
+/**
+ * Checks keys, using the filters cached by the connection.
+ * Same arguments and return as filtmgr_check_keys.
+ */
+static int cached_check_keys(bloom_conn_handler *handle, char *filter_name, char **keys, int num_keys, char *result) {
+    if (!handle->state) return filtmgr_check_keys(handle->mgr, filter_name, keys, num_keys, result);
+    return filter_ref_keys(handle, cached_filter_ref(handle, filter_name), 0, keys, num_keys, result);
+}
+
+
+/**
+ * Sets keys, using the filters cached by the connection.
+ * Same arguments and return as filtmgr_set_keys,
+ * or -3 if writes are not allowed.
+ */
+static int cached_set_keys(bloom_conn_handler *handle, char *filter_name, char **keys, int num_keys, char *result) {
+    if (READ_ONLY()) return -3;
+    if (!handle->state) return filtmgr_set_keys(handle->mgr, filter_name, keys, num_keys, result);
+    return filter_ref_keys(handle, cached_filter_ref(handle, filter_name), 1, keys, num_keys, result);
+}
+
+
 /**
  * Helper to handle sending the response to the multi commands,
  * either multi or bulk.
@@ -580,6 +1640,9 @@ static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int nu
             case -1:
                 handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
                 break;
+            case -3:
+                handle_client_resp(handle->conn, (char*)READ_ONLY_RESP, READ_ONLY_RESP_LEN);
+                break;
             default:
                 INTERNAL_ERROR();
                 break;
@@ -639,6 +1702,195 @@ static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len)
 }
 
 
+/**
+ * Determines which worker owns a filter, when filters
+ * are sharded across the workers.
+ * @arg handle The connection related information
+ * @arg name The filter name, need not be null terminated
+ * @arg name_len The length of the name
+ * @return The index of the owning worker, or -1 if
+ * the command should be handled by this worker.
+ */
+static int filter_owner(bloom_conn_handler *handle, char *name, int name_len) {
+    if (!handle->state || !handle->config->shard_filters) return -1;
+    if (handle->config->worker_threads < 2) return -1;
+
+    uint64_t out[2];
+    MurmurHash3_x64_128(name, name_len, 0, &out);
+    int owner = out[0] % handle->config->worker_threads;
+    return (owner == handle->worker_id) ? -1 : owner;
+}
+
+
+/**
+ * Determines if a command should be run by the I/O pool,
+ * because it may block on disk.
+ * @arg handle The connection related information
+ * @arg cls The I/O class of the command
+ * @arg name The filter name, need not be null terminated
+ * @arg name_len The length of the name
+ * @return IO_POOL_OWNER if the command may block,
+ * or -1 if it can be run by a worker.
+ */
+static int io_owner(bloom_conn_handler *handle, io_class cls, char *name, int name_len) {
+    if (!handle->state || !handle->config->io_threads || cls == IO_NEVER) return -1;
+
+    // Only key commands on a proxied filter will fault
+    if (cls == IO_IF_COLD) {
+        if (name_len > MAX_FILTER_NAME_LEN) return -1;
+        char filter_name[MAX_FILTER_NAME_LEN + 1];
+        memcpy(filter_name, name, name_len);
+        filter_name[name_len] = '\0';
+        if (filtmgr_is_proxied(handle->mgr, filter_name) != 1) return -1;
+    }
+    return IO_POOL_OWNER;
+}
+
+
+/**
+ * Determines which worker should handle a text command.
+ * Commands that may block on disk are sent to the I/O pool.
+ * Other commands that are not bound to a single filter, or
+ * that are malformed, are handled by this worker.
+ * @return The index of the owning worker, IO_POOL_OWNER,
+ * or -1 for this worker.
+ */
+static int text_cmd_owner(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    io_class cls;
+    switch (type) {
+        case CHECK:
+        case CHECK_MULTI:
+        case SET:
+        case SET_MULTI:
+            cls = IO_IF_COLD;
+            break;
+        case CREATE:
+        case DROP:
+        case CLOSE:
+        case CLEAR:
+        case FLUSH:
+            cls = IO_ALWAYS;
+            break;
+        case INFO:
+            cls = IO_NEVER;
+            break;
+        default:
+            return -1;
+    }
+
+    // Flushing all the filters is not bound to a single filter
+    if (!args) return (type == FLUSH) ? io_owner(handle, cls, NULL, 0) : -1;
+
+    // The filter name runs up to the first space
+    char *space = memchr(args, ' ', args_len);
+    int name_len = (space) ? space - args : (int)strlen(args);
+    int owner = io_owner(handle, cls, args, name_len);
+    if (owner != -1) return owner;
+    return filter_owner(handle, args, name_len);
+}
+
+
+/**
+ * Determines which worker should handle a binary request.
+ * Requests that may block on disk are sent to the I/O pool.
+ * Malformed requests are handled by this worker, which
+ * responds with an error and closes the connection.
+ * @return The index of the owning worker, IO_POOL_OWNER,
+ * or -1 for this worker.
+ */
+static int binary_cmd_owner(bloom_conn_handler *handle, bin_request *req, char *body) {
+    if (req->opcode < BIN_CHECK || req->opcode > BIN_FLUSH) return -1;
+    if (req->opcode != BIN_CHECK && req->opcode != BIN_SET && req->key_count) return -1;
+    if (binary_validate_body(req, body)) return -1;
+
+    // Find the name of an opened filter
+    char *name = body;
+    int name_len = req->name_len;
+    if (!name_len) {
+        filter_ref *ref = binary_opened_filter(handle, body);
+        if (!ref) return -1;
+        name = ref->name;
+        name_len = ref->name_len;
+    }
+
+    io_class cls = (req->opcode == BIN_CHECK || req->opcode == BIN_SET) ? IO_IF_COLD : IO_ALWAYS;
+    int owner = io_owner(handle, cls, name, name_len);
+    if (owner != -1) return owner;
+    return filter_owner(handle, name, name_len);
+}
+
+
+/**
+ * Determines how a command should be scheduled, given
+ * the worker that owns it, and the pending batch.
+ * @return 0 if the command should be run now, 1 if it
+ * should be added to the batch, and 2 if it must wait
+ * until the batch completes.
+ */
+static int schedule_cmd(cmd_batch *batch, int owner) {
+    if (!batch->count) return (owner == -1) ? 0 : 1;
+    if (owner != batch->owner || batch->count >= MAX_DEFER_BATCH) return 2;
+    return 1;
+}
+
+
+/**
+ * Adds a command to the batch
+ */
+static void batch_append(cmd_batch *batch, int owner, deferred_cmd *cmd) {
+    if (batch->tail)
+        batch->tail->next = cmd;
+    else
+        batch->head = cmd;
+    batch->tail = cmd;
+    batch->owner = owner;
+    batch->count++;
+}
+
+
+/**
+ * Copies a text command so that it can be deferred.
+ */
+static deferred_cmd* copy_text_cmd(conn_cmd_type type, char *args, int args_len) {
+    int len = (args) ? args_len : 0;
+    deferred_cmd *cmd = malloc(sizeof(deferred_cmd) + len);
+    cmd->next = NULL;
+    cmd->binary = 0;
+    cmd->type = type;
+    cmd->args_len = (args) ? args_len : -1;
+    if (args) memcpy(cmd->args, args, args_len);
+    return cmd;
+}
+
+
+/**
+ * Copies a binary request so that it can be deferred.
+ */
+static deferred_cmd* copy_binary_cmd(bin_request *req, char *body) {
+    deferred_cmd *cmd = malloc(sizeof(deferred_cmd) + req->body_len + 1);
+    cmd->next = NULL;
+    cmd->binary = 1;
+    cmd->type = UNKNOWN;
+    cmd->req = *req;
+    cmd->args_len = req->body_len;
+    memcpy(cmd->args + 1, body, req->body_len);
+    return cmd;
+}
+
+
+/**
+ * Frees a list of deferred commands
+ */
+static void free_deferred_cmds(deferred_cmd *cmd) {
+    deferred_cmd *next;
+    while (cmd) {
+        next = cmd->next;
+        free(cmd);
+        cmd = next;
+    }
+}
+
+
 /**
  * Determines the client command.
  * @arg cmd_buf A command buffer
@@ -685,6 +1937,12 @@ static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char *
         type = CLEAR;
     } else if (CMD_MATCH("flush")) {
         type = FLUSH;
+    } else if (CMD_MATCH("stats")) {
+        type = STATS;
+    } else if (CMD_MATCH("noreply")) {
+        type = NO_REPLY;
+    } else if (CMD_MATCH("binary")) {
+        type = BINARY;
     }
 
     return type;
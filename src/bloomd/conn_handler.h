@@ -4,6 +4,19 @@
 #include "networking.h"
 #include "filter_manager.h"
 
+/**
+ * This structure is used to store per-connection
+ * state for the connection handlers. It is embedded
+ * in each connection by the networking layer, which
+ * zeros it when the connection is accepted.
+ */
+typedef struct {
+    int no_reply;             // Suppress success responses to write commands
+    int binary;               // Connection is using the binary protocol
+    void *stash;              // Command waiting on a deferred command
+    void *filters;            // Filters resolved by this connection
+} bloom_conn_state;
+
 /**
  * This structure is used to communicate
  * between the connection handlers and the
@@ -13,6 +26,8 @@ typedef struct {
     bloom_config *config;     // Global bloom configuration
     bloom_filtmgr *mgr;       // Filter manager
     bloom_conn_info *conn;    // Opaque handle into the networking stack
+    bloom_conn_state *state;  // Connection state, NULL for periodic updates
+    int worker_id;            // Index of the worker invoking the handler
 } bloom_conn_handler;
 
 /**
@@ -30,6 +45,23 @@ void init_conn_handler();
  */
 int handle_client_connect(bloom_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer on the worker owning
+ * a filter, to run commands deferred by another worker.
+ * The responses are sent using the provided connection.
+ * @arg handle The connection related information
+ * @arg cmds The commands passed to defer_client_command
+ * @return 0 on success, 1 if the connection should be closed.
+ */
+int handle_deferred_command(bloom_conn_handler *handle, void *cmds);
+
+/**
+ * Invoked by the networking layer when a connection
+ * is closed, to release any connection state.
+ * @arg state The connection state
+ */
+void cleanup_conn_state(bloom_conn_state *state);
+
 /**
  * Invoked by the networking layer periodically to
  * handle state updates. Does not provide
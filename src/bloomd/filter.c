@@ -30,9 +30,11 @@ static const char* CONFIG_FILENAME = "config.ini";
  * Static delarations
  */
 static int thread_safe_fault(bloom_filter *f);
+static int flush_locked(bloom_filter *filter);
 static int discover_existing_filters(bloom_filter *f);
 static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters);
 static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out);
+static bitmap_mode persistent_mode(bloom_config *config);
 static int timediff_msec(struct timeval *t1, struct timeval *t2);
 
 static int filter_out_special(CONST_DIRENT_T *d);
@@ -40,18 +42,20 @@ static int filter_out_special(CONST_DIRENT_T *d);
 /**
  * Initializes a bloom filter wrapper.
  * @arg config The configuration to use
+ * @arg pack The pack to use for small layers, or NULL
  * @arg filter_name The name of the filter
  * @arg discover Should existing data files be discovered. Otherwise
  * they will be faulted in on-demand.
  * @arg filter Output parameter, the new filter
  * @return 0 on success
  */
-int init_bloom_filter(bloom_config *config, char *filter_name, int discover, bloom_filter **filter) {
+int init_bloom_filter(bloom_config *config, bloom_pack *pack, char *filter_name, int discover, bloom_filter **filter) {
     // Allocate the buffers
     bloom_filter *f = *filter = calloc(1, sizeof(bloom_filter));
 
     // Store the things
     f->config = config;
+    f->pack = pack;
     f->filter_name = strdup(filter_name);
 
     // Copy filter configs
@@ -146,6 +150,27 @@ int bloomf_is_proxied(bloom_filter *filter) {
     return !(filter->sbf);
 }
 
+/**
+ * Faults the filter into memory, if it is proxied
+ * or compressed. This is done on demand by the other
+ * methods, but can be used to warm a filter ahead of use.
+ * Mapped filters also start reading their pages.
+ * @notes Thread safe.
+ * @return 0 on success.
+ */
+int bloomf_fault(bloom_filter *filter) {
+    if (!filter->sbf || filter->is_compressed) {
+        int res = thread_safe_fault(filter);
+        if (res) return res;
+    }
+
+    // The pages of a mapped filter are read lazily
+    if (filter->config->use_mmap) {
+        sbf_prefetch((bloom_sbf*)filter->sbf);
+    }
+    return 0;
+}
+
 /**
  * Flushes the filter. Idempotent if the
  * filter is proxied or not dirty.
@@ -153,6 +178,83 @@ int bloomf_is_proxied(bloom_filter *filter) {
  * @return 0 on success.
  */
 int bloomf_flush(bloom_filter *filter) {
+    // Acquire lock, so we never flush concurrently
+    pthread_mutex_lock(&filter->sbf_lock);
+    int res = flush_locked(filter);
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return res;
+}
+
+/**
+ * Returns an estimate of the number of bytes
+ * that flushing the filter would write.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The number of dirty bytes, 0 if proxied.
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter) {
+    pthread_mutex_lock(&filter->sbf_lock);
+    uint64_t bytes = 0;
+    if (filter->sbf) {
+        bytes = sbf_dirty_bytes((bloom_sbf*)filter->sbf);
+    }
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return bytes;
+}
+
+/**
+ * Compresses an idle in-memory filter, to reduce the memory
+ * it uses. It is decompressed on the next check or set.
+ * @arg filter The filter to compress
+ * @return 0 if compressed, 1 if the filter is not in-memory,
+ * is already compressed, or would not shrink. Negative on error.
+ */
+int bloomf_compress(bloom_filter *filter) {
+    pthread_mutex_lock(&filter->sbf_lock);
+    int res = 1;
+    if (filter->sbf && filter->filter_config.in_memory && !filter->is_compressed) {
+        res = sbf_compress((bloom_sbf*)filter->sbf);
+        if (res > 0) {
+            filter->is_compressed = 1;
+            res = 0;
+        } else if (res == 0) {
+            res = 1;
+        }
+    }
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return res;
+}
+
+/**
+ * Checks if a filter is compressed
+ * @notes Thread safe.
+ * @return 1 if compressed, 0 otherwise.
+ */
+int bloomf_is_compressed(bloom_filter *filter) {
+    return filter->is_compressed;
+}
+
+/**
+ * Returns the number of bytes of memory used by the
+ * filter, which is 0 if proxied, and less than the
+ * byte size if compressed.
+ * @note Thread safe.
+ */
+uint64_t bloomf_resident_bytes(bloom_filter *filter) {
+    pthread_mutex_lock(&filter->sbf_lock);
+    uint64_t bytes = 0;
+    if (filter->sbf) {
+        bytes = sbf_resident_bytes((bloom_sbf*)filter->sbf);
+    }
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return bytes;
+}
+
+/**
+ * Flushes the filter. This must be
+ * invoked with the sbf lock.
+ */
+static int flush_locked(bloom_filter *filter) {
     // Only do things if we are non-proxied
     if (filter->sbf) {
         // Time how long this takes
@@ -205,13 +307,14 @@ int bloomf_close(bloom_filter *filter) {
 
     // Only act if we are non-proxied
     if (filter->sbf) {
-        bloomf_flush(filter);
+        flush_locked(filter);
 
         bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
         filter->sbf = NULL;
 
         sbf_close(sbf);
         free(sbf);
+        filter->is_compressed = 0;
 
         filter->counters.page_outs += 1;
     }
@@ -231,6 +334,11 @@ int bloomf_delete(bloom_filter *filter) {
     // Close first
     bloomf_close(filter);
 
+    // Free any packed layers
+    if (filter->pack && pack_free_filter(filter->pack, filter->filter_name)) {
+        syslog(LOG_ERR, "Failed to free the packed layers of filter %s.", filter->filter_name);
+    }
+
     // Delete the files
     struct dirent **namelist = NULL;
     int num;
@@ -272,7 +380,7 @@ int bloomf_delete(bloom_filter *filter) {
  * @return 0 if not contained, 1 if contained.
  */
 int bloomf_contains(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
+    if (!filter->sbf || filter->is_compressed) {
         if (thread_safe_fault(filter) != 0) return -1;
     }
 
@@ -297,7 +405,7 @@ int bloomf_contains(bloom_filter *filter, char *key) {
  * @return 0 if not added, 1 if added.
  */
 int bloomf_add(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
+    if (!filter->sbf || filter->is_compressed) {
         if (thread_safe_fault(filter) != 0) return -1;
     }
 
@@ -360,14 +468,18 @@ uint64_t bloomf_byte_size(bloom_filter *filter) {
 /**
  * Provides a thread safe faulting of filters.
  * The main use case of this is to allow
- * bloomf_contains to be safe.
+ * bloomf_contains to be safe. Also
+ * decompresses an in-memory filter.
  */
 static int thread_safe_fault(bloom_filter *f) {
     // Acquire lock
     pthread_mutex_lock(&f->sbf_lock);
 
     int res = 0;
-    if (!f->sbf) {
+    if (f->is_compressed) {
+        res = sbf_decompress((bloom_sbf*)f->sbf);
+        if (!res) f->is_compressed = 0;
+    } else if (!f->sbf) {
         if (f->filter_config.in_memory) {
             res = create_sbf(f, 0, NULL);
         } else {
@@ -426,28 +538,70 @@ static int filter_data_files(CONST_DIRENT_T *d) {
     return 0;
 }
 
+/**
+ * A layer found on disk, either in its own
+ * data file or in an extent of the pack.
+ */
+typedef struct {
+    uint32_t layer;
+    char *path;                 // Data file path, NULL if packed
+    bloom_pack_extent extent;
+} found_layer;
+
+// Orders the found layers, oldest first
+static int found_layer_cmp(const void *a, const void *b) {
+    uint32_t l1 = ((found_layer*)a)->layer;
+    uint32_t l2 = ((found_layer*)b)->layer;
+    return (l1 > l2) - (l1 < l2);
+}
+
 /**
  * This beast mode method scans the data directory
- * belonging to this filter for any existing filters,
- * and restores the SBF
+ * and the pack belonging to this filter for any
+ * existing filters, and restores the SBF
  * @return 0 on success. -1 on error.
  */
 static int discover_existing_filters(bloom_filter *f) {
     // Scan through the folder looking for data files
     struct dirent **namelist;
-    int num;
+    int num_files;
 
     // Filter only data dirs, in sorted order
-    num = scandir(f->full_path, &namelist, filter_data_files, alphasort);
-    if (num == -1) {
+    num_files = scandir(f->full_path, &namelist, filter_data_files, alphasort);
+    if (num_files == -1) {
         syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
                 f->filter_name, strerror(errno));
         return -1;
     }
-    syslog(LOG_INFO, "Found %d files for filter %s.", num, f->filter_name);
+
+    // Get any packed layers
+    bloom_pack_extent *exts = NULL;
+    int num_packed = 0;
+    if (f->pack) pack_layers(f->pack, f->filter_name, &exts, &num_packed);
+    syslog(LOG_INFO, "Found %d files and %d packed layers for filter %s.",
+            num_files, num_packed, f->filter_name);
+
+    // Merge the layers in order
+    int num = num_files + num_packed;
+    found_layer *layers = calloc(num ? num : 1, sizeof(found_layer));
+    for (int i=0; i < num_files; i++) {
+        int layer = i;
+        sscanf(namelist[i]->d_name, DATA_FILE_NAME, &layer);
+        layers[i].layer = layer;
+        layers[i].path = join_path(f->full_path, namelist[i]->d_name);
+        free(namelist[i]);
+    }
+    free(namelist);
+    for (int i=0; i < num_packed; i++) {
+        layers[num_files + i].layer = exts[i].layer;
+        layers[num_files + i].extent = exts[i];
+    }
+    free(exts);
+    qsort(layers, num, sizeof(found_layer), found_layer_cmp);
 
     // Speical case when there are no filters
     if (num == 0) {
+        free(layers);
         int res = create_sbf(f, 0, NULL);
         return res;
     }
@@ -459,30 +613,42 @@ static int discover_existing_filters(bloom_filter *f) {
     // Initialize the bitmaps and bloom filters
     int res;
     int err = 0;
+    int loaded = 0;
     uint64_t size;
-    bitmap_mode mode = (f->config->use_mmap) ? SHARED : PERSISTENT;
+    bitmap_mode mode = (f->config->use_mmap) ? SHARED : persistent_mode(f->config);
     for (int i=0; i < num && !err; i++) {
-        // Get the full path to the bitmap
-        char *bitmap_path = join_path(f->full_path, namelist[i]->d_name);
-        syslog(LOG_INFO, "Discovered bloom filter: %s.", bitmap_path);
-
-        // Get the size
-        size = get_size(bitmap_path);
-        if (size == 0) {
+        found_layer *found = layers + i;
+        if (i > 0 && found->layer == layers[i-1].layer) {
             err = 1;
-            syslog(LOG_ERR, "Failed to get the filesize for: %s. %s", bitmap_path, strerror(errno));
-            free(bitmap_path);
+            syslog(LOG_ERR, "Found layer %u twice for filter %s.", found->layer, f->filter_name);
             break;
         }
 
         // Create the bitmap
         bloom_bitmap *bitmap = maps[num - i - 1] = malloc(sizeof(bloom_bitmap));
-        res = bitmap_from_filename(bitmap_path, size, 0, mode, bitmap);
+        if (found->path) {
+            syslog(LOG_INFO, "Discovered bloom filter: %s.", found->path);
+
+            // Get the size
+            size = get_size(found->path);
+            if (size == 0) {
+                err = 1;
+                syslog(LOG_ERR, "Failed to get the filesize for: %s. %s", found->path, strerror(errno));
+                free(bitmap);
+                break;
+            }
+            res = bitmap_from_filename(found->path, size, 0, mode, bitmap);
+        } else {
+            syslog(LOG_INFO, "Discovered packed bloom filter: %s layer %u.",
+                    f->filter_name, found->layer);
+            res = bitmap_from_extent(found->extent.fileno, found->extent.offset,
+                    found->extent.size, persistent_mode(f->config), bitmap);
+        }
         if (res != 0) {
             err = 1;
-            syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", bitmap_path, strerror(errno));
+            syslog(LOG_ERR, "Failed to load bitmap for: %s layer %u. %s",
+                    f->filter_name, found->layer, strerror(errno));
             free(bitmap);
-            free(bitmap_path);
             break;
         }
 
@@ -491,38 +657,36 @@ static int discover_existing_filters(bloom_filter *f) {
         res = bf_from_bitmap(bitmap, 1, 0, filter);
         if (res != 0) {
             err = 1;
-            syslog(LOG_ERR, "Failed to load bloom filter for: %s. [%d]", bitmap_path, res);
+            syslog(LOG_ERR, "Failed to load bloom filter for: %s layer %u. [%d]",
+                    f->filter_name, found->layer, res);
             free(filter);
             bitmap_close(bitmap);
             free(bitmap);
-            free(bitmap_path);
             break;
         }
-
-        // Cleanup
-        free(bitmap_path);
+        loaded++;
     }
 
-    // Free the memory associated with scandir
-    for (int i=0; i < num; i++) free(namelist[i]);
-    free(namelist);
-
-    // Return if there was an error
-    if (err) return -1;
+    // Free the found layers
+    for (int i=0; i < num; i++) free(layers[i].path);
+    free(layers);
 
     // Create the SBF
-    res = create_sbf(f, num, filters);
+    if (!err) {
+        res = create_sbf(f, num, filters);
+        if (res != 0) {
+            syslog(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
+            err = 1;
+        }
+    }
 
-    // Cleanup on err
-    if (res != 0) {
-        syslog(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
-
-        // For fucks sake. We need to clean up so much shit now.
-        for (int i=0; i < num; i++) {
-            bf_close(filters[i]);
-            bitmap_close(maps[i]);
-            free(filters[i]);
-            free(maps[i]);
+    // Cleanup on err. For fucks sake. We need to clean up so much shit now.
+    if (err) {
+        for (int i=0; i < loaded; i++) {
+            bf_close(filters[num - i - 1]);
+            bitmap_close(maps[num - i - 1]);
+            free(filters[num - i - 1]);
+            free(maps[num - i - 1]);
         }
     }
 
@@ -565,6 +729,7 @@ static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters) {
 
 /**
  * Callback used with SBF to generate file names.
+ * Small layers are put in the pack if there is one.
  */
 static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
     // Cast the input pointer
@@ -597,10 +762,39 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
     }
     if (namelist) free(namelist);
 
+    // Count the packed layers, so layer numbers are unique
+    int num_packed = 0;
+    bloom_pack_extent *exts = NULL;
+    if (filt->pack) {
+        pack_layers(filt->pack, filt->filter_name, &exts, &num_packed);
+        free(exts);
+    }
+    int layer = num_files + num_packed;
+
+    // Put small layers in the pack
+    int res;
+    if (filt->pack && !filt->config->use_mmap && bytes <= filt->config->pack_layer_size) {
+        bloom_pack_extent ext;
+        res = pack_alloc(filt->pack, filt->filter_name, layer, bytes, &ext);
+        if (!res) {
+            syslog(LOG_INFO, "Creating new packed layer %d for filter %s. Size: %llu",
+                    layer, filt->filter_name, (unsigned long long)bytes);
+            res = bitmap_from_extent(ext.fileno, ext.offset, ext.size,
+                    persistent_mode(filt->config) | NEW_BITMAP, out);
+            if (res) {
+                syslog(LOG_CRIT, "Failed to create packed layer %d for filter %s. Err: %d",
+                    layer, filt->filter_name, res);
+            }
+            return res;
+        }
+        syslog(LOG_WARNING, "Failed to pack layer %d for filter %s, using a file. Err: %d",
+                layer, filt->filter_name, res);
+    }
+
     // Generate the new file name
     char *filename = NULL;
     int file_name_len;
-    file_name_len = asprintf(&filename, DATA_FILE_NAME, num_files);
+    file_name_len = asprintf(&filename, DATA_FILE_NAME, layer);
     assert(file_name_len != -1);
 
     // Get the full path
@@ -610,8 +804,8 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
             full_path, filt->filter_name, (unsigned long long)bytes);
 
     // Create the bitmap
-    bitmap_mode mode = (filt->config->use_mmap) ? SHARED : PERSISTENT;
-    int res = bitmap_from_filename(full_path, bytes, 1, mode, out);
+    bitmap_mode mode = (filt->config->use_mmap) ? SHARED : persistent_mode(filt->config);
+    res = bitmap_from_filename(full_path, bytes, 1, mode, out);
     if (res) {
         syslog(LOG_CRIT, "Failed to create new file: %s for filter %s. Err: %s",
             full_path, filt->filter_name, strerror(errno));
@@ -620,6 +814,14 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
     return res;
 }
 
+/**
+ * Returns the mode for PERSISTENT bitmaps, which
+ * may keep their writes out of the page cache.
+ */
+static bitmap_mode persistent_mode(bloom_config *config) {
+    return (config->use_direct_io) ? PERSISTENT | DIRECT_IO : PERSISTENT;
+}
+
 /**
  * Computes the difference in time in milliseconds
  * between two timeval structures.
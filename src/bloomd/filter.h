@@ -2,6 +2,7 @@
 #define BLOOM_FILTER_H
 #include <pthread.h>
 #include "config.h"
+#include "pack.h"
 #include "spinlock.h"
 #include "sbf.h"
 
@@ -32,9 +33,11 @@ typedef struct bloom_filter {
 
     char *filter_name;              // The name of the filter
     char *full_path;                // Path to our data
+    bloom_pack *pack;               // Shared arenas for small layers, or NULL
 
     volatile bloom_sbf *sbf;        // Underlying SBF
-    pthread_mutex_t sbf_lock;       // Protects faulting in the SBF
+    pthread_mutex_t sbf_lock;       // Protects faulting in and flushing the SBF
+    volatile int is_compressed;     // Set while an in-memory SBF is compressed
 
     filter_counters counters;       // Counters
     bloom_spinlock counter_lock;    // Protect the counters
@@ -43,13 +46,14 @@ typedef struct bloom_filter {
 /**
  * Initializes a bloom filter wrapper.
  * @arg config The configuration to use
+ * @arg pack The pack to use for small layers, or NULL
  * @arg filter_name The name of the filter
  * @arg discover Should existing data files be discovered. Otherwise
  * they will be faulted in on-demand.
  * @arg filter Output parameter, the new filter
  * @return 0 on success
  */
-int init_bloom_filter(bloom_config *config, char *filter_name, int discover, bloom_filter **filter);
+int init_bloom_filter(bloom_config *config, bloom_pack *pack, char *filter_name, int discover, bloom_filter **filter);
 
 /**
  * Destroys a bloom filter
@@ -74,6 +78,16 @@ filter_counters* bloomf_counters(bloom_filter *filter);
  */
 int bloomf_is_proxied(bloom_filter *filter);
 
+/**
+ * Faults the filter into memory, if it is proxied
+ * or compressed. This is done on demand by the other
+ * methods, but can be used to warm a filter ahead of use.
+ * Mapped filters also start reading their pages.
+ * @notes Thread safe.
+ * @return 0 on success.
+ */
+int bloomf_fault(bloom_filter *filter);
+
 /**
  * Flushes the filter. Idempotent if the
  * filter is proxied or not dirty.
@@ -82,6 +96,41 @@ int bloomf_is_proxied(bloom_filter *filter);
  */
 int bloomf_flush(bloom_filter *filter);
 
+/**
+ * Returns an estimate of the number of bytes
+ * that flushing the filter would write.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The number of dirty bytes, 0 if proxied.
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter);
+
+/**
+ * Compresses an idle in-memory filter, to reduce the memory
+ * it uses. It is decompressed on the next check or set.
+ * @arg filter The filter to compress
+ * @return 0 if compressed, 1 if the filter is not in-memory,
+ * is already compressed, or would not shrink. Negative on error.
+ */
+int bloomf_compress(bloom_filter *filter);
+
+/**
+ * Checks if a filter is compressed
+ * @notes Thread safe.
+ * @return 1 if compressed, 0 otherwise.
+ */
+int bloomf_is_compressed(bloom_filter *filter);
+
+/**
+ * Returns the number of bytes of memory used by the
+ * filter, which is 0 if proxied, and less than the
+ * byte size if compressed.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The number of bytes in memory.
+ */
+uint64_t bloomf_resident_bytes(bloom_filter *filter);
+
 /**
  * Gracefully closes a bloom filter.
  * @arg filter The filter to close
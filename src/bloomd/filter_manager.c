@@ -1,20 +1,37 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <syslog.h>
 #include <pthread.h>
 #include <dirent.h>
 #include <string.h>
+#include <sys/time.h>
 #include "spinlock.h"
 #include "filter_manager.h"
 #include "art.h"
+#include "hashmap.h"
 #include "filter.h"
+#include "pack.h"
 #include "type_compat.h"
 
 /**
- * This defines how log we sleep between vacuum poll
- * iterations in microseconds
+ * This defines how long we sleep between vacuum attempts
+ * while there is garbage that some client can still see,
+ * in microseconds
  */
-#define VACUUM_POLL_USEC 500000
+#define VACUUM_RETRY_USEC 1000
+
+/**
+ * The version of a client that is offline, and so
+ * cannot be holding any references. This is larger
+ * than any real version.
+ */
+#define OFFLINE_VSN ULLONG_MAX
+
+/**
+ * The initial number of slots in the filter map
+ */
+#define INITIAL_MAP_SIZE 1024
 
 /**
  * Wraps a bloom_filter to ensure only a single
@@ -25,6 +42,10 @@ typedef struct {
     volatile int is_active;         // Set to 0 when we are trying to delete it
     volatile int is_hot;            // Used to mark a filter as hot
     volatile int should_delete;     // Used to control deletion
+    volatile int is_dirty;          // Set once queued in the dirty set
+    volatile int is_referenced;     // Set on access, cleared by the eviction clock
+    volatile int is_used;           // Set on access, cleared by the compression sweep
+    uint64_t resident;              // Bytes counted in the resident bytes
 
     bloom_filter *filter;    // The actual filter object
     pthread_rwlock_t rwlock; // Protects the filter
@@ -35,21 +56,23 @@ typedef struct {
  * We use a linked list of filtmgr_client
  * structs to track any clients of the filter manager.
  * Each client maintains a thread ID as well as the
- * last known version they used. The vacuum thread
- * uses this information to safely garbage collect
- * old versions.
+ * last known version they used, or OFFLINE_VSN.
+ * The vacuum thread uses this information to safely
+ * garbage collect old versions. Each thread finds its
+ * own client through a thread specific key, which also
+ * removes the client if the thread exits without leaving.
  */
 typedef struct filtmgr_client {
     pthread_t id;
-    unsigned long long vsn;
+    volatile unsigned long long vsn;
+    bloom_filtmgr *mgr;
     struct filtmgr_client *next;
 } filtmgr_client;
 
 // Enum of possible delta updates
 typedef enum {
-    CREATE,
-    DELETE,
-    BARRIER
+    DELETE,     // A filter was dropped or cleared
+    RETIRE      // The filter map table was replaced
 } delta_type;
 
 // Simple linked list of filter wrappers
@@ -57,6 +80,7 @@ typedef struct filter_list {
     unsigned long long vsn;
     delta_type type;
     bloom_filter_wrapper *filter;
+    hashmap_table *table;
     struct filter_list *next;
 } filter_list;
 
@@ -64,24 +88,33 @@ typedef struct filter_list {
  * We use a a simple form of Multi-Version Concurrency Controll (MVCC)
  * to prevent locking on access to the map of filter name -> bloom_filter_wrapper.
  *
- * The way it works is we have 2 ART trees, the "primary" and an alternate.
- * All the clients of the filter manager have reads go through the primary
- * without any locking. We also maintain a delta list of new and deleted filters,
- * which is a simple linked list.
+ * The map is a single concurrent hash table. All the clients of the
+ * filter manager read it without any locking, while writes are serialized
+ * by the write lock and applied in place. A write that unlinks memory a
+ * reader may still be using, such as dropping a filter or replacing the
+ * table on a resize, creates a new version and adds the memory to the
+ * delta list.
  *
- * We use a separate vacuum thread to merge changes from the delta lists
- * into the alternate tree, and then do a pointer swap to rotate the
- * primary tree for the alternate.
+ * We use a separate vacuum thread to release the memory on the delta
+ * list once all the clients have checkpointed past its version, since
+ * no client holds a reference across a checkpoint. This is quiescent
+ * state based reclamation: checkpoints are cheap enough for workers to
+ * make one on every event loop iteration, and clients that are blocked
+ * go offline so they never hold up the vacuum. The vacuum thread sleeps
+ * until there is garbage, and then retries frequently until it is freed.
  *
- * This mechanism ensures we have at most 2 ART trees, reads are lock-free,
- * and performance does not degrade with the number of filters.
+ * Listing filters needs them in order, so an ordered ART index of
+ * the names is built lazily, and only rebuilt if the version changes.
  *
  */
 struct bloom_filtmgr {
     bloom_config *config;
+    bloom_pack *pack;   // Shared arenas for small layers, or NULL
 
     int should_run;  // Used to stop the vacuum thread
     pthread_t vacuum_thread;
+    pthread_mutex_t vacuum_lock;
+    pthread_cond_t vacuum_cond; // Signaled when there is garbage
 
     /*
      * To support vacuuming of old versions, we require that
@@ -92,29 +125,121 @@ struct bloom_filtmgr {
      */
     filtmgr_client *clients;
     bloom_spinlock clients_lock;
+    pthread_key_t client_key;   // Maps a thread to its filtmgr_client
 
-    // This is the current version. Should be used under the write lock.
+    // This is the current version. Should be updated under the write lock.
     unsigned long long vsn;
     pthread_mutex_t write_lock;
 
     // Maps key names -> bloom_filter_wrapper
-    unsigned long long primary_vsn; // This is the version that filter_map represents
-    art_tree *filter_map;
-    art_tree *alt_filter_map;
+    bloom_hashmap filter_map;
+
+    // Ordered index of the filters by name, built lazily for listing
+    art_tree *list_index;
+    unsigned long long list_vsn; // The version list_index represents
+    pthread_mutex_t list_lock;
 
     /**
      * List of pending deletes. This is necessary
-     * because the filter may reflect that a delete has
-     * taken place, while the vacuum thread has not yet performed the
-     * delete. This allows create to return a "Delete in progress".
+     * because the filter is removed from the map before
+     * the vacuum thread has performed the delete.
+     * This allows create to return a "Delete in progress".
      */
     bloom_filter_list *pending_deletes;
     bloom_spinlock pending_lock;
 
-    // Delta lists for non-merged operations
+    /**
+     * Lock-free stack of the filters that have been set since they
+     * were last flushed, so that a scheduled flush only visits the
+     * filters that changed. Filters are queued by name, since they
+     * may be dropped before they are flushed.
+     */
+    bloom_filter_list *dirty;
+
+    /**
+     * Tracks the bytes of the filters in memory, to keep them within
+     * max_resident_bytes. Before a filter is faulted in, we evict filters
+     * using the CLOCK algorithm: the hand sweeps the slots of the filter
+     * map, clearing the referenced flag of each filter, and closes the
+     * first filter that was not referenced since the last sweep.
+     * In-memory filters are never closed, so only the evictable
+     * bytes are held to the limit.
+     */
+    volatile uint64_t resident_bytes;
+    volatile uint64_t evictable_bytes;
+    volatile uint64_t evictions;
+    volatile uint64_t evict_retry_at;   // No sweeps until then, in usec
+    uint64_t clock_hand;        // Slot of the filter map to sweep next
+    pthread_mutex_t evict_lock; // Serializes the evictions
+
+    // Delta lists for memory that cannot be released yet
     filter_list *delta;
+
+    // Invoked with each change to the filters, or NULL
+    filtmgr_log_cb log_cb;
+    void *log_data;
 };
 
+/**
+ * Passed through the iterators used to stream filters
+ */
+typedef struct {
+    char *prefix;       // Stop at the first name without the prefix
+    int prefix_len;
+    int past_prefix;    // Set once we reach the end of the prefix
+    filter_iter_cb cb;
+    void *data;
+} filter_iter_data;
+
+/**
+ * Passed through the eviction clock
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    uint64_t limit;     // Evict until the evictable bytes are within this
+    int evicted;        // Number of filters evicted
+} evict_data;
+
+/**
+ * Passed through the compression sweep
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    int compressed;     // Number of filters compressed
+} compress_data;
+
+/**
+ * A filter ranked in the hot set
+ */
+typedef struct {
+    char *filter_name;
+    int is_hot;
+    uint64_t accesses;
+} hot_entry;
+
+/**
+ * Passed through the hot set listing
+ */
+typedef struct {
+    hot_entry *entries;
+    int len;
+    int size;
+} hot_set;
+
+/**
+ * The eviction clock gives up after sweeping the
+ * filter map this many times, if every filter in
+ * memory is busy or cannot be evicted.
+ */
+#define MAX_CLOCK_SWEEPS 2
+
+/**
+ * After the eviction clock evicts nothing, the sweeps
+ * are skipped for this long, in usec, so that every
+ * write does not scan the filter map in turn.
+ */
+#define EVICT_RETRY_USEC 100000
+
 /**
  * We warn if there are this many outstanding versions
  * that cannot be vacuumed
@@ -129,14 +254,33 @@ static const int FOLDER_PREFIX_LEN = sizeof(FOLDER_PREFIX) - 1;
 
 static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name);
 static bloom_filter_wrapper* take_filter(bloom_filtmgr *mgr, char *filter_name);
-static void delete_filter(bloom_filter_wrapper *filt);
-static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int delta);
-static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
-static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
-static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int check_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int num_keys, char *result);
+static int set_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int num_keys, char *result);
+static void mark_dirty(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static void update_resident(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static void reserve_resident(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static void make_room(bloom_filtmgr *mgr, uint64_t bytes);
+static int evict_clock_cb(void *data, void *value);
+static void delete_filter(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot);
+static void remove_filter(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, int should_delete);
+static const char* filter_map_key(void *value);
+static int check_cold(bloom_filter_wrapper *filt);
+static int filter_map_list_cold_cb(void *data, void *value);
+static int filter_map_iter_cold_cb(void *data, void *value);
+static int filter_map_delete_cb(void *data, void *value);
+static int filter_map_compress_cb(void *data, void *value);
+static int filter_map_list_hot_cb(void *data, void *value);
+static int compare_hot_entries(const void *a, const void *b);
+static int list_index_insert_cb(void *data, void *value);
+static int list_index_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int list_index_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int build_list_index(bloom_filtmgr *mgr);
 static int load_existing_filters(bloom_filtmgr *mgr);
-static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt);
+static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt, hashmap_table *table);
 static void* filtmgr_thread_main(void *in);
+static void remove_client(bloom_filtmgr *mgr, filtmgr_client *cl);
+static void client_exit(void *in);
 
 /**
  * Initializer
@@ -155,33 +299,35 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
 
     // Initialize the locks
     pthread_mutex_init(&m->write_lock, NULL);
+    pthread_mutex_init(&m->list_lock, NULL);
+    pthread_mutex_init(&m->evict_lock, NULL);
+    pthread_mutex_init(&m->vacuum_lock, NULL);
+    pthread_cond_init(&m->vacuum_cond, NULL);
+    pthread_key_create(&m->client_key, client_exit);
     INIT_BLOOM_SPIN(&m->clients_lock);
     INIT_BLOOM_SPIN(&m->pending_lock);
 
-    // Allocate storage for the art trees
-    art_tree *trees = calloc(2, sizeof(art_tree));
-    m->filter_map = trees;
-    m->alt_filter_map = trees+1;
-
-    // Allocate the initial art tree
-    int res = init_art_tree(m->filter_map);
+    // Allocate the filter map
+    int res = hashmap_init(&m->filter_map, INITIAL_MAP_SIZE, filter_map_key);
     if (res) {
         syslog(LOG_ERR, "Failed to allocate filter map!");
         free(m);
         return -1;
     }
 
-    // Discover existing filters
-    load_existing_filters(m);
-
-    // Initialize the alternate map
-    res = art_copy(m->alt_filter_map, m->filter_map);
+    // Open the pack before the filters, since their layers may be in it
+    res = init_pack(config, &m->pack);
     if (res) {
-        syslog(LOG_ERR, "Failed to copy filter map to alternate!");
-        destroy_filter_manager(m);
+        syslog(LOG_ERR, "Failed to load the pack! Err: %d", res);
+        if (m->pack) destroy_pack(m->pack);
+        hashmap_destroy(&m->filter_map);
+        free(m);
         return -1;
     }
 
+    // Discover existing filters
+    load_existing_filters(m);
+
     // Start the vacuum thread
     m->should_run = vacuum;
     if (vacuum && pthread_create(&m->vacuum_thread, NULL, filtmgr_thread_main, m)) {
@@ -201,24 +347,45 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
  */
 int destroy_filter_manager(bloom_filtmgr *mgr) {
     // Stop the vacuum thread
+    pthread_mutex_lock(&mgr->vacuum_lock);
     mgr->should_run = 0;
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
 
     // Nuke all the keys in the current version.
-    art_iter(mgr->filter_map, filter_map_delete_cb, mgr);
+    hashmap_iter(&mgr->filter_map, filter_map_delete_cb, mgr);
 
     // Handle any delta operations
     filter_list *next, *current = mgr->delta;
     while (current) {
-        // Only delete pending creates, pending
-        // deletes are still in the primary tree
-        if (current->type == CREATE)
-            delete_filter(current->filter);
+        // Complete any pending drops or clears
+        if (current->type == DELETE) {
+            delete_filter(mgr, current->filter);
+        } else {
+            hashmap_free_table(current->table);
+        }
         next = current->next;
         free(current);
         current = next;
     }
 
+    // Free the pending deletes and the dirty set
+    bloom_filter_list *pending_next, *pending = mgr->pending_deletes;
+    while (pending) {
+        pending_next = pending->next;
+        free(pending->filter_name);
+        free(pending);
+        pending = pending_next;
+    }
+    pending = mgr->dirty;
+    while (pending) {
+        pending_next = pending->next;
+        free(pending->filter_name);
+        free(pending);
+        pending = pending_next;
+    }
+
     // Free the clients
     filtmgr_client *cl_next, *cl = mgr->clients;
     while (cl) {
@@ -226,11 +393,20 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
         free(cl);
         cl = cl_next;
     }
+    pthread_key_delete(mgr->client_key);
 
-    // Destroy the ART trees
-    destroy_art_tree(mgr->filter_map);
-    destroy_art_tree(mgr->alt_filter_map);
-    free((mgr->filter_map < mgr->alt_filter_map) ? mgr->filter_map : mgr->alt_filter_map);
+    // Close the pack, once all the filters are closed
+    if (mgr->pack) destroy_pack(mgr->pack);
+
+    // Destroy the map and the index
+    hashmap_destroy(&mgr->filter_map);
+    if (mgr->list_index) {
+        destroy_art_tree(mgr->list_index);
+        free(mgr->list_index);
+    }
+    pthread_cond_destroy(&mgr->vacuum_cond);
+    pthread_mutex_destroy(&mgr->vacuum_lock);
+    pthread_mutex_destroy(&mgr->evict_lock);
 
     // Free the manager
     free(mgr);
@@ -242,29 +418,25 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
  * the vacuum thread to cleanup garbage state. It should also
  * be called before making other calls into the filter manager
  * so that it is aware of a client making use of the current
- * state.
+ * state. This is O(1) once the thread is a client, so it can
+ * be invoked very frequently.
  * @arg mgr The manager
  */
 void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
-
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    filtmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            cl->vsn = mgr->vsn;
-            return;
-        }
-        cl = cl->next;
+    // Look for our client, and update the version. This must be
+    // visible to the vacuum before we make any lookups.
+    filtmgr_client *cl = pthread_getspecific(mgr->client_key);
+    if (cl) {
+        __atomic_store_n(&cl->vsn, __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+        return;
     }
 
     // If we make it here, we are not a client yet
     // so we need to safely add ourself
     cl = malloc(sizeof(filtmgr_client));
-    cl->id = id;
-    cl->vsn = mgr->vsn;
+    cl->id = pthread_self();
+    cl->vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE);
+    cl->mgr = mgr;
 
     // Critical section for the flip
     LOCK_BLOOM_SPIN(&mgr->clients_lock);
@@ -273,6 +445,21 @@ void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
     mgr->clients = cl;
 
     UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
+    pthread_setspecific(mgr->client_key, cl);
+}
+
+/**
+ * Should be invoked by clients before they block or
+ * otherwise stop using the filter manager for a while.
+ * The client must not hold any references from the filter
+ * manager, and must checkpoint before using it again.
+ * This allows the vacuum thread to cleanup garbage state
+ * without waiting on idle clients.
+ * @arg mgr The manager
+ */
+void filtmgr_client_offline(bloom_filtmgr *mgr) {
+    filtmgr_client *cl = pthread_getspecific(mgr->client_key);
+    if (cl) __atomic_store_n(&cl->vsn, OFFLINE_VSN, __ATOMIC_RELEASE);
 }
 
 /**
@@ -283,28 +470,38 @@ void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
  */
 void filtmgr_client_leave(bloom_filtmgr *mgr) {
     // Get a reference to ourself
-    pthread_t id = pthread_self();
+    filtmgr_client *cl = pthread_getspecific(mgr->client_key);
+    if (!cl) return;
+    pthread_setspecific(mgr->client_key, NULL);
+    remove_client(mgr, cl);
+}
 
+/**
+ * Unlinks a client and frees it
+ */
+static void remove_client(bloom_filtmgr *mgr, filtmgr_client *cl) {
     // Critical section
     LOCK_BLOOM_SPIN(&mgr->clients_lock);
 
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
+    // Set the last prev pointer to skip our entry
     filtmgr_client **last_next = &mgr->clients;
-    filtmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            // Set the last prev pointer to skip the current entry
-            *last_next = cl->next;
+    while (*last_next != cl) last_next = &(*last_next)->next;
+    *last_next = cl->next;
 
-            // Cleanup the memory associated
-            free(cl);
-            break;
-        }
-        last_next = &cl->next;
-        cl = cl->next;
-    }
     UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
+
+    // Cleanup the memory associated
+    free(cl);
+}
+
+/**
+ * Invoked when a thread that is still a client exits,
+ * so that embedding applications do not have to leave
+ * from every thread that used the manager.
+ */
+static void client_exit(void *in) {
+    filtmgr_client *cl = in;
+    remove_client(cl->mgr, cl);
 }
 
 /**
@@ -317,6 +514,14 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name) {
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
 
+    // Clear the dirty flag first, so that keys added during
+    // the flush queue the filter again
+    if (filt->is_dirty) {
+        pthread_rwlock_rdlock(&filt->rwlock);
+        filt->is_dirty = 0;
+        pthread_rwlock_unlock(&filt->rwlock);
+    }
+
     // Flush
     bloomf_flush(filt->filter);
     return 0;
@@ -336,24 +541,7 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
-
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&filt->rwlock);
-
-    // Check the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_contains(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
-    }
-
-    // Mark as hot
-    filt->is_hot = 1;
-
-    // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
-    return (res == -1) ? -2 : 0;
+    return check_keys(mgr, filt, keys, num_keys, result);
 }
 
 /**
@@ -370,24 +558,64 @@ int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
+    return set_keys(mgr, filt, keys, num_keys, result);
+}
 
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&filt->rwlock);
+/**
+ * Resolves a filter to a handle, which can be cached.
+ * @arg filter_name The name of the filter
+ * @arg handle Output, the resolved handle
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_get_handle(bloom_filtmgr *mgr, char *filter_name, bloom_filter_handle *handle) {
+    // Read the version first, so that a concurrent
+    // change leaves the handle invalid, not stale
+    handle->vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE);
+    handle->filter = take_filter(mgr, filter_name);
+    return (handle->filter) ? 0 : -1;
+}
 
-    // Set the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_add(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
-    }
+/**
+ * Checks if a handle is still valid. This is just a
+ * comparison with the current version.
+ * @arg handle The handle to check
+ * @return 1 if valid, 0 if it must be resolved again.
+ */
+int filtmgr_handle_valid(bloom_filtmgr *mgr, bloom_filter_handle *handle) {
+    return handle->filter && handle->vsn == __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE);
+}
 
-    // Mark as hot
-    filt->is_hot = 1;
+/**
+ * Checks for the presence of keys in the filter of a handle.
+ * The handle must be valid.
+ * @arg handle The handle of the filter
+ * @arg keys A list of points to character arrays to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_check_handle_keys(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result) {
+    bloom_filter_wrapper *filt = handle->filter;
+    if (!filt || !filt->is_active) return -1;
+    return check_keys(mgr, filt, keys, num_keys, result);
+}
 
-    // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
-    return (res == -1) ? -2 : 0;
+/**
+ * Sets keys in the filter of a handle. The handle must be valid.
+ * @arg handle The handle of the filter
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_set_handle_keys(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result) {
+    bloom_filter_wrapper *filt = handle->filter;
+    if (!filt || !filt->is_active) return -1;
+    return set_keys(mgr, filt, keys, num_keys, result);
 }
 
 /**
@@ -404,7 +632,7 @@ int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *c
     // Bail if the filter already exists.
     bloom_filter_wrapper *filt = find_filter(mgr, filter_name);
     if (filt) {
-        res = (filt->is_active) ? -1 : -3;
+        res = -1;
         goto LEAVE;
     }
 
@@ -426,13 +654,16 @@ int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *c
     // Use a custom config if provided, else the default
     bloom_config *config = (custom_config) ? custom_config : mgr->config;
 
-    // Add the filter to the new version
-    if (add_filter(mgr, filter_name, config, 1, 1)) {
+    // Add the filter to the map
+    if (add_filter(mgr, filter_name, config, 1)) {
         res = -2; // Internal error
     }
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
+
+    // Evict other filters if we went past the limit
+    if (!res) make_room(mgr, 0);
     return res;
 }
 
@@ -453,10 +684,16 @@ int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name) {
         goto LEAVE;
     }
 
-    // Set the filter to be non-active and mark for deletion
-    filt->is_active = 0;
-    filt->should_delete = 1;
-    create_delta_update(mgr, DELETE, filt);
+    // Set the filter to be non-active and mark for deletion.
+    // When logging, sets hold the filter lock, so none are logged after the drop.
+    if (mgr->log_cb) {
+        pthread_rwlock_wrlock(&filt->rwlock);
+        remove_filter(mgr, filt, 1);
+        mgr->log_cb(mgr->log_data, FILTMGR_DROP, filter_name, NULL, NULL, 0, NULL);
+        pthread_rwlock_unlock(&filt->rwlock);
+    } else {
+        remove_filter(mgr, filt, 1);
+    }
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
@@ -489,9 +726,51 @@ int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name) {
 
     // This is critical, as it prevents it from
     // being deleted. Instead, it is merely closed.
-    filt->is_active = 0;
-    filt->should_delete = 0;
-    create_delta_update(mgr, DELETE, filt);
+    if (mgr->log_cb) {
+        pthread_rwlock_wrlock(&filt->rwlock);
+        remove_filter(mgr, filt, 0);
+        mgr->log_cb(mgr->log_data, FILTMGR_CLEAR, filter_name, NULL, NULL, 0, NULL);
+        pthread_rwlock_unlock(&filt->rwlock);
+    } else {
+        remove_filter(mgr, filt, 0);
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Closes the filter and clears it from the internal data stores,
+ * in one step under the lock of the filter, so that a reader cannot
+ * fault it back in between. Used where a clear must not fail
+ * because the filter is in use.
+ * @arg filter_name The name of the filter to clear
+ * @return 0 on success, -1 if the filter does not exist, -2
+ * if the filter is in memory, and so cannot be closed.
+ */
+int filtmgr_close_clear_filter(bloom_filtmgr *mgr, char *filter_name) {
+    int res = 0;
+    pthread_mutex_lock(&mgr->write_lock);
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) {
+        res = -1;
+        goto LEAVE;
+    }
+    if (filt->filter->filter_config.in_memory) {
+        res = -2;
+        goto LEAVE;
+    }
+
+    // Close and remove the filter, without deleting it
+    pthread_rwlock_wrlock(&filt->rwlock);
+    bloomf_close(filt->filter);
+    update_resident(mgr, filt);
+    remove_filter(mgr, filt, 0);
+    if (mgr->log_cb) mgr->log_cb(mgr->log_data, FILTMGR_CLEAR, filter_name, NULL, NULL, 0, NULL);
+    pthread_rwlock_unlock(&filt->rwlock);
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
@@ -521,6 +800,7 @@ int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name) {
 
     // Close the filter
     bloomf_close(filt->filter);
+    update_resident(mgr, filt);
 
     // Release the lock
     pthread_rwlock_unlock(&filt->rwlock);
@@ -529,6 +809,37 @@ LEAVE:
     return 0;
 }
 
+/**
+ * Faults a filter into memory ahead of use, and marks it
+ * as hot. This is used to warm the filters that were hot
+ * before a restart, so that the first requests do not
+ * wait on the disk.
+ * @arg filter_name The name of the filter to fault in
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error.
+ */
+int filtmgr_prefault_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Make room for the filter
+    reserve_resident(mgr, filt);
+
+    // Acquire the write lock
+    pthread_rwlock_wrlock(&filt->rwlock);
+
+    // Fault in, and mark as hot
+    int res = bloomf_fault(filt->filter);
+    filt->is_hot = 1;
+    filt->is_referenced = 1;
+    update_resident(mgr, filt);
+
+    // Release the lock
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -2 : 0;
+}
+
 /**
  * Allocates space for and returns a linked
  * list of all the filters.
@@ -541,36 +852,59 @@ int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_hea
     // Allocate the head
     bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
 
+    // Bring the index up to date with the map
+    pthread_mutex_lock(&mgr->list_lock);
+    if (build_list_index(mgr)) {
+        pthread_mutex_unlock(&mgr->list_lock);
+        return -1;
+    }
+
     // Iterate through a callback to append
-    int prefix_len = 0;
-    if (prefix) {
-        prefix_len = strlen(prefix);
-        art_iter_prefix(mgr->filter_map, (unsigned char*)prefix, prefix_len, filter_map_list_cb, h);
-    } else
-        art_iter(mgr->filter_map, filter_map_list_cb, h);
-
-    // Joy... we have to potentially handle the delta updates
-    if (mgr->primary_vsn == mgr->vsn) return 0;
-
-    filter_list *current = mgr->delta;
-    bloom_filter_wrapper *f;
-    while (current) {
-        // Check if this is a match (potential prefix)
-        if (current->type == CREATE) {
-            f = current->filter;
-            if (!prefix_len || !strncmp(f->filter->filter_name, prefix, prefix_len)) {
-                f = current->filter;
-                filter_map_list_cb(h, (unsigned char*)f->filter->filter_name, 0, f);
-            }
-        }
+    if (prefix)
+        art_iter_prefix(mgr->list_index, (unsigned char*)prefix, strlen(prefix), list_index_cb, h);
+    else
+        art_iter(mgr->list_index, list_index_cb, h);
+    pthread_mutex_unlock(&mgr->list_lock);
+    return 0;
+}
 
-        // Don't seek past what the primary map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
+
+/**
+ * Streams the filters in order of their names, without building
+ * a list. The callback is invoked with the list lock held, so
+ * it must not call back into the manager, and it should be quick.
+ * The filters may only be used to read metrics, as with filtmgr_filter_cb.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg after Only visit the filters after this name, or NULL for all.
+ * The name need not exist, so the last name returned can be used to resume.
+ * @arg cb The callback to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -1 on error, or the return of the
+ * callback if it stopped the iteration.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, char *after, filter_iter_cb cb, void *data) {
+    filter_iter_data iter = {prefix, (prefix) ? strlen(prefix) : 0, 0, cb, data};
+
+    // Seek to the prefix, or just past the after name if that is later.
+    // The names are stored with the NULL terminator, so the bare prefix
+    // sorts before any name starting with it.
+    char *start = (prefix) ? prefix : "";
+    int start_len = iter.prefix_len;
+    if (after && strcmp(after, start) >= 0) {
+        start = after;
+        start_len = strlen(after) + 1;
     }
 
-    return 0;
+    // Bring the index up to date with the map
+    pthread_mutex_lock(&mgr->list_lock);
+    if (build_list_index(mgr)) {
+        pthread_mutex_unlock(&mgr->list_lock);
+        return -1;
+    }
+    int res = art_iter_after(mgr->list_index, (unsigned char*)start, start_len, list_index_iter_cb, &iter);
+    pthread_mutex_unlock(&mgr->list_lock);
+    return (iter.past_prefix) ? 0 : res;
 }
 
 
@@ -586,9 +920,89 @@ int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head)
     // Allocate the head of a new hashmap
     bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
 
-    // Scan for the cold filters. Ignore deltas, since they are either
-    // new (e.g. hot), or being deleted anyways.
-    art_iter(mgr->filter_map, filter_map_list_cold_cb, h);
+    // Scan for the cold filters. Dropped filters are
+    // already removed from the map.
+    hashmap_iter(&mgr->filter_map, filter_map_list_cold_cb, h);
+    return 0;
+}
+
+
+/**
+ * Streams the cold filters in batches, without building a list.
+ * Like filtmgr_list_cold_filters, this clears the list of cold filters
+ * as it goes. The iteration can be stopped by the callback and resumed
+ * with the cursor, so that the caller can checkpoint between batches.
+ * The filters may only be used to read metrics, as with filtmgr_filter_cb.
+ * @arg mgr The manager to list from
+ * @arg cursor Input/Output. Start with 0. Updated to resume the scan
+ * after the callback stops it, and reset to 0 once the scan is complete.
+ * @arg cb The callback to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 once the scan is complete, or the return
+ * of the callback if it stopped the iteration.
+ */
+int filtmgr_iter_cold_filters(bloom_filtmgr *mgr, unsigned long long *cursor, filter_iter_cb cb, void *data) {
+    filter_iter_data iter = {NULL, 0, 0, cb, data};
+    uint64_t pos = *cursor;
+    int res = hashmap_iter_from(&mgr->filter_map, &pos, filter_map_iter_cold_cb, &iter);
+    *cursor = pos;
+    return res;
+}
+
+
+/**
+ * Allocates space for and returns a linked list of the
+ * filters that are in memory, hottest first. Filters used
+ * since the last cold scan come first, and are otherwise
+ * ranked by their number of accesses. In-memory only filters
+ * are skipped, since they can not be faulted in again.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_hot_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head) {
+    // Allocate the head
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Collect and rank the filters in memory
+    hot_set set = {NULL, 0, 0};
+    hashmap_iter(&mgr->filter_map, filter_map_list_hot_cb, &set);
+    qsort(set.entries, set.len, sizeof(hot_entry), compare_hot_entries);
+
+    // Build the list in rank order, taking the names
+    for (int i=0; i < set.len; i++) {
+        bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+        node->filter_name = set.entries[i].filter_name;
+        node->next = NULL;
+        if (h->tail) h->tail->next = node;
+        else h->head = node;
+        h->tail = node;
+        h->size++;
+    }
+    free(set.entries);
+    return 0;
+}
+
+/**
+ * Allocates space for and returns a linked list of the
+ * filters that have been set since they were last flushed.
+ * This has the side effect of clearing the dirty set, and
+ * the filters are queued again once they are flushed and set.
+ * A name may be listed even if the filter was since dropped.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_dirty_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head) {
+    // Allocate the head
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Take the whole stack at once
+    h->head = __atomic_exchange_n(&mgr->dirty, NULL, __ATOMIC_ACQUIRE);
+    for (bloom_filter_list *node = h->head; node; node = node->next) {
+        h->tail = node;
+        h->size++;
+    }
     return 0;
 }
 
@@ -613,46 +1027,117 @@ int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void*
 
 
 /**
- * Convenience method to cleanup a filter list.
+ * Invokes a callback with a filter faulted in, and locked against
+ * writers. This allows the bitmaps of the filter to be copied, in
+ * a consistent order with the change log.
+ * @arg filter_name The name of the filter
+ * @arg cb The callback, which must not call back into the manager
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if it could not be faulted in.
  */
-void filtmgr_cleanup_list(bloom_filter_list_head *head) {
-    bloom_filter_list *next, *current = head->head;
-    while (current) {
-        next = current->next;
-        free(current->filter_name);
-        free(current);
-        current = next;
-    }
-    free(head);
+int filtmgr_snapshot_filter(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void* data) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Make room for the filter
+    reserve_resident(mgr, filt);
+
+    // Acquire the write lock, the filter may have been dropped since
+    int res = -1;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    if (filt->is_active) {
+        res = (bloomf_fault(filt->filter)) ? -2 : 0;
+        if (!res) cb(data, filter_name, filt->filter);
+        update_resident(mgr, filt);
+    }
+
+    // Release the lock
+    pthread_rwlock_unlock(&filt->rwlock);
+    return res;
 }
 
-// Searches the primary tree and the delta list for a filter
-static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name) {
-    // Search the tree first
-    bloom_filter_wrapper *filt = art_search(mgr->filter_map,
-            (unsigned char*)filter_name, strlen(filter_name)+1);
-    if (filt) return filt;
+/**
+ * Sets the change log callback. This must be
+ * invoked before any clients use the manager.
+ * @arg cb The callback, or NULL to disable
+ * @arg data Opaque handle passed to the callback
+ */
+void filtmgr_set_log(bloom_filtmgr *mgr, filtmgr_log_cb cb, void *data) {
+    mgr->log_data = data;
+    mgr->log_cb = cb;
+}
+
+/**
+ * Checks if a filter is proxied, meaning that it is not
+ * in memory, and must be faulted in from disk on access.
+ * The result is only a hint, since the filter may be
+ * faulted in or out concurrently.
+ * @arg filter_name The name of the filter
+ * @return 1 if proxied, 0 if in memory, -1 if the filter does not exist.
+ */
+int filtmgr_is_proxied(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    return bloomf_is_proxied(filt->filter);
+}
 
-    // Check if the primary has all delta changes
-    if (mgr->primary_vsn == mgr->vsn) return NULL;
+/**
+ * Compresses the in-memory filters that have not been used since
+ * the last call. Filters that are in use are skipped, and are
+ * retried on the next call.
+ * @arg mgr The manager
+ * @return The number of filters compressed.
+ */
+int filtmgr_compress_idle_filters(bloom_filtmgr *mgr) {
+    compress_data data = {mgr, 0};
+    hashmap_iter(&mgr->filter_map, filter_map_compress_cb, &data);
+    return data.compressed;
+}
 
-    // Search the delta list
-    filter_list *current = mgr->delta;
-    while (current) {
-        // Check if this is a match
-        if (current->type != BARRIER &&
-            strcmp(current->filter->filter->filter_name, filter_name) == 0) {
-            return current->filter;
-        }
+/**
+ * Returns the total byte size of the filters in memory
+ */
+uint64_t filtmgr_resident_bytes(bloom_filtmgr *mgr) {
+    return __atomic_load_n(&mgr->resident_bytes, __ATOMIC_RELAXED);
+}
 
-        // Don't seek past what the primary map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
+/**
+ * Returns the byte size of the filters in memory that may be
+ * closed, which is held to the max_resident_bytes limit
+ */
+uint64_t filtmgr_evictable_bytes(bloom_filtmgr *mgr) {
+    return __atomic_load_n(&mgr->evictable_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the number of filters closed to stay
+ * within the max_resident_bytes limit.
+ */
+uint64_t filtmgr_evictions(bloom_filtmgr *mgr) {
+    return __atomic_load_n(&mgr->evictions, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Convenience method to cleanup a filter list.
+ */
+void filtmgr_cleanup_list(bloom_filter_list_head *head) {
+    bloom_filter_list *next, *current = head->head;
+    while (current) {
+        next = current->next;
+        free(current->filter_name);
+        free(current);
+        current = next;
     }
+    free(head);
+}
 
-    // Not found
-    return NULL;
+// Searches the map for a filter
+static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name) {
+    return hashmap_get(&mgr->filter_map, filter_name);
 }
 
 // Gets the bloom filter in a thread safe way.
@@ -662,16 +1147,202 @@ static bloom_filter_wrapper* take_filter(bloom_filtmgr *mgr, char *filter_name)
 }
 
 
+/**
+ * Checks the keys in a filter, under its lock
+ */
+static int check_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int num_keys, char *result) {
+    // Make room if we will fault in the filter
+    reserve_resident(mgr, filt);
+
+    // Acquire the write lock
+    pthread_rwlock_wrlock(&filt->rwlock);
+
+    // Check the keys, store the results
+    int res = 0;
+    for (int i=0; i<num_keys; i++) {
+        res = bloomf_contains(filt->filter, keys[i]);
+        if (res == -1) break;
+        *(result+i) = res;
+    }
+
+    // Mark as hot
+    filt->is_hot = 1;
+    filt->is_referenced = 1;
+    filt->is_used = 1;
+    update_resident(mgr, filt);
+
+    // Release the lock
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res == -1) ? -2 : 0;
+}
+
+/**
+ * Sets the keys in a filter, under its lock
+ */
+static int set_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int num_keys, char *result) {
+    // Make room if we will fault in the filter
+    reserve_resident(mgr, filt);
+
+    // Acquire the write lock
+    pthread_rwlock_wrlock(&filt->rwlock);
+
+    // Set the keys, store the results
+    int res = 0, added = 0, i;
+    for (i=0; i<num_keys; i++) {
+        res = bloomf_add(filt->filter, keys[i]);
+        if (res == -1) break;
+        *(result+i) = res;
+        added |= res;
+    }
+
+    // Log the keys that were added, unless the filter was dropped
+    if (added && mgr->log_cb && filt->is_active) {
+        mgr->log_cb(mgr->log_data, FILTMGR_SET, filt->filter->filter_name, NULL, keys, i, result);
+    }
+
+    // Mark as hot, and dirty if anything was added
+    filt->is_hot = 1;
+    filt->is_referenced = 1;
+    filt->is_used = 1;
+    if (added && !filt->is_dirty) mark_dirty(mgr, filt);
+    update_resident(mgr, filt);
+
+    // Release the lock
+    pthread_rwlock_unlock(&filt->rwlock);
+
+    // We may have grown past the limit
+    make_room(mgr, 0);
+    return (res == -1) ? -2 : 0;
+}
+
+/**
+ * Queues a filter in the dirty set. This must be invoked with
+ * the write lock of the filter, so that a concurrent flush either
+ * sees the keys that were added, or leaves the filter to be queued.
+ */
+static void mark_dirty(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    filt->is_dirty = 1;
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup(filt->filter->filter_name);
+
+    // Push onto the stack
+    node->next = __atomic_load_n(&mgr->dirty, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&mgr->dirty, &node->next, node, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Updates the bytes a filter counts in the resident bytes,
+ * after it may have been faulted in, grown, or closed.
+ * This must be invoked with the write lock of the filter.
+ */
+static void update_resident(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    uint64_t bytes;
+    if (bloomf_is_proxied(filt->filter))
+        bytes = 0;
+    else if (bloomf_is_compressed(filt->filter))
+        bytes = bloomf_resident_bytes(filt->filter);
+    else
+        bytes = bloomf_byte_size(filt->filter);
+    if (bytes == filt->resident) return;
+    __atomic_add_fetch(&mgr->resident_bytes, bytes - filt->resident, __ATOMIC_RELAXED);
+    if (!filt->filter->filter_config.in_memory)
+        __atomic_add_fetch(&mgr->evictable_bytes, bytes - filt->resident, __ATOMIC_RELAXED);
+    filt->resident = bytes;
+}
+
+/**
+ * Makes room for a filter that is about to be faulted
+ * in or decompressed. Must be invoked without the
+ * lock of the filter.
+ */
+static void reserve_resident(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    // The size is known from when the filter was last flushed
+    if (bloomf_is_proxied(filt->filter))
+        make_room(mgr, filt->filter->filter_config.bytes);
+    else if (bloomf_is_compressed(filt->filter))
+        make_room(mgr, bloomf_byte_size(filt->filter) - filt->resident);
+}
+
+/**
+ * Evicts the least recently used filters until the given number of
+ * bytes fits within max_resident_bytes. This is best effort, since
+ * filters that are in use are skipped, and the sweeps back off for
+ * EVICT_RETRY_USEC after evicting nothing. Must be invoked without
+ * holding the lock of any filter.
+ * @arg bytes The bytes that are about to be faulted in
+ */
+static void make_room(bloom_filtmgr *mgr, uint64_t bytes) {
+    uint64_t max = mgr->config->max_resident_bytes;
+    if (!max || __atomic_load_n(&mgr->evictable_bytes, __ATOMIC_RELAXED) + bytes <= max) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t now_usec = now.tv_sec * 1000000ULL + now.tv_usec;
+    if (now_usec < __atomic_load_n(&mgr->evict_retry_at, __ATOMIC_RELAXED)) return;
+
+    // Another thread may have swept while we waited
+    evict_data data = {mgr, (bytes < max) ? max - bytes : 0, 0};
+    pthread_mutex_lock(&mgr->evict_lock);
+    if (__atomic_load_n(&mgr->evictable_bytes, __ATOMIC_RELAXED) + bytes > max &&
+            now_usec >= mgr->evict_retry_at) {
+        for (int sweeps=0; sweeps < MAX_CLOCK_SWEEPS; sweeps++) {
+            if (hashmap_iter_from(&mgr->filter_map, &mgr->clock_hand, evict_clock_cb, &data)) break;
+        }
+        if (!data.evicted) {
+            __atomic_store_n(&mgr->evict_retry_at, now_usec + EVICT_RETRY_USEC, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&mgr->evict_lock);
+}
+
+/**
+ * Called as part of the hashmap callback to advance the eviction
+ * clock. Evicts the filter if it was not referenced since the
+ * last sweep, and is not in use.
+ * @return 1 once the evictable bytes are within the limit.
+ */
+static int evict_clock_cb(void *data, void *value) {
+    evict_data *evict = data;
+    bloom_filter_wrapper *filt = value;
+    bloom_filtmgr *mgr = evict->mgr;
+
+    // Skip the filters we cannot evict
+    if (!filt->is_active || filt->filter->filter_config.in_memory ||
+            bloomf_is_proxied(filt->filter)) return 0;
+
+    // Give a second chance to recently used filters
+    if (filt->is_referenced) {
+        filt->is_referenced = 0;
+        return 0;
+    }
+
+    // Never wait on a filter that is in use
+    if (pthread_rwlock_trywrlock(&filt->rwlock)) return 0;
+    bloomf_close(filt->filter);
+    update_resident(mgr, filt);
+    pthread_rwlock_unlock(&filt->rwlock);
+
+    __atomic_add_fetch(&mgr->evictions, 1, __ATOMIC_RELAXED);
+    evict->evicted++;
+    syslog(LOG_DEBUG, "Evicted filter '%s' to stay within max_resident_bytes.",
+            filt->filter->filter_name);
+    return __atomic_load_n(&mgr->evictable_bytes, __ATOMIC_RELAXED) <= evict->limit;
+}
+
 /**
  * Invoked to cleanup a filter once we
  * have hit 0 remaining references.
  */
-static void delete_filter(bloom_filter_wrapper *filt) {
+static void delete_filter(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
     // Delete or Close the filter
     if (filt->should_delete)
         bloomf_delete(filt->filter);
     else
         bloomf_close(filt->filter);
+    __atomic_sub_fetch(&mgr->resident_bytes, filt->resident, __ATOMIC_RELAXED);
+    if (!filt->filter->filter_config.in_memory)
+        __atomic_sub_fetch(&mgr->evictable_bytes, filt->resident, __ATOMIC_RELAXED);
 
     // Cleanup the filter
     destroy_bloom_filter(filt->filter);
@@ -688,18 +1359,20 @@ static void delete_filter(bloom_filter_wrapper *filt) {
 
 /**
  * Creates a new filter and adds it to the filter map.
+ * This must be invoked with the write lock, or during init.
  * @arg mgr The manager to add to
  * @arg filter_name The name of the filter
  * @arg config The configuration for the filter
  * @arg is_hot Is the filter hot. False for existing.
- * @arg delta Is this a delta update or should the map be updated
  * @return 0 on success, -1 on error
  */
-static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int delta) {
+static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot) {
     // Create the filter
     bloom_filter_wrapper *filt = calloc(1, sizeof(bloom_filter_wrapper));
     filt->is_active = 1;
     filt->is_hot = is_hot;
+    filt->is_referenced = is_hot;
+    filt->is_used = is_hot;
     filt->should_delete = 0;
     pthread_rwlock_init(&filt->rwlock, NULL);
 
@@ -709,105 +1382,289 @@ static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *confi
     }
 
     // Try to create the underlying filter. Only discover if it is hot.
-    int res = init_bloom_filter(config, filter_name, is_hot, &filt->filter);
+    int res = init_bloom_filter(config, mgr->pack, filter_name, is_hot, &filt->filter);
     if (res != 0) {
         free(filt);
         return -1;
     }
 
-    // Check if we are adding a delta value or directly updating ART tree
-    if (delta)
-        create_delta_update(mgr, CREATE, filt);
-    else
-        art_insert(mgr->filter_map, (unsigned char*)filter_name, strlen(filter_name)+1, filt);
+    // Count the filter if it was faulted in
+    update_resident(mgr, filt);
+
+    // Insert into the map, the key is owned by the filter. New filters
+    // are locked until the create is logged, so that no set precedes it.
+    hashmap_table *retired;
+    if (is_hot) pthread_rwlock_wrlock(&filt->rwlock);
+    res = hashmap_put(&mgr->filter_map, filt, &retired);
+    if (res) {
+        syslog(LOG_ERR, "Failed to add filter '%s' to the map!", filter_name);
+        if (is_hot) pthread_rwlock_unlock(&filt->rwlock);
+        bloomf_close(filt->filter);
+        update_resident(mgr, filt);
+        destroy_bloom_filter(filt->filter);
+        free(filt);
+        return -1;
+    }
+    if (is_hot) {
+        if (mgr->log_cb) {
+            mgr->log_cb(mgr->log_data, FILTMGR_CREATE, filter_name,
+                    &filt->filter->filter_config, NULL, 0, NULL);
+        }
+        pthread_rwlock_unlock(&filt->rwlock);
+    }
+
+    // Readers may still be probing the old table
+    if (retired) create_delta_update(mgr, RETIRE, NULL, retired);
+    else __atomic_add_fetch(&mgr->vsn, 1, __ATOMIC_RELEASE);
     return 0;
 }
 
 /**
- * Called as part of the hashmap callback
- * to list all the filters. Only works if value is
- * not NULL.
+ * Removes a filter from the filter map. The filter is released
+ * by the vacuum thread once no client can be using it.
+ * This must be invoked with the write lock.
+ * @arg mgr The manager
+ * @arg filt The filter to remove
+ * @arg should_delete Should the files be deleted, or just closed
  */
-static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)key_len;
-    // Filter out the non-active nodes
+static void remove_filter(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, int should_delete) {
+    filt->is_active = 0;
+    filt->should_delete = should_delete;
+    hashmap_delete(&mgr->filter_map, filt->filter->filter_name);
+
+    // Block creates until the filter is released
+    bloom_filter_list *pending = malloc(sizeof(bloom_filter_list));
+    pending->filter_name = strdup(filt->filter->filter_name);
+    LOCK_BLOOM_SPIN(&mgr->pending_lock);
+    pending->next = mgr->pending_deletes;
+    mgr->pending_deletes = pending;
+    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+
+    create_delta_update(mgr, DELETE, filt, NULL);
+}
+
+// Returns the key of a filter in the filter map
+static const char* filter_map_key(void *value) {
     bloom_filter_wrapper *filt = value;
-    if (!filt->is_active) return 0;
+    return filt->filter->filter_name;
+}
+
+/**
+ * Checks if a filter is cold, meaning it has not been
+ * used since the last check, and is still in memory.
+ * This has the side effect of clearing the hot flag.
+ * @return 1 if cold, 0 otherwise.
+ */
+static int check_cold(bloom_filter_wrapper *filt) {
+    // Check if hot, turn off and skip
+    if (filt->is_hot) {
+        filt->is_hot = 0;
+        return 0;
+    }
+
+    // Check if proxied
+    return !bloomf_is_proxied(filt->filter);
+}
 
+/**
+ * Called as part of the hashmap callback
+ * to list cold filters.
+ */
+static int filter_map_list_cold_cb(void *data, void *value) {
     // Cast the inputs
     bloom_filter_list_head *head = data;
+    bloom_filter_wrapper *filt = value;
+    if (!check_cold(filt)) return 0;
 
     // Allocate a new entry
     bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
 
     // Setup
-    node->filter_name = strdup((char*)key);
-    node->next = NULL;
-
-    // Inject at head if first node
-    if (!head->head) {
-        head->head = node;
-        head->tail = node;
+    node->filter_name = strdup(filt->filter->filter_name);
+    node->next = head->head;
 
-    // Inject at tail
-    } else {
-        head->tail->next = node;
-        head->tail = node;
-    }
+    // Inject
+    head->head = node;
     head->size++;
     return 0;
 }
 
 /**
  * Called as part of the hashmap callback
- * to list cold filters. Only works if value is
- * not NULL.
+ * to stream cold filters.
  */
-static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)key_len;
-    // Cast the inputs
-    bloom_filter_list_head *head = data;
+static int filter_map_iter_cold_cb(void *data, void *value) {
+    filter_iter_data *iter = data;
     bloom_filter_wrapper *filt = value;
+    if (!check_cold(filt)) return 0;
+    return iter->cb(iter->data, filt->filter->filter_name, filt->filter);
+}
 
-    // Check if hot, turn off and skip
-    if (filt->is_hot) {
-        filt->is_hot = 0;
-        return 0;
+/**
+ * Called as part of the hashmap callback
+ * to collect the filters in the hot set.
+ */
+static int filter_map_list_hot_cb(void *data, void *value) {
+    hot_set *set = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || filt->filter->filter_config.in_memory) return 0;
+    if (bloomf_is_proxied(filt->filter)) return 0;
+
+    // Grow the set if needed
+    if (set->len == set->size) {
+        set->size = (set->size) ? set->size * 2 : 64;
+        set->entries = realloc(set->entries, set->size * sizeof(hot_entry));
     }
 
-    // Check if proxied
-    if (bloomf_is_proxied(filt->filter)) {
+    // The counters are only read, so we do not lock
+    filter_counters *counters = bloomf_counters(filt->filter);
+    hot_entry *entry = set->entries + set->len++;
+    entry->filter_name = strdup(filt->filter->filter_name);
+    entry->is_hot = filt->is_hot;
+    entry->accesses = counters->check_hits + counters->check_misses +
+        counters->set_hits + counters->set_misses;
+    return 0;
+}
+
+// Orders the hot set with the hottest filters first
+static int compare_hot_entries(const void *a, const void *b) {
+    const hot_entry *ea = a, *eb = b;
+    if (ea->is_hot != eb->is_hot) return eb->is_hot - ea->is_hot;
+    if (ea->accesses != eb->accesses) return (ea->accesses < eb->accesses) ? 1 : -1;
+    return strcmp(ea->filter_name, eb->filter_name);
+}
+
+/**
+ * Called as part of the hashmap callback to compress
+ * the idle in-memory filters. Clears the used flag.
+ */
+static int filter_map_compress_cb(void *data, void *value) {
+    compress_data *compress = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || !filt->filter->filter_config.in_memory) return 0;
+
+    // Skip if used since the last sweep
+    if (filt->is_used) {
+        filt->is_used = 0;
         return 0;
     }
+    if (bloomf_is_compressed(filt->filter)) return 0;
+
+    // Never wait on a filter that is in use
+    if (pthread_rwlock_trywrlock(&filt->rwlock)) return 0;
+    if (bloomf_compress(filt->filter) == 0) {
+        update_resident(compress->mgr, filt);
+        compress->compressed++;
+    }
+    pthread_rwlock_unlock(&filt->rwlock);
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to cleanup the filters.
+ */
+static int filter_map_delete_cb(void *data, void *value) {
+    // Cast the inputs
+    bloom_filter_wrapper *filt = value;
+
+    // Delete, but not the underlying files
+    filt->should_delete = 0;
+    delete_filter(data, filt);
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback to
+ * add the active filters to the list index.
+ */
+static int list_index_insert_cb(void *data, void *value) {
+    art_tree *index = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active) return 0;
+    char *name = filt->filter->filter_name;
+    art_insert(index, (unsigned char*)name, strlen(name)+1, filt);
+    return 0;
+}
+
+/**
+ * Called as part of the ART callback
+ * to list all the filters in order.
+ */
+static int list_index_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    (void)value;
+
+    // Cast the inputs
+    bloom_filter_list_head *head = data;
 
     // Allocate a new entry
     bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
 
     // Setup
     node->filter_name = strdup((char*)key);
-    node->next = head->head;
+    node->next = NULL;
 
-    // Inject
-    head->head = node;
+    // Inject at head if first node
+    if (!head->head) {
+        head->head = node;
+        head->tail = node;
+
+    // Inject at tail
+    } else {
+        head->tail->next = node;
+        head->tail = node;
+    }
     head->size++;
     return 0;
 }
 
 /**
- * Called as part of the hashmap callback
- * to cleanup the filters.
+ * Called as part of the ART callback to stream
+ * the filters in order, until the prefix ends.
  */
-static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)data;
-    (void)key;
+static int list_index_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
     (void)key_len;
-
-    // Cast the inputs
+    filter_iter_data *iter = data;
     bloom_filter_wrapper *filt = value;
 
-    // Delete, but not the underlying files
-    filt->should_delete = 0;
-    delete_filter(filt);
+    // The names are in order, so we are done at the first mismatch
+    if (iter->prefix && strncmp((char*)key, iter->prefix, iter->prefix_len)) {
+        iter->past_prefix = 1;
+        return 1;
+    }
+    if (!filt->is_active) return 0;
+    return iter->cb(iter->data, (char*)key, filt->filter);
+}
+
+/**
+ * Rebuilds the ordered list index if the map has changed
+ * since it was last built. The index maps the names to the
+ * filters that were in the map at that version. A filter dropped
+ * after that is not reclaimed before the caller next checkpoints,
+ * so the filters are safe to use while the list lock is held.
+ * This must be invoked with the list lock.
+ * @return 0 on success.
+ */
+static int build_list_index(bloom_filtmgr *mgr) {
+    unsigned long long vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE);
+    if (mgr->list_index && mgr->list_vsn == vsn) return 0;
+
+    // Allocate the index the first time
+    if (!mgr->list_index) {
+        mgr->list_index = malloc(sizeof(art_tree));
+        if (init_art_tree(mgr->list_index)) {
+            free(mgr->list_index);
+            mgr->list_index = NULL;
+            return -1;
+        }
+    } else {
+        destroy_art_tree(mgr->list_index);
+        init_art_tree(mgr->list_index);
+    }
+
+    hashmap_iter(&mgr->filter_map, list_index_insert_cb, mgr->list_index);
+    mgr->list_vsn = vsn;
     return 0;
 }
 
@@ -852,7 +1709,7 @@ static int load_existing_filters(bloom_filtmgr *mgr) {
     for (int i=0; i< num; i++) {
         char *folder_name = namelist[i]->d_name;
         char *filter_name = folder_name + FOLDER_PREFIX_LEN;
-        if (add_filter(mgr, filter_name, mgr->config, 0, 0)) {
+        if (add_filter(mgr, filter_name, mgr->config, 0)) {
             syslog(LOG_ERR, "Failed to load filter '%s'!", filter_name);
         }
     }
@@ -869,99 +1726,24 @@ static int load_existing_filters(bloom_filtmgr *mgr) {
  * @arg mgr The manager
  * @arg type The type of delta
  * @arg filt The filter that is affected
+ * @arg table The table that is retired
  * @return The new version we created
  */
-static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt) {
+static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt, hashmap_table *table) {
     filter_list *delta = malloc(sizeof(filter_list));
-    delta->vsn = ++mgr->vsn;
+    delta->vsn = mgr->vsn + 1;
     delta->type = type;
     delta->filter = filt;
+    delta->table = table;
     delta->next = mgr->delta;
     mgr->delta = delta;
-    return delta->vsn;
-}
-
-/**
- * Merges changes into the alternate tree from the delta lists
- * Safety: Safe ONLY if no other thread is using alt_filter_map
- */
-static void merge_old_versions(bloom_filtmgr *mgr, filter_list *delta, unsigned long long min_vsn) {
-    // Handle older delta first (bottom up)
-    if (delta->next) merge_old_versions(mgr, delta->next, min_vsn);
-
-    // Check if we should skip this update
-    if (delta->vsn > min_vsn) return;
-
-    // Handle current update
-    bloom_filter_wrapper *s = delta->filter;
-    switch (delta->type) {
-        case CREATE:
-            art_insert(mgr->alt_filter_map, (unsigned char*)s->filter->filter_name, strlen(s->filter->filter_name)+1, s);
-            break;
-        case DELETE:
-            art_delete(mgr->alt_filter_map, (unsigned char*)s->filter->filter_name, strlen(s->filter->filter_name)+1);
-            break;
-        case BARRIER:
-            // Ignore the barrier...
-            break;
-    }
-}
-
-/**
- * Updates the pending deletes list with a list of pending deletes
- */
-static void mark_pending_deletes(bloom_filtmgr *mgr, unsigned long long min_vsn) {
-    bloom_filter_list *tmp, *pending = NULL;
-
-    // Add each delete
-    filter_list *delta = mgr->delta;
-    while (delta) {
-        if (delta->vsn <= min_vsn && delta->type == DELETE) {
-            tmp = malloc(sizeof(bloom_filter_list));
-            tmp->filter_name = strdup(delta->filter->filter->filter_name);
-            tmp->next = pending;
-            pending = tmp;
-        }
-        delta = delta->next;
-    }
-
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = pending;
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
-}
-
-/**
- * Clears the pending deletes
- */
-static void clear_pending_deletes(bloom_filtmgr *mgr) {
-    // Get a reference to the head
-    bloom_filter_list *pending = mgr->pending_deletes;
-    if (!pending) return;
+    __atomic_store_n(&mgr->vsn, delta->vsn, __ATOMIC_RELEASE);
 
-    // filter the pending list to NULL safely
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = NULL;
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
-
-    // Free the nodes
-    bloom_filter_list *next;
-    while (pending) {
-        free(pending->filter_name);
-        next = pending->next;
-        free(pending);
-        pending = next;
-    }
-}
-
-/**
- * Swap the alternate / primary maps, filters the primary_vsn
- * This is always safe, since its just a pointer swap.
- */
-static void swap_filter_maps(bloom_filtmgr *mgr, unsigned long long primary_vsn) {
-    art_tree *tmp = mgr->filter_map;
-    mgr->filter_map = mgr->alt_filter_map;
-    mgr->alt_filter_map = tmp;
-    mgr->primary_vsn = primary_vsn;
+    // Wake the vacuum thread
+    pthread_mutex_lock(&mgr->vacuum_lock);
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
+    return delta->vsn;
 }
 
 /*
@@ -970,7 +1752,7 @@ static void swap_filter_maps(bloom_filtmgr *mgr, unsigned long long primary_vsn)
  * and returns a pointer to that node.
  *
  * Safety: This is ONLY safe if the minimum client version
- * and the primary_vsn is strictly greater than the min_vsn argument.
+ * is greater than or equal to the min_vsn argument.
  * This ensures access to older delta entries will not happen.
  */
 static filter_list* remove_delta_versions(filter_list *init, filter_list **ref, unsigned long long min_vsn) {
@@ -986,26 +1768,64 @@ static filter_list* remove_delta_versions(filter_list *init, filter_list **ref,
     return current;
 }
 
+/**
+ * Removes a name from the pending deletes
+ */
+static void clear_pending_delete(bloom_filtmgr *mgr, char *filter_name) {
+    LOCK_BLOOM_SPIN(&mgr->pending_lock);
+    bloom_filter_list **prev = &mgr->pending_deletes;
+    bloom_filter_list *node = mgr->pending_deletes;
+    while (node) {
+        if (!strcmp(node->filter_name, filter_name)) {
+            *prev = node->next;
+            break;
+        }
+        prev = &node->next;
+        node = node->next;
+    }
+    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+
+    if (node) {
+        free(node->filter_name);
+        free(node);
+    }
+}
+
 /**
  * Deletes old versions from the delta lists, and calls
  * delete_filter on the filters in the destroyed list.
  *
  * Safety: Same as remove_delta_versions
+ * @return The number of deltas deleted
  */
-static void delete_old_versions(bloom_filtmgr *mgr, unsigned long long min_vsn) {
-    // Get the merged in pending ops, lock to avoid a race
+static int delete_old_versions(bloom_filtmgr *mgr, unsigned long long min_vsn) {
+    // Get the old deltas, lock to avoid a race
     pthread_mutex_lock(&mgr->write_lock);
     filter_list *old = remove_delta_versions(mgr->delta, &mgr->delta, min_vsn);
     pthread_mutex_unlock(&mgr->write_lock);
 
-    // Delete the filters now that we have merged into both trees
+    // Release the memory now that no client can reach it
+    int deleted = 0;
     filter_list *next, *current = old;
     while (current) {
-        if (current->type == DELETE) delete_filter(current->filter);
+        if (current->type == DELETE) {
+            /*
+             * Copy the name, since the delete is not complete until
+             * delete_filter returns. Creates are blocked until then.
+             */
+            char *name = strdup(current->filter->filter->filter_name);
+            delete_filter(mgr, current->filter);
+            clear_pending_delete(mgr, name);
+            free(name);
+        } else {
+            hashmap_free_table(current->table);
+        }
         next = current->next;
         free(current);
         current = next;
+        deleted++;
     }
+    return deleted;
 }
 
 /**
@@ -1013,121 +1833,59 @@ static void delete_old_versions(bloom_filtmgr *mgr, unsigned long long min_vsn)
  * Safety: Always safe
  */
 static unsigned long long client_min_vsn(bloom_filtmgr *mgr) {
-    // Determine the minimum version
-    unsigned long long thread_vsn, min_vsn = mgr->vsn;
+    // Determine the minimum version. The fence pairs with the
+    // checkpoint, so a client is either seen online, or will
+    // see every change made before the current version.
+    unsigned long long thread_vsn, min_vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    LOCK_BLOOM_SPIN(&mgr->clients_lock);
     for (filtmgr_client *cl=mgr->clients; cl != NULL; cl=cl->next) {
-        thread_vsn = cl->vsn;
+        thread_vsn = __atomic_load_n(&cl->vsn, __ATOMIC_SEQ_CST);
         if (thread_vsn < min_vsn) min_vsn = thread_vsn;
     }
+    UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
     return min_vsn;
 }
 
-/**
- * Creates a barrier that is implicit by adding a
- * new version, and waiting for all clients to reach
- * that version. This can be used as a non-locking
- * syncronization mechanism.
- */
-static void version_barrier(bloom_filtmgr *mgr) {
-    // Create a new delta
-    pthread_mutex_lock(&mgr->write_lock);
-    unsigned long long vsn = create_delta_update(mgr, BARRIER, NULL);
-    pthread_mutex_unlock(&mgr->write_lock);
-
-    // Wait until we converge on the version
-    while (mgr->should_run && client_min_vsn(mgr) < vsn)
-        usleep(VACUUM_POLL_USEC);
-}
-
 /**
  * This thread is started after initialization to maintain
  * the state of the filter manager. It's current use is to
  * cleanup the garbage created by our MVCC model. We do this
- * by making use of periodic 'checkpoints'. Our worker threads
- * report the version they are currently using, and we are always
- * able to delete versions that are strictly less than the minimum.
+ * by making use of 'checkpoints'. Our worker threads report
+ * the version they are currently using, and we are always
+ * able to release versions that are less than or equal to the minimum.
  */
 static void* filtmgr_thread_main(void *in) {
     // Extract our arguments
     bloom_filtmgr *mgr = in;
     unsigned long long min_vsn, mgr_vsn;
+    int deleted;
     while (mgr->should_run) {
-        // Do nothing if there is no changes
-        if (mgr->vsn == mgr->primary_vsn) {
-            usleep(VACUUM_POLL_USEC);
-            continue;
-        }
-
-        /*
-         * Because we use a version barrier, we always
-         * end up creating a new version when we try to
-         * apply delta updates. We need to handle the special case
-         * where we are 1 version behind and the only delta is
-         * a barrier. Do this by just updating primary_vsn.
-         */
-        mgr_vsn = mgr->vsn;
-        if ((mgr_vsn - mgr->primary_vsn) == 1) {
-            pthread_mutex_lock(&mgr->write_lock);
-
-            // Ensure no version created in the mean time
-            int should_continue = 0;
-            if (mgr_vsn == mgr->vsn && mgr->delta->type == BARRIER) {
-                mgr->primary_vsn = mgr_vsn;
-                should_continue = 1;
-            }
-
-            // Release the lock and see if we should loop back
-            pthread_mutex_unlock(&mgr->write_lock);
-            if (should_continue) {
-                syslog(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
-                continue;
-            }
-        }
+        // Sleep until there is garbage
+        pthread_mutex_lock(&mgr->vacuum_lock);
+        while (mgr->should_run && !mgr->delta)
+            pthread_cond_wait(&mgr->vacuum_cond, &mgr->vacuum_lock);
+        pthread_mutex_unlock(&mgr->vacuum_lock);
+        if (!mgr->should_run) break;
 
         // Determine the minimum version
+        mgr_vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE);
         min_vsn = client_min_vsn(mgr);
 
         // Warn if there are a lot of outstanding deltas
-        if (mgr->vsn - min_vsn > WARN_THRESHOLD) {
+        if (mgr_vsn - min_vsn > WARN_THRESHOLD) {
             syslog(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
-        } else {
-            syslog(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
+                    min_vsn, mgr_vsn);
         }
 
-        // Merge the old versions into the alternate three
-        merge_old_versions(mgr, mgr->delta, min_vsn);
-
-        /*
-         * Mark any pending deletes so that create does not allow
-         * a filter to be created before we manage to call delete_old_versions.
-         * There is an unforunate race that can happen if a client
-         * does a create/drop/create cycle, where the create/drop are
-         * reflected in the filter_map, and thus the second create is allowed
-         * BEFORE we have had a chance to actually handle the delete.
-         */
-        mark_pending_deletes(mgr, min_vsn);
-
-        // Swap the maps
-        swap_filter_maps(mgr, min_vsn);
-
-        // Wait on a barrier until nobody is using the old tree
-        version_barrier(mgr);
-
-        // Merge the changes into the other tree now that its safe
-        merge_old_versions(mgr, mgr->delta, min_vsn);
-
-        // Both trees have the changes incorporated, safe to delete
-        delete_old_versions(mgr, min_vsn);
-
-        // Clear the pending delete list, since delete_old_versions() will
-        // block untill all deletes are completed.
-        clear_pending_deletes(mgr);
-
-        // Log that we finished
-        syslog(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
-                min_vsn, mgr->vsn);
+        // Release everything no client can see
+        deleted = delete_old_versions(mgr, min_vsn);
+        if (deleted) {
+            syslog(LOG_DEBUG, "Released %d delta updates up to: %llu (vsn: %llu)",
+                    deleted, min_vsn, mgr_vsn);
+        } else {
+            usleep(VACUUM_RETRY_USEC);
+        }
     }
     return NULL;
 }
@@ -1139,10 +1897,6 @@ static void* filtmgr_thread_main(void *in) {
  * but can be used in an embeded or test environment.
  */
 void filtmgr_vacuum(bloom_filtmgr *mgr) {
-    unsigned long long vsn = mgr->vsn;
-    merge_old_versions(mgr, mgr->delta, vsn);
-    swap_filter_maps(mgr, vsn);
-    merge_old_versions(mgr, mgr->delta, vsn);
-    delete_old_versions(mgr, vsn);
+    delete_old_versions(mgr, __atomic_load_n(&mgr->vsn, __ATOMIC_ACQUIRE));
 }
 
@@ -23,6 +23,19 @@ typedef struct {
    bloom_filter_list *tail;
 } bloom_filter_list_head;
 
+/**
+ * A filter that has been resolved by name, so that clients
+ * can cache it and skip the lookup. A handle is only valid
+ * until the filter manager changes, e.g. on a create or drop,
+ * which is checked using filtmgr_handle_valid. Once a client
+ * checkpoints or goes offline, it must check the handle again
+ * before using it.
+ */
+typedef struct {
+    unsigned long long vsn;     // The manager version it was resolved at
+    void *filter;               // The filter, opaque to clients
+} bloom_filter_handle;
+
 /**
  * Initializer
  * @arg config The configuration
@@ -45,11 +58,23 @@ int destroy_filter_manager(bloom_filtmgr *mgr);
  * the vacuum thread to cleanup garbage state. It should also
  * be called before making other calls into the filter manager
  * so that it is aware of a client making use of the current
- * state.
+ * state. This is O(1) once the thread is a client, so it can
+ * be invoked very frequently.
  * @arg mgr The manager
  */
 void filtmgr_client_checkpoint(bloom_filtmgr *mgr);
 
+/**
+ * Should be invoked by clients before they block or
+ * otherwise stop using the filter manager for a while.
+ * The client must not hold any references from the filter
+ * manager, and must checkpoint before using it again.
+ * This allows the vacuum thread to cleanup garbage state
+ * without waiting on idle clients.
+ * @arg mgr The manager
+ */
+void filtmgr_client_offline(bloom_filtmgr *mgr);
+
 /**
  * Should be invoked by clients when they no longer
  * need to make use of the filter manager. This
@@ -89,6 +114,47 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
  */
 int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
 
+/**
+ * Resolves a filter to a handle, which can be cached.
+ * @arg filter_name The name of the filter
+ * @arg handle Output, the resolved handle
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_get_handle(bloom_filtmgr *mgr, char *filter_name, bloom_filter_handle *handle);
+
+/**
+ * Checks if a handle is still valid. This is just a
+ * comparison with the current version.
+ * @arg handle The handle to check
+ * @return 1 if valid, 0 if it must be resolved again.
+ */
+int filtmgr_handle_valid(bloom_filtmgr *mgr, bloom_filter_handle *handle);
+
+/**
+ * Checks for the presence of keys in the filter of a handle.
+ * The handle must be valid.
+ * @arg handle The handle of the filter
+ * @arg keys A list of points to character arrays to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_check_handle_keys(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result);
+
+/**
+ * Sets keys in the filter of a handle. The handle must be valid.
+ * @arg handle The handle of the filter
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_set_handle_keys(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result);
+
 /**
  * Creates a new filter of the given name and parameters.
  * @arg filter_name The name of the filter
@@ -117,6 +183,17 @@ int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name);
  */
 int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Faults a filter into memory ahead of use, and marks it
+ * as hot. This is used to warm the filters that were hot
+ * before a restart, so that the first requests do not
+ * wait on the disk.
+ * @arg filter_name The name of the filter to fault in
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error.
+ */
+int filtmgr_prefault_filter(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Clears the filter from the internal data stores. This can only
  * be performed if the filter is proxied.
@@ -126,6 +203,17 @@ int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name);
  */
 int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Closes the filter and clears it from the internal data stores,
+ * in one step under the lock of the filter, so that a reader cannot
+ * fault it back in between. Used where a clear must not fail
+ * because the filter is in use.
+ * @arg filter_name The name of the filter to clear
+ * @return 0 on success, -1 if the filter does not exist, -2
+ * if the filter is in memory, and so cannot be closed.
+ */
+int filtmgr_close_clear_filter(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Allocates space for and returns a linked
  * list of all the filters. The memory should be free'd by
@@ -137,6 +225,28 @@ int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name);
  */
 int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_head **head);
 
+/**
+ * Used to stream filters from the manager. The filter may
+ * only be used to read metrics, size information, etc.
+ * Return non-zero to stop iterating.
+ */
+typedef int(*filter_iter_cb)(void *data, char *filter_name, bloom_filter *filter);
+
+/**
+ * Streams the filters in order of their names, without building
+ * a list. The callback is invoked with the list lock held, so
+ * it must not call back into the manager, and it should be quick.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg after Only visit the filters after this name, or NULL for all.
+ * The name need not exist, so the last name returned can be used to resume.
+ * @arg cb The callback to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -1 on error, or the return of the
+ * callback if it stopped the iteration.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, char *after, filter_iter_cb cb, void *data);
+
 /**
  * Allocates space for and returns a linked
  * list of all the cold filters. This has the side effect
@@ -148,6 +258,56 @@ int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_hea
  */
 int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head);
 
+/**
+ * Streams the cold filters in batches, without building a list.
+ * Like filtmgr_list_cold_filters, this clears the list of cold filters
+ * as it goes. The iteration can be stopped by the callback and resumed
+ * with the cursor, so that the caller can checkpoint between batches.
+ * @arg mgr The manager to list from
+ * @arg cursor Input/Output. Start with 0. Updated to resume the scan
+ * after the callback stops it, and reset to 0 once the scan is complete.
+ * @arg cb The callback to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 once the scan is complete, or the return
+ * of the callback if it stopped the iteration.
+ */
+int filtmgr_iter_cold_filters(bloom_filtmgr *mgr, unsigned long long *cursor, filter_iter_cb cb, void *data);
+
+/**
+ * Compresses the in-memory filters that have not been used since
+ * the last call. Filters that are in use are skipped, and are
+ * retried on the next call.
+ * @arg mgr The manager
+ * @return The number of filters compressed.
+ */
+int filtmgr_compress_idle_filters(bloom_filtmgr *mgr);
+
+/**
+ * Allocates space for and returns a linked list of the
+ * filters that are in memory, hottest first. Filters used
+ * since the last cold scan come first, and are otherwise
+ * ranked by their number of accesses. In-memory only filters
+ * are skipped, since they can not be faulted in again.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_hot_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head);
+
+/**
+ * Allocates space for and returns a linked list of the
+ * filters that have been set since they were last flushed.
+ * This has the side effect of clearing the dirty set, and
+ * the filters are queued again once they are flushed and set.
+ * A name may be listed even if the filter was since dropped.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_dirty_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head);
+
 /**
  * Convenience method to cleanup a filter list.
  */
@@ -164,6 +324,81 @@ void filtmgr_cleanup_list(bloom_filter_list_head *head);
 typedef void(*filter_cb)(void* in, char *filter_name, bloom_filter *filter);
 int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void* data);
 
+/**
+ * Invokes a callback with a filter faulted in, and locked against
+ * writers. This allows the bitmaps of the filter to be copied, in
+ * a consistent order with the change log.
+ * @arg filter_name The name of the filter
+ * @arg cb The callback, which must not call back into the manager
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if it could not be faulted in.
+ */
+int filtmgr_snapshot_filter(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void* data);
+
+/**
+ * The changes to the filters passed to the change log
+ */
+typedef enum {
+    FILTMGR_CREATE,     // A filter was created
+    FILTMGR_DROP,       // A filter was dropped
+    FILTMGR_CLEAR,      // A filter was cleared
+    FILTMGR_SET         // Keys were added to a filter
+} filtmgr_change;
+
+/**
+ * Invoked with each change to the filters. The changes to a filter
+ * are logged in the order they are applied, while holding the lock
+ * of the filter, so the callback must be quick and must not call
+ * back into the manager. Creates, drops and clears also hold the
+ * write lock of the manager, so they are totally ordered.
+ * @arg data Opaque handle given to filtmgr_set_log
+ * @arg change The type of change
+ * @arg filter_name The name of the filter
+ * @arg config The config of a created filter, NULL otherwise
+ * @arg keys The keys of a set, NULL otherwise
+ * @arg num_keys The number of keys
+ * @arg result The result of the set for each key. Only the keys
+ * that were added are set, the others were already present.
+ */
+typedef void(*filtmgr_log_cb)(void *data, filtmgr_change change, char *filter_name,
+        bloom_filter_config *config, char **keys, int num_keys, char *result);
+
+/**
+ * Sets the change log callback. This must be
+ * invoked before any clients use the manager.
+ * @arg cb The callback, or NULL to disable
+ * @arg data Opaque handle passed to the callback
+ */
+void filtmgr_set_log(bloom_filtmgr *mgr, filtmgr_log_cb cb, void *data);
+
+/**
+ * Checks if a filter is proxied, meaning that it is not
+ * in memory, and must be faulted in from disk on access.
+ * The result is only a hint, since the filter may be
+ * faulted in or out concurrently.
+ * @arg filter_name The name of the filter
+ * @return 1 if proxied, 0 if in memory, -1 if the filter does not exist.
+ */
+int filtmgr_is_proxied(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Returns the total byte size of the filters in memory
+ */
+uint64_t filtmgr_resident_bytes(bloom_filtmgr *mgr);
+
+/**
+ * Returns the byte size of the filters in memory that may be
+ * closed, which is held to the max_resident_bytes limit
+ */
+uint64_t filtmgr_evictable_bytes(bloom_filtmgr *mgr);
+
+/**
+ * Returns the number of filters closed to stay
+ * within the max_resident_bytes limit.
+ */
+uint64_t filtmgr_evictions(bloom_filtmgr *mgr);
+
 /**
  * This method is used to force a vacuum up to the current
  * version. It is generally unsafe to use in bloomd,
@@ -36,6 +36,9 @@ static const int FILT_NOT_PROXIED_LEN = sizeof(FILT_NOT_PROXIED) - 1;
 static const char DELETE_IN_PROGRESS[] = "Delete in progress\n";
 static const int DELETE_IN_PROGRESS_LEN = sizeof(DELETE_IN_PROGRESS) - 1;
 
+static const char READ_ONLY_RESP[] = "Read only replica\n";
+static const int READ_ONLY_RESP_LEN = sizeof(READ_ONLY_RESP) - 1;
+
 static const char DONE_RESP[] = "Done\n";
 static const int DONE_RESP_LEN = sizeof(DONE_RESP) - 1;
 
@@ -76,8 +79,57 @@ typedef enum {
     CLOSE,          // Close a filter
     CLEAR,          // Clears a filter from the internals
     FLUSH,          // Force flush a filter
+    STATS,          // Server wide stats
+    NO_REPLY,       // Toggles no-reply mode for write commands
+    BINARY,         // Switches the connection to the binary protocol
 } conn_cmd_type;
 
+/*
+ * Binary protocol definitions. A request is a fixed size
+ * header followed by a body of body_len bytes. All integers
+ * are in network byte order. The header is:
+ *
+ *  opcode (1 byte) | name_len (1 byte) | reserved (2 bytes) |
+ *  key_count (4 bytes) | body_len (4 bytes)
+ *
+ * The body is the filter name (name_len bytes), followed by
+ * key_count keys, each prefixed by a 2 byte length. If name_len
+ * is 0, the name is replaced by a 4 byte handle returned by an
+ * open request. Responses
+ * are a fixed size header of:
+ *
+ *  status (1 byte) | reserved (3 bytes) | count (4 bytes)
+ *
+ * followed by a bitset of count bits, packed least significant
+ * bit first, which has the per-key result of a check or set.
+ */
+#define BIN_REQ_HEADER_SIZE 12
+#define BIN_RESP_HEADER_SIZE 8
+#define BIN_MAX_BODY_SIZE (64 * 1024 * 1024)
+#define BIN_HANDLE_SIZE 4
+
+typedef enum {
+    BIN_CHECK = 1,  // Check one or more keys
+    BIN_SET,        // Set one or more keys
+    BIN_CREATE,     // Creates a filter with the default config
+    BIN_DROP,       // Drop a filter
+    BIN_CLOSE,      // Close a filter
+    BIN_CLEAR,      // Clears a filter from the internals
+    BIN_FLUSH,      // Force flush a filter
+    BIN_OPEN,       // Returns a handle for a filter as the count
+} bin_opcode;
+
+typedef enum {
+    BIN_OK = 0,                 // Success, includes a bitset for keys
+    BIN_FILT_NOT_EXIST,         // Filter does not exist
+    BIN_EXISTS,                 // Filter already exists
+    BIN_DELETE_IN_PROGRESS,     // Filter is being deleted
+    BIN_FILT_NOT_PROXIED,       // Filter must be closed first
+    BIN_CLIENT_ERR,             // Malformed request, connection is closed
+    BIN_INTERNAL_ERR,           // Internal error
+    BIN_READ_ONLY,              // Writes are rejected by a replica
+} bin_status;
+
 /* Static regexes */
 static regex_t VALID_FILTER_NAMES_RE;
 static const char *VALID_FILTER_NAMES_PATTERN = "^[^ \t\n\r]{1,200}$";
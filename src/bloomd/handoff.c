@@ -0,0 +1,310 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+/**
+ * The request sent by the new process, and
+ * the reply header sent back by the old one.
+ */
+#define HANDOFF_REQUEST 0x51524842  // "BHRQ"
+#define HANDOFF_REPLY 0x464f4842    // "BHOF"
+
+/**
+ * The file descriptors are passed in batches,
+ * to stay within the kernel limit per message.
+ */
+#define FDS_PER_MSG 64
+
+/**
+ * The reply header. It is followed by the file
+ * descriptors, the TCP listeners first, and then
+ * the NUL terminated names of the hot filters.
+ */
+typedef struct {
+    uint32_t magic;
+    int32_t num_tcp;
+    int32_t has_udp;
+    int32_t has_unix;
+    int32_t num_hot;
+    uint32_t names_len;
+} handoff_header;
+
+// Static declarations
+static int write_all(int fd, char *buf, uint64_t len);
+static int read_all(int fd, char *buf, uint64_t len);
+static int send_fds(int fd, int *fds, int num);
+static int recv_fds(int fd, int *fds, int num);
+
+/**
+ * Requests a handoff from a running bloomd listening on
+ * the handoff socket. Once the state is received, this blocks
+ * until the old process has flushed its filters and exited,
+ * since they share the data directory.
+ * @arg path The path of the handoff socket
+ * @arg handoff Output, the received state. Should be freed
+ * with handoff_free.
+ * @return 0 on success, 1 if there is no process to take
+ * over from, and -1 on error.
+ */
+int handoff_request(char *path, bloom_handoff **handoff) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // Nothing to take over if there is no listener
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return 1;
+    }
+
+    syslog(LOG_INFO, "Taking over from the running bloomd at '%s'.", path);
+    if (handoff_recv(fd, handoff)) {
+        close(fd);
+        return -1;
+    }
+
+    // The old process keeps the connection open until it exits
+    char buf[64];
+    ssize_t res;
+    do {
+        res = read(fd, buf, sizeof(buf));
+    } while (res > 0 || (res == -1 && errno == EINTR));
+    close(fd);
+    return 0;
+}
+
+/**
+ * Serves a handoff request on a connected socket. The
+ * request is read and checked before anything is sent.
+ * @arg fd The connection from the new process
+ * @arg handoff The state to send. The file descriptors
+ * remain open in the sending process.
+ * @return 0 on success.
+ */
+int handoff_send(int fd, bloom_handoff *handoff) {
+    // Check the request
+    uint32_t request = 0;
+    if (read_all(fd, (char*)&request, sizeof(request)) || request != HANDOFF_REQUEST) {
+        syslog(LOG_ERR, "Invalid handoff request!");
+        return -1;
+    }
+
+    // Build the header, and the list of descriptors
+    handoff_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_REPLY;
+    header.num_tcp = handoff->num_tcp;
+    header.has_udp = handoff->udp_fd >= 0;
+    header.has_unix = handoff->unix_fd >= 0;
+    header.num_hot = handoff->num_hot;
+    for (int i=0; i < handoff->num_hot; i++) {
+        header.names_len += strlen(handoff->hot_filters[i]) + 1;
+    }
+
+    int num_fds = header.num_tcp + header.has_udp + header.has_unix;
+    int *fds = malloc((num_fds + 1) * sizeof(int));
+    memcpy(fds, handoff->tcp_fds, handoff->num_tcp * sizeof(int));
+    int idx = handoff->num_tcp;
+    if (header.has_udp) fds[idx++] = handoff->udp_fd;
+    if (header.has_unix) fds[idx++] = handoff->unix_fd;
+
+    // Send everything
+    int res = write_all(fd, (char*)&header, sizeof(header));
+    if (!res) res = send_fds(fd, fds, num_fds);
+    for (int i=0; !res && i < handoff->num_hot; i++) {
+        res = write_all(fd, handoff->hot_filters[i], strlen(handoff->hot_filters[i]) + 1);
+    }
+    free(fds);
+    if (res) {
+        syslog(LOG_ERR, "Failed to send the handoff! Err: %s", strerror(errno));
+    }
+    return res;
+}
+
+/**
+ * Sends a handoff request on a connected socket,
+ * and receives the state.
+ * @arg fd The connection to the old process
+ * @arg handoff Output, the received state. Should be freed
+ * with handoff_free.
+ * @return 0 on success.
+ */
+int handoff_recv(int fd, bloom_handoff **handoff) {
+    // Send the request, read the header
+    uint32_t request = HANDOFF_REQUEST;
+    handoff_header header;
+    if (write_all(fd, (char*)&request, sizeof(request)) ||
+            read_all(fd, (char*)&header, sizeof(header))) {
+        syslog(LOG_ERR, "Failed to request the handoff! Err: %s", strerror(errno));
+        return -1;
+    }
+    if (header.magic != HANDOFF_REPLY || header.num_tcp < 0 ||
+            header.num_hot < 0 || header.names_len > INT32_MAX) {
+        syslog(LOG_ERR, "Invalid handoff reply!");
+        return -1;
+    }
+
+    // Receive the descriptors
+    bloom_handoff *h = calloc(1, sizeof(bloom_handoff));
+    int num_fds = header.num_tcp + (header.has_udp != 0) + (header.has_unix != 0);
+    int *fds = calloc(num_fds + 1, sizeof(int));
+    if (recv_fds(fd, fds, num_fds)) {
+        syslog(LOG_ERR, "Failed to receive the handoff listeners!");
+        free(fds);
+        free(h);
+        return -1;
+    }
+    h->num_tcp = header.num_tcp;
+    h->tcp_fds = fds;
+    h->udp_fd = (header.has_udp) ? fds[h->num_tcp] : -1;
+    h->unix_fd = (header.has_unix) ? fds[num_fds - 1] : -1;
+
+    // Receive the hot filters. The listeners are
+    // usable even if this fails, we just start cold.
+    char *names = malloc(header.names_len + 1);
+    names[header.names_len] = '\0';
+    if (read_all(fd, names, header.names_len)) {
+        syslog(LOG_ERR, "Failed to receive the handoff filters!");
+        free(names);
+        *handoff = h;
+        return 0;
+    }
+    h->hot_filters = calloc(header.num_hot + 1, sizeof(char*));
+    char *name = names;
+    while (h->num_hot < header.num_hot && name < names + header.names_len) {
+        h->hot_filters[h->num_hot++] = strdup(name);
+        name += strlen(name) + 1;
+    }
+    free(names);
+
+    *handoff = h;
+    return 0;
+}
+
+/**
+ * Frees the handoff state. Any file descriptors are left
+ * open, since they are adopted by the networking stack.
+ * @arg handoff The state to free
+ */
+void handoff_free(bloom_handoff *handoff) {
+    for (int i=0; i < handoff->num_hot; i++) {
+        free(handoff->hot_filters[i]);
+    }
+    free(handoff->hot_filters);
+    free(handoff->tcp_fds);
+    free(handoff);
+}
+
+/**
+ * Writes the whole buffer, retrying short writes.
+ * @return 0 on success.
+ */
+static int write_all(int fd, char *buf, uint64_t len) {
+    ssize_t res;
+    while (len) {
+        res = write(fd, buf, len);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/**
+ * Reads the whole buffer, retrying short reads.
+ * @return 0 on success, -1 on error or early EOF.
+ */
+static int read_all(int fd, char *buf, uint64_t len) {
+    ssize_t res;
+    while (len) {
+        res = read(fd, buf, len);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/**
+ * Sends file descriptors as SCM_RIGHTS. Each
+ * batch rides along with a single byte of data.
+ * @return 0 on success.
+ */
+static int send_fds(int fd, int *fds, int num) {
+    char cbuf[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+    char byte = 0;
+    while (num > 0) {
+        int batch = (num < FDS_PER_MSG) ? num : FDS_PER_MSG;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, batch * sizeof(int));
+
+        ssize_t res;
+        do {
+            res = sendmsg(fd, &msg, 0);
+        } while (res == -1 && errno == EINTR);
+        if (res != 1) return -1;
+        fds += batch;
+        num -= batch;
+    }
+    return 0;
+}
+
+/**
+ * Receives file descriptors sent by send_fds.
+ * @return 0 on success.
+ */
+static int recv_fds(int fd, int *fds, int num) {
+    char cbuf[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+    char byte;
+    while (num > 0) {
+        int batch = (num < FDS_PER_MSG) ? num : FDS_PER_MSG;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+        ssize_t res;
+        do {
+            res = recvmsg(fd, &msg, 0);
+        } while (res == -1 && errno == EINTR);
+        if (res != 1) return -1;
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+                cmsg->cmsg_len != CMSG_LEN(batch * sizeof(int))) {
+            return -1;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), batch * sizeof(int));
+        fds += batch;
+        num -= batch;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef BLOOM_HANDOFF_H
+#define BLOOM_HANDOFF_H
+
+/**
+ * The state handed from a running bloomd to its
+ * replacement during a restart. The listening sockets are
+ * passed over a Unix domain socket, so that new connections
+ * wait in the kernel backlog instead of being refused,
+ * along with the filters that were hot, so that the new
+ * process can fault them in before taking traffic.
+ */
+typedef struct {
+    int num_tcp;        // Number of TCP listeners
+    int *tcp_fds;       // The TCP listeners
+    int udp_fd;         // The UDP listener, -1 if none
+    int unix_fd;        // The Unix listener, -1 if none
+    int num_hot;        // Number of hot filters
+    char **hot_filters; // The names of the hot filters
+} bloom_handoff;
+
+/**
+ * Requests a handoff from a running bloomd listening on
+ * the handoff socket. Once the state is received, this blocks
+ * until the old process has flushed its filters and exited,
+ * since they share the data directory.
+ * @arg path The path of the handoff socket
+ * @arg handoff Output, the received state. Should be freed
+ * with handoff_free.
+ * @return 0 on success, 1 if there is no process to take
+ * over from, and -1 on error.
+ */
+int handoff_request(char *path, bloom_handoff **handoff);
+
+/**
+ * Serves a handoff request on a connected socket. The
+ * request is read and checked before anything is sent.
+ * @arg fd The connection from the new process
+ * @arg handoff The state to send. The file descriptors
+ * remain open in the sending process.
+ * @return 0 on success.
+ */
+int handoff_send(int fd, bloom_handoff *handoff);
+
+/**
+ * Sends a handoff request on a connected socket,
+ * and receives the state.
+ * @arg fd The connection to the old process
+ * @arg handoff Output, the received state. Should be freed
+ * with handoff_free.
+ * @return 0 on success.
+ */
+int handoff_recv(int fd, bloom_handoff **handoff);
+
+/**
+ * Frees the handoff state. Any file descriptors are left
+ * open, since they are adopted by the networking stack.
+ * @arg handoff The state to free
+ */
+void handoff_free(bloom_handoff *handoff);
+
+#endif
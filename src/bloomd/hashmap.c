@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hashmap.h"
+
+/**
+ * The smallest table we use
+ */
+#define MIN_TABLE_SIZE 16
+
+/**
+ * Marks a slot whose value was deleted. Probing
+ * continues past deleted slots, and they may be re-used
+ * by an insert.
+ */
+#define TOMBSTONE ((void*)1)
+
+/**
+ * Each slot stores the hash of the key, so that most
+ * mismatches can be rejected without comparing keys.
+ * The hash is always written before the value is
+ * published, and read after the value.
+ */
+typedef struct {
+    uint64_t hash;
+    void *value;    // NULL if empty, TOMBSTONE if deleted
+} hashmap_slot;
+
+struct hashmap_table {
+    uint64_t size;      // Number of slots, a power of 2
+    uint64_t count;     // Number of values
+    uint64_t used;      // Number of non-empty slots, including tombstones
+    hashmap_slot slots[];
+};
+
+// Link to the MurmurHash3 implementation
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+/* Static method declarations */
+static uint64_t hash_key(const char *key);
+static hashmap_table* alloc_table(uint64_t size);
+static void resize_table(bloom_hashmap *map, hashmap_table **retired);
+
+/**
+ * Initializes a map
+ * @arg map The map to initialize
+ * @arg initial_size The initial number of slots, rounded up to a power of 2
+ * @arg key_fn Used to get the key of a value
+ * @return 0 on success.
+ */
+int hashmap_init(bloom_hashmap *map, uint64_t initial_size, hashmap_key_fn key_fn) {
+    uint64_t size = MIN_TABLE_SIZE;
+    while (size < initial_size) size <<= 1;
+    map->table = alloc_table(size);
+    map->key_fn = key_fn;
+    return (map->table) ? 0 : -1;
+}
+
+/**
+ * Destroys a map. Does not free the values.
+ * @return 0 on success.
+ */
+int hashmap_destroy(bloom_hashmap *map) {
+    hashmap_free_table(map->table);
+    map->table = NULL;
+    return 0;
+}
+
+/**
+ * Returns the number of values in the map
+ */
+uint64_t hashmap_size(bloom_hashmap *map) {
+    hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Searches for a value. This is lock-free, and safe
+ * to call concurrently with a writer.
+ * @arg map The map
+ * @arg key The key
+ * @return The value, or NULL if not found.
+ */
+void* hashmap_get(bloom_hashmap *map, const char *key) {
+    uint64_t hash = hash_key(key);
+    hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    uint64_t mask = table->size - 1;
+    hashmap_slot *slot;
+    void *value;
+
+    // Probe until we find an empty slot
+    for (uint64_t i=0; i < table->size; i++) {
+        slot = table->slots + ((hash + i) & mask);
+        value = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+        if (!value) return NULL;
+        if (value == TOMBSTONE) continue;
+        if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash &&
+                strcmp(map->key_fn(value), key) == 0)
+            return value;
+    }
+    return NULL;
+}
+
+/**
+ * Inserts a value. Must not be called concurrently with other writes.
+ * @arg map The map
+ * @arg value The value to insert, using the key of the value.
+ * @arg retired Output. Set to the previous table if the map
+ * was resized, NULL otherwise. It must be freed with hashmap_free_table
+ * once no reader can be using it.
+ * @return 0 on success, -1 if the key already exists,
+ * -2 if the table is full and could not be grown.
+ */
+int hashmap_put(bloom_hashmap *map, void *value, hashmap_table **retired) {
+    *retired = NULL;
+    const char *key = map->key_fn(value);
+    if (hashmap_get(map, key)) return -1;
+
+    // Keep the load factor, including tombstones, below 3/4
+    hashmap_table *table = map->table;
+    if ((table->used + 1) * 4 > table->size * 3) {
+        resize_table(map, retired);
+        table = map->table;
+    }
+
+    // Find the first free slot, re-using tombstones
+    uint64_t hash = hash_key(key);
+    uint64_t mask = table->size - 1;
+    hashmap_slot *slot = NULL;
+    for (uint64_t i=0; i < table->size; i++) {
+        slot = table->slots + ((hash + i) & mask);
+        if (!slot->value || slot->value == TOMBSTONE) break;
+    }
+
+    // Only possible if we failed to grow the table
+    if (slot->value && slot->value != TOMBSTONE) return -2;
+    if (!slot->value) table->used++;
+
+    // Publish the value after the hash
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Deletes a value. Must not be called concurrently with other writes.
+ * @arg map The map
+ * @arg key The key to delete
+ * @return The deleted value, or NULL if not found.
+ */
+void* hashmap_delete(bloom_hashmap *map, const char *key) {
+    uint64_t hash = hash_key(key);
+    hashmap_table *table = map->table;
+    uint64_t mask = table->size - 1;
+    hashmap_slot *slot;
+    void *value;
+
+    for (uint64_t i=0; i < table->size; i++) {
+        slot = table->slots + ((hash + i) & mask);
+        value = slot->value;
+        if (!value) return NULL;
+        if (value == TOMBSTONE) continue;
+        if (slot->hash == hash && strcmp(map->key_fn(value), key) == 0) {
+            __atomic_store_n(&slot->value, TOMBSTONE, __ATOMIC_RELEASE);
+            __atomic_store_n(&table->count, table->count - 1, __ATOMIC_RELAXED);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Iterates over all the values in the map, in no particular order.
+ * Safe to call concurrently with a writer, but may or may not see
+ * the concurrent changes.
+ * @arg map The map
+ * @arg cb The callback
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int hashmap_iter(bloom_hashmap *map, hashmap_callback cb, void *data) {
+    hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    void *value;
+    int res;
+    for (uint64_t i=0; i < table->size; i++) {
+        value = __atomic_load_n(&table->slots[i].value, __ATOMIC_ACQUIRE);
+        if (!value || value == TOMBSTONE) continue;
+        res = cb(data, value);
+        if (res) return res;
+    }
+    return 0;
+}
+
+/**
+ * Iterates over the values in the map starting at a cursor,
+ * so that a long scan can be split into several calls.
+ * Safe to call concurrently with a writer. Values may be
+ * missed or repeated if the map is resized between calls.
+ * @arg map The map
+ * @arg cursor Input/Output. Start with 0. If the callback stops
+ * the iteration, this is set to resume after that value,
+ * otherwise it is reset to 0 once the scan is complete.
+ * @arg cb The callback
+ * @arg data Opaque data passed to the callback
+ * @return 0 once the scan is complete, or the return of the callback.
+ */
+int hashmap_iter_from(bloom_hashmap *map, uint64_t *cursor, hashmap_callback cb, void *data) {
+    hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    void *value;
+    int res;
+    for (uint64_t i=*cursor; i < table->size; i++) {
+        value = __atomic_load_n(&table->slots[i].value, __ATOMIC_ACQUIRE);
+        if (!value || value == TOMBSTONE) continue;
+        res = cb(data, value);
+        if (res) {
+            *cursor = i + 1;
+            return res;
+        }
+    }
+    *cursor = 0;
+    return 0;
+}
+
+/**
+ * Frees a table that was retired by a resize
+ */
+void hashmap_free_table(hashmap_table *table) {
+    free(table);
+}
+
+// Hashes a key
+static uint64_t hash_key(const char *key) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, strlen(key), 0, &out);
+    return out[0];
+}
+
+// Allocates an empty table
+static hashmap_table* alloc_table(uint64_t size) {
+    hashmap_table *table = calloc(1, sizeof(hashmap_table) + size * sizeof(hashmap_slot));
+    if (table) table->size = size;
+    return table;
+}
+
+/**
+ * Replaces the table with one sized for twice the current
+ * number of values, which also drops all the tombstones.
+ * The new table is filled before it is published, so readers
+ * see either the old or the new table in full.
+ */
+static void resize_table(bloom_hashmap *map, hashmap_table **retired) {
+    hashmap_table *old = map->table;
+    uint64_t size = MIN_TABLE_SIZE;
+    while (size < (old->count + 1) * 2) size <<= 1;
+    hashmap_table *table = alloc_table(size);
+    if (!table) return;
+
+    // Copy the values, we can re-use the hashes
+    uint64_t mask = size - 1;
+    hashmap_slot *slot;
+    for (uint64_t i=0; i < old->size; i++) {
+        if (!old->slots[i].value || old->slots[i].value == TOMBSTONE) continue;
+        for (uint64_t j=0; j < size; j++) {
+            slot = table->slots + ((old->slots[i].hash + j) & mask);
+            if (!slot->value) {
+                *slot = old->slots[i];
+                break;
+            }
+        }
+    }
+    table->count = old->count;
+    table->used = old->count;
+
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    *retired = old;
+}
@@ -0,0 +1,116 @@
+#ifndef BLOOM_HASHMAP_H
+#define BLOOM_HASHMAP_H
+#include <stdint.h>
+
+/**
+ * Used to get the key of a value stored in the map.
+ * The key must remain valid as long as the value is.
+ */
+typedef const char*(*hashmap_key_fn)(void *value);
+
+/**
+ * Used to iterate over the values in the map.
+ * Return non-zero to stop iterating.
+ */
+typedef int(*hashmap_callback)(void *data, void *value);
+
+/**
+ * A table of slots. Tables are replaced when the map
+ * is resized, and the old table must be kept until
+ * no reader can be using it.
+ */
+typedef struct hashmap_table hashmap_table;
+
+/**
+ * A concurrent hash map keyed by strings, using open addressing
+ * with linear probing. Reads are lock-free and may run concurrently
+ * with a single writer. Writers must be serialized externally.
+ * Only the values are stored; their keys are found using the key
+ * function, so values must outlive any concurrent reader.
+ */
+typedef struct {
+    hashmap_table *table;
+    hashmap_key_fn key_fn;
+} bloom_hashmap;
+
+/**
+ * Initializes a map
+ * @arg map The map to initialize
+ * @arg initial_size The initial number of slots, rounded up to a power of 2
+ * @arg key_fn Used to get the key of a value
+ * @return 0 on success.
+ */
+int hashmap_init(bloom_hashmap *map, uint64_t initial_size, hashmap_key_fn key_fn);
+
+/**
+ * Destroys a map. Does not free the values.
+ * @return 0 on success.
+ */
+int hashmap_destroy(bloom_hashmap *map);
+
+/**
+ * Returns the number of values in the map
+ */
+uint64_t hashmap_size(bloom_hashmap *map);
+
+/**
+ * Searches for a value. This is lock-free, and safe
+ * to call concurrently with a writer.
+ * @arg map The map
+ * @arg key The key
+ * @return The value, or NULL if not found.
+ */
+void* hashmap_get(bloom_hashmap *map, const char *key);
+
+/**
+ * Inserts a value. Must not be called concurrently with other writes.
+ * @arg map The map
+ * @arg value The value to insert, using the key of the value.
+ * @arg retired Output. Set to the previous table if the map
+ * was resized, NULL otherwise. It must be freed with hashmap_free_table
+ * once no reader can be using it.
+ * @return 0 on success, -1 if the key already exists,
+ * -2 if the table is full and could not be grown.
+ */
+int hashmap_put(bloom_hashmap *map, void *value, hashmap_table **retired);
+
+/**
+ * Deletes a value. Must not be called concurrently with other writes.
+ * @arg map The map
+ * @arg key The key to delete
+ * @return The deleted value, or NULL if not found.
+ */
+void* hashmap_delete(bloom_hashmap *map, const char *key);
+
+/**
+ * Iterates over all the values in the map, in no particular order.
+ * Safe to call concurrently with a writer, but may or may not see
+ * the concurrent changes.
+ * @arg map The map
+ * @arg cb The callback
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int hashmap_iter(bloom_hashmap *map, hashmap_callback cb, void *data);
+
+/**
+ * Iterates over the values in the map starting at a cursor,
+ * so that a long scan can be split into several calls.
+ * Safe to call concurrently with a writer. Values may be
+ * missed or repeated if the map is resized between calls.
+ * @arg map The map
+ * @arg cursor Input/Output. Start with 0. If the callback stops
+ * the iteration, this is set to resume after that value,
+ * otherwise it is reset to 0 once the scan is complete.
+ * @arg cb The callback
+ * @arg data Opaque data passed to the callback
+ * @return 0 once the scan is complete, or the return of the callback.
+ */
+int hashmap_iter_from(bloom_hashmap *map, uint64_t *cursor, hashmap_callback cb, void *data);
+
+/**
+ * Frees a table that was retired by a resize
+ */
+void hashmap_free_table(hashmap_table *table);
+
+#endif
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "background.h"
+#include "libbloomd.h"
+
+/**
+ * The longest filter name, matching the protocol
+ */
+#define MAX_NAME_LEN 200
+
+/**
+ * An embedded bloomd
+ */
+struct bloomd {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int should_run;         // Cleared to stop the background threads
+    int flush_on;
+    int unmap_on;
+    int compress_on;
+    pthread_t flush_thread;
+    pthread_t unmap_thread;
+    pthread_t compress_thread;
+};
+
+// Static declarations
+static int valid_name(char *name);
+static int multi_keys(bloomd *db, char *name, char **keys, int num_keys, char *result, int set);
+
+/**
+ * Opens an embedded bloomd, loading the existing filters.
+ * @arg config_file The bloomd configuration file, or NULL for
+ * the defaults. The networking settings are ignored.
+ * @arg flags The background threads to start, see BLOOMD_BACKGROUND.
+ * @arg db Output, the handle. Must be closed with bloomd_close.
+ * @return 0 on success, negative on error.
+ */
+int bloomd_open(char *config_file, int flags, bloomd **db) {
+    bloom_config *config = calloc(1, sizeof(bloom_config));
+    if (config_from_filename(config_file, config) || validate_config(config)) {
+        syslog(LOG_ERR, "Invalid configuration for the embedded bloomd!");
+        free(config);
+        return BLOOMD_ERR_BAD_ARGS;
+    }
+
+    // Load the filters. The manager vacuums in the background,
+    // since our clients go offline between every call.
+    bloom_filtmgr *mgr;
+    if (init_filter_manager(config, 1, &mgr)) {
+        free(config);
+        return BLOOMD_ERR_INTERNAL;
+    }
+
+    bloomd *d = calloc(1, sizeof(bloomd));
+    d->config = config;
+    d->mgr = mgr;
+    d->should_run = 1;
+    if (flags & BLOOMD_FLUSH_THREAD)
+        d->flush_on = start_flush_thread(config, mgr, &d->should_run, &d->flush_thread);
+    if (flags & BLOOMD_UNMAP_THREAD)
+        d->unmap_on = start_cold_unmap_thread(config, mgr, &d->should_run, &d->unmap_thread);
+    if (flags & BLOOMD_COMPRESS_THREAD)
+        d->compress_on = start_compress_thread(config, mgr, &d->should_run, &d->compress_thread);
+
+    *db = d;
+    return BLOOMD_OK;
+}
+
+/**
+ * Stops the background threads, flushes and closes the
+ * filters, and frees the handle. There must be no other
+ * calls using the handle during or after this.
+ * @arg db The handle
+ * @return 0 on success.
+ */
+int bloomd_close(bloomd *db) {
+    db->should_run = 0;
+    if (db->flush_on) pthread_join(db->flush_thread, NULL);
+    if (db->unmap_on) pthread_join(db->unmap_thread, NULL);
+    if (db->compress_on) pthread_join(db->compress_thread, NULL);
+
+    filtmgr_client_leave(db->mgr);
+    destroy_filter_manager(db->mgr);
+    free(db->config);
+    free(db);
+    return BLOOMD_OK;
+}
+
+/**
+ * Creates a new filter, or opens it if it already exists.
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg opts The options for a new filter, NULL for the defaults
+ * @return 0 if created, BLOOMD_ERR_EXISTS if it already existed,
+ * or another negative code on error.
+ */
+int bloomd_create(bloomd *db, char *name, bloomd_filter_opts *opts) {
+    if (!valid_name(name)) return BLOOMD_ERR_BAD_ARGS;
+
+    // Override the defaults, the manager owns the config once created
+    bloom_config *config = NULL;
+    if (opts) {
+        config = malloc(sizeof(bloom_config));
+        memcpy(config, db->config, sizeof(bloom_config));
+        if (opts->capacity) config->initial_capacity = opts->capacity;
+        if (opts->prob) config->default_probability = opts->prob;
+        config->in_memory = opts->in_memory;
+
+        if (sane_initial_capacity(config->initial_capacity) ||
+                sane_default_probability(config->default_probability) ||
+                sane_in_memory(config->in_memory)) {
+            free(config);
+            return BLOOMD_ERR_BAD_ARGS;
+        }
+    }
+
+    filtmgr_client_checkpoint(db->mgr);
+    int res = filtmgr_create_filter(db->mgr, name, config);
+    filtmgr_client_offline(db->mgr);
+    if (res && config) free(config);
+
+    switch (res) {
+        case 0: return BLOOMD_OK;
+        case -1: return BLOOMD_ERR_EXISTS;
+        case -3: return BLOOMD_ERR_DELETE_IN_PROGRESS;
+        default: return BLOOMD_ERR_INTERNAL;
+    }
+}
+
+/**
+ * Checks for a key in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg key The key to check
+ * @return 1 if present, 0 if not, negative on error.
+ */
+int bloomd_check(bloomd *db, char *name, char *key) {
+    char result = 0;
+    int res = multi_keys(db, name, &key, 1, &result, 0);
+    return (res) ? res : result;
+}
+
+/**
+ * Sets a key in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg key The key to set
+ * @return 1 if added, 0 if already present, negative on error.
+ */
+int bloomd_set(bloomd *db, char *name, char *key) {
+    char result = 0;
+    int res = multi_keys(db, name, &key, 1, &result, 1);
+    return (res) ? res : result;
+}
+
+/**
+ * Checks for multiple keys in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output, 1 for each key that is present, 0 otherwise
+ * @return 0 on success, negative on error.
+ */
+int bloomd_multi(bloomd *db, char *name, char **keys, int num_keys, char *result) {
+    return multi_keys(db, name, keys, num_keys, result, 0);
+}
+
+/**
+ * Sets multiple keys in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg keys The keys to set
+ * @arg num_keys The number of keys
+ * @arg result Output, 1 for each key that is added, 0 otherwise
+ * @return 0 on success, negative on error.
+ */
+int bloomd_bulk(bloomd *db, char *name, char **keys, int num_keys, char *result) {
+    return multi_keys(db, name, keys, num_keys, result, 1);
+}
+
+/**
+ * Flushes a filter to disk
+ * @arg db The handle
+ * @arg name The name of the filter, or NULL for all of them
+ * @return 0 on success, negative on error.
+ */
+int bloomd_flush(bloomd *db, char *name) {
+    int res = 0;
+    filtmgr_client_checkpoint(db->mgr);
+    if (name) {
+        res = (filtmgr_flush_filter(db->mgr, name)) ? BLOOMD_ERR_NO_FILTER : BLOOMD_OK;
+
+    } else {
+        // Flush all, ignore errors since
+        // filters might get deleted in the process
+        bloom_filter_list_head *head;
+        if (filtmgr_list_filters(db->mgr, NULL, &head)) {
+            res = BLOOMD_ERR_INTERNAL;
+        } else {
+            for (bloom_filter_list *node = head->head; node; node = node->next) {
+                filtmgr_flush_filter(db->mgr, node->filter_name);
+            }
+            filtmgr_cleanup_list(head);
+        }
+    }
+    filtmgr_client_offline(db->mgr);
+    return res;
+}
+
+/**
+ * Closes a filter, removing it from memory. It remains
+ * on disk, and is faulted back in on the next use.
+ * In-memory filters are left open.
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @return 0 on success, negative on error.
+ */
+int bloomd_close_filter(bloomd *db, char *name) {
+    filtmgr_client_checkpoint(db->mgr);
+    int res = filtmgr_unmap_filter(db->mgr, name);
+    filtmgr_client_offline(db->mgr);
+    return (res) ? BLOOMD_ERR_NO_FILTER : BLOOMD_OK;
+}
+
+/**
+ * Drops a filter, deleting it from disk
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @return 0 on success, negative on error.
+ */
+int bloomd_drop(bloomd *db, char *name) {
+    filtmgr_client_checkpoint(db->mgr);
+    int res = filtmgr_drop_filter(db->mgr, name);
+    filtmgr_client_offline(db->mgr);
+    return (res) ? BLOOMD_ERR_NO_FILTER : BLOOMD_OK;
+}
+
+/**
+ * Checks a filter name, with the same rules as the
+ * protocol, since the name is used for the directory.
+ */
+static int valid_name(char *name) {
+    if (!name) return 0;
+    int len = 0;
+    for (; name[len]; len++) {
+        if (len == MAX_NAME_LEN || strchr(" \t\n\r", name[len])) return 0;
+    }
+    return len > 0;
+}
+
+/**
+ * Checks or sets keys. The calling thread checkpoints before
+ * the call and goes offline after it, so that any thread can
+ * use the handle without blocking the vacuum while it is idle.
+ */
+static int multi_keys(bloomd *db, char *name, char **keys, int num_keys, char *result, int set) {
+    if (num_keys <= 0) return BLOOMD_ERR_BAD_ARGS;
+    filtmgr_client_checkpoint(db->mgr);
+    int res = (set) ? filtmgr_set_keys(db->mgr, name, keys, num_keys, result) :
+                      filtmgr_check_keys(db->mgr, name, keys, num_keys, result);
+    filtmgr_client_offline(db->mgr);
+
+    switch (res) {
+        case 0: return BLOOMD_OK;
+        case -1: return BLOOMD_ERR_NO_FILTER;
+        default: return BLOOMD_ERR_INTERNAL;
+    }
+}
@@ -0,0 +1,149 @@
+#ifndef BLOOM_LIBBLOOMD_H
+#define BLOOM_LIBBLOOMD_H
+#include <stdint.h>
+
+/**
+ * libbloomd embeds the bloomd filter manager in another
+ * process, so that filters can be used without a network
+ * round trip. Filters are stored in the same format as bloomd
+ * uses, so a data directory can be served by either, but
+ * not by both at the same time.
+ *
+ * All the functions are safe to call from any thread. The
+ * threads do not need to register or checkpoint, this is
+ * handled by the library on each call.
+ */
+
+/**
+ * Opaque handle to an embedded bloomd
+ */
+typedef struct bloomd bloomd;
+
+/**
+ * Return codes. Operations return 0 on success, or a
+ * negative code. Check and set return 1 or 0 on success.
+ */
+#define BLOOMD_OK 0
+#define BLOOMD_ERR_NO_FILTER -1         // The filter does not exist
+#define BLOOMD_ERR_EXISTS -2            // The filter already exists
+#define BLOOMD_ERR_DELETE_IN_PROGRESS -3 // The filter is still being deleted
+#define BLOOMD_ERR_BAD_ARGS -4          // Invalid filter name or options
+#define BLOOMD_ERR_INTERNAL -5          // Internal error, see syslog
+
+/**
+ * Flags for bloomd_open, selecting the background
+ * threads to run. Without them, filters are only flushed
+ * by bloomd_flush and bloomd_close, and are never closed
+ * when cold.
+ */
+#define BLOOMD_FLUSH_THREAD 1       // Flush on the flush_interval
+#define BLOOMD_UNMAP_THREAD 2       // Close cold filters on the cold_interval
+#define BLOOMD_COMPRESS_THREAD 4    // Compress idle in-memory filters
+#define BLOOMD_BACKGROUND (BLOOMD_FLUSH_THREAD | BLOOMD_UNMAP_THREAD | BLOOMD_COMPRESS_THREAD)
+
+/**
+ * Options for a new filter. Zero values use the defaults
+ * of the configuration, except for in_memory.
+ */
+typedef struct {
+    uint64_t capacity;      // The initial capacity
+    double prob;            // The false positive probability
+    int in_memory;          // 1 to not persist the filter
+} bloomd_filter_opts;
+
+/**
+ * Opens an embedded bloomd, loading the existing filters.
+ * @arg config_file The bloomd configuration file, or NULL for
+ * the defaults. The networking settings are ignored.
+ * @arg flags The background threads to start, see BLOOMD_BACKGROUND.
+ * @arg db Output, the handle. Must be closed with bloomd_close.
+ * @return 0 on success, negative on error.
+ */
+int bloomd_open(char *config_file, int flags, bloomd **db);
+
+/**
+ * Stops the background threads, flushes and closes the
+ * filters, and frees the handle. There must be no other
+ * calls using the handle during or after this.
+ * @arg db The handle
+ * @return 0 on success.
+ */
+int bloomd_close(bloomd *db);
+
+/**
+ * Creates a new filter, or opens it if it already exists.
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg opts The options for a new filter, NULL for the defaults
+ * @return 0 if created, BLOOMD_ERR_EXISTS if it already existed,
+ * or another negative code on error.
+ */
+int bloomd_create(bloomd *db, char *name, bloomd_filter_opts *opts);
+
+/**
+ * Checks for a key in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg key The key to check
+ * @return 1 if present, 0 if not, negative on error.
+ */
+int bloomd_check(bloomd *db, char *name, char *key);
+
+/**
+ * Sets a key in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg key The key to set
+ * @return 1 if added, 0 if already present, negative on error.
+ */
+int bloomd_set(bloomd *db, char *name, char *key);
+
+/**
+ * Checks for multiple keys in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output, 1 for each key that is present, 0 otherwise
+ * @return 0 on success, negative on error.
+ */
+int bloomd_multi(bloomd *db, char *name, char **keys, int num_keys, char *result);
+
+/**
+ * Sets multiple keys in a filter
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg keys The keys to set
+ * @arg num_keys The number of keys
+ * @arg result Output, 1 for each key that is added, 0 otherwise
+ * @return 0 on success, negative on error.
+ */
+int bloomd_bulk(bloomd *db, char *name, char **keys, int num_keys, char *result);
+
+/**
+ * Flushes a filter to disk
+ * @arg db The handle
+ * @arg name The name of the filter, or NULL for all of them
+ * @return 0 on success, negative on error.
+ */
+int bloomd_flush(bloomd *db, char *name);
+
+/**
+ * Closes a filter, removing it from memory. It remains
+ * on disk, and is faulted back in on the next use.
+ * In-memory filters are left open.
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @return 0 on success, negative on error.
+ */
+int bloomd_close_filter(bloomd *db, char *name);
+
+/**
+ * Drops a filter, deleting it from disk
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @return 0 on success, negative on error.
+ */
+int bloomd_drop(bloomd *db, char *name);
+
+#endif
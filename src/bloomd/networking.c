@@ -7,6 +7,7 @@
 #ifdef __linux__
 #define EV_USE_CLOCK_SYSCALL 0
 #define EV_USE_EPOLL 1
+#define EV_USE_EVENTFD 1
 #endif
 #ifdef __MACH__
 #define EV_USE_KQUEUE 1
@@ -18,14 +19,21 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <limits.h>
 #include <math.h>
 #include <errno.h>
+#include <sched.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 #include "conn_handler.h"
 #include "spinlock.h"
 #include "barrier.h"
@@ -37,6 +45,14 @@
  */
 #define BACKLOG_SIZE 64
 
+/**
+ * Maximum number of connections a worker
+ * accepts from its own listener in a single
+ * event. This drains reconnect storms quickly,
+ * without starving the existing clients.
+ */
+#define ACCEPT_BATCH_SIZE 32
+
 /**
  * How big should the default connection
  * buffer size be. One page seems reasonable
@@ -54,6 +70,14 @@
  */
 #define CONN_BUF_MULTIPLIER 8
 
+/**
+ * While a connection is corked, responses are
+ * accumulated in the output buffer. Once this many
+ * bytes are buffered, we flush early instead of waiting
+ * for the end of the read event, to bound the buffer size.
+ */
+#define CORK_FLUSH_SIZE 65536
+
 
 /**
  * This defines how often we invoke the
@@ -63,6 +87,33 @@
  */
 #define PERIODIC_TIME_SEC 0.25
 
+/**
+ * How long the main loop waits on a stalled
+ * peer while serving a restart handoff.
+ */
+#define HANDOFF_TIMEOUT_SEC 5
+
+/**
+ * The longest the connections are drained after a
+ * handoff. We shutdown once every worker reports that
+ * its in-flight commands are complete, or after this.
+ * New connections wait in the listen backlog meanwhile.
+ */
+#define HANDOFF_DRAIN_SEC 30.0
+
+
+/**
+ * Represents a message sent to a worker thread.
+ * Messages are pushed onto the inbox of the worker,
+ * which is a lock-free stack, and the worker is woken
+ * using an ev_async, which libev implements with an
+ * eventfd where available.
+ */
+typedef struct worker_msg {
+    struct worker_msg *next;
+    char type;          // 'a' accept, 'q' quit, 'j' job, 'r' job result, 'd' drain
+    void *data;
+} worker_msg;
 
 /**
  * Stores the worker thread specific user data.
@@ -71,22 +122,36 @@ typedef struct conn_info conn_info;
 typedef struct {
     bloom_networking *netconf;
     ev_loop *loop;
-    int pipefd[2];
-    ev_io pipe_client;
+    int id;                 // Index of this worker
+    worker_msg *inbox;      // Pending messages, most recent first
+    int notify_pending;     // Set if a wakeup has been sent
+    ev_async notify;
     ev_timer periodic;
+    ev_prepare quiescent;   // Goes offline before the loop blocks
+    ev_check online;        // Checkpoints once the loop wakes
+    ev_io listen_client;    // Used if the worker has its own listener
     int should_run;
+    int draining;           // Close connections once they are idle
+    int drain_reported;     // Set once the main thread knows we are drained
+    int num_parked;         // Connections waiting on a deferred command
+    int num_writing;        // Connections with buffered output
 
     // Used to free inactive connections
     conn_info *inactive;
 } worker_ev_userdata;
 
 /**
- * Represents a simple circular buffer
+ * Represents a simple circular buffer. If the
+ * buffer is mirrored, the same memory is mapped
+ * twice back to back, so that any data in the
+ * buffer can be accessed contiguously starting
+ * at the read cursor, even when it wraps.
  */
 typedef struct {
     int write_cursor;
     int read_cursor;
     uint32_t buf_size;
+    int mirrored;
     char *buffer;
 } circular_buffer;
 
@@ -108,6 +173,12 @@ typedef struct {
  * allows us to minimize copies and latency for most
  * clients, while still supporting the massive bulk
  * loads.
+ *
+ * Additionally, the connection is 'corked' while the
+ * connection handlers run. All the responses generated
+ * by a single read are collected in the output buffer,
+ * and flushed with a single write. This way a pipelining
+ * client does not cost us a syscall per command.
  */
 struct conn_info {
     worker_ev_userdata *thread_ev;
@@ -117,12 +188,30 @@ struct conn_info {
     circular_buffer input;
 
     int use_write_buf;
+    int corked;
     ev_io write_client;
     circular_buffer output;
 
+    bloom_conn_state state;
+    int parked;     // Waiting on a deferred command
+
     struct conn_info *next;
 };
 
+/**
+ * Stores a deferred command. The job is created by the
+ * worker owning the connection, executed by another thread
+ * which captures the responses, and then returned to complete.
+ */
+typedef struct {
+    worker_msg msg;             // Used to send the job, and the result
+    conn_info *conn;            // The parked connection
+    worker_ev_userdata *origin; // The worker owning the connection
+    void *cmd;                  // Opaque command from the handlers
+    int result;                 // Non-zero if the connection should close
+    circular_buffer output;     // The captured responses
+} client_job;
+
 
 /**
  * Defines a structure that is
@@ -137,22 +226,63 @@ struct bloom_networking {
     ev_loop *default_loop;
     ev_io tcp_client;
     ev_io udp_client;
+    ev_io unix_client;
+    int *reuseport_fds; // Per-worker listeners, if use_reuseport
+
+    ev_io handoff_client;   // Serves restart handoffs, if configured
+    int handoff_conn;       // Held open until exit, once handed off
+    int handed_off;         // Set once our listeners are handed off
+    ev_timer drain_timer;   // Bounds the drain after a handoff
+    ev_async drain_notify;  // Signaled as the workers are drained
+    int drained_workers;    // Workers drained after a handoff
+    ev_timer wake_timer;    // Wakes the loop to check should_run
+    int *should_run;        // Cleared to exit after a handoff
 
     barrier_t thread_barrier;
     pthread_t *threads; // Reference to all the workers
     worker_ev_userdata **workers;
     unsigned last_assign;    // Last thread we assigned to
+
+    /*
+     * The I/O pool runs commands that may block on
+     * disk, so that they do not stall the workers.
+     * Jobs are queued under the lock, and the pool
+     * threads wait on the condition.
+     */
+    pthread_t *io_threads;
+    pthread_mutex_t io_lock;
+    pthread_cond_t io_cond;
+    worker_msg *io_head;
+    worker_msg *io_tail;
+    int io_should_run;
 };
 
 
 // Static typedefs
 static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_new_worker_client(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_handoff_request(ev_loop *lp, ev_io *watcher, int ready_events);
 static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events);
 static int read_client_data(conn_info *conn);
-static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_worker_notification(ev_loop *lp, ev_async *watcher, int ready_events);
+static void send_worker_msg(worker_ev_userdata *worker, worker_msg *msg);
+static client_job* park_client_job(conn_info *conn, void *cmd);
+static void execute_client_job(bloom_networking *netconf, int worker_id, client_job *job);
+static int start_io_pool(bloom_networking *netconf);
+static void stop_io_pool(bloom_networking *netconf);
+static void* io_pool_main(void *in);
+static void complete_client_job(worker_ev_userdata *data, client_job *job);
+static void process_client_input(worker_ev_userdata *data, conn_info *conn);
 static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_loop_prepare(ev_loop *lp, ev_prepare *w, int ready_events);
+static void handle_loop_check(ev_loop *lp, ev_check *w, int ready_events);
+static void handle_drain_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_worker_drained(ev_loop *lp, ev_async *watcher, int ready_events);
+static void check_worker_drained(worker_ev_userdata *data);
+static void handle_wake_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static int is_drained(worker_ev_userdata *data, conn_info *conn);
 
 static void close_client_connection(conn_info *conn);
 static void deactivate_client_connection(conn_info *conn);
@@ -160,17 +290,21 @@ static void deactivate_client_connection(conn_info *conn);
 // Helpers for send_client_response
 static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
 static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
+static int flush_client_output(conn_info *conn);
 
 
 // Utility methods
-static int set_client_sockopts(int client_fd);
+static conn_info* accept_client(int listen_fd, int is_unix);
+static int set_client_sockopts(int client_fd, int is_tcp);
 static conn_info* get_conn();
 
 
 // Circular buffer method
 static void circbuf_init(circular_buffer *buf);
+static void circbuf_init_mirrored(circular_buffer *buf);
 static void circbuf_free(circular_buffer *buf);
 static uint64_t circbuf_avail_buf(circular_buffer *buf);
+static uint64_t circbuf_used_buf(circular_buffer *buf);
 static void circbuf_grow_buf(circular_buffer *buf);
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_setup_writev_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
@@ -179,11 +313,12 @@ static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes);
 static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes);
 
 /**
- * Initializes the TCP listener
+ * Creates a bound TCP listening socket
  * @arg netconf The network configuration
- * @return 0 on success.
+ * @arg reuseport Should SO_REUSEPORT be set
+ * @return The listening fd, -1 on error.
  */
-static int setup_tcp_listener(bloom_networking *netconf) {
+static int bind_tcp_listener(bloom_networking *netconf, int reuseport) {
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
@@ -194,7 +329,7 @@ static int setup_tcp_listener(bloom_networking *netconf) {
     int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
     if (ret != 1) {
         syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
-        return 1;
+        return -1;
     }
     addr.sin_addr = bind_addr;
 
@@ -205,32 +340,170 @@ static int setup_tcp_listener(bloom_networking *netconf) {
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(tcp_listener_fd, SOL_SOCKET,
+                SO_REUSEPORT, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+        close(tcp_listener_fd);
+        return -1;
+    }
+#endif
     if (bind(tcp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
     if (listen(tcp_listener_fd, BACKLOG_SIZE) != 0) {
         syslog(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
+        return -1;
+    }
+    return tcp_listener_fd;
+}
+
+/**
+ * Attaches a classic BPF program to a SO_REUSEPORT group,
+ * which steers each new connection to the listener with the
+ * same index as the CPU that received it. Combined with
+ * cpu_affinity, the connection is handled by the worker
+ * that is pinned to that CPU.
+ * @arg fd Any listener in the group
+ * @arg num_listeners The number of listeners in the group
+ * @return 0 on success.
+ */
+static int attach_reuseport_steering(int fd, int num_listeners) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },    // A = CPU
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_listeners },             // A %= listeners
+        { BPF_RET | BPF_A, 0, 0, 0 },                                   // Return A
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+        syslog(LOG_WARNING, "Failed to attach SO_REUSEPORT steering! Err: %s", strerror(errno));
         return 1;
     }
+    return 0;
+#else
+    (void)fd;
+    (void)num_listeners;
+    syslog(LOG_WARNING, "SO_REUSEPORT steering is not supported on this platform.");
+    return 1;
+#endif
+}
 
-    // Create the libev objects
-    ev_io_init(&netconf->tcp_client, handle_new_client,
-                tcp_listener_fd, EV_READ);
-    ev_io_start(netconf->default_loop, &netconf->tcp_client);
+/**
+ * Checks if a handed off listener is bound to the
+ * configured port, and may be adopted.
+ * @arg fd The listener
+ * @arg port The configured port
+ * @return 1 if it matches.
+ */
+static int listener_matches(int fd, int port) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &addr_len)) return 0;
+    return addr.sin_family == AF_INET && ntohs(addr.sin_port) == port;
+}
+
+/**
+ * Initializes the TCP listener. If use_reuseport is set,
+ * a listener is created for each of the workers, which
+ * then accept connections directly. Otherwise the main
+ * loop accepts and dispatches the connections.
+ * @arg netconf The network configuration
+ * @arg handoff The handed off state, or NULL. Its listeners
+ * are adopted if they match, and closed otherwise.
+ * @return 0 on success.
+ */
+static int setup_tcp_listener(bloom_networking *netconf, bloom_handoff *handoff) {
+    // Adopt the handed off listeners if they match. The
+    // connections queued on them are then not lost.
+    int num = (netconf->config->use_reuseport) ? netconf->config->worker_threads : 1;
+    int *inherited = NULL;
+    if (handoff && handoff->num_tcp) {
+        int matches = (handoff->num_tcp == num);
+        for (int i=0; matches && i < num; i++) {
+            matches = listener_matches(handoff->tcp_fds[i], netconf->config->tcp_port);
+        }
+        if (matches) {
+            inherited = handoff->tcp_fds;
+        } else {
+            syslog(LOG_WARNING, "Handed off TCP listeners do not match the configuration!");
+            for (int i=0; i < handoff->num_tcp; i++) close(handoff->tcp_fds[i]);
+        }
+    }
+
+    if (!netconf->config->use_reuseport) {
+        int tcp_listener_fd = (inherited) ? inherited[0] : bind_tcp_listener(netconf, 0);
+        if (tcp_listener_fd < 0) return 1;
+
+        // Create the libev objects
+        ev_io_init(&netconf->tcp_client, handle_new_client,
+                    tcp_listener_fd, EV_READ);
+        ev_io_start(netconf->default_loop, &netconf->tcp_client);
+        return 0;
+    }
+
+    // Create a non-blocking listener per worker
+    netconf->reuseport_fds = calloc(num, sizeof(int));
+    for (int i=0; i < num; i++) {
+        int fd = (inherited) ? inherited[i] : bind_tcp_listener(netconf, 1);
+        if (fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK)) {
+            if (fd >= 0) close(fd);
+            for (int j=0; j < i; j++) close(netconf->reuseport_fds[j]);
+            free(netconf->reuseport_fds);
+            netconf->reuseport_fds = NULL;
+            return 1;
+        }
+        netconf->reuseport_fds[i] = fd;
+    }
+
+    // Steer connections by CPU if the workers are pinned
+    if (netconf->config->cpu_affinity) {
+        attach_reuseport_steering(netconf->reuseport_fds[0], num);
+    }
     return 0;
 }
 
+/**
+ * Closes the TCP listeners
+ * @arg netconf The network configuration
+ */
+static void close_tcp_listeners(bloom_networking *netconf) {
+    if (netconf->reuseport_fds) {
+        for (int i=0; i < netconf->config->worker_threads; i++) {
+            close(netconf->reuseport_fds[i]);
+        }
+        free(netconf->reuseport_fds);
+        netconf->reuseport_fds = NULL;
+    } else {
+        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
+        close(netconf->tcp_client.fd);
+    }
+}
+
 /**
  * Initializes the UDP Listener.
  * @arg netconf The network configuration
+ * @arg handoff The handed off state, or NULL
  * @return 0 on success.
  */
-static int setup_udp_listener(bloom_networking *netconf) {
+static int setup_udp_listener(bloom_networking *netconf, bloom_handoff *handoff) {
+    // Adopt the handed off listener if it matches
+    if (handoff && handoff->udp_fd >= 0) {
+        if (listener_matches(handoff->udp_fd, netconf->config->udp_port)) {
+            ev_io_init(&netconf->udp_client, handle_new_udp_mesg,
+                        handoff->udp_fd, EV_READ);
+            ev_io_start(netconf->default_loop, &netconf->udp_client);
+            return 0;
+        }
+        syslog(LOG_WARNING, "Handed off UDP listener does not match the configuration!");
+        close(handoff->udp_fd);
+    }
+
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
@@ -267,19 +540,174 @@ static int setup_udp_listener(bloom_networking *netconf) {
     return 0;
 }
 
+/**
+ * Removes a stale socket file left at a path, so that it
+ * can be bound again. Anything other than a socket is left
+ * alone, so that a mistyped path does not delete a file.
+ * @arg path The path of the socket
+ * @return 0 if the path is free to bind.
+ */
+static int remove_stale_socket(char *path) {
+    struct stat st;
+    if (lstat(path, &st)) {
+        if (errno == ENOENT) return 0;
+        syslog(LOG_ERR, "Failed to stat socket path '%s'! Err: %s", path, strerror(errno));
+        return 1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        syslog(LOG_ERR, "Refusing to replace '%s', which is not a socket!", path);
+        return 1;
+    }
+    if (unlink(path)) {
+        syslog(LOG_ERR, "Failed to remove stale socket '%s'! Err: %s", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Initializes the Unix domain socket listener, if
+ * a socket path is configured. A stale socket at the
+ * path is removed first, but any other file is an error.
+ * @arg netconf The network configuration
+ * @arg handoff The handed off state, or NULL
+ * @return 0 on success.
+ */
+static int setup_unix_listener(bloom_networking *netconf, bloom_handoff *handoff) {
+    struct sockaddr_un addr;
+
+    // Adopt the handed off listener if it has our path.
+    // Otherwise it is stale, and is removed.
+    if (handoff && handoff->unix_fd >= 0) {
+        socklen_t addr_len = sizeof(addr);
+        bzero(&addr, sizeof(addr));
+        getsockname(handoff->unix_fd, (struct sockaddr*)&addr, &addr_len);
+        if (netconf->config->unix_socket && !strcmp(addr.sun_path, netconf->config->unix_socket)) {
+            ev_io_init(&netconf->unix_client, handle_new_client,
+                        handoff->unix_fd, EV_READ);
+            ev_io_start(netconf->default_loop, &netconf->unix_client);
+            return 0;
+        }
+        if (addr.sun_path[0]) unlink(addr.sun_path);
+        close(handoff->unix_fd);
+    }
+    if (!netconf->config->unix_socket) return 0;
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, netconf->config->unix_socket, sizeof(addr.sun_path) - 1);
+
+    // Make the socket, bind and listen
+    if (remove_stale_socket(netconf->config->unix_socket)) return 1;
+    int unix_listener_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_listener_fd < 0) {
+        syslog(LOG_ERR, "Failed to create unix socket! Err: %s", strerror(errno));
+        return 1;
+    }
+    if (bind(unix_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on unix socket '%s'! Err: %s",
+                netconf->config->unix_socket, strerror(errno));
+        close(unix_listener_fd);
+        return 1;
+    }
+    if (listen(unix_listener_fd, BACKLOG_SIZE) != 0) {
+        syslog(LOG_ERR, "Failed to listen on unix socket! Err: %s", strerror(errno));
+        close(unix_listener_fd);
+        unlink(netconf->config->unix_socket);
+        return 1;
+    }
+
+    // Create the libev objects
+    ev_io_init(&netconf->unix_client, handle_new_client,
+                unix_listener_fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->unix_client);
+    return 0;
+}
+
+/**
+ * Closes the Unix domain socket listener, and
+ * removes the socket file, unless it was handed off.
+ * @arg netconf The network configuration
+ */
+static void close_unix_listener(bloom_networking *netconf) {
+    if (!netconf->config->unix_socket) return;
+    ev_io_stop(netconf->default_loop, &netconf->unix_client);
+    close(netconf->unix_client.fd);
+    if (!netconf->handed_off) unlink(netconf->config->unix_socket);
+}
+
+/**
+ * Initializes the listener that serves restart handoffs,
+ * if a handoff socket is configured. A new process connects
+ * to it to take over our listeners. A stale socket at the
+ * path is removed first, but any other file is an error.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_handoff_listener(bloom_networking *netconf) {
+    if (!netconf->config->handoff_socket) return 0;
+
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, netconf->config->handoff_socket, sizeof(addr.sun_path) - 1);
+
+    // Make the socket, bind and listen
+    if (remove_stale_socket(netconf->config->handoff_socket)) return 1;
+    int handoff_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (handoff_fd < 0) {
+        syslog(LOG_ERR, "Failed to create handoff socket! Err: %s", strerror(errno));
+        return 1;
+    }
+    if (bind(handoff_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on handoff socket '%s'! Err: %s",
+                netconf->config->handoff_socket, strerror(errno));
+        close(handoff_fd);
+        return 1;
+    }
+    if (listen(handoff_fd, 1) != 0) {
+        syslog(LOG_ERR, "Failed to listen on handoff socket! Err: %s", strerror(errno));
+        close(handoff_fd);
+        unlink(netconf->config->handoff_socket);
+        return 1;
+    }
+
+    // Create the libev objects
+    ev_io_init(&netconf->handoff_client, handle_handoff_request,
+                handoff_fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->handoff_client);
+    return 0;
+}
+
+/**
+ * Closes the handoff listener, and removes the socket
+ * file. This is done once a handoff is served, since
+ * only one process can take over.
+ * @arg netconf The network configuration
+ */
+static void close_handoff_listener(bloom_networking *netconf) {
+    if (!ev_is_active(&netconf->handoff_client)) return;
+    ev_io_stop(netconf->default_loop, &netconf->handoff_client);
+    close(netconf->handoff_client.fd);
+    unlink(netconf->config->handoff_socket);
+}
+
 /**
  * Initializes the networking interfaces
  * @arg config Takes the bloom server configuration
  * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg handoff The state handed off by a previous process, or NULL.
+ * Its listeners are adopted if they match the configuration.
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out) {
+int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_handoff *handoff, bloom_networking **netconf_out) {
     // Make the netconf structure
     bloom_networking *netconf = calloc(1, sizeof(struct bloom_networking));
 
     // Initialize
     netconf->config = config;
     netconf->mgr = mgr;
+    netconf->handoff_conn = -1;
     netconf->workers = calloc(config->worker_threads, sizeof(worker_ev_userdata*));
     if (!netconf->workers) {
         free(netconf);
@@ -313,17 +741,49 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
     }
 
     // Setup the TCP listener
-    int res = setup_tcp_listener(netconf);
+    int res = setup_tcp_listener(netconf, handoff);
     if (res != 0) {
         free(netconf);
         return 1;
     }
 
     // Setup the UDP listener
-    res = setup_udp_listener(netconf);
+    res = setup_udp_listener(netconf, handoff);
     if (res != 0) {
-        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-        close(netconf->tcp_client.fd);
+        close_tcp_listeners(netconf);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the Unix listener
+    res = setup_unix_listener(netconf, handoff);
+    if (res != 0) {
+        close_tcp_listeners(netconf);
+        ev_io_stop(netconf->default_loop, &netconf->udp_client);
+        close(netconf->udp_client.fd);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the handoff listener
+    res = setup_handoff_listener(netconf);
+    if (res != 0) {
+        close_tcp_listeners(netconf);
+        ev_io_stop(netconf->default_loop, &netconf->udp_client);
+        close(netconf->udp_client.fd);
+        close_unix_listener(netconf);
+        free(netconf);
+        return 1;
+    }
+
+    // Start the I/O pool
+    res = start_io_pool(netconf);
+    if (res != 0) {
+        close_tcp_listeners(netconf);
+        ev_io_stop(netconf->default_loop, &netconf->udp_client);
+        close(netconf->udp_client.fd);
+        close_unix_listener(netconf);
+        close_handoff_listener(netconf);
         free(netconf);
         return 1;
     }
@@ -338,36 +798,40 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
 
 
 /**
- * Invoked when a TCP listening socket fd is ready
- * to accept a new client. Accepts the client, initializes
- * the connection buffers, and prepares to start listening
- * for client data
+ * Accepts a new client, and initializes the
+ * connection buffers.
+ * @arg listen_fd The listening socket
+ * @arg is_unix Is this a Unix domain socket
+ * @return A new connection, or NULL on error.
  */
-static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // Get the network configuration
-    bloom_networking *netconf = ev_userdata(lp);
-
+static conn_info* accept_client(int listen_fd, int is_unix) {
     // Accept the client connection
     struct sockaddr_in client_addr;
     int client_addr_len = sizeof(client_addr);
-    int client_fd = accept(watcher->fd,
-                        (struct sockaddr*)&client_addr,
-                        &client_addr_len);
+    int client_fd = accept(listen_fd,
+                        (is_unix) ? NULL : (struct sockaddr*)&client_addr,
+                        (is_unix) ? NULL : &client_addr_len);
 
     // Check for an error
     if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
-        return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
+        }
+        return NULL;
     }
 
     // Setup the socket
-    if (set_client_sockopts(client_fd)) {
-        return;
+    if (set_client_sockopts(client_fd, !is_unix)) {
+        return NULL;
     }
 
     // Debug info
-    syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
-            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+    if (is_unix) {
+        syslog(LOG_DEBUG, "Accepted unix client connection [%d]", client_fd);
+    } else {
+        syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
+                inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+    }
 
     // Get the associated conn object
     conn_info *conn = get_conn();
@@ -375,14 +839,55 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     // Initialize the libev stuff
     ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
     ev_io_init(&conn->write_client, handle_client_writebuf, client_fd, EV_WRITE);
+    return conn;
+}
+
+
+/**
+ * Invoked when a TCP listening socket fd is ready
+ * to accept a new client. Accepts the client, initializes
+ * the connection buffers, and prepares to start listening
+ * for client data
+ */
+static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the network configuration
+    bloom_networking *netconf = ev_userdata(lp);
+
+    // Accept the client connection
+    conn_info *conn = accept_client(watcher->fd, watcher == &netconf->unix_client);
+    if (!conn) return;
 
     // Dispatch this client to a worker thread
     int next_thread = netconf->last_assign++ % netconf->config->worker_threads;
     worker_ev_userdata *data = netconf->workers[next_thread];
 
     // Sent accept along with the connection
-    write(data->pipefd[1], "a", 1);
-    write(data->pipefd[1], &conn, sizeof(conn_info*));
+    worker_msg *msg = malloc(sizeof(worker_msg));
+    msg->type = 'a';
+    msg->data = conn;
+    send_worker_msg(data, msg);
+}
+
+
+/**
+ * Invoked when the listening socket owned by a worker
+ * is ready to accept new clients. The clients are
+ * scheduled directly on the worker thread.
+ */
+static void handle_new_worker_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+
+    // Accept a batch of clients
+    conn_info *conn;
+    for (int i=0; i < ACCEPT_BATCH_SIZE; i++) {
+        conn = accept_client(watcher->fd, 0);
+        if (!conn) break;
+
+        // Schedule this connection on this thread
+        conn->thread_ev = data;
+        ev_io_start(lp, &conn->client);
+    }
 }
 
 
@@ -395,6 +900,140 @@ static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
 }
 
 
+/**
+ * Collects the names of the filters that are in memory.
+ * These are warmed by the new process after a handoff.
+ * In-memory only filters are skipped, since they do
+ * not survive the restart anyways.
+ */
+static int collect_hot_filter(void *data, char *filter_name, bloom_filter *filter) {
+    bloom_handoff *h = data;
+    if (bloomf_is_proxied(filter) || filter->filter_config.in_memory) return 0;
+    if (!(h->num_hot % 64)) {
+        h->hot_filters = realloc(h->hot_filters, (h->num_hot + 64) * sizeof(char*));
+    }
+    h->hot_filters[h->num_hot++] = strdup(filter_name);
+    return 0;
+}
+
+
+/**
+ * Invoked when a new process connects to the handoff socket
+ * to take over. We pass it our listeners along with the hot
+ * filters, and then stop accepting. Connections arriving after
+ * this are queued on the listeners until the new process is
+ * ready. The open connections are closed as they go idle, and
+ * we then shutdown, which flushes the filters. The handoff
+ * connection is held open until we exit, which tells the new
+ * process that the data is safe.
+ */
+static void handle_handoff_request(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the network configuration
+    bloom_networking *netconf = ev_userdata(lp);
+
+    // Accept the new process
+    int fd = accept(watcher->fd, NULL, NULL);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to accept() handoff connection! %s.", strerror(errno));
+        return;
+    }
+
+    // Do not let a stalled peer block the main loop
+    struct timeval timeout = {HANDOFF_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Gather our listeners
+    bloom_handoff h;
+    bzero(&h, sizeof(h));
+    if (netconf->reuseport_fds) {
+        h.num_tcp = netconf->config->worker_threads;
+        h.tcp_fds = netconf->reuseport_fds;
+    } else {
+        h.num_tcp = 1;
+        h.tcp_fds = &netconf->tcp_client.fd;
+    }
+    h.udp_fd = netconf->udp_client.fd;
+    h.unix_fd = (netconf->config->unix_socket) ? netconf->unix_client.fd : -1;
+
+    // Gather the hot filters
+    filtmgr_client_checkpoint(netconf->mgr);
+    filtmgr_iter_filters(netconf->mgr, NULL, NULL, collect_hot_filter, &h);
+    filtmgr_client_leave(netconf->mgr);
+
+    // Send everything, keep serving if that fails
+    int res = handoff_send(fd, &h);
+    for (int i=0; i < h.num_hot; i++) free(h.hot_filters[i]);
+    free(h.hot_filters);
+    if (res) {
+        close(fd);
+        return;
+    }
+    syslog(LOG_INFO, "Handed off %d listeners and %d hot filters. Exiting...",
+            h.num_tcp + (h.unix_fd >= 0) + 1, h.num_hot);
+
+    // Stop accepting, the workers stop at shutdown
+    if (!netconf->reuseport_fds) ev_io_stop(lp, &netconf->tcp_client);
+    ev_io_stop(lp, &netconf->udp_client);
+    if (netconf->config->unix_socket) ev_io_stop(lp, &netconf->unix_client);
+    close_handoff_listener(netconf);
+
+    netconf->handed_off = 1;
+    netconf->handoff_conn = fd;
+
+    // Let the workers finish the in-flight commands,
+    // and shutdown once they all report they are drained
+    ev_async_init(&netconf->drain_notify, handle_worker_drained);
+    ev_async_start(lp, &netconf->drain_notify);
+    for (int i=0; i < netconf->config->worker_threads; i++) {
+        worker_msg *msg = malloc(sizeof(worker_msg));
+        msg->type = 'd';
+        msg->data = NULL;
+        send_worker_msg(netconf->workers[i], msg);
+    }
+    ev_timer_init(&netconf->drain_timer, handle_drain_timeout, HANDOFF_DRAIN_SEC, 0);
+    ev_timer_start(lp, &netconf->drain_timer);
+}
+
+
+/**
+ * Invoked as the workers report that they are drained
+ * after a handoff. Once they all have, any connections
+ * still open are idle, and are closed as we shutdown.
+ */
+static void handle_worker_drained(ev_loop *lp, ev_async *watcher, int ready_events) {
+    bloom_networking *netconf = ev_userdata(lp);
+    int drained = __atomic_load_n(&netconf->drained_workers, __ATOMIC_SEQ_CST);
+    if (drained < netconf->config->worker_threads) return;
+    syslog(LOG_INFO, "Connections drained after handoff.");
+    ev_timer_stop(lp, &netconf->drain_timer);
+    ev_async_stop(lp, watcher);
+    *netconf->should_run = 0;
+}
+
+
+/**
+ * Invoked if the workers are not drained in time
+ * after a handoff. We shutdown anyways, closing
+ * the connections with commands still in-flight.
+ */
+static void handle_drain_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    bloom_networking *netconf = ev_userdata(lp);
+    syslog(LOG_WARNING, "Timed out draining connections after handoff!");
+    ev_async_stop(lp, &netconf->drain_notify);
+    *netconf->should_run = 0;
+}
+
+
+/**
+ * Invoked periodically on the main loop. Nothing to do, but
+ * returning lets us notice should_run being cleared by
+ * another thread, such as when replication is lost.
+ */
+static void handle_wake_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+}
+
+
 /**
  * Invoked when a client connection has data ready to be read.
  * We need to take care to add the data to our buffers, and then
@@ -464,7 +1103,13 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
         // This is done when the buffer size is 0.
         if (conn->output.read_cursor == conn->output.write_cursor) {
             conn->use_write_buf = 0;
+            conn->thread_ev->num_writing--;
             ev_io_stop(lp, &conn->write_client);
+            if (is_drained(ev_userdata(lp), conn)) {
+                deactivate_client_connection(conn);
+                return;
+            }
+            check_worker_drained(conn->thread_ev);
         }
     }
 
@@ -498,55 +1143,386 @@ static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events)
         return;
     }
 
+    // Invoke the connection handlers
+    process_client_input(data, conn);
+}
+
+
+/**
+ * Invokes the connection handlers on all the buffered
+ * input of a connection. If the handlers defer a command,
+ * the connection is parked, and the remaining input is
+ * processed once the command completes.
+ */
+static void process_client_input(worker_ev_userdata *data, conn_info *conn) {
     // Prepare to invoke the handler
     bloom_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
     handle.conn = conn;
+    handle.state = &conn->state;
+    handle.worker_id = data->id;
+
+    // Cork the connection so the responses are batched
+    conn->corked = 1;
+    int res = handle_client_connect(&handle);
+
+    // Uncork, and send all the responses at once. This is
+    // done even if the handler fails, so the client gets the error.
+    conn->corked = 0;
+    if (conn->active && !conn->use_write_buf && flush_client_output(conn))
+        res = 1;
 
     // Reschedule the watcher, unless it's non-active now
-    if (handle_client_connect(&handle))
-        deactivate_client_connection(conn);
+    if (res || is_drained(data, conn)) deactivate_client_connection(conn);
+}
+
+
+/**
+ * Checks if a connection can be closed while draining.
+ * This is once the in-flight commands are complete, and
+ * the responses are sent, so the client sees a clean close.
+ */
+static int is_drained(worker_ev_userdata *data, conn_info *conn) {
+    return data->draining && conn->active && !conn->parked &&
+        !conn->use_write_buf && !circbuf_used_buf(&conn->input);
 }
 
 
 /**
- * Invoked to handle async notifications via the thread pipes
+ * Reports to the main thread once a draining worker has no
+ * deferred commands in-flight, and no output left to send.
+ * Must be invoked on the worker thread.
  */
-static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events) {
+static void check_worker_drained(worker_ev_userdata *data) {
+    if (!data->draining || data->drain_reported) return;
+    if (data->num_parked || data->num_writing) return;
+    data->drain_reported = 1;
+    bloom_networking *netconf = data->netconf;
+    __atomic_add_fetch(&netconf->drained_workers, 1, __ATOMIC_SEQ_CST);
+    ev_async_send(netconf->default_loop, &netconf->drain_notify);
+}
+
+
+/**
+ * Sends a message to a worker thread. This is safe
+ * to call from any thread. The worker is only woken
+ * if a wakeup is not already pending.
+ */
+static void send_worker_msg(worker_ev_userdata *worker, worker_msg *msg) {
+    // Push onto the inbox
+    worker_msg *head = __atomic_load_n(&worker->inbox, __ATOMIC_SEQ_CST);
+    do {
+        msg->next = head;
+    } while (!__atomic_compare_exchange_n(&worker->inbox, &head, msg, 1,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    // Wake the worker
+    if (!__atomic_exchange_n(&worker->notify_pending, 1, __ATOMIC_SEQ_CST)) {
+        ev_async_send(worker->loop, &worker->notify);
+    }
+}
+
+
+/**
+ * Invoked to handle async notifications sent to the worker
+ */
+static void handle_worker_notification(ev_loop *lp, ev_async *watcher, int ready_events) {
     // Get the user data
     worker_ev_userdata *data = ev_userdata(lp);
 
-    // Attempt to read a single character from the pipe
-    char cmd;
-    if (read(data->pipefd[0], &cmd, 1) != 1)
-        return;
+    // Take all the messages. The pending flag is cleared
+    // first so that any later message causes a new wakeup.
+    __atomic_store_n(&data->notify_pending, 0, __ATOMIC_SEQ_CST);
+    worker_msg *msg = __atomic_exchange_n(&data->inbox, NULL, __ATOMIC_SEQ_CST);
+
+    // Reverse the messages, so we handle them in order
+    worker_msg *ordered = NULL, *next;
+    while (msg) {
+        next = msg->next;
+        msg->next = ordered;
+        ordered = msg;
+        msg = next;
+    }
 
-    // Handle the command
+    // Handle the commands
     conn_info *conn;
-    switch (cmd) {
-        // Accept new connection
-        case 'a':
-            // Read the address of conn from the pipe
-            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
-                perror("Failed to read from async pipe");
-                return;
+    while (ordered) {
+        msg = ordered;
+        ordered = msg->next;
+        switch (msg->type) {
+            // Accept new connection
+            case 'a':
+                // Schedule this connection on this thread
+                conn = msg->data;
+                conn->thread_ev = data;
+                ev_io_start(data->loop, &conn->client);
+                free(msg);
+                break;
+
+            // Run a deferred command
+            case 'j':
+                execute_client_job(data->netconf, data->id, msg->data);
+                break;
+
+            // Complete a deferred command
+            case 'r':
+                complete_client_job(data, msg->data);
+                break;
+
+            // Drain after a handoff
+            case 'd':
+                data->draining = 1;
+                if (data->netconf->reuseport_fds) ev_io_stop(lp, &data->listen_client);
+                free(msg);
+                check_worker_drained(data);
+                break;
+
+            // Quit
+            case 'q':
+                data->should_run = 0;
+                ev_break(lp, EVBREAK_ALL);
+                free(msg);
+                break;
+
+            default:
+                syslog(LOG_WARNING, "Received unknown comand: %c", msg->type);
+                free(msg);
+        }
+    }
+}
+
+
+/**
+ * Defers a command to another worker. The connection is
+ * parked, meaning no more input is read or processed
+ * until the command completes.
+ * @arg conn The client connection
+ * @arg worker The index of the worker to run the command
+ * @arg cmd Opaque command, passed to handle_deferred_command
+ * @return 0 on success.
+ */
+int defer_client_command(bloom_conn_info *conn, int worker, void *cmd) {
+    client_job *job = park_client_job(conn, cmd);
+    send_worker_msg(job->origin->netconf->workers[worker], &job->msg);
+    return 0;
+}
+
+
+/**
+ * Defers a command that may block on disk to the I/O pool.
+ * The connection is parked just as with defer_client_command,
+ * while the other connections on the worker continue to
+ * be served.
+ * @arg conn The client connection
+ * @arg cmd Opaque command, passed to handle_deferred_command
+ * @return 0 on success.
+ */
+int defer_client_io(bloom_conn_info *conn, void *cmd) {
+    client_job *job = park_client_job(conn, cmd);
+    bloom_networking *netconf = job->origin->netconf;
+
+    // Queue the job, and wake a pool thread
+    pthread_mutex_lock(&netconf->io_lock);
+    job->msg.next = NULL;
+    if (netconf->io_tail)
+        netconf->io_tail->next = &job->msg;
+    else
+        netconf->io_head = &job->msg;
+    netconf->io_tail = &job->msg;
+    pthread_cond_signal(&netconf->io_cond);
+    pthread_mutex_unlock(&netconf->io_lock);
+    return 0;
+}
+
+
+/**
+ * Creates a job for a deferred command, and parks
+ * the connection until the job completes.
+ */
+static client_job* park_client_job(conn_info *conn, void *cmd) {
+    worker_ev_userdata *data = conn->thread_ev;
+    client_job *job = calloc(1, sizeof(client_job));
+    job->conn = conn;
+    job->origin = data;
+    job->cmd = cmd;
+    job->msg.type = 'j';
+    job->msg.data = job;
+
+    // Park the connection
+    conn->parked = 1;
+    data->num_parked++;
+    ev_io_stop(data->loop, &conn->client);
+    return job;
+}
+
+
+/**
+ * Executes a deferred command. This is invoked on the
+ * worker owning the filter, or on an I/O pool thread.
+ * The responses are captured into the job, which is sent
+ * back to the worker that owns the connection.
+ * @arg netconf The network configuration
+ * @arg worker_id The index of the current worker, -1 for the I/O pool
+ * @arg job The job to execute
+ */
+static void execute_client_job(bloom_networking *netconf, int worker_id, client_job *job) {
+    /*
+     * Use a placeholder connection to capture the responses.
+     * Since use_write_buf is set, all the responses are written
+     * to the output buffer, and it is never flushed. It has no
+     * thread_ev, since this may run on the I/O pool, so it must
+     * never reach the helpers that use the event loop.
+     */
+    conn_info capture;
+    bzero(&capture, sizeof(capture));
+    capture.active = 1;
+    capture.use_write_buf = 1;
+    circbuf_init(&capture.output);
+
+    // Invoke the handler
+    bloom_conn_handler handle;
+    handle.config = netconf->config;
+    handle.mgr = netconf->mgr;
+    handle.conn = &capture;
+    handle.state = &job->conn->state;
+    handle.worker_id = worker_id;
+    job->result = handle_deferred_command(&handle, job->cmd);
+
+    // Close the client if the responses could not be captured
+    if (!capture.active) job->result = 1;
+
+    // Return the results
+    job->output = capture.output;
+    job->msg.type = 'r';
+    send_worker_msg(job->origin, &job->msg);
+}
+
+
+/**
+ * Completes a deferred command. The captured responses
+ * are sent, and the connection resumes processing input.
+ */
+static void complete_client_job(worker_ev_userdata *data, client_job *job) {
+    conn_info *conn = job->conn;
+    conn->parked = 0;
+    data->num_parked--;
+
+    // Close the connection if it failed while parked
+    if (!conn->active) {
+        close_client_connection(conn);
+
+    } else {
+        // Send the responses. The capture buffer is never read
+        // from, so the data is contiguous from the start.
+        char *buffers[] = {job->output.buffer};
+        int sizes[] = {job->output.write_cursor};
+        conn->corked = 1;
+        if (sizes[0]) send_client_response(conn, (char**)&buffers, (int*)&sizes, 1);
+
+        // Close the connection if the command failed, otherwise
+        // handle any remaining input, and continue reading
+        if (job->result) {
+            conn->corked = 0;
+            if (!conn->use_write_buf) flush_client_output(conn);
+            deactivate_client_connection(conn);
+        } else {
+            process_client_input(data, conn);
+            if (conn->active && !conn->parked) {
+                ev_io_start(data->loop, &conn->client);
             }
+        }
+    }
 
-            // Schedule this connection on this thread
-            conn->thread_ev = data;
-            ev_io_start(data->loop, &conn->client);
-            break;
+    circbuf_free(&job->output);
+    free(job);
+    check_worker_drained(data);
+}
 
-        // Quit
-        case 'q':
-            data->should_run = 0;
-            ev_break(lp, EVBREAK_ALL);
-            break;
 
-        default:
-            syslog(LOG_WARNING, "Received unknown comand: %c", cmd);
+/**
+ * Starts the I/O pool threads, if any are configured.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int start_io_pool(bloom_networking *netconf) {
+    pthread_mutex_init(&netconf->io_lock, NULL);
+    pthread_cond_init(&netconf->io_cond, NULL);
+    netconf->io_should_run = 1;
+
+    int num = netconf->config->io_threads;
+    if (!num) return 0;
+    netconf->io_threads = calloc(num, sizeof(pthread_t));
+    for (int i=0; i < num; i++) {
+        if (pthread_create(&netconf->io_threads[i], NULL, io_pool_main, netconf)) {
+            syslog(LOG_ERR, "Failed to start I/O thread! Err: %s", strerror(errno));
+            stop_io_pool(netconf);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Stops and joins the I/O pool threads.
+ * @arg netconf The network configuration
+ */
+static void stop_io_pool(bloom_networking *netconf) {
+    pthread_mutex_lock(&netconf->io_lock);
+    netconf->io_should_run = 0;
+    pthread_cond_broadcast(&netconf->io_cond);
+    pthread_mutex_unlock(&netconf->io_lock);
+
+    if (netconf->io_threads) {
+        for (int i=0; i < netconf->config->io_threads; i++) {
+            if (netconf->io_threads[i]) pthread_join(netconf->io_threads[i], NULL);
+        }
+        free(netconf->io_threads);
+        netconf->io_threads = NULL;
+    }
+    pthread_cond_destroy(&netconf->io_cond);
+    pthread_mutex_destroy(&netconf->io_lock);
+}
+
+
+/**
+ * Entry point for the I/O pool threads. Runs jobs
+ * until the pool is stopped, and the queue is drained.
+ * The thread goes offline
+ * with the filter manager while it has no work,
+ * so that an idle pool does not hold up the vacuum.
+ */
+static void* io_pool_main(void *in) {
+    bloom_networking *netconf = in;
+    worker_msg *msg;
+    pthread_mutex_lock(&netconf->io_lock);
+    while (netconf->io_should_run || netconf->io_head) {
+        // Wait for a job
+        msg = netconf->io_head;
+        if (!msg) {
+            pthread_cond_wait(&netconf->io_cond, &netconf->io_lock);
+            continue;
+        }
+        netconf->io_head = msg->next;
+        if (!netconf->io_head) netconf->io_tail = NULL;
+        pthread_mutex_unlock(&netconf->io_lock);
+
+        // Run the job
+        filtmgr_client_checkpoint(netconf->mgr);
+        execute_client_job(netconf, -1, msg->data);
+
+        // Go offline if there is no more work
+        pthread_mutex_lock(&netconf->io_lock);
+        if (!netconf->io_head) {
+            pthread_mutex_unlock(&netconf->io_lock);
+            filtmgr_client_offline(netconf->mgr);
+            pthread_mutex_lock(&netconf->io_lock);
+        }
     }
+    pthread_mutex_unlock(&netconf->io_lock);
+    filtmgr_client_leave(netconf->mgr);
+    return NULL;
 }
 
 
@@ -563,12 +1539,35 @@ static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events)
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
     handle.conn = NULL;
+    handle.state = NULL;
+    handle.worker_id = data->id;
 
     // Invoke the connection handler layer
     periodic_update(&handle);
 }
 
 
+/**
+ * Invoked before the event loop blocks. We hold no
+ * references into the filter manager between loop
+ * iterations, so we are quiescent until we wake.
+ */
+static void handle_loop_prepare(ev_loop *lp, ev_prepare *w, int ready_events) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    filtmgr_client_offline(data->netconf->mgr);
+}
+
+
+/**
+ * Invoked when the event loop wakes, before any
+ * other watchers, to checkpoint with the filter manager.
+ */
+static void handle_loop_check(ev_loop *lp, ev_check *w, int ready_events) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    filtmgr_client_checkpoint(data->netconf->mgr);
+}
+
+
 /**
  * Entry point for threads to join the networking
  * stack. This method blocks indefinitely until the
@@ -579,15 +1578,16 @@ void start_networking_worker(bloom_networking *netconf) {
     // Allocate our user data
     worker_ev_userdata data;
     data.netconf = netconf;
+    data.id = 0;
+    data.inbox = NULL;
+    data.notify_pending = 0;
     data.should_run = 1;
+    data.draining = 0;
+    data.drain_reported = 0;
+    data.num_parked = 0;
+    data.num_writing = 0;
     data.inactive = NULL;
 
-    // Allocate our pipe
-    if (pipe(data.pipefd)) {
-        perror("failed to allocate worker pipes!");
-        return;
-    }
-
     // Create the event loop
     if (!(data.loop = ev_loop_new(netconf->ev_mode))) {
         syslog(LOG_ERR, "Failed to create event loop for worker!");
@@ -597,30 +1597,59 @@ void start_networking_worker(bloom_networking *netconf) {
     // Set the user data to be for this thread
     ev_set_userdata(data.loop, &data);
 
-    // Setup the pipe listener
-    ev_io_init(&data.pipe_client, handle_worker_notification,
-                data.pipefd[0], EV_READ);
-    ev_io_start(data.loop, &data.pipe_client);
+    // Setup the async notifications
+    ev_async_init(&data.notify, handle_worker_notification);
+    ev_async_start(data.loop, &data.notify);
 
     // Setup the periodic timers,
     ev_timer_init(&data.periodic, handle_periodic_timeout,
                 PERIODIC_TIME_SEC, 1);
     ev_timer_start(data.loop, &data.periodic);
 
+    // Announce quiescence on every loop iteration. The check
+    // watcher must run before any watcher uses the filter manager.
+    ev_prepare_init(&data.quiescent, handle_loop_prepare);
+    ev_prepare_start(data.loop, &data.quiescent);
+    ev_check_init(&data.online, handle_loop_check);
+    ev_set_priority(&data.online, EV_MAXPRI);
+    ev_check_start(data.loop, &data.online);
+
     // Syncronize until netconf->threads is available
     barrier_wait(&netconf->thread_barrier);
 
     // Register this thread so we can accept connections
     assert(netconf->threads);
     pthread_t id = pthread_self();
+    int worker_id = 0;
     for (int i=0; i < netconf->config->worker_threads; i++) {
         if (pthread_equal(id, netconf->threads[i])) {
             // Provide a pointer to our data
             netconf->workers[i] = &data;
+            worker_id = i;
+            data.id = i;
             break;
         }
     }
 
+    // Pin the worker to a CPU
+#ifdef __linux__
+    if (netconf->config->cpu_affinity) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker_id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(id, sizeof(cpus), &cpus)) {
+            syslog(LOG_WARNING, "Failed to set the CPU affinity of worker %d!", worker_id);
+        }
+    }
+#endif
+
+    // Accept on our own listener, if we have one
+    if (netconf->reuseport_fds) {
+        ev_io_init(&data.listen_client, handle_new_worker_client,
+                    netconf->reuseport_fds[worker_id], EV_READ);
+        ev_io_start(data.loop, &data.listen_client);
+    }
+
     // Wait for everybody to be registered
     barrier_wait(&netconf->thread_barrier);
 
@@ -628,21 +1657,24 @@ void start_networking_worker(bloom_networking *netconf) {
     while (data.should_run) {
         ev_run(data.loop, EVRUN_ONCE);
 
-        // Free inactive connections
+        // Free inactive connections. Parked connections
+        // are closed when their deferred command completes.
         conn_info *c = data.inactive;
         while (c) {
             conn_info *n = c->next;
-            close_client_connection(c);
+            if (!c->parked) close_client_connection(c);
             c = n;
         }
         data.inactive = NULL;
+        check_worker_drained(&data);
     }
 
     // Cleanup after exit
+    if (netconf->reuseport_fds) ev_io_stop(data.loop, &data.listen_client);
     ev_timer_stop(data.loop, &data.periodic);
-    ev_io_stop(data.loop, &data.pipe_client);
-    close(data.pipefd[0]);
-    close(data.pipefd[1]);
+    ev_prepare_stop(data.loop, &data.quiescent);
+    ev_check_stop(data.loop, &data.online);
+    ev_async_stop(data.loop, &data.notify);
     ev_loop_destroy(data.loop);
 }
 
@@ -656,6 +1688,7 @@ void start_networking_worker(bloom_networking *netconf) {
 void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *threads) {
     // Store a reference to the threads
     netconf->threads = threads;
+    netconf->should_run = should_run;
 
     // Set the user data of the main loop to netconf
     ev_set_userdata(netconf->default_loop, netconf);
@@ -667,9 +1700,13 @@ void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *thre
     barrier_wait(&netconf->thread_barrier);
 
     // Run forever
+    ev_timer_init(&netconf->wake_timer, handle_wake_timeout,
+            PERIODIC_TIME_SEC, PERIODIC_TIME_SEC);
+    ev_timer_start(netconf->default_loop, &netconf->wake_timer);
     while (*should_run) {
         ev_run(netconf->default_loop, EVRUN_ONCE);
     }
+    ev_timer_stop(netconf->default_loop, &netconf->wake_timer);
 }
 
 
@@ -681,14 +1718,22 @@ void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *thre
  */
 int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
     // Stop listening for new connections
-    ev_io_stop(netconf->default_loop, &netconf->tcp_client);
     ev_io_stop(netconf->default_loop, &netconf->udp_client);
-    close(netconf->tcp_client.fd);
     close(netconf->udp_client.fd);
+    close_unix_listener(netconf);
+    close_handoff_listener(netconf);
+
+    // Stop the I/O pool first, since it sends results
+    // to the workers. The queued jobs are completed first,
+    // so their responses are sent before the workers quit.
+    stop_io_pool(netconf);
 
     // Tell the threads to quit, async signal
     for (int i=0; i < netconf->config->worker_threads; i++) {
-        write(netconf->workers[i]->pipefd[1], "q", 1);
+        worker_msg *msg = malloc(sizeof(worker_msg));
+        msg->type = 'q';
+        msg->data = NULL;
+        send_worker_msg(netconf->workers[i], msg);
     }
 
     // Wait for the threads to return
@@ -698,6 +1743,9 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
         if (thread) pthread_join(thread, NULL);
     }
 
+    // Close the TCP listeners, once the workers are done with them
+    close_tcp_listeners(netconf);
+
     // TODO: Close all the client connections
     // ??? For now, we just leak the memory
     // since we are shutdown down anyways...
@@ -705,7 +1753,8 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
     // Shutdown the event loo
     ev_loop_destroy(netconf->default_loop);
 
-    // Free the netconf
+    // Free the netconf. A handoff connection is left open,
+    // so the new process knows when we have exited.
     free(netconf->workers);
     free(netconf);
     return 0;
@@ -726,12 +1775,15 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
  */
 static void close_client_connection(conn_info *conn) {
     // Stop the libev clients
+    assert(conn->thread_ev);
     ev_io_stop(conn->thread_ev->loop, &conn->client);
     ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+    if (conn->use_write_buf) conn->thread_ev->num_writing--;
 
     // Clear everything out
     circbuf_free(&conn->input);
     circbuf_free(&conn->output);
+    cleanup_conn_state(&conn->state);
 
     // Close the fd
     syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
@@ -742,10 +1794,13 @@ static void close_client_connection(conn_info *conn) {
 /**
  * Marks a client connection as 'inactive' and
  * to be closed when the event loop is finished.
+ * A capture connection has no event loop, so it
+ * is only marked, and the job closes the client.
  */
 static void deactivate_client_connection(conn_info *conn) {
     if (!conn->active) return;
     conn->active = 0;
+    if (!conn->thread_ev) return;
     conn->next = conn->thread_ev->inactive;
     conn->thread_ev->inactive = conn;
 }
@@ -768,13 +1823,19 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
         send_bufs = ((num_bufs - offset) <= IOV_MAX) ? (num_bufs - offset) : IOV_MAX;
 
         // Check if we are doing buffered writes
-        if (conn->use_write_buf) {
+        if (conn->use_write_buf || conn->corked) {
             res = send_client_response_buffered(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
         } else {
             res = send_client_response_direct(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
         }
     }
 
+    // Flush early if too much output is corked
+    if (!res && conn->corked && !conn->use_write_buf &&
+            circbuf_used_buf(&conn->output) >= CORK_FLUSH_SIZE) {
+        res = flush_client_output(conn);
+    }
+
     // Disable the connection on error
     if (res) deactivate_client_connection(conn);
     return res;
@@ -840,7 +1901,9 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
     }
 
     // Setup the async write
+    assert(conn->thread_ev);
     conn->use_write_buf = 1;
+    conn->thread_ev->num_writing++;
     ev_io_start(conn->thread_ev->loop, &conn->write_client);
 
     // Done
@@ -848,6 +1911,45 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 }
 
 
+/**
+ * Flushes the output buffer of a connection that is not
+ * currently using the write buffer. Anything that cannot be
+ * written immediately is left in the buffer, and the async
+ * write is setup like in send_client_response_direct.
+ * @return 0 on success, 1 on a fatal error.
+ */
+static int flush_client_output(conn_info *conn) {
+    // Nothing to do if empty
+    if (conn->output.read_cursor == conn->output.write_cursor) return 0;
+
+    // Build the IO vectors to perform the write
+    struct iovec vectors[2];
+    int num_vectors;
+    circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+
+    // Issue the write
+    ssize_t sent = writev(conn->client.fd, (struct iovec*)&vectors, num_vectors);
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                    conn->client.fd, strerror(errno));
+            return 1;
+        }
+        sent = 0;
+    }
+    circbuf_advance_read(&conn->output, sent);
+
+    // Setup the async write for anything remaining
+    if (conn->output.read_cursor != conn->output.write_cursor) {
+        assert(conn->thread_ev);
+        conn->use_write_buf = 1;
+        conn->thread_ev->num_writing++;
+        ev_io_start(conn->thread_ev->loop, &conn->write_client);
+    }
+    return 0;
+}
+
+
 /**
  * This method is used to conveniently extract commands from the
  * command buffer. It scans up to a terminator, and then sets the
@@ -866,7 +1968,23 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
     // First we need to find the terminator...
     char *term_addr = NULL;
-    if (conn->input.write_cursor < conn->input.read_cursor) {
+    if (conn->input.mirrored) {
+        /*
+         * The buffered data is contiguous from the read cursor,
+         * even if it wraps, so the command is used in place.
+         */
+        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
+                           terminator,
+                           circbuf_used_buf(&conn->input));
+        if (term_addr) {
+            *buf = conn->input.buffer + conn->input.read_cursor;
+            *buf_len = term_addr - *buf + 1;    // Difference between the terminator and location
+            *term_addr = '\0';                  // Add a null terminator
+            *should_free = 0;                   // No need to free, in the buffer
+            conn->input.read_cursor = (term_addr - conn->input.buffer + 1) % conn->input.buf_size;
+        }
+
+    } else if (conn->input.write_cursor < conn->input.read_cursor) {
         /*
          * We need to scan from the read cursor to the end of
          * the buffer, and then from the start of the buffer to
@@ -945,10 +2063,73 @@ int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, in
 
 
 /**
- * Sets the client socket options.
+ * Copies the first bytes of the command buffer without
+ * consuming them. This is used to inspect fixed size headers
+ * before the rest of a request has arrived.
+ * @arg conn The client connection
+ * @arg buf The output buffer, must be at least len bytes
+ * @arg len The number of bytes to copy
+ * @return 0 on success, -1 if fewer than len bytes are buffered.
+ */
+int peek_client_bytes(bloom_conn_info *conn, char *buf, int len) {
+    if (circbuf_used_buf(&conn->input) < (uint64_t)len) return -1;
+
+    // Copy up to the end of the buffer, then wrap around
+    int end_size = conn->input.buf_size - conn->input.read_cursor;
+    if (conn->input.mirrored || end_size >= len) {
+        memcpy(buf, conn->input.buffer + conn->input.read_cursor, len);
+    } else {
+        memcpy(buf, conn->input.buffer + conn->input.read_cursor, end_size);
+        memcpy(buf + end_size, conn->input.buffer, len - end_size);
+    }
+    return 0;
+}
+
+
+/**
+ * This method is used to extract a fixed number of bytes from
+ * the command buffer. It sets buf to the start of the bytes.
+ * The output param should_free indicates that the caller should
+ * free the buffer pointed to by buf when it is finished.
+ * This method consumes the bytes from the underlying buffer, freeing
+ * space for later reads.
+ * @arg conn The client connection
+ * @arg len The number of bytes to extract
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if fewer than len bytes are buffered.
+ */
+int extract_client_bytes(bloom_conn_info *conn, int len, char **buf, int *should_free) {
+    if (circbuf_used_buf(&conn->input) < (uint64_t)len) return -1;
+
+    // If the bytes are contiguous, we can just move up the read cursor
+    int end_size = conn->input.buf_size - conn->input.read_cursor;
+    if (conn->input.mirrored || end_size >= len) {
+        *buf = conn->input.buffer + conn->input.read_cursor;
+        *should_free = 0;
+
+    // Otherwise we need to provide a linear copy
+    } else {
+        *buf = malloc(len);
+        peek_client_bytes(conn, *buf, len);
+        *should_free = 1;
+    }
+
+    // Consume the bytes. This may reset the cursors, but does
+    // not modify the buffer, so buf remains valid.
+    circbuf_advance_read(&conn->input, len);
+    return 0;
+}
+
+
+/**
+ * Sets the client socket options. Unix domain
+ * sockets only need to be made non-blocking.
+ * @arg client_fd The client socket
+ * @arg is_tcp Should the TCP options be set
  * @return 0 on success, 1 on error.
  */
-static int set_client_sockopts(int client_fd) {
+static int set_client_sockopts(int client_fd, int is_tcp) {
     // Setup the socket to be non-blocking
     int sock_flags = fcntl(client_fd, F_GETFL, 0);
     if (sock_flags < 0) {
@@ -961,6 +2142,7 @@ static int set_client_sockopts(int client_fd) {
         close(client_fd);
         return 1;
     }
+    if (!is_tcp) return 0;
 
     /**
      * Set TCP_NODELAY. This will allow us to send small response packets more
@@ -990,9 +2172,13 @@ static conn_info* get_conn() {
     // Setup variables
     conn->active = 1;
     conn->use_write_buf = 0;
+    conn->corked = 0;
+    conn->parked = 0;
+    memset(&conn->state, 0, sizeof(bloom_conn_state));
 
-    // Prepare the buffers
-    circbuf_init(&conn->input);
+    // Prepare the buffers. The input is mirrored
+    // so that commands can always be parsed in place.
+    circbuf_init_mirrored(&conn->input);
     circbuf_init(&conn->output);
 
     // Store a reference to the conn object
@@ -1011,12 +2197,67 @@ static void circbuf_init(circular_buffer *buf) {
     buf->read_cursor = 0;
     buf->write_cursor = 0;
     buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
+    buf->mirrored = 0;
     buf->buffer = malloc(buf->buf_size);
 }
 
+/**
+ * Maps a mirrored buffer. A memfd of the given size is mapped
+ * twice into a contiguous reservation of twice the size.
+ * @arg size The size of the buffer, must be a multiple of the page size.
+ * @return The start of the mapping, or NULL if not supported.
+ */
+static char* mirror_map(uint32_t size) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    if (size % sysconf(_SC_PAGESIZE)) return NULL;
+    int fd = memfd_create("bloomd_conn", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Reserve the address space, then map the file over both halves
+    char *base = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * (size_t)size);
+        close(fd);
+        return NULL;
+    }
+
+    // The mappings keep the memory alive
+    close(fd);
+    return base;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+// Allocates a mirrored buffer, falls back to a plain buffer
+static void circbuf_init_mirrored(circular_buffer *buf) {
+    circbuf_init(buf);
+    char *mirror = mirror_map(buf->buf_size);
+    if (mirror) {
+        free(buf->buffer);
+        buf->buffer = mirror;
+        buf->mirrored = 1;
+    }
+}
+
 // Frees a buffer
 static void circbuf_free(circular_buffer *buf) {
-    if (buf->buffer) free(buf->buffer);
+    if (buf->buffer) {
+        if (buf->mirrored)
+            munmap(buf->buffer, 2 * (size_t)buf->buf_size);
+        else
+            free(buf->buffer);
+    }
     buf->buffer = NULL;
 }
 
@@ -1031,14 +2272,31 @@ static uint64_t circbuf_avail_buf(circular_buffer *buf) {
     return avail_buf;
 }
 
+// Calculates the number of buffered bytes
+static uint64_t circbuf_used_buf(circular_buffer *buf) {
+    if (buf->write_cursor < buf->read_cursor) {
+        return buf->buf_size - buf->read_cursor + buf->write_cursor;
+    }
+    return buf->write_cursor - buf->read_cursor;
+}
+
 // Grows the circular buffer to make room for more data
 static void circbuf_grow_buf(circular_buffer *buf) {
     int new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
-    char *new_buf = malloc(new_size);
+    char *new_buf = (buf->mirrored) ? mirror_map(new_size) : NULL;
+    int new_mirrored = (new_buf != NULL);
+    if (!new_buf) new_buf = malloc(new_size);
     int bytes_written = 0;
 
+    // The data is contiguous if mirrored
+    if (buf->mirrored) {
+        bytes_written = circbuf_used_buf(buf);
+        memcpy(new_buf,
+               buf->buffer + buf->read_cursor,
+               bytes_written);
+
     // Check if the write has wrapped around
-    if (buf->write_cursor < buf->read_cursor) {
+    } else if (buf->write_cursor < buf->read_cursor) {
         // Copy from the read cursor to the end of the buffer
         bytes_written = buf->buf_size - buf->read_cursor;
         memcpy(new_buf,
@@ -1061,9 +2319,10 @@ static void circbuf_grow_buf(circular_buffer *buf) {
     }
 
     // Update the buffer locations and everything
-    free(buf->buffer);
+    circbuf_free(buf);
     buf->buffer = new_buf;
     buf->buf_size = new_size;
+    buf->mirrored = new_mirrored;
     buf->read_cursor = 0;
     buf->write_cursor = bytes_written;
 }
@@ -1071,8 +2330,15 @@ static void circbuf_grow_buf(circular_buffer *buf) {
 
 // Initializes a pair of iovectors to be used for readv
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors) {
-    // Check if we've wrapped around
+    // The free space is always contiguous if mirrored
     *num_vectors = 1;
+    if (buf->mirrored) {
+        vectors[0].iov_base = buf->buffer + buf->write_cursor;
+        vectors[0].iov_len = circbuf_avail_buf(buf);
+        return;
+    }
+
+    // Check if we've wrapped around
     if (buf->write_cursor < buf->read_cursor) {
         vectors[0].iov_base = buf->buffer + buf->write_cursor;
         vectors[0].iov_len = buf->read_cursor - buf->write_cursor - 1;
@@ -2,6 +2,7 @@
 #define BLOOM_NETWORKING_H
 #include "config.h"
 #include "filter_manager.h"
+#include "handoff.h"
 
 // Network configuration struct
 typedef struct bloom_networking bloom_networking;
@@ -11,9 +12,11 @@ typedef struct conn_info bloom_conn_info;
  * Initializes the networking interfaces
  * @arg config Takes the bloom server configuration
  * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg handoff The state handed off by a previous process, or NULL.
+ * Its listeners are adopted if they match the configuration.
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out);
+int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_handoff *handoff, bloom_networking **netconf_out);
 
 /**
  * Entry point for the main thread to start accepting
@@ -71,4 +74,54 @@ int send_client_response(bloom_conn_info *conn, char **response_buffers, int *bu
  */
 int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
 
+/**
+ * Copies the first bytes of the command buffer without
+ * consuming them. This is used to inspect fixed size headers
+ * before the rest of a request has arrived.
+ * @arg conn The client connection
+ * @arg buf The output buffer, must be at least len bytes
+ * @arg len The number of bytes to copy
+ * @return 0 on success, -1 if fewer than len bytes are buffered.
+ */
+int peek_client_bytes(bloom_conn_info *conn, char *buf, int len);
+
+/**
+ * This method is used to extract a fixed number of bytes from
+ * the command buffer. It sets buf to the start of the bytes.
+ * The output param should_free indicates that the caller should
+ * free the buffer pointed to by buf when it is finished.
+ * This method consumes the bytes from the underlying buffer, freeing
+ * space for later reads.
+ * @arg conn The client connection
+ * @arg len The number of bytes to extract
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if fewer than len bytes are buffered.
+ */
+int extract_client_bytes(bloom_conn_info *conn, int len, char **buf, int *should_free);
+
+/**
+ * Defers a command to another worker. The connection is
+ * parked, meaning no more input is read or processed
+ * until the command completes. The command is passed to
+ * handle_deferred_command on the target worker, and any
+ * responses are then sent to the client in order.
+ * @arg conn The client connection
+ * @arg worker The index of the worker to run the command
+ * @arg cmd Opaque command, passed to handle_deferred_command
+ * @return 0 on success.
+ */
+int defer_client_command(bloom_conn_info *conn, int worker, void *cmd);
+
+/**
+ * Defers a command that may block on disk to the I/O pool.
+ * The connection is parked just as with defer_client_command,
+ * while the other connections on the worker continue to
+ * be served.
+ * @arg conn The client connection
+ * @arg cmd Opaque command, passed to handle_deferred_command
+ * @return 0 on success.
+ */
+int defer_client_io(bloom_conn_info *conn, void *cmd);
+
 #endif
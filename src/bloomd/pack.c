@@ -0,0 +1,607 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "pack.h"
+#include "hashmap.h"
+#include "type_compat.h"
+
+/*
+ * Name of the pack folder in the data directory. This
+ * does not use the filter folder prefix, so it is never
+ * mistaken for a filter.
+ */
+static const char* PACK_FOLDER_NAME = "pack";
+
+/**
+ * Format for the arena file names.
+ */
+static const char* ARENA_FILE_NAME = "arena.%03d";
+
+/**
+ * Every extent starts with a header, and extents
+ * are aligned to pages so that the layer data is
+ * page aligned, and freed extents can be punched out.
+ */
+#define PACK_HEADER_SIZE 4096
+#define PACK_ALIGN 4096
+#define PACK_MAGIC_USED 0x4b434150  // "PACK"
+#define PACK_MAGIC_FREE 0x45455246  // "FREE"
+#define MAX_PACK_NAME (PACK_HEADER_SIZE - 32)
+
+/**
+ * The on-disk header of an extent. A FREE extent
+ * has no name or layer. Everything in a FREE extent
+ * after its header is zero.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t layer;
+    uint64_t length;        // Length of the extent, including the header
+    uint64_t size;          // Size of the layer data
+    uint32_t name_len;
+    uint32_t reserved;
+    char name[MAX_PACK_NAME];
+} pack_header;
+
+/**
+ * A free extent in an arena
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} free_extent;
+
+/**
+ * An arena file. Everything past the tail has
+ * never been allocated.
+ */
+typedef struct {
+    int fileno;
+    uint64_t size;          // Size of the arena file
+    uint64_t tail;          // End of the last extent
+    free_extent *free;      // Free extents, sorted by offset
+    int num_free;
+    int max_free;
+} pack_arena;
+
+/**
+ * An extent in use by a layer
+ */
+typedef struct {
+    int arena;
+    uint64_t offset;        // Offset of the header
+    uint64_t length;
+    uint64_t size;
+    uint32_t layer;
+} used_extent;
+
+/**
+ * The extents of a single filter
+ */
+typedef struct {
+    char *name;
+    used_extent *extents;
+    int num;
+} pack_entry;
+
+struct bloom_pack {
+    bloom_config *config;
+    char *path;             // Path of the pack folder
+    pthread_mutex_t lock;   // Protects everything below
+    pack_arena *arenas;
+    int num_arenas;
+    int next_arena;         // Number of the next arena file
+    bloom_hashmap entries;  // Map of filter name to pack_entry
+};
+
+/*
+ * Static declarations
+ */
+static const char* entry_key(void *value);
+static int filter_arena_files(CONST_DIRENT_T *d);
+static int open_arena(bloom_pack *pack, char *filename, int create);
+static int load_arena(bloom_pack *pack, int idx);
+static int add_used(bloom_pack *pack, char *name, used_extent *ext);
+static int insert_free(pack_arena *arena, int pos, uint64_t offset, uint64_t length);
+static int free_extent_locked(bloom_pack *pack, int idx, uint64_t offset, uint64_t length);
+static int alloc_locked(bloom_pack *pack, uint64_t length, int *idx, uint64_t *offset);
+static int write_header(int fileno, uint64_t offset, uint32_t magic,
+        uint32_t layer, uint64_t length, uint64_t size, char *name);
+static int zero_range(int fileno, uint64_t offset, uint64_t length);
+
+/**
+ * Initializes the pack, and loads any existing arenas
+ * from the pack folder of the data directory.
+ * @arg config The configuration to use
+ * @arg pack Output parameter, the new pack. Set to NULL
+ * if packing is disabled and there is no existing pack.
+ * @return 0 on success
+ */
+int init_pack(bloom_config *config, bloom_pack **pack) {
+    // Existing packs are loaded even if packing is now disabled,
+    // since the filters may still have layers in them
+    struct stat buf;
+    char *path = join_path(config->data_dir, (char*)PACK_FOLDER_NAME);
+    if (!config->pack_layer_size && stat(path, &buf)) {
+        free(path);
+        *pack = NULL;
+        return 0;
+    }
+
+    bloom_pack *p = *pack = calloc(1, sizeof(bloom_pack));
+    p->config = config;
+    p->path = path;
+    pthread_mutex_init(&p->lock, NULL);
+    hashmap_init(&p->entries, 0, entry_key);
+
+    int res = mkdir(p->path, 0755);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create pack directory '%s'. %s", p->path, strerror(errno));
+        return -1;
+    }
+
+    // Load the existing arenas, in order
+    struct dirent **namelist = NULL;
+    int num = scandir(p->path, &namelist, filter_arena_files, alphasort);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan pack directory '%s'. %s", p->path, strerror(errno));
+        return -1;
+    }
+
+    int err = 0;
+    for (int i=0; i < num; i++) {
+        if (!err) {
+            err = open_arena(p, namelist[i]->d_name, 0);
+            if (!err) err = load_arena(p, p->num_arenas - 1);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    if (err) return err;
+
+    syslog(LOG_INFO, "Loaded %d pack arenas with %llu filters.", p->num_arenas,
+            (unsigned long long)hashmap_size(&p->entries));
+    return 0;
+}
+
+// Frees a pack_entry, used when destroying the pack
+static int free_entry_cb(void *data, void *value) {
+    (void)data;
+    pack_entry *entry = value;
+    free(entry->name);
+    free(entry->extents);
+    free(entry);
+    return 0;
+}
+
+/**
+ * Destroys the pack, and closes the arenas. Any bitmaps
+ * using the extents of the pack must be closed first.
+ * @arg pack The pack to destroy
+ * @return 0 on success
+ */
+int destroy_pack(bloom_pack *pack) {
+    hashmap_iter(&pack->entries, free_entry_cb, NULL);
+    hashmap_destroy(&pack->entries);
+    for (int i=0; i < pack->num_arenas; i++) {
+        close(pack->arenas[i].fileno);
+        free(pack->arenas[i].free);
+    }
+    free(pack->arenas);
+    pthread_mutex_destroy(&pack->lock);
+    free(pack->path);
+    free(pack);
+    return 0;
+}
+
+/**
+ * Allocates a new zeroed extent for a layer of a filter.
+ * @arg pack The pack
+ * @arg filter_name The name of the filter
+ * @arg layer The layer number within the filter
+ * @arg size The size of the layer data
+ * @arg ext Output, the new extent
+ * @return 0 on success, -ENOSPC if the size can never fit
+ * in an arena, and negative on other errors.
+ */
+int pack_alloc(bloom_pack *pack, char *filter_name, uint32_t layer, uint64_t size, bloom_pack_extent *ext) {
+    if (strlen(filter_name) >= MAX_PACK_NAME) return -ENAMETOOLONG;
+
+    // Round up to the alignment, including the header
+    uint64_t length = PACK_HEADER_SIZE + size;
+    length = (length + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+    if (size == 0 || length > pack->config->pack_arena_size) return -ENOSPC;
+
+    pthread_mutex_lock(&pack->lock);
+    int idx;
+    uint64_t offset;
+    int res = alloc_locked(pack, length, &idx, &offset);
+
+    // Claim the extent
+    if (!res) {
+        int fileno = pack->arenas[idx].fileno;
+        res = write_header(fileno, offset, PACK_MAGIC_USED, layer, length, size, filter_name);
+        if (!res && fsync(fileno)) res = -errno;
+        if (res) {
+            syslog(LOG_ERR, "Failed to claim pack extent for filter %s. Err: %d",
+                    filter_name, res);
+            free_extent_locked(pack, idx, offset, length);
+        }
+    }
+
+    if (!res) {
+        used_extent used = {idx, offset, length, size, layer};
+        res = add_used(pack, filter_name, &used);
+        ext->fileno = pack->arenas[idx].fileno;
+        ext->offset = offset + PACK_HEADER_SIZE;
+        ext->size = size;
+        ext->layer = layer;
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return res;
+}
+
+/**
+ * Lists the extents that belong to a filter.
+ * @arg pack The pack
+ * @arg filter_name The name of the filter
+ * @arg exts Output, a malloc()'d array of extents, or NULL
+ * if there are none. The caller should free() it.
+ * @arg num Output, the number of extents
+ * @return 0 on success
+ */
+int pack_layers(bloom_pack *pack, char *filter_name, bloom_pack_extent **exts, int *num) {
+    *exts = NULL;
+    *num = 0;
+
+    pthread_mutex_lock(&pack->lock);
+    pack_entry *entry = hashmap_get(&pack->entries, filter_name);
+    if (entry && entry->num) {
+        *exts = malloc(entry->num * sizeof(bloom_pack_extent));
+        for (int i=0; i < entry->num; i++) {
+            used_extent *used = entry->extents + i;
+            (*exts)[i].fileno = pack->arenas[used->arena].fileno;
+            (*exts)[i].offset = used->offset + PACK_HEADER_SIZE;
+            (*exts)[i].size = used->size;
+            (*exts)[i].layer = used->layer;
+        }
+        *num = entry->num;
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return 0;
+}
+
+/**
+ * Frees all the extents that belong to a filter. The filter
+ * must be closed first.
+ * @arg pack The pack
+ * @arg filter_name The name of the filter
+ * @return 0 on success
+ */
+int pack_free_filter(bloom_pack *pack, char *filter_name) {
+    int res = 0;
+    pthread_mutex_lock(&pack->lock);
+    pack_entry *entry = hashmap_delete(&pack->entries, filter_name);
+    if (entry) {
+        syslog(LOG_INFO, "Freeing %d pack extents for filter %s.", entry->num, filter_name);
+        for (int i=0; i < entry->num; i++) {
+            used_extent *used = entry->extents + i;
+            res |= free_extent_locked(pack, used->arena, used->offset, used->length);
+        }
+        free_entry_cb(NULL, entry);
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return res;
+}
+
+// Used to get the key of a pack_entry
+static const char* entry_key(void *value) {
+    return ((pack_entry*)value)->name;
+}
+
+/**
+ * Works with scandir to filter out non-arena files.
+ */
+static int filter_arena_files(CONST_DIRENT_T *d) {
+    int num;
+    return sscanf(d->d_name, ARENA_FILE_NAME, &num) == 1;
+}
+
+/**
+ * Opens an arena file and adds it to the pack.
+ * New arenas are created sparse, at the configured size.
+ */
+static int open_arena(bloom_pack *pack, char *filename, int create) {
+    char *path = join_path(pack->path, filename);
+    int flags = (create) ? O_RDWR|O_CREAT|O_EXCL : O_RDWR;
+    int fileno = open(path, flags, 0644);
+    if (fileno == -1) {
+        syslog(LOG_ERR, "Failed to open pack arena '%s'. %s", path, strerror(errno));
+        free(path);
+        return -errno;
+    }
+
+    struct stat buf;
+    if (create && ftruncate(fileno, pack->config->pack_arena_size)) {
+        syslog(LOG_ERR, "Failed to size pack arena '%s'. %s", path, strerror(errno));
+        close(fileno);
+        unlink(path);
+        free(path);
+        return -errno;
+    } else if (fstat(fileno, &buf)) {
+        close(fileno);
+        free(path);
+        return -errno;
+    }
+    free(path);
+
+    // Track the next arena number
+    int num = 0;
+    sscanf(filename, ARENA_FILE_NAME, &num);
+    if (num >= pack->next_arena) pack->next_arena = num + 1;
+
+    pack->arenas = realloc(pack->arenas, (pack->num_arenas + 1) * sizeof(pack_arena));
+    pack_arena *arena = pack->arenas + pack->num_arenas++;
+    memset(arena, 0, sizeof(pack_arena));
+    arena->fileno = fileno;
+    arena->size = buf.st_size;
+    return 0;
+}
+
+/**
+ * Scans the headers of an arena, to rebuild the free
+ * list and the extents of each filter. The scan stops
+ * at the first invalid header, which marks the tail.
+ */
+static int load_arena(bloom_pack *pack, int idx) {
+    pack_arena *arena = pack->arenas + idx;
+    pack_header *header = malloc(sizeof(pack_header));
+    uint64_t offset = 0;
+    int res = 0;
+    while (!res && offset + PACK_HEADER_SIZE <= arena->size) {
+        ssize_t got = pread(arena->fileno, header, sizeof(pack_header), offset);
+        if (got != sizeof(pack_header)) break;
+
+        // Check the header is sane
+        uint64_t length = header->length;
+        if (header->magic != PACK_MAGIC_USED && header->magic != PACK_MAGIC_FREE) break;
+        if (length < PACK_HEADER_SIZE || length % PACK_ALIGN) break;
+        if (offset + length > arena->size) break;
+
+        if (header->magic == PACK_MAGIC_FREE) {
+            res = insert_free(arena, arena->num_free, offset, length);
+        } else {
+            if (header->name_len == 0 || header->name_len >= MAX_PACK_NAME) break;
+            if (header->size > length - PACK_HEADER_SIZE) break;
+            header->name[header->name_len] = '\0';
+            used_extent used = {idx, offset, length, header->size, header->layer};
+            res = add_used(pack, header->name, &used);
+        }
+        offset += length;
+    }
+    if (offset < arena->size && header->magic) {
+        syslog(LOG_WARNING, "Invalid pack header in arena %d at offset %llu. Treating as the tail.",
+                idx, (unsigned long long)offset);
+    }
+    arena->tail = offset;
+    free(header);
+    return res;
+}
+
+/**
+ * Adds a used extent to the entry of a filter,
+ * creating the entry if needed.
+ */
+static int add_used(bloom_pack *pack, char *name, used_extent *ext) {
+    pack_entry *entry = hashmap_get(&pack->entries, name);
+    if (!entry) {
+        entry = calloc(1, sizeof(pack_entry));
+        entry->name = strdup(name);
+        hashmap_table *retired = NULL;
+        if (hashmap_put(&pack->entries, entry, &retired)) {
+            free_entry_cb(NULL, entry);
+            return -1;
+        }
+
+        // All access is under the pack lock, so there are no readers
+        if (retired) hashmap_free_table(retired);
+    }
+    entry->extents = realloc(entry->extents, (entry->num + 1) * sizeof(used_extent));
+    entry->extents[entry->num++] = *ext;
+    return 0;
+}
+
+/**
+ * Inserts into the free list of an arena at a position,
+ * without merging or writing any headers.
+ */
+static int insert_free(pack_arena *arena, int pos, uint64_t offset, uint64_t length) {
+    if (arena->num_free == arena->max_free) {
+        int max = (arena->max_free) ? arena->max_free * 2 : 16;
+        free_extent *list = realloc(arena->free, max * sizeof(free_extent));
+        if (!list) return -ENOMEM;
+        arena->free = list;
+        arena->max_free = max;
+    }
+    memmove(arena->free + pos + 1, arena->free + pos,
+            (arena->num_free - pos) * sizeof(free_extent));
+    arena->free[pos].offset = offset;
+    arena->free[pos].length = length;
+    arena->num_free++;
+    return 0;
+}
+
+/**
+ * Frees an extent, merging it with its free neighbours.
+ * The merged header is written first, and then the rest
+ * of the merged extent is zeroed, so a crash at any point
+ * leaves a valid chain of headers.
+ */
+static int free_extent_locked(bloom_pack *pack, int idx, uint64_t offset, uint64_t length) {
+    pack_arena *arena = pack->arenas + idx;
+
+    // Find where it goes in the sorted list
+    int pos = 0;
+    while (pos < arena->num_free && arena->free[pos].offset < offset) pos++;
+    int merge_prev = (pos > 0 &&
+            arena->free[pos-1].offset + arena->free[pos-1].length == offset);
+    int merge_next = (pos < arena->num_free &&
+            offset + length == arena->free[pos].offset);
+
+    uint64_t start = (merge_prev) ? arena->free[pos-1].offset : offset;
+    uint64_t end = offset + length;
+    if (merge_next) end += arena->free[pos].length;
+
+    int res = write_header(arena->fileno, start, PACK_MAGIC_FREE, 0, end - start, 0, "");
+    if (!res && fsync(arena->fileno)) res = -errno;
+    if (res) {
+        syslog(LOG_ERR, "Failed to free pack extent in arena %d at offset %llu. Err: %d",
+                idx, (unsigned long long)offset, res);
+        return res;
+    }
+
+    // Zero the freed extent, keeping the header if it is ours
+    uint64_t zero_start = (merge_prev) ? offset : offset + PACK_HEADER_SIZE;
+    uint64_t zero_end = (merge_next) ? offset + length + PACK_HEADER_SIZE : offset + length;
+    res = zero_range(arena->fileno, zero_start, zero_end - zero_start);
+
+    // Update the free list
+    if (merge_prev && merge_next) {
+        arena->free[pos-1].length = end - start;
+        memmove(arena->free + pos, arena->free + pos + 1,
+                (arena->num_free - pos - 1) * sizeof(free_extent));
+        arena->num_free--;
+    } else if (merge_prev) {
+        arena->free[pos-1].length = end - start;
+    } else if (merge_next) {
+        arena->free[pos].offset = start;
+        arena->free[pos].length = end - start;
+    } else {
+        res |= insert_free(arena, pos, start, end - start);
+    }
+    return res;
+}
+
+/**
+ * Finds space for an extent. Uses the first free extent
+ * that fits, splitting off the remainder. Otherwise extends
+ * the tail of an arena, or creates a new arena.
+ */
+static int alloc_locked(bloom_pack *pack, uint64_t length, int *idx, uint64_t *offset) {
+    int res;
+    for (int i=0; i < pack->num_arenas; i++) {
+        pack_arena *arena = pack->arenas + i;
+        for (int j=0; j < arena->num_free; j++) {
+            free_extent *free_ext = arena->free + j;
+            if (free_ext->length < length) continue;
+
+            // Split off the remainder first
+            if (free_ext->length > length) {
+                res = write_header(arena->fileno, free_ext->offset + length,
+                        PACK_MAGIC_FREE, 0, free_ext->length - length, 0, "");
+                if (!res && fsync(arena->fileno)) res = -errno;
+                if (res) return res;
+            }
+
+            *idx = i;
+            *offset = free_ext->offset;
+            if (free_ext->length > length) {
+                free_ext->offset += length;
+                free_ext->length -= length;
+            } else {
+                memmove(free_ext, free_ext + 1,
+                        (arena->num_free - j - 1) * sizeof(free_extent));
+                arena->num_free--;
+            }
+            return 0;
+        }
+
+        // Extend the tail
+        if (arena->tail + length <= arena->size) {
+            res = zero_range(arena->fileno, arena->tail, length);
+            if (res) return res;
+            *idx = i;
+            *offset = arena->tail;
+            arena->tail += length;
+            return 0;
+        }
+    }
+
+    // Create a new arena
+    char *filename = NULL;
+    res = asprintf(&filename, ARENA_FILE_NAME, pack->next_arena);
+    assert(res != -1);
+    syslog(LOG_INFO, "Creating new pack arena %s. Size: %llu", filename,
+            (unsigned long long)pack->config->pack_arena_size);
+    res = open_arena(pack, filename, 1);
+    free(filename);
+    if (res) return res;
+
+    pack_arena *arena = pack->arenas + pack->num_arenas - 1;
+    *idx = pack->num_arenas - 1;
+    *offset = 0;
+    arena->tail = length;
+    return 0;
+}
+
+/**
+ * Writes the header of an extent
+ */
+static int write_header(int fileno, uint64_t offset, uint32_t magic,
+        uint32_t layer, uint64_t length, uint64_t size, char *name) {
+    pack_header *header = calloc(1, sizeof(pack_header));
+    header->magic = magic;
+    header->layer = layer;
+    header->length = length;
+    header->size = size;
+    header->name_len = strlen(name);
+    memcpy(header->name, name, header->name_len);
+
+    int res = 0;
+    uint64_t total = 0;
+    while (total < sizeof(pack_header)) {
+        ssize_t written = pwrite(fileno, (char*)header + total,
+                sizeof(pack_header) - total, offset + total);
+        if (written == -1 && errno != EINTR) {
+            res = -errno;
+            break;
+        } else if (written > 0)
+            total += written;
+    }
+    free(header);
+    return res;
+}
+
+/**
+ * Zeros a range of an arena. Punches a hole where supported,
+ * so that free extents do not use any disk space.
+ */
+static int zero_range(int fileno, uint64_t offset, uint64_t length) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (!fallocate(fileno, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length))
+        return 0;
+#endif
+    char *zeros = calloc(1, PACK_ALIGN);
+    int res = 0;
+    uint64_t total = 0;
+    while (total < length) {
+        uint64_t chunk = length - total;
+        if (chunk > PACK_ALIGN) chunk = PACK_ALIGN;
+        ssize_t written = pwrite(fileno, zeros, chunk, offset + total);
+        if (written == -1 && errno != EINTR) {
+            res = -errno;
+            break;
+        } else if (written > 0)
+            total += written;
+    }
+    free(zeros);
+    return res;
+}
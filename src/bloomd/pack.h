@@ -0,0 +1,76 @@
+#ifndef BLOOM_PACK_H
+#define BLOOM_PACK_H
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * A pack stores the small layers of many filters together
+ * in a few large arena files, instead of a data file per layer.
+ * Each extent in an arena starts with a header that names the
+ * filter and layer it belongs to, so the pack can be rebuilt
+ * by scanning the arenas on start.
+ * @notes All the pack functions are thread safe.
+ */
+typedef struct bloom_pack bloom_pack;
+
+/**
+ * An extent of an arena holding the data of a single layer.
+ */
+typedef struct {
+    int fileno;         // The arena file. Owned by the pack.
+    uint64_t offset;    // Offset of the layer data in the arena
+    uint64_t size;      // Size of the layer data
+    uint32_t layer;     // The layer number within the filter
+} bloom_pack_extent;
+
+/**
+ * Initializes the pack, and loads any existing arenas
+ * from the pack folder of the data directory.
+ * @arg config The configuration to use
+ * @arg pack Output parameter, the new pack. Set to NULL
+ * if packing is disabled and there is no existing pack.
+ * @return 0 on success
+ */
+int init_pack(bloom_config *config, bloom_pack **pack);
+
+/**
+ * Destroys the pack, and closes the arenas. Any bitmaps
+ * using the extents of the pack must be closed first.
+ * @arg pack The pack to destroy
+ * @return 0 on success
+ */
+int destroy_pack(bloom_pack *pack);
+
+/**
+ * Allocates a new zeroed extent for a layer of a filter.
+ * @arg pack The pack
+ * @arg filter_name The name of the filter
+ * @arg layer The layer number within the filter
+ * @arg size The size of the layer data
+ * @arg ext Output, the new extent
+ * @return 0 on success, -ENOSPC if the size can never fit
+ * in an arena, and negative on other errors.
+ */
+int pack_alloc(bloom_pack *pack, char *filter_name, uint32_t layer, uint64_t size, bloom_pack_extent *ext);
+
+/**
+ * Lists the extents that belong to a filter.
+ * @arg pack The pack
+ * @arg filter_name The name of the filter
+ * @arg exts Output, a malloc()'d array of extents, or NULL
+ * if there are none. The caller should free() it.
+ * @arg num Output, the number of extents
+ * @return 0 on success
+ */
+int pack_layers(bloom_pack *pack, char *filter_name, bloom_pack_extent **exts, int *num);
+
+/**
+ * Frees all the extents that belong to a filter. The filter
+ * must be closed first.
+ * @arg pack The pack
+ * @arg filter_name The name of the filter
+ * @return 0 on success
+ */
+int pack_free_filter(bloom_pack *pack, char *filter_name);
+
+#endif
@@ -0,0 +1,1245 @@
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "art.h"
+#include "replication.h"
+
+/**
+ * The handshake sent by a replica, and echoed back
+ * by the primary: the magic, then the version.
+ */
+#define REPL_MAGIC "BRPL"
+#define REPL_VERSION 1
+#define REPL_HANDSHAKE_SIZE 8
+
+/**
+ * Each frame is a type, followed by the 8 byte length of the
+ * payload. All integers are in network byte order. The snapshot
+ * is a filter frame with the config of each filter, followed by
+ * a layer frame with the bitmap of each of its layers, oldest
+ * first. The end frame separates the snapshot from the stream
+ * of changes. Changes and filter frames carry the sequence of
+ * the change, or of the last change included in the snapshot.
+ */
+#define FRAME_HEADER_SIZE 9
+#define FRAME_FILTER 'F'    // seq, name, config
+#define FRAME_LAYER 'L'     // layer, bitmap
+#define FRAME_END 'E'       // End of the snapshot
+#define FRAME_CREATE 'C'    // seq, name, config
+#define FRAME_DROP 'D'      // seq, name
+#define FRAME_CLEAR 'R'     // seq, name
+#define FRAME_SET 'S'       // seq, name, number of keys, keys
+
+/**
+ * The largest frame we accept, other than layers. Sets are
+ * bounded by the size of a client request.
+ */
+#define MAX_FRAME_SIZE (256 * 1024 * 1024)
+
+/**
+ * The most changes buffered for a replica. A replica that
+ * falls further behind is disconnected, and must bootstrap
+ * again, rather than using unbounded memory on the primary.
+ */
+#define MAX_REPLICA_LAG (128 * 1024 * 1024)
+
+/**
+ * The longest filter name, matching the protocol
+ */
+#define MAX_NAME_LEN 200
+
+/**
+ * How often the listener checks if it should stop, in msec
+ */
+#define LISTEN_POLL_MSEC 1000
+
+/**
+ * How long to wait before retrying a create, while
+ * the filter is still being deleted, in usec
+ */
+#define CREATE_RETRY_USEC 10000
+
+/**
+ * Room reserved in a filter copy for the frame headers,
+ * the name and the config, on top of the bitmaps
+ */
+#define SNAPSHOT_FRAME_BYTES 4096
+
+static const char* FILTER_FOLDER_NAME = "bloomd.%s";
+static const char FOLDER_PREFIX[] = "bloomd.";
+static const char* PACK_FOLDER_NAME = "pack";
+static const char* CONFIG_FILENAME = "config.ini";
+static const char* DATA_FILE_NAME = "data.%03d.mmap";
+
+/**
+ * A growable buffer used to encode frames
+ */
+typedef struct {
+    unsigned char *buf;
+    uint64_t len;
+    uint64_t size;
+} repl_buffer;
+
+/**
+ * Used to decode a frame. Reads past the
+ * end set the error flag, and return zeros.
+ */
+typedef struct {
+    unsigned char *pos;
+    unsigned char *end;
+    int err;
+} repl_reader;
+
+/**
+ * A connected replica, served by its own thread. It is
+ * subscribed to the changes before the snapshot is taken,
+ * and the changes are buffered until the snapshot is sent.
+ */
+typedef struct replica {
+    bloom_replication *repl;
+    int fd;
+    pthread_t thread;
+    int subscribed;         // Set once the changes are buffered
+    repl_buffer pending;    // Changes not yet sent
+    volatile int closed;    // Set once the replica is disconnected
+    volatile int done;      // Set once the thread has exited
+    struct replica *next;
+} replica;
+
+struct bloom_replication {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;        // Cleared if the stream from the primary is lost
+    volatile int stopping;  // Set to stop all the threads
+    volatile int lost;      // Set if the stream from the primary is lost
+
+    // Protects the replicas, their buffers, and the sequence
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // Signaled when there are changes to send
+    uint64_t seq;           // Sequence of the last change
+    replica *replicas;
+    volatile int num_subscribed;    // Changed under the lock, read without it by sets
+    repl_buffer scratch;    // Used to encode a change once for all replicas
+
+    int listen_fd;          // Replication listener, or -1
+    pthread_t listen_thread;
+
+    int follow_fd;          // Connection to the primary, or -1
+    pthread_t follow_thread;
+    int following;
+    art_tree *snapshot_seqs;    // Sequence each filter was copied at, +1
+    uint64_t snapshot_max;      // The highest sequence in the snapshot
+};
+
+/**
+ * Used to copy a filter in the snapshot
+ */
+typedef struct {
+    bloom_replication *repl;
+    repl_buffer out;
+} snapshot_filter;
+
+// Static declarations
+static void log_change(void *data, filtmgr_change change, char *filter_name,
+        bloom_filter_config *config, char **keys, int num_keys, char *result);
+static void* replica_main(void *in);
+static int send_snapshot(replica *r);
+static void snapshot_filter_cb(void *in, char *filter_name, bloom_filter *filter);
+static void byte_size_cb(void *in, char *filter_name, bloom_filter *filter);
+static void* listen_main(void *in);
+static int open_listener(bloom_config *config);
+static void reap_replicas(bloom_replication *repl, int all);
+static int connect_primary(char *address, int *fd);
+static int write_snapshot_layer(char *path, int layer, int fd, uint64_t len);
+static int clear_data_dir(char *data_dir);
+static int remove_dir(char *path);
+static int valid_name(char *name);
+static void* follow_main(void *in);
+static int apply_change(bloom_replication *repl, unsigned char type, repl_reader *r);
+static int skip_change(bloom_replication *repl, char *name, uint64_t seq);
+static int write_all(int fd, void *buf, uint64_t len);
+static int read_all(int fd, void *buf, uint64_t len);
+static int send_handshake(int fd);
+static int recv_handshake(int fd);
+static int read_frame(int fd, unsigned char *type, uint64_t *len);
+static uint64_t begin_frame(repl_buffer *b, unsigned char type);
+static void end_frame(repl_buffer *b, uint64_t start);
+static void buf_reserve(repl_buffer *b, uint64_t len);
+static void buf_put(repl_buffer *b, const void *data, uint64_t len);
+static void buf_put_int(repl_buffer *b, uint64_t val, int bytes);
+static void buf_put_double(repl_buffer *b, double val);
+static void buf_put_name(repl_buffer *b, char *name);
+static void buf_put_config(repl_buffer *b, bloom_filter_config *config);
+static uint64_t get_int(repl_reader *r, int bytes);
+static double get_double(repl_reader *r);
+static char* get_name(repl_reader *r);
+static void get_config(repl_reader *r, bloom_filter_config *config);
+
+/**
+ * Initializes replication. If the configuration has replicate_from,
+ * this connects to the primary and bootstraps from its snapshot,
+ * replacing any filters in the data directory. This must be
+ * invoked before the filter manager is initialized.
+ * @arg config The configuration
+ * @arg should_run Cleared if the stream from the primary is lost
+ * @arg repl Output, the replication state
+ * @return 0 on success.
+ */
+int init_replication(bloom_config *config, int *should_run, bloom_replication **repl) {
+    bloom_replication *r = *repl = calloc(1, sizeof(bloom_replication));
+    r->config = config;
+    r->should_run = should_run;
+    r->listen_fd = -1;
+    r->follow_fd = -1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if (config->replicate_from) {
+        int fd;
+        if (connect_primary(config->replicate_from, &fd) || replication_bootstrap(r, fd)) {
+            destroy_replication(r);
+            *repl = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Bootstraps from a snapshot on a connection to a primary,
+ * replacing any filters in the data directory. The changes that
+ * follow are applied once replication is started.
+ * @arg repl The replication state
+ * @arg fd The connection to the primary, owned by repl
+ * @return 0 on success.
+ */
+int replication_bootstrap(bloom_replication *repl, int fd) {
+    repl->follow_fd = fd;
+    if (send_handshake(fd) || recv_handshake(fd)) {
+        syslog(LOG_ERR, "Failed the handshake with the primary!");
+        return -1;
+    }
+
+    // The snapshot replaces all the filters we have
+    if (clear_data_dir(repl->config->data_dir)) return -1;
+    repl->snapshot_seqs = malloc(sizeof(art_tree));
+    init_art_tree(repl->snapshot_seqs);
+
+    char *path = NULL;
+    unsigned char type;
+    uint64_t len;
+    int res = 0, num_filters = 0;
+    while (!(res = read_frame(fd, &type, &len)) && type != FRAME_END) {
+        // Layers are streamed straight to their file
+        if (type == FRAME_LAYER) {
+            unsigned char layer[4];
+            if (!path || len < sizeof(layer) || read_all(fd, layer, sizeof(layer))) {
+                res = -1;
+                break;
+            }
+            repl_reader r = {layer, layer + sizeof(layer), 0};
+            res = write_snapshot_layer(path, get_int(&r, 4), fd, len - sizeof(layer));
+            if (res) break;
+            continue;
+        }
+        if (type != FRAME_FILTER || len > MAX_FRAME_SIZE) {
+            res = -1;
+            break;
+        }
+
+        // Read the filter frame
+        unsigned char *buf = malloc(len ? len : 1);
+        if (read_all(fd, buf, len)) {
+            free(buf);
+            res = -1;
+            break;
+        }
+        repl_reader r = {buf, buf + len, 0};
+        uint64_t seq = get_int(&r, 8);
+        char *name = get_name(&r);
+        bloom_filter_config config;
+        get_config(&r, &config);
+        free(buf);
+        if (r.err || !valid_name(name)) {
+            free(name);
+            res = -1;
+            break;
+        }
+
+        // Create the folder and its config. The filter is persisted
+        // on the replica even if it is in memory on the primary,
+        // since it is loaded from the snapshot.
+        free(path);
+        char *folder = NULL;
+        res = asprintf(&folder, FILTER_FOLDER_NAME, name);
+        assert(res != -1);
+        path = join_path(repl->config->data_dir, folder);
+        free(folder);
+        if (mkdir(path, 0755)) {
+            syslog(LOG_ERR, "Failed to create the filter directory '%s'. %s", path, strerror(errno));
+            free(name);
+            res = -1;
+            break;
+        }
+        config.in_memory = 0;
+        char *config_path = join_path(path, (char*)CONFIG_FILENAME);
+        res = update_filename_from_filter_config(config_path, &config);
+        free(config_path);
+        if (res) {
+            syslog(LOG_ERR, "Failed to write the config of filter '%s'. Err: %d", name, res);
+            free(name);
+            break;
+        }
+
+        // Changes included in the copy are skipped later
+        art_insert(repl->snapshot_seqs, (unsigned char*)name, strlen(name)+1, (void*)(uintptr_t)(seq + 1));
+        if (seq > repl->snapshot_max) repl->snapshot_max = seq;
+        num_filters++;
+        free(name);
+    }
+    free(path);
+
+    if (res) {
+        syslog(LOG_ERR, "Failed to bootstrap from the primary!");
+        return -1;
+    }
+    syslog(LOG_INFO, "Bootstrapped %d filters from the primary.", num_filters);
+    return 0;
+}
+
+/**
+ * Starts replication once the filters are loaded. The changes
+ * to the filters are streamed to any replicas, the replication
+ * port is opened if configured, and the stream from the primary
+ * is applied after a bootstrap.
+ * @arg repl The replication state
+ * @arg mgr The filter manager
+ * @return 0 on success.
+ */
+int start_replication(bloom_replication *repl, bloom_filtmgr *mgr) {
+    repl->mgr = mgr;
+
+    // Serve replicas
+    if (repl->config->replication_port) {
+        repl->listen_fd = open_listener(repl->config);
+        if (repl->listen_fd < 0) return -1;
+        filtmgr_set_log(mgr, log_change, repl);
+        if (pthread_create(&repl->listen_thread, NULL, listen_main, repl)) {
+            syslog(LOG_ERR, "Failed to start the replication listener!");
+            filtmgr_set_log(mgr, NULL, NULL);
+            close(repl->listen_fd);
+            repl->listen_fd = -1;
+            return -1;
+        }
+        syslog(LOG_INFO, "Serving replicas on port %d.", repl->config->replication_port);
+    }
+
+    // Apply the changes from the primary
+    if (repl->follow_fd >= 0) {
+        if (pthread_create(&repl->follow_thread, NULL, follow_main, repl)) {
+            syslog(LOG_ERR, "Failed to start the replication stream!");
+            return -1;
+        }
+        repl->following = 1;
+    }
+    return 0;
+}
+
+/**
+ * Serves a replica on a connection. The snapshot and the
+ * stream are sent by a new thread.
+ * @arg repl The replication state
+ * @arg fd The connection from the replica, owned by repl
+ * @return 0 on success.
+ */
+int replication_add_replica(bloom_replication *repl, int fd) {
+    replica *r = calloc(1, sizeof(replica));
+    r->repl = repl;
+    r->fd = fd;
+
+    pthread_mutex_lock(&repl->lock);
+    r->next = repl->replicas;
+    repl->replicas = r;
+    if (pthread_create(&r->thread, NULL, replica_main, r)) {
+        repl->replicas = r->next;
+        pthread_mutex_unlock(&repl->lock);
+        syslog(LOG_ERR, "Failed to start a replica thread!");
+        close(fd);
+        free(r);
+        return -1;
+    }
+    pthread_mutex_unlock(&repl->lock);
+    return 0;
+}
+
+/**
+ * Stops replication, disconnecting all the replicas
+ * and the primary. This must be invoked before the
+ * filter manager is destroyed.
+ * @arg repl The replication state
+ * @return 0 on success, 1 if the stream from the primary was lost.
+ */
+int destroy_replication(bloom_replication *repl) {
+    repl->stopping = 1;
+
+    // Stop accepting replicas
+    if (repl->listen_fd >= 0) {
+        pthread_join(repl->listen_thread, NULL);
+        close(repl->listen_fd);
+    }
+    if (repl->mgr) filtmgr_set_log(repl->mgr, NULL, NULL);
+
+    // Disconnect the replicas, and wake their threads
+    pthread_mutex_lock(&repl->lock);
+    for (replica *r = repl->replicas; r; r = r->next) {
+        shutdown(r->fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&repl->cond);
+    pthread_mutex_unlock(&repl->lock);
+    reap_replicas(repl, 1);
+
+    // Disconnect from the primary
+    if (repl->follow_fd >= 0) {
+        shutdown(repl->follow_fd, SHUT_RDWR);
+        if (repl->following) pthread_join(repl->follow_thread, NULL);
+        close(repl->follow_fd);
+    }
+
+    if (repl->snapshot_seqs) {
+        destroy_art_tree(repl->snapshot_seqs);
+        free(repl->snapshot_seqs);
+    }
+    free(repl->scratch.buf);
+    pthread_mutex_destroy(&repl->lock);
+    pthread_cond_destroy(&repl->cond);
+    int lost = repl->lost;
+    free(repl);
+    return (lost) ? 1 : 0;
+}
+
+/**
+ * Invoked by the filter manager with each change. The change is
+ * encoded once, and appended to the buffer of each replica.
+ * Sets skip the lock while no replica is subscribed. A set is
+ * logged under the lock of its filter, which the snapshot also
+ * holds when it reads the sequence, so a set that misses a new
+ * replica is already in the copy of its filter.
+ */
+static void log_change(void *data, filtmgr_change change, char *filter_name,
+        bloom_filter_config *config, char **keys, int num_keys, char *result) {
+    bloom_replication *repl = data;
+    if (change == FILTMGR_SET && !__atomic_load_n(&repl->num_subscribed, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&repl->lock);
+    uint64_t seq = ++repl->seq;
+    if (!repl->num_subscribed) {
+        pthread_mutex_unlock(&repl->lock);
+        return;
+    }
+
+    // Encode the change
+    repl_buffer *b = &repl->scratch;
+    b->len = 0;
+    uint64_t start;
+    switch (change) {
+        case FILTMGR_CREATE:
+            start = begin_frame(b, FRAME_CREATE);
+            buf_put_int(b, seq, 8);
+            buf_put_name(b, filter_name);
+            buf_put_config(b, config);
+            break;
+        case FILTMGR_DROP:
+        case FILTMGR_CLEAR:
+            start = begin_frame(b, (change == FILTMGR_DROP) ? FRAME_DROP : FRAME_CLEAR);
+            buf_put_int(b, seq, 8);
+            buf_put_name(b, filter_name);
+            break;
+        default:
+            // Only the keys that were added are sent
+            start = begin_frame(b, FRAME_SET);
+            buf_put_int(b, seq, 8);
+            buf_put_name(b, filter_name);
+            int added = 0;
+            for (int i=0; i < num_keys; i++) added += (result[i] == 1);
+            buf_put_int(b, added, 4);
+            for (int i=0; i < num_keys; i++) {
+                if (result[i] != 1) continue;
+                uint32_t len = strlen(keys[i]);
+                buf_put_int(b, len, 4);
+                buf_put(b, keys[i], len);
+            }
+            break;
+    }
+    end_frame(b, start);
+
+    // Queue it for the replicas
+    for (replica *r = repl->replicas; r; r = r->next) {
+        if (!r->subscribed || r->closed) continue;
+        if (r->pending.len + b->len > MAX_REPLICA_LAG) {
+            syslog(LOG_WARNING, "Disconnecting a replica that is too far behind!");
+            r->closed = 1;
+            shutdown(r->fd, SHUT_RDWR);
+            continue;
+        }
+        buf_put(&r->pending, b->buf, b->len);
+    }
+    pthread_cond_broadcast(&repl->cond);
+    pthread_mutex_unlock(&repl->lock);
+}
+
+/**
+ * Main thread serving a replica. Sends the snapshot
+ * and then the changes, until the replica is disconnected.
+ */
+static void* replica_main(void *in) {
+    replica *r = in;
+    bloom_replication *repl = r->repl;
+    if (recv_handshake(r->fd) || send_handshake(r->fd)) {
+        syslog(LOG_ERR, "Invalid replication handshake!");
+        goto EXIT;
+    }
+
+    // Buffer the changes, before we copy the filters
+    pthread_mutex_lock(&repl->lock);
+    r->subscribed = 1;
+    __atomic_add_fetch(&repl->num_subscribed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&repl->lock);
+
+    if (send_snapshot(r)) goto EXIT;
+    syslog(LOG_INFO, "Sent the snapshot to a replica, streaming the changes.");
+
+    // Send the changes as they are buffered
+    repl_buffer out = {NULL, 0, 0};
+    while (1) {
+        pthread_mutex_lock(&repl->lock);
+        while (!r->pending.len && !r->closed && !repl->stopping) {
+            pthread_cond_wait(&repl->cond, &repl->lock);
+        }
+        if (r->closed || repl->stopping) {
+            pthread_mutex_unlock(&repl->lock);
+            break;
+        }
+
+        // Swap the buffers, so they are reused
+        repl_buffer tmp = out;
+        out = r->pending;
+        r->pending = tmp;
+        r->pending.len = 0;
+        pthread_mutex_unlock(&repl->lock);
+
+        if (write_all(r->fd, out.buf, out.len)) {
+            if (!repl->stopping) {
+                syslog(LOG_WARNING, "Lost a replica. %s", strerror(errno));
+            }
+            break;
+        }
+    }
+    free(out.buf);
+
+EXIT:
+    pthread_mutex_lock(&repl->lock);
+    if (r->subscribed) __atomic_sub_fetch(&repl->num_subscribed, 1, __ATOMIC_RELEASE);
+    r->subscribed = 0;
+    r->closed = 1;
+    free(r->pending.buf);
+    r->pending.buf = NULL;
+    r->pending.len = r->pending.size = 0;
+    pthread_mutex_unlock(&repl->lock);
+    r->done = 1;
+    return NULL;
+}
+
+/**
+ * Sends the snapshot of all the filters to a replica. Each filter
+ * is copied under its lock, and then sent while the thread is
+ * offline, so slow replicas do not hold up the vacuum. The copy
+ * is sized before the lock is taken, so holding the lock costs
+ * one memcpy of the bitmaps. This needs as much memory again as
+ * the filter being copied, for each replica bootstrapping.
+ * @return 0 on success.
+ */
+static int send_snapshot(replica *r) {
+    bloom_replication *repl = r->repl;
+    bloom_filtmgr *mgr = repl->mgr;
+    bloom_filter_list_head *head;
+    filtmgr_client_checkpoint(mgr);
+    int res = filtmgr_list_filters(mgr, NULL, &head);
+    filtmgr_client_offline(mgr);
+    if (res) {
+        filtmgr_client_leave(mgr);
+        return -1;
+    }
+
+    int num_filters = 0;
+    for (bloom_filter_list *node = head->head; node && !res; node = node->next) {
+        if (r->closed || repl->stopping) {
+            res = -1;
+            break;
+        }
+
+        // Filters dropped since they were listed are skipped,
+        // the replica gets the drop in the stream.
+        snapshot_filter snap = {repl, {NULL, 0, 0}};
+        uint64_t bytes = 0;
+        filtmgr_client_checkpoint(mgr);
+        if (!filtmgr_filter_cb(mgr, node->filter_name, byte_size_cb, &bytes)) {
+            snap.out.size = bytes + SNAPSHOT_FRAME_BYTES;
+            snap.out.buf = malloc(snap.out.size);
+        }
+        int snap_res = filtmgr_snapshot_filter(mgr, node->filter_name, snapshot_filter_cb, &snap);
+        filtmgr_client_offline(mgr);
+        if (snap_res == -2) {
+            syslog(LOG_ERR, "Failed to fault in filter '%s' for a replica!", node->filter_name);
+            res = -1;
+        } else if (!snap_res) {
+            res = write_all(r->fd, snap.out.buf, snap.out.len);
+            num_filters++;
+        }
+        free(snap.out.buf);
+    }
+    filtmgr_cleanup_list(head);
+    filtmgr_client_leave(mgr);
+
+    // Mark the end of the snapshot
+    if (!res) {
+        unsigned char end[FRAME_HEADER_SIZE] = {FRAME_END};
+        res = write_all(r->fd, end, sizeof(end));
+    }
+    if (res) {
+        syslog(LOG_ERR, "Failed to send the snapshot to a replica!");
+        return -1;
+    }
+    syslog(LOG_INFO, "Sent %d filters to a replica.", num_filters);
+    return 0;
+}
+
+/**
+ * Invoked with a filter faulted in and locked, to copy it into
+ * the snapshot. The sequence is taken under the lock of the filter,
+ * so every change to it with a lower sequence is in the copy.
+ */
+static void snapshot_filter_cb(void *in, char *filter_name, bloom_filter *filter) {
+    snapshot_filter *snap = in;
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    repl_buffer *b = &snap->out;
+
+    pthread_mutex_lock(&snap->repl->lock);
+    uint64_t seq = snap->repl->seq;
+    pthread_mutex_unlock(&snap->repl->lock);
+
+    bloom_filter_config config = filter->filter_config;
+    config.size = bloomf_size(filter);
+    config.capacity = bloomf_capacity(filter);
+    config.bytes = bloomf_byte_size(filter);
+
+    uint64_t start = begin_frame(b, FRAME_FILTER);
+    buf_put_int(b, seq, 8);
+    buf_put_name(b, filter_name);
+    buf_put_config(b, &config);
+    end_frame(b, start);
+
+    // The SBF has the newest layer first
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        bloom_bitmap *map = sbf->filters[sbf->num_filters - i - 1]->map;
+        start = begin_frame(b, FRAME_LAYER);
+        buf_put_int(b, i, 4);
+        buf_put(b, map->mmap, map->size);
+        end_frame(b, start);
+    }
+}
+
+// Gets the size of the bitmaps of a filter
+static void byte_size_cb(void *in, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(uint64_t*)in = bloomf_byte_size(filter);
+}
+
+/**
+ * Main thread accepting replicas
+ */
+static void* listen_main(void *in) {
+    bloom_replication *repl = in;
+    struct pollfd pfd;
+    while (!repl->stopping) {
+        reap_replicas(repl, 0);
+        pfd.fd = repl->listen_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, LISTEN_POLL_MSEC) <= 0) continue;
+
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(repl->listen_fd, (struct sockaddr*)&addr, &addr_len);
+        if (fd < 0) continue;
+
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+        syslog(LOG_INFO, "Accepted a replica from %s.", inet_ntoa(addr.sin_addr));
+        replication_add_replica(repl, fd);
+    }
+    return NULL;
+}
+
+/**
+ * Opens the replication listener
+ * @return The listener, or -1 on error.
+ */
+static int open_listener(bloom_config *config) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(config->replication_port);
+    if (inet_pton(AF_INET, config->bind_address, &addr.sin_addr) != 1) {
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", config->bind_address);
+        return -1;
+    }
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) ||
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)) {
+        syslog(LOG_ERR, "Failed to listen on the replication port! Err: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Joins the threads of the disconnected replicas,
+ * and releases them.
+ * @arg all Join all the replicas, used once they are all stopping
+ */
+static void reap_replicas(bloom_replication *repl, int all) {
+    replica *reaped = NULL;
+    pthread_mutex_lock(&repl->lock);
+    replica **prev = &repl->replicas;
+    while (*prev) {
+        replica *r = *prev;
+        if (all || r->done) {
+            *prev = r->next;
+            r->next = reaped;
+            reaped = r;
+        } else {
+            prev = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&repl->lock);
+
+    while (reaped) {
+        replica *r = reaped;
+        reaped = r->next;
+        pthread_join(r->thread, NULL);
+        close(r->fd);
+        free(r);
+    }
+}
+
+/**
+ * Connects to the primary
+ * @arg address The host:port of the primary
+ * @arg fd Output, the connection
+ * @return 0 on success.
+ */
+static int connect_primary(char *address, int *fd) {
+    char *host = strdup(address);
+    char *port = strrchr(host, ':');
+    *port++ = '\0';
+
+    struct addrinfo hints, *addrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int res = getaddrinfo(host, port, &hints, &addrs);
+    if (res) {
+        syslog(LOG_ERR, "Failed to resolve the primary '%s'. %s", address, gai_strerror(res));
+        free(host);
+        return -1;
+    }
+
+    *fd = -1;
+    for (struct addrinfo *a = addrs; a && *fd < 0; a = a->ai_next) {
+        *fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (*fd >= 0 && connect(*fd, a->ai_addr, a->ai_addrlen)) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    free(host);
+    if (*fd < 0) {
+        syslog(LOG_ERR, "Failed to connect to the primary '%s'. %s", address, strerror(errno));
+        return -1;
+    }
+
+    int flag = 1;
+    setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+    syslog(LOG_INFO, "Replicating from the primary '%s'.", address);
+    return 0;
+}
+
+/**
+ * Streams a layer of the snapshot into its data file
+ * @arg path The folder of the filter
+ * @arg layer The layer, used to name the file
+ * @arg fd The connection to read from
+ * @arg len The size of the layer
+ * @return 0 on success.
+ */
+static int write_snapshot_layer(char *path, int layer, int fd, uint64_t len) {
+    char *filename = NULL;
+    int res = asprintf(&filename, DATA_FILE_NAME, layer);
+    assert(res != -1);
+    char *full_path = join_path(path, filename);
+    free(filename);
+
+    int out = open(full_path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (out < 0) {
+        syslog(LOG_ERR, "Failed to create '%s'. %s", full_path, strerror(errno));
+        free(full_path);
+        return -1;
+    }
+
+    // Copy in chunks
+    char buf[65536];
+    res = 0;
+    while (len && !res) {
+        uint64_t chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+        res = read_all(fd, buf, chunk) || write_all(out, buf, chunk);
+        len -= chunk;
+    }
+    if (close(out)) res = -1;
+    if (res) syslog(LOG_ERR, "Failed to write '%s'. %s", full_path, strerror(errno));
+    free(full_path);
+    return (res) ? -1 : 0;
+}
+
+/**
+ * Removes the filters and the pack from the data directory
+ * @return 0 on success.
+ */
+static int clear_data_dir(char *data_dir) {
+    DIR *dir = opendir(data_dir);
+    if (!dir) {
+        syslog(LOG_ERR, "Failed to open the data directory '%s'. %s", data_dir, strerror(errno));
+        return -1;
+    }
+
+    int res = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) && !res) {
+        if (strncmp(ent->d_name, FOLDER_PREFIX, sizeof(FOLDER_PREFIX) - 1) &&
+                strcmp(ent->d_name, PACK_FOLDER_NAME)) continue;
+        char *path = join_path(data_dir, ent->d_name);
+        res = remove_dir(path);
+        free(path);
+    }
+    closedir(dir);
+    return res;
+}
+
+/**
+ * Removes a directory, and the files in it
+ * @return 0 on success.
+ */
+static int remove_dir(char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return (errno == ENOTDIR) ? 0 : -1;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        char *file = join_path(path, ent->d_name);
+        if (unlink(file)) {
+            syslog(LOG_ERR, "Failed to delete '%s'. %s", file, strerror(errno));
+        }
+        free(file);
+    }
+    closedir(dir);
+    if (rmdir(path)) {
+        syslog(LOG_ERR, "Failed to delete '%s'. %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks a filter name, with the same rules as the
+ * protocol, since the name is used for the directory.
+ */
+static int valid_name(char *name) {
+    if (!name) return 0;
+    int len = 0;
+    for (; name[len]; len++) {
+        if (len == MAX_NAME_LEN || strchr(" \t\n\r/", name[len])) return 0;
+    }
+    return len > 0 && strcmp(name, ".") && strcmp(name, "..");
+}
+
+/**
+ * Main thread applying the changes from the primary. If the
+ * stream is lost, we stop bloomd, since the filters are stale
+ * and a new snapshot is needed.
+ */
+static void* follow_main(void *in) {
+    bloom_replication *repl = in;
+    unsigned char type;
+    uint64_t len;
+    unsigned char *buf = NULL;
+    uint64_t buf_size = 0;
+    int res = 0;
+    while (!repl->stopping) {
+        // Wait offline for the next change
+        filtmgr_client_offline(repl->mgr);
+        res = read_frame(repl->follow_fd, &type, &len);
+        if (res) break;
+        if (len > MAX_FRAME_SIZE) {
+            syslog(LOG_ERR, "Replication frame is too large!");
+            res = -1;
+            break;
+        }
+        if (len > buf_size) {
+            buf_size = len;
+            buf = realloc(buf, buf_size);
+        }
+        if (read_all(repl->follow_fd, buf, len)) {
+            res = -1;
+            break;
+        }
+
+        repl_reader r = {buf, buf + len, 0};
+        filtmgr_client_checkpoint(repl->mgr);
+        res = apply_change(repl, type, &r);
+        if (res) break;
+    }
+    free(buf);
+    filtmgr_client_leave(repl->mgr);
+
+    if (!repl->stopping) {
+        syslog(LOG_ERR, "Lost the replication stream from the primary! Exiting...");
+        repl->lost = 1;
+        *repl->should_run = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Applies a change from the primary. Changes are idempotent, so
+ * missing filters and existing filters are not errors, and
+ * changes already included in the snapshot are skipped.
+ * @return 0 on success, -1 if the change is malformed.
+ */
+static int apply_change(bloom_replication *repl, unsigned char type, repl_reader *r) {
+    uint64_t seq = get_int(r, 8);
+    char *name = get_name(r);
+    if (r->err) {
+        syslog(LOG_ERR, "Malformed replication change!");
+        free(name);
+        return -1;
+    }
+    if (skip_change(repl, name, seq)) {
+        free(name);
+        return 0;
+    }
+
+    int res = 0;
+    bloom_filtmgr *mgr = repl->mgr;
+    switch (type) {
+        case FRAME_CREATE: {
+            bloom_filter_config filter_config;
+            get_config(r, &filter_config);
+            if (r->err) {
+                res = -1;
+                break;
+            }
+            bloom_config *config = malloc(sizeof(bloom_config));
+            memcpy(config, repl->config, sizeof(bloom_config));
+            config->initial_capacity = filter_config.initial_capacity;
+            config->default_probability = filter_config.default_probability;
+            config->scale_size = filter_config.scale_size;
+            config->probability_reduction = filter_config.probability_reduction;
+            // Persisted like the filters of the snapshot
+            config->in_memory = 0;
+
+            // Wait for a drop of the same name to complete
+            int create_res;
+            while ((create_res = filtmgr_create_filter(mgr, name, config)) == -3 && !repl->stopping) {
+                filtmgr_client_offline(mgr);
+                usleep(CREATE_RETRY_USEC);
+                filtmgr_client_checkpoint(mgr);
+            }
+            if (create_res) free(config);
+            if (create_res == -2) {
+                syslog(LOG_ERR, "Failed to create replicated filter '%s'!", name);
+            }
+            break;
+        }
+
+        case FRAME_DROP:
+            filtmgr_drop_filter(mgr, name);
+            break;
+
+        case FRAME_CLEAR:
+            // Closed in the same step, since readers may be faulting it in.
+            // Replicated filters are persisted, so this does not fail.
+            if (filtmgr_close_clear_filter(mgr, name) == -2) {
+                syslog(LOG_ERR, "Failed to clear replicated filter '%s'!", name);
+            }
+            break;
+
+        case FRAME_SET: {
+            uint32_t num_keys = get_int(r, 4);
+            if (r->err || num_keys > (uint64_t)(r->end - r->pos) / 4) {
+                res = -1;
+                break;
+            }
+
+            // Copy the keys out, to terminate them
+            char **keys = malloc((num_keys ? num_keys : 1) * sizeof(char*));
+            char *key_buf = malloc(r->end - r->pos + num_keys + 1);
+            char *key = key_buf;
+            for (uint32_t i=0; i < num_keys; i++) {
+                uint32_t len = get_int(r, 4);
+                if (r->err || len > (uint64_t)(r->end - r->pos)) {
+                    res = -1;
+                    break;
+                }
+                memcpy(key, r->pos, len);
+                key[len] = '\0';
+                keys[i] = key;
+                key += len + 1;
+                r->pos += len;
+            }
+
+            char *result = malloc(num_keys ? num_keys : 1);
+            if (!res && num_keys && filtmgr_set_keys(mgr, name, keys, num_keys, result) == -2) {
+                syslog(LOG_ERR, "Failed to set replicated keys in filter '%s'!", name);
+            }
+            free(result);
+            free(key_buf);
+            free(keys);
+            break;
+        }
+
+        default:
+            res = -1;
+            break;
+    }
+
+    if (res) syslog(LOG_ERR, "Malformed replication change for filter '%s'!", name);
+    free(name);
+    return res;
+}
+
+/**
+ * Checks if a change is already included in the snapshot. A
+ * filter in the snapshot has every change up to the sequence
+ * it was copied at, including any earlier drop and create.
+ * @return 1 if the change should be skipped.
+ */
+static int skip_change(bloom_replication *repl, char *name, uint64_t seq) {
+    if (!repl->snapshot_seqs) return 0;
+
+    // Release the snapshot once the stream has caught up
+    if (seq > repl->snapshot_max) {
+        destroy_art_tree(repl->snapshot_seqs);
+        free(repl->snapshot_seqs);
+        repl->snapshot_seqs = NULL;
+        return 0;
+    }
+    uintptr_t copied = (uintptr_t)art_search(repl->snapshot_seqs, (unsigned char*)name, strlen(name)+1);
+    return copied && seq < copied;
+}
+
+/**
+ * Writes the whole buffer, retrying short writes.
+ * @return 0 on success.
+ */
+static int write_all(int fd, void *buf, uint64_t len) {
+    char *pos = buf;
+    ssize_t res;
+    while (len) {
+        res = write(fd, pos, len);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+        pos += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/**
+ * Reads the whole buffer, retrying short reads.
+ * @return 0 on success, -1 on error or early EOF.
+ */
+static int read_all(int fd, void *buf, uint64_t len) {
+    char *pos = buf;
+    ssize_t res;
+    while (len) {
+        res = read(fd, pos, len);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+        pos += res;
+        len -= res;
+    }
+    return 0;
+}
+
+// Sends the handshake
+static int send_handshake(int fd) {
+    repl_buffer b = {NULL, 0, 0};
+    buf_put(&b, REPL_MAGIC, 4);
+    buf_put_int(&b, REPL_VERSION, 4);
+    int res = write_all(fd, b.buf, b.len);
+    free(b.buf);
+    return res;
+}
+
+// Receives and checks the handshake
+static int recv_handshake(int fd) {
+    unsigned char buf[REPL_HANDSHAKE_SIZE];
+    if (read_all(fd, buf, sizeof(buf))) return -1;
+    repl_reader r = {buf + 4, buf + sizeof(buf), 0};
+    if (memcmp(buf, REPL_MAGIC, 4) || get_int(&r, 4) != REPL_VERSION) return -1;
+    return 0;
+}
+
+/**
+ * Reads the header of the next frame
+ * @return 0 on success.
+ */
+static int read_frame(int fd, unsigned char *type, uint64_t *len) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (read_all(fd, header, sizeof(header))) return -1;
+    repl_reader r = {header + 1, header + sizeof(header), 0};
+    *type = header[0];
+    *len = get_int(&r, 8);
+    return 0;
+}
+
+/**
+ * Starts a frame, the length is filled in by end_frame
+ * @return The offset of the frame
+ */
+static uint64_t begin_frame(repl_buffer *b, unsigned char type) {
+    uint64_t start = b->len;
+    buf_put_int(b, type, 1);
+    buf_put_int(b, 0, 8);
+    return start;
+}
+
+// Fills in the length of a frame
+static void end_frame(repl_buffer *b, uint64_t start) {
+    uint64_t len = b->len - start - FRAME_HEADER_SIZE;
+    for (int i=0; i < 8; i++) {
+        b->buf[start + 8 - i] = len >> (8 * i);
+    }
+}
+
+// Grows the buffer to fit more bytes
+static void buf_reserve(repl_buffer *b, uint64_t len) {
+    if (b->len + len <= b->size) return;
+    uint64_t size = (b->size) ? b->size : 4096;
+    while (size < b->len + len) size *= 2;
+    b->buf = realloc(b->buf, size);
+    b->size = size;
+}
+
+static void buf_put(repl_buffer *b, const void *data, uint64_t len) {
+    buf_reserve(b, len);
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+// Appends an integer of the given size in bytes, big endian
+static void buf_put_int(repl_buffer *b, uint64_t val, int bytes) {
+    buf_reserve(b, bytes);
+    for (int i=0; i < bytes; i++) {
+        b->buf[b->len + i] = val >> (8 * (bytes - i - 1));
+    }
+    b->len += bytes;
+}
+
+static void buf_put_double(repl_buffer *b, double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    buf_put_int(b, bits, 8);
+}
+
+// Appends a name, prefixed by its 2 byte length
+static void buf_put_name(repl_buffer *b, char *name) {
+    uint16_t len = strlen(name);
+    buf_put_int(b, len, 2);
+    buf_put(b, name, len);
+}
+
+static void buf_put_config(repl_buffer *b, bloom_filter_config *config) {
+    buf_put_int(b, config->initial_capacity, 8);
+    buf_put_double(b, config->default_probability);
+    buf_put_int(b, config->scale_size, 4);
+    buf_put_double(b, config->probability_reduction);
+    buf_put_int(b, config->in_memory, 1);
+    buf_put_int(b, config->size, 8);
+    buf_put_int(b, config->capacity, 8);
+    buf_put_int(b, config->bytes, 8);
+}
+
+// Reads an integer of the given size in bytes, big endian
+static uint64_t get_int(repl_reader *r, int bytes) {
+    if (r->end - r->pos < bytes) {
+        r->err = 1;
+        return 0;
+    }
+    uint64_t val = 0;
+    for (int i=0; i < bytes; i++) {
+        val = (val << 8) | r->pos[i];
+    }
+    r->pos += bytes;
+    return val;
+}
+
+static double get_double(repl_reader *r) {
+    uint64_t bits = get_int(r, 8);
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+// Reads a name, returns a new string or NULL
+static char* get_name(repl_reader *r) {
+    uint16_t len = get_int(r, 2);
+    if (r->err || r->end - r->pos < len) {
+        r->err = 1;
+        return NULL;
+    }
+    char *name = malloc(len + 1);
+    memcpy(name, r->pos, len);
+    name[len] = '\0';
+    r->pos += len;
+    return name;
+}
+
+static void get_config(repl_reader *r, bloom_filter_config *config) {
+    config->initial_capacity = get_int(r, 8);
+    config->default_probability = get_double(r);
+    config->scale_size = get_int(r, 4);
+    config->probability_reduction = get_double(r);
+    config->in_memory = get_int(r, 1);
+    config->size = get_int(r, 8);
+    config->capacity = get_int(r, 8);
+    config->bytes = get_int(r, 8);
+}
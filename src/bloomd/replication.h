@@ -0,0 +1,73 @@
+#ifndef BLOOM_REPLICATION_H
+#define BLOOM_REPLICATION_H
+#include "config.h"
+#include "filter_manager.h"
+
+/**
+ * Replication lets read-only replicas serve checks for
+ * the filters of a primary. A primary with a replication_port
+ * accepts replicas over TCP. Each new replica is sent a snapshot
+ * of the bitmaps of every filter, followed by a stream of the
+ * changes made since: creates, drops, clears, and the keys that
+ * were added to a filter. A replica set with replicate_from
+ * bootstraps from the snapshot before loading its filters, and
+ * then applies the stream. If the stream is lost, the replica
+ * exits, so that it is restarted and bootstraps again.
+ *
+ * A replica can also serve its own replicas, since the changes
+ * it applies are streamed in turn.
+ */
+typedef struct bloom_replication bloom_replication;
+
+/**
+ * Initializes replication. If the configuration has replicate_from,
+ * this connects to the primary and bootstraps from its snapshot,
+ * replacing any filters in the data directory. This must be
+ * invoked before the filter manager is initialized.
+ * @arg config The configuration
+ * @arg should_run Cleared if the stream from the primary is lost
+ * @arg repl Output, the replication state
+ * @return 0 on success.
+ */
+int init_replication(bloom_config *config, int *should_run, bloom_replication **repl);
+
+/**
+ * Bootstraps from a snapshot on a connection to a primary,
+ * replacing any filters in the data directory. The changes that
+ * follow are applied once replication is started.
+ * @arg repl The replication state
+ * @arg fd The connection to the primary, owned by repl
+ * @return 0 on success.
+ */
+int replication_bootstrap(bloom_replication *repl, int fd);
+
+/**
+ * Starts replication once the filters are loaded. The changes
+ * to the filters are streamed to any replicas, the replication
+ * port is opened if configured, and the stream from the primary
+ * is applied after a bootstrap.
+ * @arg repl The replication state
+ * @arg mgr The filter manager
+ * @return 0 on success.
+ */
+int start_replication(bloom_replication *repl, bloom_filtmgr *mgr);
+
+/**
+ * Serves a replica on a connection. The snapshot and the
+ * stream are sent by a new thread.
+ * @arg repl The replication state
+ * @arg fd The connection from the replica, owned by repl
+ * @return 0 on success.
+ */
+int replication_add_replica(bloom_replication *repl, int fd);
+
+/**
+ * Stops replication, disconnecting all the replicas
+ * and the primary. This must be invoked before the
+ * filter manager is destroyed.
+ * @arg repl The replication state
+ * @return 0 on success, 1 if the stream from the primary was lost.
+ */
+int destroy_replication(bloom_replication *repl);
+
+#endif
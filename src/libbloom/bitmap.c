@@ -5,17 +5,38 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <strings.h>
+#include <string.h>
 #include <errno.h>
 #include <syslog.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include "bitmap.h"
 
+/**
+ * Bitmaps are compressed a page at a time. Each
+ * page is encoded as a tag followed by its contents.
+ */
+#define PACKED_PAGE_SIZE 4096
+#define PAGE_EMPTY 0    // All zero, no contents
+#define PAGE_SPARSE 1   // A count, and (offset, byte) pairs
+#define PAGE_RAW 2      // The page as is
+
+/**
+ * The encoded size of a sparse page, with
+ * the given number of non-zero bytes.
+ */
+#define SPARSE_SIZE(count) (sizeof(uint16_t) + (count) * (sizeof(uint16_t) + 1))
+
 /* Static declarations */
 static void* alloc_dirty_page_bitmap(uint64_t len);
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
+static int fill_buffer(int fileno, unsigned char* buf, uint64_t len, uint64_t offset);
 static int flush_dirty_pages(bloom_bitmap *map);
-static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
+static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page, unsigned char *staging);
+static void enable_direct_io(bloom_bitmap *map);
+static void disable_direct_io(bloom_bitmap *map);
+static int set_direct_io(int fileno, int enable);
+static void drop_cached_pages(bloom_bitmap *map);
+static uint64_t page_nonzero(unsigned char *page, uint64_t len);
 extern inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
 
@@ -34,9 +55,10 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
         return -EINVAL;
     }
 
-    // Check for and clear NEW_BITMAP from the mode
+    // Check for and clear NEW_BITMAP and DIRECT_IO from the mode
     int new_bitmap = (mode & NEW_BITMAP) ? 1 : 0;
-    mode &= ~NEW_BITMAP;
+    int direct_io = (mode & DIRECT_IO) ? 1 : 0;
+    mode &= ~(NEW_BITMAP | DIRECT_IO);
 
     // Handle each mode
     int flags;
@@ -99,7 +121,7 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
 
         // For existing bitmaps we need to read in the data
         // since we cannot use the kernel to fault it in
-        if (!new_bitmap && (res = fill_buffer(newfileno, addr, len))) {
+        if (!new_bitmap && (res = fill_buffer(newfileno, addr, len, 0))) {
             free(dirty);
             munmap(addr, len);
             if (newfileno >= 0) close(newfileno);
@@ -113,6 +135,69 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
     map->size = len;
     map->mmap = addr;
     map->dirty_pages = dirty;
+    map->packed = NULL;
+    map->packed_len = 0;
+    map->offset = 0;
+    map->is_extent = 0;
+    map->is_direct = 0;
+    map->drop_cache = 0;
+    if (mode == PERSISTENT && direct_io) enable_direct_io(map);
+    return 0;
+}
+
+/**
+ * Returns a PERSISTENT bloom_bitmap over an extent of a file,
+ * so that many bitmaps can share a single file. The file handle
+ * is borrowed, and must stay open until the bitmap is closed.
+ * @arg fileno The fileno, opened with read/write privileges.
+ * @arg offset The offset of the bitmap in the file.
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode PERSISTENT, optionally with NEW_BITMAP if the contents
+ * should not be read, and DIRECT_IO. The shared file handle is
+ * never switched to O_DIRECT, so DIRECT_IO drops the cached pages
+ * of the extent after each flush instead.
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_extent(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, bloom_bitmap *map) {
+    int new_bitmap = (mode & NEW_BITMAP) ? 1 : 0;
+    int direct_io = (mode & DIRECT_IO) ? 1 : 0;
+    mode &= ~(NEW_BITMAP | DIRECT_IO);
+    if (len == 0 || fileno < 0 || mode != PERSISTENT) return -EINVAL;
+
+    unsigned char* addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+            MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap failed!");
+        return -errno;
+    }
+
+    unsigned char* dirty = alloc_dirty_page_bitmap(len);
+    if (!dirty) {
+        munmap(addr, len);
+        return -ENOMEM;
+    }
+
+    // Read in the existing data
+    int res;
+    if (!new_bitmap && (res = fill_buffer(fileno, addr, len, offset))) {
+        free(dirty);
+        munmap(addr, len);
+        return res;
+    }
+
+    map->mode = PERSISTENT;
+    map->fileno = fileno;
+    map->size = len;
+    map->mmap = addr;
+    map->dirty_pages = dirty;
+    map->packed = NULL;
+    map->packed_len = 0;
+    map->offset = offset;
+    map->is_extent = 1;
+    map->is_direct = 0;
+    map->drop_cache = 0;
+    if (direct_io) enable_direct_io(map);
     return 0;
 }
 
@@ -136,13 +221,13 @@ static void* alloc_dirty_page_bitmap(uint64_t len) {
 
 
 /*
- * Populates a buffer with the contents of a file
+ * Populates a buffer with the contents of a file, from an offset
  */
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
+static int fill_buffer(int fileno, unsigned char* buf, uint64_t len, uint64_t offset) {
     uint64_t total_read = 0;
     ssize_t more;
     while (total_read < len) {
-        more = pread(fileno, buf+total_read, len-total_read, total_read);
+        more = pread(fileno, buf+total_read, len-total_read, offset+total_read);
         if (more == 0)
             break;
         else if (more < 0 && errno != EINTR) {
@@ -257,6 +342,10 @@ int bitmap_flush(bloom_bitmap *map) {
     // SHARED / PERSISTENT both have a file backing
     res = fsync(map->fileno);
     if (res == -1) return -errno;
+
+    // The pages are clean now, and can be dropped. Direct I/O
+    // still caches a partial last page.
+    if (map->drop_cache || map->is_direct) drop_cached_pages(map);
     return 0;
 }
 
@@ -285,6 +374,14 @@ static int flush_dirty_pages(bloom_bitmap *map) {
         syslog(LOG_ERR, "Failed to allocate new dirty page bitmap!");
         return -1;
     }
+
+    // Direct writes need an aligned buffer to stage the pages
+    void *staging = NULL;
+    if (map->is_direct && posix_memalign(&staging, 4096, 4096)) {
+        syslog(LOG_ERR, "Failed to allocate direct I/O staging page!");
+        free(new_dirty);
+        return -1;
+    }
     unsigned char* dirty_pages = map->dirty_pages;
     map->dirty_pages = new_dirty;
 
@@ -298,21 +395,25 @@ static int flush_dirty_pages(bloom_bitmap *map) {
 
         if (dirty || i == 0) {
             // Flush the page
-            res = flush_page(map, i, map->size, pages - 1);
+            res = flush_page(map, i, map->size, pages - 1, staging);
             if (res) goto LEAVE;
         }
     }
 LEAVE:
     // Cleanup the old bitmap
     free(dirty_pages);
+    free(staging);
     return res;
 }
 
 
 /**
- * Flushes out a single page that is dirty
+ * Flushes out a single page that is dirty. For direct I/O,
+ * full pages are copied to the aligned staging page, so they
+ * do not change while the write is in flight. A partial last
+ * page cannot be written directly, and goes through the cache.
  */
-static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page) {
+static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page, unsigned char *staging) {
     int res, total = 0;
     uint64_t offset = page * 4096;
 
@@ -322,17 +423,261 @@ static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t
         should_write = size % 4096;
     }
 
+    unsigned char *buf = map->mmap + offset;
+    int buffered = 0;
+    if (map->is_direct && should_write == 4096) {
+        memcpy(staging, buf, 4096);
+        buf = staging;
+    } else if (map->is_direct) {
+        buffered = !set_direct_io(map->fileno, 0);
+    }
+
     while (total < should_write) {
-        res = pwrite(map->fileno, map->mmap + offset + total,
-                should_write - total, offset + total);
-        if (res == -1 && errno != EINTR)
+        res = pwrite(map->fileno, buf + total,
+                should_write - total, map->offset + offset + total);
+        if (res == -1 && errno == EINVAL && map->is_direct) {
+            // The file system does not support direct writes after all
+            disable_direct_io(map);
+            buf = map->mmap + offset;
+        } else if (res == -1 && errno != EINTR)
             return -errno;
-        else
+        else if (res > 0)
             total += res;
     }
+
+    if (buffered && map->is_direct) set_direct_io(map->fileno, 1);
     return 0;
 }
 
+/**
+ * Keeps the flushed pages of a PERSISTENT bitmap out of
+ * the page cache, since they are already in our memory.
+ * Uses O_DIRECT where possible, otherwise the cached pages
+ * are dropped after each flush. Borrowed file handles are
+ * never switched to O_DIRECT, since they are shared.
+ */
+static void enable_direct_io(bloom_bitmap *map) {
+    // Drop anything cached by reading in the bitmap
+    drop_cached_pages(map);
+    map->drop_cache = 1;
+    if (!map->is_extent && !set_direct_io(map->fileno, 1)) {
+        map->is_direct = 1;
+        map->drop_cache = 0;
+    }
+}
+
+// Falls back to dropping the cached pages after a flush
+static void disable_direct_io(bloom_bitmap *map) {
+    syslog(LOG_WARNING, "Direct I/O is not supported, dropping cached pages instead.");
+    set_direct_io(map->fileno, 0);
+    map->is_direct = 0;
+    map->drop_cache = 1;
+}
+
+/**
+ * Sets or clears O_DIRECT on a file handle.
+ * @return 0 on success, -1 if not supported.
+ */
+static int set_direct_io(int fileno, int enable) {
+#ifdef O_DIRECT
+    int flags = fcntl(fileno, F_GETFL);
+    if (flags == -1) return -1;
+    flags = (enable) ? flags | O_DIRECT : flags & ~O_DIRECT;
+    return (fcntl(fileno, F_SETFL, flags) == -1) ? -1 : 0;
+#else
+    (void)fileno;
+    (void)enable;
+    return -1;
+#endif
+}
+
+// Drops the clean cached pages of the bitmap
+static void drop_cached_pages(bloom_bitmap *map) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(map->fileno, map->offset, map->size, POSIX_FADV_DONTNEED);
+#else
+    (void)map;
+#endif
+}
+
+
+/**
+ * Returns the number of bytes that a flush of the bitmap
+ * would write. PERSISTENT bitmaps track their dirty pages,
+ * and always write the first page. SHARED bitmaps leave the
+ * dirty pages to the kernel, so the full size is returned as
+ * an upper bound. ANONYMOUS bitmaps are never written.
+ * @note Not safe to call concurrently with a flush.
+ * @arg map The bitmap
+ * @returns The number of dirty bytes.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL || map->mode == ANONYMOUS) return 0;
+    if (map->mode == SHARED) return map->size;
+
+    // Count the dirty pages, a byte at a time. The
+    // unused bits of the last byte are never set.
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t dirty = 0;
+    for (uint64_t i=0; i < (pages + 7) / 8; i++) {
+        dirty += __builtin_popcount(map->dirty_pages[i]);
+    }
+
+    // The first page is always written
+    if (!(map->dirty_pages[0] & 0x80)) dirty++;
+
+    // The last page may be partial
+    uint64_t bytes = dirty * 4096;
+    return (bytes < map->size) ? bytes : map->size;
+}
+
+
+/**
+ * Compresses an ANONYMOUS bitmap in memory. Each page after the
+ * first is encoded as empty, as a sparse list of its non-zero bytes,
+ * or as is, and the pages are released back to the kernel.
+ * @arg map The bitmap
+ * @returns 0 on success, 1 if the bitmap would not shrink by at
+ * least half and was left as is, negative on failure.
+ */
+int bitmap_compress(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL || map->mode != ANONYMOUS) return -EINVAL;
+    if (map->packed) return 0;
+    if (map->size <= PACKED_PAGE_SIZE) return 1;
+
+    // Size the encoding first, and bail if it does not pay off
+    uint64_t pages = (map->size + PACKED_PAGE_SIZE - 1) / PACKED_PAGE_SIZE;
+    uint64_t len = 0, page_len, count;
+    for (uint64_t p=1; p < pages; p++) {
+        page_len = (p == pages - 1) ? map->size - p * PACKED_PAGE_SIZE : PACKED_PAGE_SIZE;
+        count = page_nonzero(map->mmap + p * PACKED_PAGE_SIZE, page_len);
+        len += 1;
+        if (!count) continue;
+        len += (SPARSE_SIZE(count) < page_len) ? SPARSE_SIZE(count) : page_len;
+        if (len > map->size / 2) return 1;
+    }
+
+    unsigned char *packed = malloc(len);
+    if (!packed) return -ENOMEM;
+
+    // Encode the pages
+    unsigned char *out = packed, *page;
+    uint16_t val;
+    for (uint64_t p=1; p < pages; p++) {
+        page = map->mmap + p * PACKED_PAGE_SIZE;
+        page_len = (p == pages - 1) ? map->size - p * PACKED_PAGE_SIZE : PACKED_PAGE_SIZE;
+        count = page_nonzero(page, page_len);
+        if (!count) {
+            *out++ = PAGE_EMPTY;
+
+        } else if (SPARSE_SIZE(count) < page_len) {
+            *out++ = PAGE_SPARSE;
+            val = count;
+            memcpy(out, &val, sizeof(uint16_t));
+            out += sizeof(uint16_t);
+            for (uint64_t i=0; i < page_len; i++) {
+                if (!page[i]) continue;
+                val = i;
+                memcpy(out, &val, sizeof(uint16_t));
+                out += sizeof(uint16_t);
+                *out++ = page[i];
+            }
+
+        } else {
+            *out++ = PAGE_RAW;
+            memcpy(out, page, page_len);
+            out += page_len;
+        }
+    }
+
+    // Release the pages, they read as zero until decompressed.
+    // If that fails, some may be released, so restore them.
+    map->packed = packed;
+    map->packed_len = len;
+    int res = madvise(map->mmap + PACKED_PAGE_SIZE, map->size - PACKED_PAGE_SIZE, MADV_DONTNEED);
+    if (res != 0) {
+        res = -errno;
+        bitmap_decompress(map);
+        return res;
+    }
+    return 0;
+}
+
+/**
+ * Decompresses a bitmap compressed with bitmap_compress.
+ * Only the non-empty pages are written back, so the empty
+ * pages use no memory until they are set.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_decompress(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL) return -EINVAL;
+    if (!map->packed) return 0;
+
+    uint64_t pages = (map->size + PACKED_PAGE_SIZE - 1) / PACKED_PAGE_SIZE;
+    unsigned char *in = map->packed, *page;
+    uint64_t page_len;
+    uint16_t count, off;
+    for (uint64_t p=1; p < pages; p++) {
+        page = map->mmap + p * PACKED_PAGE_SIZE;
+        page_len = (p == pages - 1) ? map->size - p * PACKED_PAGE_SIZE : PACKED_PAGE_SIZE;
+        switch (*in++) {
+            case PAGE_EMPTY:
+                break;
+            case PAGE_SPARSE:
+                memcpy(&count, in, sizeof(uint16_t));
+                in += sizeof(uint16_t);
+                for (uint16_t i=0; i < count; i++) {
+                    memcpy(&off, in, sizeof(uint16_t));
+                    in += sizeof(uint16_t);
+                    page[off] = *in++;
+                }
+                break;
+            case PAGE_RAW:
+                memcpy(page, in, page_len);
+                in += page_len;
+                break;
+        }
+    }
+
+    free(map->packed);
+    map->packed = NULL;
+    map->packed_len = 0;
+    return 0;
+}
+
+/**
+ * Returns the number of bytes of memory used by the
+ * bitmap, which is smaller than its size if compressed.
+ */
+uint64_t bitmap_resident_bytes(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL) return 0;
+    if (map->packed) return PACKED_PAGE_SIZE + map->packed_len;
+    return map->size;
+}
+
+/**
+ * Starts reading the pages of a SHARED bitmap in the
+ * background, so later accesses do not fault on the disk.
+ * The other modes are read in full when created, so
+ * this is a no-op for them.
+ */
+int bitmap_prefetch(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL) return -EINVAL;
+    if (!(map->mode & SHARED)) return 0;
+    if (madvise(map->mmap, map->size, MADV_WILLNEED)) return -errno;
+    return 0;
+}
+
+// Counts the non-zero bytes of a page
+static uint64_t page_nonzero(unsigned char *page, uint64_t len) {
+    uint64_t count = 0;
+    for (uint64_t i=0; i < len; i++) {
+        count += (page[i] != 0);
+    }
+    return count;
+}
+
 
 /**
  * Closes and flushes the bitmap. This is
@@ -354,8 +699,8 @@ int bitmap_close(bloom_bitmap *map) {
     res = munmap(map->mmap, map->size);
     if (res != 0) return -errno;
 
-    // Close the file descriptor if file backed
-    if (map->mode != ANONYMOUS) {
+    // Close the file descriptor if file backed, and not borrowed
+    if (map->mode != ANONYMOUS && !map->is_extent) {
        res = close(map->fileno);
        if (res != 0) return -errno;
     }
@@ -366,6 +711,13 @@ int bitmap_close(bloom_bitmap *map) {
         map->dirty_pages = NULL;
     }
 
+    // Drop the compressed pages if any
+    if (map->packed) {
+        free(map->packed);
+        map->packed = NULL;
+        map->packed_len = 0;
+    }
+
     // Cleanup
     map->mmap = NULL;
     map->fileno = -1;
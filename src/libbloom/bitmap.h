@@ -8,7 +8,8 @@ typedef enum {
     SHARED      = 1, // MAP_SHARED mmap used, file backed.
     PERSISTENT  = 2, // MAP_ANONYMOUS used, file backed.
     ANONYMOUS   = 4, // MAP_ANONYMOUS mmap used. No file backing.
-    NEW_BITMAP  = 8  // File contents not read. Used with PERSISTENT
+    NEW_BITMAP  = 8, // File contents not read. Used with PERSISTENT
+    DIRECT_IO   = 16 // Keep flushed pages out of the page cache. Used with PERSISTENT
 } bitmap_mode;
 
 typedef struct {
@@ -17,6 +18,12 @@ typedef struct {
     uint64_t size;       // Size of bitmap in bytes
     unsigned char* mmap; // Starting address of the bitmap region
     unsigned char* dirty_pages; // Used for the PERSISTENT mode.
+    unsigned char* packed;  // Compressed pages, NULL unless compressed
+    uint64_t packed_len;    // Length of the compressed pages
+    uint64_t offset;     // Offset of the bitmap in the file
+    int is_extent;       // Set if the fileno is borrowed, see bitmap_from_extent
+    int is_direct;       // Set if the fileno is opened with O_DIRECT
+    int drop_cache;      // Set to drop the cached pages after a flush
 } bloom_bitmap;
 
 /**
@@ -30,6 +37,22 @@ typedef struct {
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *map);
 
+/**
+ * Returns a PERSISTENT bloom_bitmap over an extent of a file,
+ * so that many bitmaps can share a single file. The file handle
+ * is borrowed, and must stay open until the bitmap is closed.
+ * @arg fileno The fileno, opened with read/write privileges.
+ * @arg offset The offset of the bitmap in the file.
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode PERSISTENT, optionally with NEW_BITMAP if the contents
+ * should not be read, and DIRECT_IO. The shared file handle is
+ * never switched to O_DIRECT, so DIRECT_IO drops the cached pages
+ * of the extent after each flush instead.
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_extent(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, bloom_bitmap *map);
+
 /**
  * Returns a bloom_bitmap pointer from a filename.
  * Opens the file with read/write privileges. If create
@@ -53,6 +76,58 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
  */
 int bitmap_flush(bloom_bitmap *map);
 
+/**
+ * Returns the number of bytes that a flush of the bitmap
+ * would write. PERSISTENT bitmaps track their dirty pages,
+ * and always write the first page. SHARED bitmaps leave the
+ * dirty pages to the kernel, so the full size is returned as
+ * an upper bound. ANONYMOUS bitmaps are never written.
+ * @note Not safe to call concurrently with a flush.
+ * @arg map The bitmap
+ * @returns The number of dirty bytes.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map);
+
+/**
+ * Compresses an ANONYMOUS bitmap in memory. Each page after the
+ * first is encoded as empty, as a sparse list of its non-zero bytes,
+ * or as is, and the pages are released back to the kernel. The
+ * address range is kept, so pointers into the bitmap remain valid,
+ * and the first page is left in place so it can still be read.
+ * The bitmap must be decompressed before any other page is used.
+ * @arg map The bitmap
+ * @returns 0 on success, 1 if the bitmap would not shrink by at
+ * least half and was left as is, negative on failure.
+ */
+int bitmap_compress(bloom_bitmap *map);
+
+/**
+ * Decompresses a bitmap compressed with bitmap_compress.
+ * Only the non-empty pages are written back, so the empty
+ * pages use no memory until they are set.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_decompress(bloom_bitmap *map);
+
+/**
+ * Returns the number of bytes of memory used by the
+ * bitmap, which is smaller than its size if compressed.
+ * @arg map The bitmap
+ * @returns The number of bytes.
+ */
+uint64_t bitmap_resident_bytes(bloom_bitmap *map);
+
+/**
+ * Starts reading the pages of a SHARED bitmap in the
+ * background, so later accesses do not fault on the disk.
+ * The other modes are read in full when created, so
+ * this is a no-op for them.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_prefetch(bloom_bitmap *map);
+
 /**
  * * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -128,6 +128,81 @@ int sbf_flush(bloom_sbf *sbf) {
     return res;
 }
 
+/**
+ * Returns the number of bytes that a flush of the
+ * SBF would write, using bitmap_dirty_bytes.
+ */
+uint64_t sbf_dirty_bytes(bloom_sbf *sbf) {
+    uint64_t bytes = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        if (sbf->dirty_filters[i] == 1) {
+            bytes += bitmap_dirty_bytes(sbf->filters[i]->map);
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Compresses the filters of an in-memory SBF, using
+ * bitmap_compress. The SBF must be decompressed before use.
+ * On failure, the filters already compressed are decompressed,
+ * so the SBF is left usable.
+ * @return The number of filters compressed, negative on failure.
+ */
+int sbf_compress(bloom_sbf *sbf) {
+    int res, compressed = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        res = bitmap_compress(sbf->filters[i]->map);
+        if (res < 0) {
+            for (uint32_t j=0;j<i;j++) {
+                bitmap_decompress(sbf->filters[j]->map);
+            }
+            return res;
+        }
+        if (res == 0) compressed++;
+    }
+    return compressed;
+}
+
+/**
+ * Decompresses the filters of an SBF.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_decompress(bloom_sbf *sbf) {
+    int res = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        res = bitmap_decompress(sbf->filters[i]->map);
+        if (res != 0) break;
+    }
+    return res;
+}
+
+/**
+ * Returns the number of bytes of memory used by the SBF,
+ * using bitmap_resident_bytes.
+ */
+uint64_t sbf_resident_bytes(bloom_sbf *sbf) {
+    uint64_t bytes = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        bytes += bitmap_resident_bytes(sbf->filters[i]->map);
+    }
+    return bytes;
+}
+
+/**
+ * Prefetches the pages of all the filters,
+ * using bitmap_prefetch.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_prefetch(bloom_sbf *sbf) {
+    int res = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        int r = bitmap_prefetch(sbf->filters[i]->map);
+        if (r) res = r;
+    }
+    return res;
+}
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap and filters,
  * and frees them.
@@ -102,6 +102,39 @@ uint64_t sbf_size(bloom_sbf *sbf);
  */
 int sbf_flush(bloom_sbf *sbf);
 
+/**
+ * Returns the number of bytes that a flush of the
+ * SBF would write, using bitmap_dirty_bytes.
+ */
+uint64_t sbf_dirty_bytes(bloom_sbf *sbf);
+
+/**
+ * Compresses the filters of an in-memory SBF, using
+ * bitmap_compress. The SBF must be decompressed before use.
+ * On failure, the filters already compressed are decompressed.
+ * @return The number of filters compressed, negative on failure.
+ */
+int sbf_compress(bloom_sbf *sbf);
+
+/**
+ * Decompresses the filters of an SBF.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_decompress(bloom_sbf *sbf);
+
+/**
+ * Returns the number of bytes of memory used by the SBF,
+ * using bitmap_resident_bytes.
+ */
+uint64_t sbf_resident_bytes(bloom_sbf *sbf);
+
+/**
+ * Prefetches the pages of all the filters,
+ * using bitmap_prefetch.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_prefetch(bloom_sbf *sbf);
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap and filters,
  * and frees them.
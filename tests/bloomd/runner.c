@@ -5,6 +5,11 @@
 #include "test_filter.c"
 #include "test_filtmgr.c"
 #include "test_art.c"
+#include "test_hashmap.c"
+#include "test_pack.c"
+#include "test_handoff.c"
+#include "test_libbloomd.c"
+#include "test_replication.c"
 
 int main(void)
 {
@@ -15,6 +20,11 @@ int main(void)
     TCase *tc3 = tcase_create("filter");
     TCase *tc4 = tcase_create("filter manager");
     TCase *tc5 = tcase_create("art");
+    TCase *tc6 = tcase_create("hashmap");
+    TCase *tc7 = tcase_create("pack");
+    TCase *tc8 = tcase_create("handoff");
+    TCase *tc9 = tcase_create("libbloomd");
+    TCase *tc10 = tcase_create("replication");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -38,6 +48,20 @@ int main(void)
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_use_reuseport);
+    tcase_add_test(tc1, test_sane_cpu_affinity);
+    tcase_add_test(tc1, test_sane_unix_socket);
+    tcase_add_test(tc1, test_sane_shard_filters);
+    tcase_add_test(tc1, test_sane_io_threads);
+    tcase_add_test(tc1, test_sane_flush_threads);
+    tcase_add_test(tc1, test_sane_compress_interval);
+    tcase_add_test(tc1, test_sane_pack_sizes);
+    tcase_add_test(tc1, test_sane_use_direct_io);
+    tcase_add_test(tc1, test_sane_handoff_socket);
+    tcase_add_test(tc1, test_sane_warmup_threads);
+    tcase_add_test(tc1, test_sane_hotset_interval);
+    tcase_add_test(tc1, test_sane_replication_port);
+    tcase_add_test(tc1, test_sane_replicate_from);
     tcase_add_test(tc1, test_filter_config_bad_file);
     tcase_add_test(tc1, test_filter_config_empty_file);
     tcase_add_test(tc1, test_filter_config_basic_config);
@@ -59,6 +83,10 @@ int main(void)
     tcase_add_test(tc3, test_filter_restore_order);
     tcase_add_test(tc3, test_filter_page_out);
     tcase_add_test(tc3, test_filter_bounded_fp);
+    tcase_add_test(tc3, test_filter_dirty_bytes);
+    tcase_add_test(tc3, test_filter_compress);
+    tcase_add_test(tc3, test_filter_compress_persistent);
+    tcase_add_test(tc3, test_filter_packed);
 
     // Add the filter tests
     suite_add_tcase(s1, tc4);
@@ -77,10 +105,13 @@ int main(void)
     tcase_add_test(tc4, test_mgr_unmap_no_filter);
     tcase_add_test(tc4, test_mgr_unmap);
     tcase_add_test(tc4, test_mgr_unmap_add_keys);
+    tcase_add_test(tc4, test_mgr_prefault);
+    tcase_add_test(tc4, test_mgr_list_hot);
     tcase_add_test(tc4, test_mgr_clear_no_filter);
     tcase_add_test(tc4, test_mgr_clear_not_proxied);
     tcase_add_test(tc4, test_mgr_clear);
     tcase_add_test(tc4, test_mgr_clear_reload);
+    tcase_add_test(tc4, test_mgr_close_clear);
     tcase_add_test(tc4, test_mgr_list_cold_no_filters);
     tcase_add_test(tc4, test_mgr_list_cold);
     tcase_add_test(tc4, test_mgr_unmap_in_mem);
@@ -88,6 +119,15 @@ int main(void)
     tcase_add_test(tc4, test_mgr_grow);
     tcase_add_test(tc4, test_mgr_restore);
     tcase_add_test(tc4, test_mgr_callback);
+    tcase_add_test(tc4, test_mgr_is_proxied);
+    tcase_add_test(tc4, test_mgr_drop_create_vacuum);
+    tcase_add_test(tc4, test_mgr_handle);
+    tcase_add_test(tc4, test_mgr_iter_filters);
+    tcase_add_test(tc4, test_mgr_iter_cold_filters);
+    tcase_add_test(tc4, test_mgr_list_dirty);
+    tcase_add_test(tc4, test_mgr_max_resident);
+    tcase_add_test(tc4, test_mgr_max_resident_in_memory);
+    tcase_add_test(tc4, test_mgr_compress_idle);
 
     // Add the art tests
     suite_add_tcase(s1, tc5);
@@ -99,8 +139,46 @@ int main(void)
     tcase_add_test(tc5, test_art_insert_delete);
     tcase_add_test(tc5, test_art_insert_iter);
     tcase_add_test(tc5, test_art_iter_prefix);
+    tcase_add_test(tc5, test_art_iter_after);
+    tcase_add_test(tc5, test_art_iter_after_words);
     tcase_add_test(tc5, test_art_insert_copy_delete);
 
+    // Add the hashmap tests
+    suite_add_tcase(s1, tc6);
+    tcase_add_test(tc6, test_hashmap_init_and_destroy);
+    tcase_add_test(tc6, test_hashmap_put_get);
+    tcase_add_test(tc6, test_hashmap_put_delete);
+    tcase_add_test(tc6, test_hashmap_insert_resize);
+    tcase_add_test(tc6, test_hashmap_iter);
+    tcase_add_test(tc6, test_hashmap_iter_from);
+
+    // Add the pack tests
+    suite_add_tcase(s1, tc7);
+    tcase_add_test(tc7, test_pack_disabled);
+    tcase_add_test(tc7, test_pack_alloc_reload);
+    tcase_add_test(tc7, test_pack_merge_free);
+    tcase_add_test(tc7, test_pack_new_arena);
+
+    // Add the handoff tests
+    suite_add_tcase(s1, tc8);
+    tcase_add_test(tc8, test_handoff_no_listener);
+    tcase_add_test(tc8, test_handoff_send_recv);
+    tcase_add_test(tc8, test_handoff_bad_request);
+
+    // Add the libbloomd tests
+    suite_add_tcase(s1, tc9);
+    tcase_set_timeout(tc9, 10);
+    tcase_add_test(tc9, test_libbloomd_set_check);
+    tcase_add_test(tc9, test_libbloomd_opts);
+    tcase_add_test(tc9, test_libbloomd_threads);
+    tcase_add_test(tc9, test_libbloomd_two_handles);
+
+    // Add the replication tests
+    suite_add_tcase(s1, tc10);
+    tcase_set_timeout(tc10, 20);
+    tcase_add_test(tc10, test_replication_stream);
+    tcase_add_test(tc10, test_replication_no_primary);
+
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
     srunner_free(sr);
@@ -325,6 +325,135 @@ START_TEST(test_art_iter_prefix)
 }
 END_TEST
 
+START_TEST(test_art_iter_after)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    char *keys[] = {"abc.123.456", "api", "api.foe.fum", "api.foo", "api.foo.bar", "api.foo.baz", "bar"};
+    for (int i=0; i < 7; i++) {
+        fail_unless(NULL == art_insert(&t, (unsigned char*)keys[i], strlen(keys[i])+1, NULL));
+    }
+
+    // Start after an existing key, including the NULL
+    prefix_data p = { 0, 3, keys+4 };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"api.foo", 8, test_prefix_cb, &p));
+    fail_unless(p.count == p.max_count, "Count: %d Max: %d", p.count, p.max_count);
+
+    // Start at a prefix, which sorts before its extensions
+    prefix_data p2 = { 0, 4, keys+3 };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"api.foo", 7, test_prefix_cb, &p2));
+    fail_unless(p2.count == p2.max_count, "Count: %d Max: %d", p2.count, p2.max_count);
+
+    // Start after a missing key
+    prefix_data p3 = { 0, 5, keys+2 };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"api.a", 6, test_prefix_cb, &p3));
+    fail_unless(p3.count == p3.max_count, "Count: %d Max: %d", p3.count, p3.max_count);
+
+    // Empty key visits everything
+    prefix_data p4 = { 0, 7, keys };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"", 0, test_prefix_cb, &p4));
+    fail_unless(p4.count == p4.max_count);
+
+    // Nothing after the last key
+    prefix_data p5 = { 0, 0, NULL };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"bar", 4, test_prefix_cb, &p5));
+    fail_unless(p5.count == 0);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    const unsigned char **keys;
+    uint32_t *lens;
+    uint64_t count;
+    uint64_t next;          // Index of the next expected key
+    uint64_t mismatches;
+} after_data;
+
+static int compare_art_keys(const unsigned char *a, uint32_t a_len, const unsigned char *b, uint32_t b_len) {
+    int res = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+    return (res) ? res : (int)a_len - (int)b_len;
+}
+
+// Records the keys of a full iteration, in order
+static int test_after_record_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)val;
+    after_data *a = data;
+    a->keys[a->count] = k;
+    a->lens[a->count++] = k_len;
+    return 0;
+}
+
+// Checks each key against the next one of the full iteration
+static int test_after_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)val;
+    after_data *a = data;
+    if (a->next == a->count || compare_art_keys(k, k_len, a->keys[a->next], a->lens[a->next]))
+        a->mismatches++;
+    a->next++;
+    return 0;
+}
+
+START_TEST(test_art_iter_after_words)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        art_insert(&t, (unsigned char*)buf, len, NULL);
+    }
+
+    // Record a single full iteration
+    uint64_t size = art_size(&t);
+    after_data all = { malloc(size * sizeof(char*)), malloc(size * sizeof(uint32_t)), 0, 0, 0 };
+    fail_unless(!art_iter(&t, test_after_record_cb, &all));
+    fail_unless(all.count == size);
+
+    // Resuming after every 1000th key should visit exactly
+    // the keys that the full iteration finds after it
+    rewind(f);
+    uint64_t line = 0;
+    while (fgets(buf, sizeof buf, f)) {
+        if (line++ % 1000) continue;
+        len = strlen(buf);
+        buf[len-1] = '\0';
+
+        // Find the key in the full iteration
+        uint64_t lo = 0, hi = all.count;
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if (compare_art_keys(all.keys[mid], all.lens[mid], (unsigned char*)buf, len) <= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        after_data resumed = all;
+        resumed.next = lo;
+        fail_unless(!art_iter_after(&t, (unsigned char*)buf, len, test_after_cb, &resumed));
+        fail_unless(resumed.mismatches == 0, "%s: %llu", buf, resumed.mismatches);
+        fail_unless(resumed.next == all.count, "%s: %llu %llu", buf, resumed.next, all.count);
+    }
+    fclose(f);
+    free(all.keys);
+    free(all.lens);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_art_insert_copy_delete)
 {
     art_tree t;
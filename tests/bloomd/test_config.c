@@ -27,6 +27,23 @@ START_TEST(test_config_get_default)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.use_reuseport == 0);
+    fail_unless(config.cpu_affinity == 0);
+    fail_unless(config.unix_socket == NULL);
+    fail_unless(config.shard_filters == 0);
+    fail_unless(config.io_threads == 0);
+    fail_unless(config.flush_threads == 1);
+    fail_unless(config.flush_rate == 0);
+    fail_unless(config.max_resident_bytes == 0);
+    fail_unless(config.compress_interval == 0);
+    fail_unless(config.pack_layer_size == 0);
+    fail_unless(config.pack_arena_size == 1073741824);
+    fail_unless(config.use_direct_io == 0);
+    fail_unless(config.handoff_socket == NULL);
+    fail_unless(config.warmup_threads == 1);
+    fail_unless(config.hotset_interval == 300);
+    fail_unless(config.replication_port == 0);
+    fail_unless(config.replicate_from == NULL);
 }
 END_TEST
 
@@ -100,6 +117,23 @@ probability_reduction = 0.8\n\
 data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
+use_reuseport = 1\n\
+cpu_affinity = 1\n\
+unix_socket = /tmp/bloomd.sock\n\
+shard_filters = 1\n\
+io_threads = 2\n\
+flush_threads = 4\n\
+flush_rate = 1048576\n\
+max_resident_bytes = 1073741824\n\
+compress_interval = 300\n\
+pack_layer_size = 1048576\n\
+pack_arena_size = 67108864\n\
+use_direct_io = 1\n\
+handoff_socket = /tmp/bloomd.handoff\n\
+warmup_threads = 3\n\
+hotset_interval = 60\n\
+replication_port = 8675\n\
+replicate_from = 10.0.0.1:8675\n\
 log_level = INFO\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
@@ -123,6 +157,23 @@ log_level = INFO\n";
     fail_unless(config.in_memory == 1);
     fail_unless(config.worker_threads == 2);
     fail_unless(config.use_mmap == 1);
+    fail_unless(config.use_reuseport == 1);
+    fail_unless(config.cpu_affinity == 1);
+    fail_unless(strcmp(config.unix_socket, "/tmp/bloomd.sock") == 0);
+    fail_unless(config.shard_filters == 1);
+    fail_unless(config.io_threads == 2);
+    fail_unless(config.flush_threads == 4);
+    fail_unless(config.flush_rate == 1048576);
+    fail_unless(config.max_resident_bytes == 1073741824);
+    fail_unless(config.compress_interval == 300);
+    fail_unless(config.pack_layer_size == 1048576);
+    fail_unless(config.pack_arena_size == 67108864);
+    fail_unless(config.use_direct_io == 1);
+    fail_unless(strcmp(config.handoff_socket, "/tmp/bloomd.handoff") == 0);
+    fail_unless(config.warmup_threads == 3);
+    fail_unless(config.hotset_interval == 60);
+    fail_unless(config.replication_port == 8675);
+    fail_unless(strcmp(config.replicate_from, "10.0.0.1:8675") == 0);
 
     unlink("/tmp/basic_config");
 }
@@ -285,6 +336,137 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_use_reuseport)
+{
+    fail_unless(sane_use_reuseport(-1) == 1);
+    fail_unless(sane_use_reuseport(0) == 0);
+    fail_unless(sane_use_reuseport(1) == 0);
+    fail_unless(sane_use_reuseport(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_cpu_affinity)
+{
+    fail_unless(sane_cpu_affinity(-1) == 1);
+    fail_unless(sane_cpu_affinity(0) == 0);
+    fail_unless(sane_cpu_affinity(1) == 0);
+    fail_unless(sane_cpu_affinity(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_unix_socket)
+{
+    char long_path[200];
+    memset(long_path, 'a', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    fail_unless(sane_unix_socket(NULL) == 0);
+    fail_unless(sane_unix_socket("/tmp/bloomd.sock") == 0);
+    fail_unless(sane_unix_socket("") == 1);
+    fail_unless(sane_unix_socket(long_path) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_handoff_socket)
+{
+    char long_path[200];
+    memset(long_path, 'a', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    fail_unless(sane_handoff_socket(NULL) == 0);
+    fail_unless(sane_handoff_socket("/tmp/bloomd.handoff") == 0);
+    fail_unless(sane_handoff_socket("") == 1);
+    fail_unless(sane_handoff_socket(long_path) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_warmup_threads)
+{
+    fail_unless(sane_warmup_threads(-1) == 1);
+    fail_unless(sane_warmup_threads(0) == 0);
+    fail_unless(sane_warmup_threads(4) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_hotset_interval)
+{
+    fail_unless(sane_hotset_interval(-1) == 1);
+    fail_unless(sane_hotset_interval(0) == 0);
+    fail_unless(sane_hotset_interval(300) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_replication_port)
+{
+    fail_unless(sane_replication_port(-1) == 1);
+    fail_unless(sane_replication_port(0) == 0);
+    fail_unless(sane_replication_port(8675) == 0);
+    fail_unless(sane_replication_port(65536) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_replicate_from)
+{
+    fail_unless(sane_replicate_from(NULL) == 0);
+    fail_unless(sane_replicate_from("localhost:8675") == 0);
+    fail_unless(sane_replicate_from("localhost") == 1);
+    fail_unless(sane_replicate_from(":8675") == 1);
+    fail_unless(sane_replicate_from("localhost:0") == 1);
+    fail_unless(sane_replicate_from("localhost:70000") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_shard_filters)
+{
+    fail_unless(sane_shard_filters(-1) == 1);
+    fail_unless(sane_shard_filters(0) == 0);
+    fail_unless(sane_shard_filters(1) == 0);
+    fail_unless(sane_shard_filters(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_io_threads)
+{
+    fail_unless(sane_io_threads(-1) == 1);
+    fail_unless(sane_io_threads(0) == 0);
+    fail_unless(sane_io_threads(1) == 0);
+    fail_unless(sane_io_threads(16) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_flush_threads)
+{
+    fail_unless(sane_flush_threads(-1) == 1);
+    fail_unless(sane_flush_threads(0) == 1);
+    fail_unless(sane_flush_threads(1) == 0);
+    fail_unless(sane_flush_threads(8) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_compress_interval)
+{
+    fail_unless(sane_compress_interval(-1) == 1);
+    fail_unless(sane_compress_interval(0) == 0);
+    fail_unless(sane_compress_interval(300) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_use_direct_io)
+{
+    fail_unless(sane_use_direct_io(-1) == 1);
+    fail_unless(sane_use_direct_io(0) == 0);
+    fail_unless(sane_use_direct_io(1) == 0);
+    fail_unless(sane_use_direct_io(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_pack_sizes)
+{
+    fail_unless(sane_pack_sizes(0, 0) == 0);
+    fail_unless(sane_pack_sizes(1048576, 1048576) == 1);
+    fail_unless(sane_pack_sizes(1048576, 2097152) == 0);
+    fail_unless(sane_pack_sizes(1048576, 1073741824) == 0);
+}
+END_TEST
+
 START_TEST(test_filter_config_bad_file)
 {
     bloom_filter_config config;
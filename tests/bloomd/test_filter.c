@@ -56,7 +56,7 @@ START_TEST(test_filter_init_destroy)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter", 0, &filter);
     fail_unless(res == 0);
 
     res = destroy_bloom_filter(filter);
@@ -71,7 +71,7 @@ START_TEST(test_filter_init_discover_destroy)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter", 1, &filter);
     fail_unless(res == 0);
     fail_unless(bloomf_is_proxied(filter) == 0);
 
@@ -88,7 +88,7 @@ START_TEST(test_filter_init_discover_delete)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter2", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter2", 1, &filter);
     fail_unless(res == 0);
     fail_unless(bloomf_is_proxied(filter) == 0);
 
@@ -108,7 +108,7 @@ START_TEST(test_filter_init_proxied)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter3", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter3", 0, &filter);
     fail_unless(res == 0);
 
     filter_counters *counters = bloomf_counters(filter);
@@ -137,7 +137,7 @@ START_TEST(test_filter_add_check)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter4", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter4", 0, &filter);
     fail_unless(res == 0);
 
     filter_counters *counters = bloomf_counters(filter);
@@ -177,7 +177,7 @@ START_TEST(test_filter_restore)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter5", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter5", 0, &filter);
     fail_unless(res == 0);
     filter_counters *counters = bloomf_counters(filter);
 
@@ -194,7 +194,7 @@ START_TEST(test_filter_restore)
     fail_unless(res == 0);
 
     // Remake the filter
-    res = init_bloom_filter(&config, "test_filter5", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter5", 1, &filter);
     fail_unless(res == 0);
     counters = bloomf_counters(filter);
 
@@ -226,7 +226,7 @@ START_TEST(test_filter_flush)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter6", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter6", 0, &filter);
     fail_unless(res == 0);
 
     // Check all the keys get added
@@ -247,7 +247,7 @@ START_TEST(test_filter_flush)
 
     // Remake the filter
     bloom_filter *filter2 = NULL;
-    res = init_bloom_filter(&config, "test_filter6", 1, &filter2);
+    res = init_bloom_filter(&config, NULL, "test_filter6", 1, &filter2);
     fail_unless(res == 0);
     filter_counters *counters2 = bloomf_counters(filter2);
 
@@ -284,7 +284,7 @@ START_TEST(test_filter_add_check_in_mem)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter7", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter7", 0, &filter);
     fail_unless(res == 0);
 
     filter_counters *counters = bloomf_counters(filter);
@@ -325,7 +325,7 @@ START_TEST(test_filter_grow)
     config.initial_capacity = 10000;
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter8", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter8", 1, &filter);
     fail_unless(res == 0);
 
     filter_counters *counters = bloomf_counters(filter);
@@ -362,7 +362,7 @@ START_TEST(test_filter_grow_restore)
     config.initial_capacity = 10000;
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter9", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter9", 1, &filter);
     fail_unless(res == 0);
 
     // Check all the keys get added
@@ -385,7 +385,7 @@ START_TEST(test_filter_grow_restore)
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/data.001.mmap", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/data.002.mmap", 0777) == 0);
 
-    res = init_bloom_filter(&config, "test_filter9", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter9", 1, &filter);
     fail_unless(res == 0);
 
     fail_unless(bloomf_size(filter) == size);
@@ -424,7 +424,7 @@ START_TEST(test_filter_restore_order)
     config.initial_capacity = 10000;
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter12", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter12", 1, &filter);
     fail_unless(res == 0);
 
     // Add enough keys so that there are 2 filters.
@@ -447,7 +447,7 @@ START_TEST(test_filter_restore_order)
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter12/data.000.mmap", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter12/data.001.mmap", 0777) == 0);
 
-    res = init_bloom_filter(&config, "test_filter12", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter12", 1, &filter);
     fail_unless(res == 0);
 
     fail_unless(bloomf_size(filter) == size);
@@ -478,7 +478,7 @@ START_TEST(test_filter_page_out)
     fail_unless(res == 0);
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter10", 0, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter10", 0, &filter);
     fail_unless(res == 0);
 
     filter_counters *counters = bloomf_counters(filter);
@@ -528,7 +528,7 @@ START_TEST(test_filter_bounded_fp)
     config.default_probability = 0.001; // 1/1K
 
     bloom_filter *filter = NULL;
-    res = init_bloom_filter(&config, "test_filter11", 1, &filter);
+    res = init_bloom_filter(&config, NULL, "test_filter11", 1, &filter);
     fail_unless(res == 0);
 
     // Check all the keys get added
@@ -557,3 +557,168 @@ START_TEST(test_filter_bounded_fp)
 }
 END_TEST
 
+
+START_TEST(test_filter_dirty_bytes)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, NULL, "test_filter12", 1, &filter);
+    fail_unless(res == 0);
+
+    // Nothing to write after the initial flush
+    fail_unless(bloomf_dirty_bytes(filter) == 0);
+
+    char buf[100];
+    for (int i=0;i<10;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t dirty = bloomf_dirty_bytes(filter);
+    fail_unless(dirty > 0);
+    fail_unless(dirty < bloomf_byte_size(filter));
+
+    fail_unless(bloomf_flush(filter) == 0);
+    fail_unless(bloomf_dirty_bytes(filter) == 0);
+
+    // Proxied filters have nothing to write
+    fail_unless(bloomf_close(filter) == 0);
+    fail_unless(bloomf_dirty_bytes(filter) == 0);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter12");
+}
+END_TEST
+
+START_TEST(test_filter_compress)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, NULL, "test_filter13", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<100;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // A sparse filter shrinks
+    uint64_t bytes = bloomf_byte_size(filter);
+    fail_unless(bloomf_resident_bytes(filter) == bytes);
+    res = bloomf_compress(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_is_compressed(filter) == 1);
+    fail_unless(bloomf_resident_bytes(filter) < bytes / 2);
+    fail_unless(bloomf_size(filter) == 100);
+    fail_unless(bloomf_compress(filter) == 1);
+
+    // Checking decompresses
+    for (int i=0;i<100;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_contains(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(bloomf_is_compressed(filter) == 0);
+    fail_unless(bloomf_resident_bytes(filter) == bytes);
+
+    // Compress again, and close while compressed
+    res = bloomf_compress(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter13");
+}
+END_TEST
+
+START_TEST(test_filter_compress_persistent)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, NULL, "test_filter14", 1, &filter);
+    fail_unless(res == 0);
+
+    // Only in-memory filters are compressed
+    res = bloomf_compress(filter);
+    fail_unless(res == 1);
+    fail_unless(bloomf_is_compressed(filter) == 0);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter14");
+}
+END_TEST
+
+START_TEST(test_filter_packed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.pack_layer_size = 1048576;
+    config.pack_arena_size = 4194304;
+
+    bloom_pack *pack = NULL;
+    res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, pack, "test_filter15", 1, &filter);
+    fail_unless(res == 0);
+
+    // Grow to a second layer
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(bloomf_flush(filter) == 0);
+
+    // The layers are in the pack, with no data files
+    bloom_pack_extent *exts;
+    int num;
+    pack_layers(pack, "test_filter15", &exts, &num);
+    fail_unless(num == 2);
+    free(exts);
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter15/data.000.mmap", &st) == -1);
+
+    // Reopen the pack and the filter
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(destroy_pack(pack) == 0);
+    res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, pack, "test_filter15", 1, &filter);
+    fail_unless(res == 0);
+
+    fail_unless(bloomf_size(filter) == 2000);
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_contains(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // Deleting frees the packed layers
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    pack_layers(pack, "test_filter15", &exts, &num);
+    fail_unless(num == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(destroy_pack(pack) == 0);
+    delete_dir("/tmp/bloomd/pack");
+}
+END_TEST
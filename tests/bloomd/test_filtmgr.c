@@ -402,6 +402,82 @@ START_TEST(test_mgr_unmap_add_keys)
 }
 END_TEST
 
+START_TEST(test_mgr_prefault)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_prefault_filter(mgr, "noop1");
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "zab10", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_unmap_filter(mgr, "zab10");
+    fail_unless(res == 0);
+    fail_unless(filtmgr_is_proxied(mgr, "zab10") == 1);
+
+    // Fault back in
+    res = filtmgr_prefault_filter(mgr, "zab10");
+    fail_unless(res == 0);
+    fail_unless(filtmgr_is_proxied(mgr, "zab10") == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab10");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_list_hot)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *mem_config = malloc(sizeof(bloom_config));
+    memcpy(mem_config, &config, sizeof(bloom_config));
+    mem_config->in_memory = 1;
+    fail_unless(filtmgr_create_filter(mgr, "hot1", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "hot2", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "hot3", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "hot4", mem_config) == 0);
+
+    // hot2 is accessed the most, hot3 is not in memory
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    fail_unless(filtmgr_set_keys(mgr, "hot2", (char**)&keys, 3, (char*)&result) == 0);
+    fail_unless(filtmgr_check_keys(mgr, "hot1", (char**)&keys, 1, (char*)&result) == 0);
+    fail_unless(filtmgr_unmap_filter(mgr, "hot3") == 0);
+
+    bloom_filter_list_head *head;
+    res = filtmgr_list_hot_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 2);
+    fail_unless(strcmp(head->head->filter_name, "hot2") == 0);
+    fail_unless(strcmp(head->tail->filter_name, "hot1") == 0);
+    filtmgr_cleanup_list(head);
+
+    for (int i=1; i <= 4; i++) {
+        char name[8];
+        snprintf(name, sizeof(name), "hot%d", i);
+        fail_unless(filtmgr_drop_filter(mgr, name) == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 /* Clear command */
 START_TEST(test_mgr_clear_no_filter)
 {
@@ -535,6 +611,60 @@ START_TEST(test_mgr_clear_reload)
 }
 END_TEST
 
+START_TEST(test_mgr_close_clear)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_close_clear_filter(mgr, "zab10");
+    fail_unless(res == -1);
+
+    bloom_config *in_mem = malloc(sizeof(bloom_config));
+    memcpy(in_mem, &config, sizeof(bloom_config));
+    in_mem->in_memory = 1;
+    res = filtmgr_create_filter(mgr, "zab11", in_mem);
+    fail_unless(res == 0);
+    res = filtmgr_close_clear_filter(mgr, "zab11");
+    fail_unless(res == -2);
+
+    // Cleared while still in memory
+    res = filtmgr_create_filter(mgr, "zab10", NULL);
+    fail_unless(res == 0);
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab10", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_is_proxied(mgr, "zab10") == 0);
+
+    res = filtmgr_close_clear_filter(mgr, "zab10");
+    fail_unless(res == 0);
+    fail_unless(filtmgr_is_proxied(mgr, "zab10") == -1);
+    filtmgr_vacuum(mgr);
+
+    // This should rediscover
+    res = filtmgr_create_filter(mgr, "zab10", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab10", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0]);
+    fail_unless(result[1]);
+    fail_unless(result[2]);
+
+    res = filtmgr_drop_filter(mgr, "zab10");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab11");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 /* List Cold */
 START_TEST(test_mgr_list_cold_no_filters)
 {
@@ -809,3 +939,507 @@ START_TEST(test_mgr_callback)
 }
 END_TEST
 
+
+START_TEST(test_mgr_is_proxied)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_is_proxied(mgr, "noop1");
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "proxy1", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_is_proxied(mgr, "proxy1");
+    fail_unless(res == 0);
+
+    res = filtmgr_unmap_filter(mgr, "proxy1");
+    fail_unless(res == 0);
+
+    res = filtmgr_is_proxied(mgr, "proxy1");
+    fail_unless(res == 1);
+
+    // Fault the filter back in
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    res = filtmgr_check_keys(mgr, "proxy1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_is_proxied(mgr, "proxy1");
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "proxy1");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_drop_create_vacuum)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+    filtmgr_client_checkpoint(mgr);
+
+    res = filtmgr_create_filter(mgr, "vac1", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "vac1");
+    fail_unless(res == 0);
+
+    // The vacuum thread should reclaim the filter
+    // soon after we are quiescent.
+    filtmgr_client_offline(mgr);
+    for (int i=0; i < 200; i++) {
+        res = filtmgr_create_filter(mgr, "vac1", NULL);
+        if (res != -3) break;
+        usleep(1000);
+    }
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "vac1");
+    fail_unless(res == 0);
+
+    filtmgr_client_leave(mgr);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_handle)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_filter_handle handle;
+    res = filtmgr_get_handle(mgr, "hdl1", &handle);
+    fail_unless(res == -1);
+    fail_unless(!filtmgr_handle_valid(mgr, &handle));
+
+    res = filtmgr_create_filter(mgr, "hdl1", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_get_handle(mgr, "hdl1", &handle);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_handle_valid(mgr, &handle));
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_handle_keys(mgr, &handle, (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    res = filtmgr_check_keys(mgr, "hdl1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    // Any change invalidates the handle
+    res = filtmgr_create_filter(mgr, "hdl2", NULL);
+    fail_unless(res == 0);
+    fail_unless(!filtmgr_handle_valid(mgr, &handle));
+
+    res = filtmgr_get_handle(mgr, "hdl1", &handle);
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "hdl1");
+    fail_unless(res == 0);
+    fail_unless(!filtmgr_handle_valid(mgr, &handle));
+
+    // The dropped filter is not usable
+    res = filtmgr_check_handle_keys(mgr, &handle, (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -1);
+    res = filtmgr_get_handle(mgr, "hdl1", &handle);
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "hdl2");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    int count;
+    int stop_at;
+    char *names[8];
+} iter_names;
+
+static int iter_names_cb(void *data, char *filter_name, bloom_filter *filter) {
+    iter_names *names = data;
+    fail_unless(strcmp(filter_name, filter->filter_name) == 0);
+    fail_unless(names->count < 8);
+    names->names[names->count++] = strdup(filter_name);
+    return names->count == names->stop_at;
+}
+
+static void iter_names_free(iter_names *names) {
+    for (int i=0; i < names->count; i++) free(names->names[i]);
+    names->count = 0;
+}
+
+START_TEST(test_mgr_iter_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *filters[] = {"bar1", "foo1", "foo2", "foo3", "zab"};
+    for (int i=0; i < 5; i++) {
+        res = filtmgr_create_filter(mgr, filters[i], NULL);
+        fail_unless(res == 0);
+    }
+
+    // All the filters, in order
+    iter_names names = {0, 0, {0}};
+    res = filtmgr_iter_filters(mgr, NULL, NULL, iter_names_cb, &names);
+    fail_unless(res == 0);
+    fail_unless(names.count == 5);
+    for (int i=0; i < 5; i++) fail_unless(strcmp(names.names[i], filters[i]) == 0);
+    iter_names_free(&names);
+
+    // A page of the prefix
+    names.stop_at = 2;
+    res = filtmgr_iter_filters(mgr, "foo", NULL, iter_names_cb, &names);
+    fail_unless(res == 1);
+    fail_unless(names.count == 2);
+    fail_unless(strcmp(names.names[1], "foo2") == 0);
+    iter_names_free(&names);
+
+    // Resume the prefix after the page
+    res = filtmgr_iter_filters(mgr, "foo", "foo2", iter_names_cb, &names);
+    fail_unless(res == 0);
+    fail_unless(names.count == 1);
+    fail_unless(strcmp(names.names[0], "foo3") == 0);
+    iter_names_free(&names);
+
+    // Resume after a missing name
+    names.stop_at = 0;
+    res = filtmgr_iter_filters(mgr, NULL, "foo", iter_names_cb, &names);
+    fail_unless(res == 0);
+    fail_unless(names.count == 4);
+    fail_unless(strcmp(names.names[0], "foo1") == 0);
+    iter_names_free(&names);
+
+    // Resume past the end of the prefix
+    res = filtmgr_iter_filters(mgr, "foo", "foo3", iter_names_cb, &names);
+    fail_unless(res == 0);
+    fail_unless(names.count == 0);
+
+    for (int i=0; i < 5; i++) {
+        res = filtmgr_drop_filter(mgr, filters[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_iter_cold_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *filters[] = {"zab8", "zab9", "zab10"};
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_create_filter(mgr, filters[i], NULL);
+        fail_unless(res == 0);
+    }
+    filtmgr_vacuum(mgr);
+
+    // New filters are hot
+    unsigned long long cursor = 0;
+    iter_names names = {0, 0, {0}};
+    res = filtmgr_iter_cold_filters(mgr, &cursor, iter_names_cb, &names);
+    fail_unless(res == 0);
+    fail_unless(names.count == 0);
+
+    // Keep one hot
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    res = filtmgr_set_keys(mgr, "zab9", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    // Scan one filter at a time
+    int calls = 0;
+    do {
+        names.stop_at = names.count + 1;
+        res = filtmgr_iter_cold_filters(mgr, &cursor, iter_names_cb, &names);
+        calls++;
+    } while (res);
+    fail_unless(names.count == 2);
+    fail_unless(calls == 3);
+    fail_unless(cursor == 0);
+    for (int i=0; i < names.count; i++) fail_unless(strcmp(names.names[i], "zab9"));
+    iter_names_free(&names);
+
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, filters[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_list_dirty)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "dirty1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "dirty2", NULL);
+    fail_unless(res == 0);
+
+    // New filters are already flushed
+    bloom_filter_list_head *head;
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    // Set keys in one, twice, it is only queued once
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "dirty1", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "dirty1", (char**)&keys+2, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "dirty1") == 0);
+    filtmgr_cleanup_list(head);
+
+    // Still dirty until flushed, so not queued again
+    res = filtmgr_set_keys(mgr, "dirty1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    // Keys that are already set do not dirty a flushed filter
+    res = filtmgr_flush_filter(mgr, "dirty1");
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "dirty1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(!result[0] && !result[1] && !result[2]);
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    // New keys do
+    char *new_keys[] = {"abc"};
+    res = filtmgr_set_keys(mgr, "dirty2", (char**)&new_keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "dirty2") == 0);
+    filtmgr_cleanup_list(head);
+
+    res = filtmgr_drop_filter(mgr, "dirty1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "dirty2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_max_resident)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Find the size of a filter
+    res = filtmgr_create_filter(mgr, "resident1", NULL);
+    fail_unless(res == 0);
+    uint64_t size = filtmgr_resident_bytes(mgr);
+    fail_unless(size > 0);
+
+    // Only room for two filters
+    config.max_resident_bytes = size * 2 + size / 2;
+    res = filtmgr_create_filter(mgr, "resident2", NULL);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_resident_bytes(mgr) == size * 2);
+    fail_unless(filtmgr_evictions(mgr) == 0);
+
+    // Creating a third evicts one
+    res = filtmgr_create_filter(mgr, "resident3", NULL);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_resident_bytes(mgr) == size * 2);
+    fail_unless(filtmgr_evictions(mgr) == 1);
+
+    // Find the evicted filter
+    char *names[] = {"resident1", "resident2", "resident3"};
+    char *evicted = NULL;
+    for (int i=0; i < 3; i++) {
+        if (filtmgr_is_proxied(mgr, names[i]) == 1) {
+            fail_unless(evicted == NULL);
+            evicted = names[i];
+        }
+    }
+    fail_unless(evicted != NULL);
+
+    // Faulting it back in evicts another
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    res = filtmgr_check_keys(mgr, evicted, (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_is_proxied(mgr, evicted) == 0);
+    fail_unless(filtmgr_resident_bytes(mgr) == size * 2);
+    fail_unless(filtmgr_evictions(mgr) == 2);
+
+    // Dropping releases the bytes
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    filtmgr_vacuum(mgr);
+    fail_unless(filtmgr_resident_bytes(mgr) == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_max_resident_in_memory)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Find the size of a filter
+    res = filtmgr_create_filter(mgr, "resident4", NULL);
+    fail_unless(res == 0);
+    uint64_t size = filtmgr_resident_bytes(mgr);
+    fail_unless(filtmgr_evictable_bytes(mgr) == size);
+
+    // An in-memory filter larger than the limit
+    config.max_resident_bytes = size + size / 2;
+    bloom_config *in_mem = malloc(sizeof(bloom_config));
+    memcpy(in_mem, &config, sizeof(bloom_config));
+    in_mem->in_memory = 1;
+    in_mem->initial_capacity *= 4;
+    res = filtmgr_create_filter(mgr, "resident5", in_mem);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_resident_bytes(mgr) > config.max_resident_bytes);
+    fail_unless(filtmgr_evictable_bytes(mgr) == size);
+
+    // Sets do not sweep, so the other filter is never evicted
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    for (int i=0; i < 1000; i++) {
+        res = filtmgr_set_keys(mgr, "resident5", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        res = filtmgr_set_keys(mgr, "resident4", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+    fail_unless(filtmgr_evictions(mgr) == 0);
+    fail_unless(filtmgr_is_proxied(mgr, "resident4") == 0);
+
+    // Dropping releases the bytes
+    res = filtmgr_drop_filter(mgr, "resident4");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "resident5");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    fail_unless(filtmgr_resident_bytes(mgr) == 0);
+    fail_unless(filtmgr_evictable_bytes(mgr) == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_compress_idle)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *in_mem = malloc(sizeof(bloom_config));
+    memcpy(in_mem, &config, sizeof(bloom_config));
+    in_mem->in_memory = 1;
+    res = filtmgr_create_filter(mgr, "idle1", in_mem);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "idle2", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "idle1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    uint64_t resident = filtmgr_resident_bytes(mgr);
+
+    // Used since the last sweep
+    fail_unless(filtmgr_compress_idle_filters(mgr) == 0);
+
+    // Only the in-memory filter is compressed
+    fail_unless(filtmgr_compress_idle_filters(mgr) == 1);
+    fail_unless(filtmgr_resident_bytes(mgr) < resident);
+    fail_unless(filtmgr_compress_idle_filters(mgr) == 0);
+
+    // Decompressed on access
+    res = filtmgr_check_keys(mgr, "idle1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    fail_unless(filtmgr_resident_bytes(mgr) == resident);
+
+    res = filtmgr_drop_filter(mgr, "idle1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "idle2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
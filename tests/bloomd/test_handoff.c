@@ -0,0 +1,91 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "handoff.h"
+
+typedef struct {
+    int fd;
+    bloom_handoff *handoff;
+    int res;
+} handoff_sender;
+
+static void* handoff_send_thread(void *in) {
+    handoff_sender *s = in;
+    s->res = handoff_send(s->fd, s->handoff);
+    return NULL;
+}
+
+START_TEST(test_handoff_no_listener)
+{
+    bloom_handoff *h = NULL;
+    unlink("/tmp/bloomd_handoff_none");
+    fail_unless(handoff_request("/tmp/bloomd_handoff_none", &h) == 1);
+    fail_unless(h == NULL);
+}
+END_TEST
+
+START_TEST(test_handoff_send_recv)
+{
+    int sock[2];
+    fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == 0);
+
+    // Pass the write ends of some pipes as the listeners
+    int pipes[4][2];
+    for (int i=0; i < 4; i++) fail_unless(pipe(pipes[i]) == 0);
+    int tcp_fds[] = {pipes[0][1], pipes[1][1]};
+    char *hot[] = {"foo", "bar.baz"};
+    bloom_handoff out = {2, tcp_fds, pipes[2][1], pipes[3][1], 2, hot};
+
+    handoff_sender s = {sock[0], &out, -1};
+    pthread_t t;
+    fail_unless(pthread_create(&t, NULL, handoff_send_thread, &s) == 0);
+
+    bloom_handoff *in = NULL;
+    fail_unless(handoff_recv(sock[1], &in) == 0);
+    pthread_join(t, NULL);
+    fail_unless(s.res == 0);
+
+    fail_unless(in->num_tcp == 2);
+    fail_unless(in->num_hot == 2);
+    fail_unless(strcmp(in->hot_filters[0], "foo") == 0);
+    fail_unless(strcmp(in->hot_filters[1], "bar.baz") == 0);
+
+    // The received descriptors refer to the same pipes
+    int received[] = {in->tcp_fds[0], in->tcp_fds[1], in->udp_fd, in->unix_fd};
+    for (int i=0; i < 4; i++) {
+        char c = 'a' + i, r = 0;
+        fail_unless(received[i] != pipes[i][1]);
+        fail_unless(write(received[i], &c, 1) == 1);
+        fail_unless(read(pipes[i][0], &r, 1) == 1);
+        fail_unless(r == c);
+        close(received[i]);
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    handoff_free(in);
+    close(sock[0]);
+    close(sock[1]);
+}
+END_TEST
+
+START_TEST(test_handoff_bad_request)
+{
+    int sock[2];
+    fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == 0);
+
+    // Nothing is sent for an invalid request
+    bloom_handoff out = {0, NULL, -1, -1, 0, NULL};
+    fail_unless(write(sock[1], "nope", 4) == 4);
+    fail_unless(handoff_send(sock[0], &out) == -1);
+
+    close(sock[0]);
+    char c;
+    fail_unless(read(sock[1], &c, 1) == 0);
+    close(sock[1]);
+}
+END_TEST
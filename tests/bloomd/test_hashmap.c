@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "hashmap.h"
+
+// The values are the keys themselves
+static const char* test_hashmap_key(void *value) {
+    return value;
+}
+
+static int test_hashmap_count_cb(void *data, void *value) {
+    (void)value;
+    (*(int*)data)++;
+    return 0;
+}
+
+START_TEST(test_hashmap_init_and_destroy)
+{
+    bloom_hashmap m;
+    int res = hashmap_init(&m, 16, test_hashmap_key);
+    fail_unless(res == 0);
+
+    fail_unless(hashmap_size(&m) == 0);
+
+    res = hashmap_destroy(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_hashmap_put_get)
+{
+    bloom_hashmap m;
+    hashmap_table *retired;
+    int res = hashmap_init(&m, 16, test_hashmap_key);
+    fail_unless(res == 0);
+
+    fail_unless(hashmap_get(&m, "foo") == NULL);
+    fail_unless(hashmap_put(&m, "foo", &retired) == 0);
+    fail_unless(retired == NULL);
+    fail_unless(hashmap_put(&m, "bar", &retired) == 0);
+    fail_unless(hashmap_size(&m) == 2);
+
+    fail_unless(strcmp(hashmap_get(&m, "foo"), "foo") == 0);
+    fail_unless(strcmp(hashmap_get(&m, "bar"), "bar") == 0);
+    fail_unless(hashmap_get(&m, "baz") == NULL);
+
+    // Duplicate keys are rejected
+    fail_unless(hashmap_put(&m, "foo", &retired) == -1);
+    fail_unless(hashmap_size(&m) == 2);
+
+    res = hashmap_destroy(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_hashmap_put_delete)
+{
+    bloom_hashmap m;
+    hashmap_table *retired;
+    int res = hashmap_init(&m, 16, test_hashmap_key);
+    fail_unless(res == 0);
+
+    fail_unless(hashmap_delete(&m, "foo") == NULL);
+    fail_unless(hashmap_put(&m, "foo", &retired) == 0);
+    fail_unless(hashmap_put(&m, "bar", &retired) == 0);
+
+    fail_unless(strcmp(hashmap_delete(&m, "foo"), "foo") == 0);
+    fail_unless(hashmap_size(&m) == 1);
+    fail_unless(hashmap_get(&m, "foo") == NULL);
+    fail_unless(strcmp(hashmap_get(&m, "bar"), "bar") == 0);
+    fail_unless(hashmap_delete(&m, "foo") == NULL);
+
+    // Re-insert over the deleted slot
+    fail_unless(hashmap_put(&m, "foo", &retired) == 0);
+    fail_unless(strcmp(hashmap_get(&m, "foo"), "foo") == 0);
+    fail_unless(hashmap_size(&m) == 2);
+
+    res = hashmap_destroy(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_hashmap_insert_resize)
+{
+    bloom_hashmap m;
+    hashmap_table *retired;
+    int res = hashmap_init(&m, 16, test_hashmap_key);
+    fail_unless(res == 0);
+
+    int len, retires = 0;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uint64_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(hashmap_put(&m, strdup(buf), &retired) == 0);
+        if (retired) {
+            hashmap_free_table(retired);
+            retires++;
+        }
+        fail_unless(hashmap_size(&m) == line);
+        line++;
+    }
+    fail_unless(retires > 0);
+
+    // Search for each word
+    fseek(f, 0, SEEK_SET);
+    char *val;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        val = hashmap_get(&m, buf);
+        fail_unless(val && strcmp(val, buf) == 0);
+    }
+
+    // Delete every word
+    fseek(f, 0, SEEK_SET);
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        val = hashmap_delete(&m, buf);
+        fail_unless(val && strcmp(val, buf) == 0);
+        free(val);
+        fail_unless(hashmap_get(&m, buf) == NULL);
+    }
+    fail_unless(hashmap_size(&m) == 0);
+    fclose(f);
+
+    res = hashmap_destroy(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_hashmap_iter)
+{
+    bloom_hashmap m;
+    hashmap_table *retired;
+    int res = hashmap_init(&m, 16, test_hashmap_key);
+    fail_unless(res == 0);
+
+    char *keys[] = {"abc", "abd", "xyz", "bloom", "filter"};
+    for (int i=0; i < 5; i++)
+        fail_unless(hashmap_put(&m, keys[i], &retired) == 0);
+    hashmap_delete(&m, "xyz");
+
+    int count = 0;
+    fail_unless(hashmap_iter(&m, test_hashmap_count_cb, &count) == 0);
+    fail_unless(count == 4);
+
+    res = hashmap_destroy(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int test_hashmap_stop_cb(void *data, void *value) {
+    (void)value;
+    (*(int*)data)++;
+    return 1;
+}
+
+START_TEST(test_hashmap_iter_from)
+{
+    bloom_hashmap m;
+    hashmap_table *retired;
+    int res = hashmap_init(&m, 16, test_hashmap_key);
+    fail_unless(res == 0);
+
+    char *keys[] = {"abc", "abd", "xyz", "bloom", "filter"};
+    for (int i=0; i < 5; i++)
+        fail_unless(hashmap_put(&m, keys[i], &retired) == 0);
+    hashmap_delete(&m, "xyz");
+
+    // Resume after each value until the scan completes
+    uint64_t cursor = 0;
+    int count = 0, calls = 0;
+    do {
+        res = hashmap_iter_from(&m, &cursor, test_hashmap_stop_cb, &count);
+        calls++;
+    } while (res);
+    fail_unless(count == 4);
+    fail_unless(calls == 5);
+    fail_unless(cursor == 0);
+
+    res = hashmap_destroy(&m);
+    fail_unless(res == 0);
+}
+END_TEST
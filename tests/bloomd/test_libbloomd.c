@@ -0,0 +1,177 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "libbloomd.h"
+#include "background.h"
+
+#define LIBBLOOMD_CONFIG "/tmp/bloomd_lib.cfg"
+#define LIBBLOOMD_DIR "/tmp/bloomd_lib"
+
+static void libbloomd_test_config() {
+    FILE *f = fopen(LIBBLOOMD_CONFIG, "w");
+    fprintf(f, "[bloomd]\ndata_dir = %s\nflush_interval = 1\n", LIBBLOOMD_DIR);
+    fclose(f);
+    mkdir(LIBBLOOMD_DIR, 0755);
+}
+
+static void libbloomd_test_cleanup() {
+    unlink(LIBBLOOMD_CONFIG);
+    rmdir(LIBBLOOMD_DIR);
+}
+
+START_TEST(test_libbloomd_set_check)
+{
+    libbloomd_test_config();
+    bloomd *db;
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, BLOOMD_BACKGROUND, &db) == BLOOMD_OK);
+
+    fail_unless(bloomd_create(db, "lib1", NULL) == BLOOMD_OK);
+    fail_unless(bloomd_create(db, "lib1", NULL) == BLOOMD_ERR_EXISTS);
+    fail_unless(bloomd_create(db, "bad name", NULL) == BLOOMD_ERR_BAD_ARGS);
+
+    fail_unless(bloomd_check(db, "lib1", "foo") == 0);
+    fail_unless(bloomd_set(db, "lib1", "foo") == 1);
+    fail_unless(bloomd_set(db, "lib1", "foo") == 0);
+    fail_unless(bloomd_check(db, "lib1", "foo") == 1);
+    fail_unless(bloomd_check(db, "nope", "foo") == BLOOMD_ERR_NO_FILTER);
+
+    char *keys[] = {"foo", "bar", "baz"};
+    char result[3];
+    fail_unless(bloomd_bulk(db, "lib1", keys, 3, result) == BLOOMD_OK);
+    fail_unless(result[0] == 0 && result[1] == 1 && result[2] == 1);
+    fail_unless(bloomd_multi(db, "lib1", keys, 3, result) == BLOOMD_OK);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 1);
+
+    // Survives closing the filter, and the handle
+    fail_unless(bloomd_flush(db, NULL) == BLOOMD_OK);
+    fail_unless(bloomd_close_filter(db, "lib1") == BLOOMD_OK);
+    fail_unless(bloomd_check(db, "lib1", "bar") == 1);
+    fail_unless(bloomd_close(db) == BLOOMD_OK);
+
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, 0, &db) == BLOOMD_OK);
+    fail_unless(bloomd_check(db, "lib1", "baz") == 1);
+    fail_unless(bloomd_drop(db, "lib1") == BLOOMD_OK);
+    fail_unless(bloomd_check(db, "lib1", "baz") == BLOOMD_ERR_NO_FILTER);
+    fail_unless(bloomd_close(db) == BLOOMD_OK);
+    libbloomd_test_cleanup();
+}
+END_TEST
+
+START_TEST(test_libbloomd_opts)
+{
+    libbloomd_test_config();
+    bloomd *db;
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, 0, &db) == BLOOMD_OK);
+
+    bloomd_filter_opts bad = {10, 0, 0};
+    fail_unless(bloomd_create(db, "lib2", &bad) == BLOOMD_ERR_BAD_ARGS);
+
+    bloomd_filter_opts opts = {20000, 0.001, 1};
+    fail_unless(bloomd_create(db, "lib2", &opts) == BLOOMD_OK);
+    fail_unless(bloomd_set(db, "lib2", "foo") == 1);
+    fail_unless(bloomd_close(db) == BLOOMD_OK);
+
+    // In-memory filters are not persisted
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, 0, &db) == BLOOMD_OK);
+    fail_unless(bloomd_check(db, "lib2", "foo") == 0);
+    fail_unless(bloomd_drop(db, "lib2") == BLOOMD_OK);
+    fail_unless(bloomd_close(db) == BLOOMD_OK);
+    libbloomd_test_cleanup();
+}
+END_TEST
+
+typedef struct {
+    bloomd *db;
+    int id;
+    int errors;
+} libbloomd_worker;
+
+static void* libbloomd_thread(void *in) {
+    libbloomd_worker *w = in;
+    char key[32];
+    for (int i=0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "%d-%d", w->id, i);
+        if (bloomd_set(w->db, "lib3", key) != 1) w->errors++;
+        if (bloomd_check(w->db, "lib3", key) != 1) w->errors++;
+    }
+    return NULL;
+}
+
+START_TEST(test_libbloomd_threads)
+{
+    libbloomd_test_config();
+    bloomd *db;
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, BLOOMD_BACKGROUND, &db) == BLOOMD_OK);
+    fail_unless(bloomd_create(db, "lib3", NULL) == BLOOMD_OK);
+
+    // Threads that exit without any cleanup, while
+    // filters are created and dropped
+    pthread_t threads[4];
+    libbloomd_worker workers[4];
+    for (int i=0; i < 4; i++) {
+        workers[i].db = db;
+        workers[i].id = i;
+        workers[i].errors = 0;
+        fail_unless(pthread_create(threads + i, NULL, libbloomd_thread, workers + i) == 0);
+    }
+    for (int i=0; i < 10; i++) {
+        int res;
+        while ((res = bloomd_create(db, "lib4", NULL)) == BLOOMD_ERR_DELETE_IN_PROGRESS) usleep(1000);
+        fail_unless(res == BLOOMD_OK);
+        fail_unless(bloomd_drop(db, "lib4") == BLOOMD_OK);
+    }
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        fail_unless(workers[i].errors == 0);
+    }
+
+    fail_unless(bloomd_drop(db, "lib3") == BLOOMD_OK);
+    fail_unless(bloomd_close(db) == BLOOMD_OK);
+    libbloomd_test_cleanup();
+}
+END_TEST
+
+START_TEST(test_libbloomd_two_handles)
+{
+    libbloomd_test_config();
+    FILE *f = fopen(LIBBLOOMD_CONFIG "2", "w");
+    fprintf(f, "[bloomd]\ndata_dir = %s2\nflush_interval = 1\n", LIBBLOOMD_DIR);
+    fclose(f);
+    mkdir(LIBBLOOMD_DIR "2", 0755);
+
+    // Each handle runs its own flush threads
+    bloomd *db1, *db2;
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, BLOOMD_BACKGROUND, &db1) == BLOOMD_OK);
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG "2", BLOOMD_BACKGROUND, &db2) == BLOOMD_OK);
+    fail_unless(bloomd_create(db1, "lib5", NULL) == BLOOMD_OK);
+    fail_unless(bloomd_create(db2, "lib6", NULL) == BLOOMD_OK);
+    fail_unless(bloomd_set(db1, "lib5", "foo") == 1);
+    fail_unless(bloomd_set(db2, "lib6", "bar") == 1);
+    usleep(1300000);
+
+    // Closing one leaves the other flushing
+    bloom_flush_stats before, after;
+    fail_unless(bloomd_close(db1) == BLOOMD_OK);
+    flush_scheduler_stats(&before);
+    fail_unless(bloomd_set(db2, "lib6", "baz") == 1);
+    usleep(1300000);
+    flush_scheduler_stats(&after);
+    fail_unless(after.flushes > before.flushes);
+    fail_unless(bloomd_check(db2, "lib6", "bar") == 1);
+    fail_unless(bloomd_drop(db2, "lib6") == BLOOMD_OK);
+    fail_unless(bloomd_close(db2) == BLOOMD_OK);
+
+    fail_unless(bloomd_open(LIBBLOOMD_CONFIG, 0, &db1) == BLOOMD_OK);
+    fail_unless(bloomd_check(db1, "lib5", "foo") == 1);
+    fail_unless(bloomd_drop(db1, "lib5") == BLOOMD_OK);
+    fail_unless(bloomd_close(db1) == BLOOMD_OK);
+    unlink(LIBBLOOMD_CONFIG "2");
+    rmdir(LIBBLOOMD_DIR "2");
+    libbloomd_test_cleanup();
+}
+END_TEST
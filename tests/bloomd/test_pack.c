@@ -0,0 +1,180 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "config.h"
+#include "pack.h"
+
+static void pack_test_config(bloom_config *config, uint64_t arena_size) {
+    int res = config_from_filename(NULL, config);
+    fail_unless(res == 0);
+    config->data_dir = "/tmp/bloomd_pack";
+    config->pack_layer_size = 65536;
+    config->pack_arena_size = arena_size;
+    mkdir(config->data_dir, 0755);
+}
+
+START_TEST(test_pack_disabled)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dir = "/tmp/bloomd_pack_disabled";
+    mkdir(config.data_dir, 0755);
+
+    // No pack unless enabled, or one exists
+    bloom_pack *pack = (bloom_pack*)1;
+    res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+    fail_unless(pack == NULL);
+    rmdir(config.data_dir);
+}
+END_TEST
+
+START_TEST(test_pack_alloc_reload)
+{
+    bloom_config config;
+    pack_test_config(&config, 1048576);
+
+    bloom_pack *pack = NULL;
+    int res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+    fail_unless(pack != NULL);
+
+    bloom_pack_extent foo0, foo1, bar0;
+    fail_unless(pack_alloc(pack, "foo", 0, 5000, &foo0) == 0);
+    fail_unless(pack_alloc(pack, "bar", 0, 4096, &bar0) == 0);
+    fail_unless(pack_alloc(pack, "foo", 1, 20000, &foo1) == 0);
+    fail_unless(foo0.offset % 4096 == 0);
+    fail_unless(foo0.offset + foo0.size <= bar0.offset);
+    fail_unless(bar0.offset + bar0.size <= foo1.offset);
+
+    // Write some data
+    char buf[100];
+    memset(buf, 'x', sizeof(buf));
+    fail_unless(pwrite(bar0.fileno, buf, sizeof(buf), bar0.offset) == sizeof(buf));
+    fail_unless(destroy_pack(pack) == 0);
+
+    // Reload
+    res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+    bloom_pack_extent *exts;
+    int num;
+    fail_unless(pack_layers(pack, "foo", &exts, &num) == 0);
+    fail_unless(num == 2);
+    fail_unless(exts[0].layer == 0 && exts[0].offset == foo0.offset && exts[0].size == 5000);
+    fail_unless(exts[1].layer == 1 && exts[1].offset == foo1.offset && exts[1].size == 20000);
+    free(exts);
+
+    fail_unless(pack_layers(pack, "bar", &exts, &num) == 0);
+    fail_unless(num == 1);
+    memset(buf, 0, sizeof(buf));
+    fail_unless(pread(exts[0].fileno, buf, sizeof(buf), exts[0].offset) == sizeof(buf));
+    fail_unless(buf[0] == 'x' && buf[99] == 'x');
+    free(exts);
+
+    fail_unless(pack_layers(pack, "baz", &exts, &num) == 0);
+    fail_unless(num == 0 && exts == NULL);
+
+    // Free foo, and the space is reused, zeroed
+    fail_unless(pack_free_filter(pack, "foo") == 0);
+    fail_unless(pack_layers(pack, "foo", &exts, &num) == 0);
+    fail_unless(num == 0);
+    bloom_pack_extent baz0;
+    fail_unless(pack_alloc(pack, "baz", 0, 4096, &baz0) == 0);
+    fail_unless(baz0.offset == foo0.offset);
+    fail_unless(destroy_pack(pack) == 0);
+
+    // The free space survives a reload
+    res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+    fail_unless(pack_layers(pack, "foo", &exts, &num) == 0);
+    fail_unless(num == 0);
+    fail_unless(pack_layers(pack, "baz", &exts, &num) == 0);
+    fail_unless(num == 1);
+    free(exts);
+    bloom_pack_extent qux0;
+    fail_unless(pack_alloc(pack, "qux", 0, 20000, &qux0) == 0);
+    fail_unless(qux0.offset == foo1.offset);
+    memset(buf, 1, sizeof(buf));
+    fail_unless(pread(qux0.fileno, buf, sizeof(buf), qux0.offset) == sizeof(buf));
+    for (int i=0; i < 100; i++) fail_unless(buf[i] == 0);
+    fail_unless(destroy_pack(pack) == 0);
+
+    delete_dir("/tmp/bloomd_pack/pack");
+    rmdir("/tmp/bloomd_pack");
+}
+END_TEST
+
+START_TEST(test_pack_merge_free)
+{
+    bloom_config config;
+    pack_test_config(&config, 1048576);
+
+    bloom_pack *pack = NULL;
+    int res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+
+    // Interleave two filters, and free one
+    bloom_pack_extent ext;
+    uint64_t first = 0;
+    for (int i=0; i < 4; i++) {
+        fail_unless(pack_alloc(pack, "foo", i, 4096, &ext) == 0);
+        if (i == 0) first = ext.offset;
+        fail_unless(pack_alloc(pack, "bar", i, 4096, &ext) == 0);
+    }
+    fail_unless(pack_free_filter(pack, "bar") == 0);
+    fail_unless(pack_free_filter(pack, "foo") == 0);
+
+    // All the freed extents merge into one
+    fail_unless(pack_alloc(pack, "baz", 0, 7*8192 - 4096, &ext) == 0);
+    fail_unless(ext.offset == first);
+    fail_unless(destroy_pack(pack) == 0);
+
+    delete_dir("/tmp/bloomd_pack/pack");
+    rmdir("/tmp/bloomd_pack");
+}
+END_TEST
+
+START_TEST(test_pack_new_arena)
+{
+    bloom_config config;
+    pack_test_config(&config, 65536);
+
+    bloom_pack *pack = NULL;
+    int res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+
+    // Too big for any arena
+    bloom_pack_extent ext1, ext2;
+    fail_unless(pack_alloc(pack, "foo", 0, 65536, &ext1) == -ENOSPC);
+
+    // Fills the first arena, then adds another
+    fail_unless(pack_alloc(pack, "foo", 0, 40000, &ext1) == 0);
+    fail_unless(pack_alloc(pack, "foo", 1, 40000, &ext2) == 0);
+    fail_unless(ext1.fileno != ext2.fileno);
+    fail_unless(destroy_pack(pack) == 0);
+
+    struct stat buf;
+    fail_unless(stat("/tmp/bloomd_pack/pack/arena.000", &buf) == 0);
+    fail_unless(stat("/tmp/bloomd_pack/pack/arena.001", &buf) == 0);
+    fail_unless(buf.st_size == 65536);
+
+    // Both arenas are loaded
+    res = init_pack(&config, &pack);
+    fail_unless(res == 0);
+    bloom_pack_extent *exts;
+    int num;
+    fail_unless(pack_layers(pack, "foo", &exts, &num) == 0);
+    fail_unless(num == 2);
+    free(exts);
+    fail_unless(destroy_pack(pack) == 0);
+
+    delete_dir("/tmp/bloomd_pack/pack");
+    rmdir("/tmp/bloomd_pack");
+}
+END_TEST
@@ -0,0 +1,127 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "replication.h"
+
+#define REPL_PRIMARY_DIR "/tmp/bloomd_repl_p"
+#define REPL_REPLICA_DIR "/tmp/bloomd_repl_r"
+
+/**
+ * Waits for a key to have the expected result on the
+ * replica, or -1 to wait for the filter to not exist.
+ */
+static int repl_wait_key(bloom_filtmgr *mgr, char *filter, char *key, int expect) {
+    for (int i=0; i < 500; i++) {
+        char result = 0;
+        filtmgr_client_checkpoint(mgr);
+        int res = filtmgr_check_keys(mgr, filter, &key, 1, &result);
+        filtmgr_client_offline(mgr);
+        if ((expect == -1 && res == -1) || (res == 0 && result == expect)) return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+static int repl_set_key(bloom_filtmgr *mgr, char *filter, char *key) {
+    char result = 0;
+    filtmgr_client_checkpoint(mgr);
+    int res = filtmgr_set_keys(mgr, filter, &key, 1, &result);
+    filtmgr_client_offline(mgr);
+    return (res) ? res : result;
+}
+
+START_TEST(test_replication_stream)
+{
+    int run = 1;
+    bloom_config pconfig, rconfig;
+    fail_unless(config_from_filename(NULL, &pconfig) == 0);
+    fail_unless(config_from_filename(NULL, &rconfig) == 0);
+    pconfig.data_dir = REPL_PRIMARY_DIR;
+    pconfig.replication_port = 18675;
+    rconfig.data_dir = REPL_REPLICA_DIR;
+    rconfig.replicate_from = "127.0.0.1:18675";
+    mkdir(REPL_PRIMARY_DIR, 0755);
+    mkdir(REPL_REPLICA_DIR, 0755);
+
+    // The replica should discard its own filters
+    mkdir(REPL_REPLICA_DIR "/bloomd.stale", 0755);
+
+    // Start the primary, with a persisted and an in-memory filter
+    bloom_replication *prepl, *rrepl;
+    bloom_filtmgr *pmgr, *rmgr;
+    fail_unless(init_replication(&pconfig, &run, &prepl) == 0);
+    fail_unless(init_filter_manager(&pconfig, 1, &pmgr) == 0);
+    fail_unless(start_replication(prepl, pmgr) == 0);
+
+    bloom_config *mem_config = malloc(sizeof(bloom_config));
+    memcpy(mem_config, &pconfig, sizeof(bloom_config));
+    mem_config->in_memory = 1;
+    filtmgr_client_checkpoint(pmgr);
+    fail_unless(filtmgr_create_filter(pmgr, "repl1", NULL) == 0);
+    fail_unless(filtmgr_create_filter(pmgr, "repl2", mem_config) == 0);
+    filtmgr_client_offline(pmgr);
+    fail_unless(repl_set_key(pmgr, "repl1", "foo") == 1);
+    fail_unless(repl_set_key(pmgr, "repl2", "bar") == 1);
+
+    // Bootstrap the replica
+    fail_unless(init_replication(&rconfig, &run, &rrepl) == 0);
+    fail_unless(init_filter_manager(&rconfig, 1, &rmgr) == 0);
+    fail_unless(start_replication(rrepl, rmgr) == 0);
+    fail_unless(repl_wait_key(rmgr, "repl1", "foo", 1));
+    fail_unless(repl_wait_key(rmgr, "repl2", "bar", 1));
+    fail_unless(repl_wait_key(rmgr, "repl1", "bar", 0));
+    fail_unless(repl_wait_key(rmgr, "stale", "foo", -1));
+
+    // Follow the changes
+    fail_unless(repl_set_key(pmgr, "repl1", "baz") == 1);
+    filtmgr_client_checkpoint(pmgr);
+    fail_unless(filtmgr_create_filter(pmgr, "repl3", NULL) == 0);
+    fail_unless(filtmgr_drop_filter(pmgr, "repl2") == 0);
+    filtmgr_client_offline(pmgr);
+    fail_unless(repl_set_key(pmgr, "repl3", "zip") == 1);
+
+    fail_unless(repl_wait_key(rmgr, "repl1", "baz", 1));
+    fail_unless(repl_wait_key(rmgr, "repl3", "zip", 1));
+    fail_unless(repl_wait_key(rmgr, "repl2", "bar", -1));
+
+    // Drop the rest, so the directories can be removed
+    filtmgr_client_checkpoint(pmgr);
+    fail_unless(filtmgr_drop_filter(pmgr, "repl1") == 0);
+    fail_unless(filtmgr_drop_filter(pmgr, "repl3") == 0);
+    filtmgr_client_offline(pmgr);
+    fail_unless(repl_wait_key(rmgr, "repl1", "foo", -1));
+    fail_unless(repl_wait_key(rmgr, "repl3", "zip", -1));
+
+    // Stopping the replica first does not stop the process
+    fail_unless(destroy_replication(rrepl) == 0);
+    fail_unless(destroy_filter_manager(rmgr) == 0);
+    fail_unless(destroy_replication(prepl) == 0);
+    filtmgr_client_leave(pmgr);
+    fail_unless(destroy_filter_manager(pmgr) == 0);
+    fail_unless(run == 1);
+    rmdir(REPL_PRIMARY_DIR);
+    rmdir(REPL_REPLICA_DIR);
+}
+END_TEST
+
+START_TEST(test_replication_no_primary)
+{
+    int run = 1;
+    bloom_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.data_dir = REPL_REPLICA_DIR;
+    config.replicate_from = "127.0.0.1:1";
+    mkdir(REPL_REPLICA_DIR, 0755);
+
+    bloom_replication *repl = NULL;
+    fail_unless(init_replication(&config, &run, &repl) == -1);
+    fail_unless(repl == NULL);
+    rmdir(REPL_REPLICA_DIR);
+}
+END_TEST
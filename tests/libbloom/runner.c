@@ -55,6 +55,13 @@ int main(void)
     tcase_add_test(tc1, close_does_flush);
     tcase_add_test(tc1, flush_does_write_persist);
     tcase_add_test(tc1, close_does_flush_persist);
+    tcase_add_test(tc1, dirty_bytes_persist);
+    tcase_add_test(tc1, dirty_bytes_shared_anonymous);
+    tcase_add_test(tc1, compress_anonymous);
+    tcase_add_test(tc1, compress_dense_or_persist);
+    tcase_add_test(tc1, extent_shared_file);
+    tcase_add_test(tc1, direct_io_persist);
+    tcase_add_test(tc1, prefetch_bitmap);
 
     // Add the bloom tests
     suite_add_tcase(s1, tc2);
@@ -101,6 +108,7 @@ int main(void)
     tcase_add_test(tc3, test_sbf_flush);
     tcase_add_test(tc3, test_sbf_close_does_flush);
     tcase_add_test(tc3, sbf_fp_prob);
+    tcase_add_test(tc3, test_sbf_compress_partial_failure);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -428,3 +429,199 @@ START_TEST(close_does_flush_persist) {
 }
 END_TEST
 
+START_TEST(dirty_bytes_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_dirty_bytes", 3*4096, 1, PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+
+    // The first page is always written
+    fail_unless(bitmap_dirty_bytes(&map) == 4096);
+
+    bitmap_setbit((&map), 2*4096*8);
+    fail_unless(bitmap_dirty_bytes(&map) == 2*4096);
+    bitmap_setbit((&map), 1);
+    fail_unless(bitmap_dirty_bytes(&map) == 2*4096);
+    bitmap_setbit((&map), 4096*8 + 7);
+    fail_unless(bitmap_dirty_bytes(&map) == 3*4096);
+
+    // Flushing cleans the pages
+    bitmap_flush(&map);
+    fail_unless(bitmap_dirty_bytes(&map) == 4096);
+
+    bitmap_close(&map);
+    unlink("/tmp/persist_dirty_bytes");
+}
+END_TEST
+
+START_TEST(dirty_bytes_shared_anonymous) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/shared_dirty_bytes", 3*4096, 1, SHARED, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(bitmap_dirty_bytes(&map) == 3*4096);
+    bitmap_close(&map);
+    unlink("/tmp/shared_dirty_bytes");
+
+    res = bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 1);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(compress_anonymous) {
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 8*4096 + 100, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 3);
+    bitmap_setbit((&map), 2*4096*8 + 17);
+    bitmap_setbit((&map), 8*4096*8 + 799);
+    memset(map.mmap + 5*4096, 0xff, 4096);
+
+    res = bitmap_compress(&map);
+    fail_unless(res == 0);
+    fail_unless(map.packed != NULL);
+    fail_unless(bitmap_resident_bytes(&map) < map.size / 2);
+
+    // The first page is left in place
+    fail_unless(bitmap_getbit((&map), 3) == 1);
+
+    res = bitmap_decompress(&map);
+    fail_unless(res == 0);
+    fail_unless(map.packed == NULL);
+    fail_unless(bitmap_resident_bytes(&map) == map.size);
+    for (uint64_t i=0; i < map.size * 8; i++) {
+        int set = (i == 3 || i == 2*4096*8 + 17 || i == 8*4096*8 + 799 ||
+                (i >= 5*4096*8 && i < 6*4096*8));
+        fail_unless(bitmap_getbit((&map), i) == set);
+    }
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(compress_dense_or_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 4*4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    memset(map.mmap, 0x11, 4*4096);
+
+    // Left as is, since it would not shrink
+    res = bitmap_compress(&map);
+    fail_unless(res == 1);
+    fail_unless(map.packed == NULL);
+    bitmap_close(&map);
+
+    res = bitmap_from_filename("/tmp/persist_compress", 4*4096, 1, PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(bitmap_compress(&map) == -EINVAL);
+    bitmap_close(&map);
+    unlink("/tmp/persist_compress");
+}
+END_TEST
+
+
+START_TEST(extent_shared_file) {
+    int fd = open("/tmp/persist_extents", O_RDWR|O_CREAT, 0777);
+    fail_unless(fd >= 0);
+    fail_unless(ftruncate(fd, 3*8192) == 0);
+
+    // Two bitmaps sharing a file, with a gap between
+    bloom_bitmap map1, map2;
+    fail_unless(bitmap_from_extent(fd, 0, 8192, PERSISTENT|NEW_BITMAP, &map1) == 0);
+    fail_unless(bitmap_from_extent(fd, 2*8192, 8192, PERSISTENT|NEW_BITMAP, &map2) == 0);
+    fail_unless(map1.is_extent && map2.offset == 2*8192);
+    memset(map1.mmap, 0x11, 8192);
+    memset(map2.mmap, 0x22, 8192);
+
+    // Mark both pages dirty, since we bypassed bitmap_setbit
+    map1.dirty_pages[0] = 0xC0;
+    map2.dirty_pages[0] = 0xC0;
+    fail_unless(bitmap_close(&map1) == 0);
+    fail_unless(bitmap_close(&map2) == 0);
+
+    // The file handle is borrowed, and must still be open
+    fail_unless(fcntl(fd, F_GETFD) != -1);
+
+    // Re-read the extents
+    fail_unless(bitmap_from_extent(fd, 0, 8192, PERSISTENT, &map1) == 0);
+    fail_unless(bitmap_from_extent(fd, 8192, 8192, PERSISTENT, &map2) == 0);
+    for (int i=0; i < 8192; i++) {
+        fail_unless(map1.mmap[i] == 0x11);
+        fail_unless(map2.mmap[i] == 0);
+    }
+    bitmap_close(&map2);
+    fail_unless(bitmap_from_extent(fd, 2*8192, 8192, PERSISTENT, &map2) == 0);
+    for (int i=0; i < 8192; i++) {
+        fail_unless(map2.mmap[i] == 0x22);
+    }
+    bitmap_close(&map1);
+    bitmap_close(&map2);
+    fail_unless(bitmap_from_extent(-1, 0, 8192, PERSISTENT|NEW_BITMAP, &map1) == -EINVAL);
+    close(fd);
+    unlink("/tmp/persist_extents");
+}
+END_TEST
+
+START_TEST(direct_io_persist) {
+    // Partial last page, which cannot be written directly
+    uint64_t len = 3*4096 + 100;
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_direct_io", len, 1,
+            PERSISTENT|DIRECT_IO, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(map.is_direct || map.drop_cache);
+    for (uint64_t idx = 0; idx < len*8; idx += 3) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(bitmap_flush(&map) == 0);
+    bitmap_setbit((&map), 1);
+    fail_unless(bitmap_close(&map) == 0);
+
+    struct stat buf;
+    fail_unless(stat("/tmp/persist_direct_io", &buf) == 0);
+    fail_unless((uint64_t)buf.st_size == len);
+
+    // Read back through the cache
+    res = bitmap_from_filename("/tmp/persist_direct_io", len, 0, PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(!map.is_direct && !map.drop_cache);
+    for (uint64_t idx = 0; idx < len*8; idx++) {
+        fail_unless(bitmap_getbit((&map), idx) == (idx % 3 == 0 || idx == 1));
+    }
+    bitmap_close(&map);
+
+    // Extents only drop the cached pages, since the file is shared
+    int fd = open("/tmp/persist_direct_io", O_RDWR);
+    res = bitmap_from_extent(fd, 4096, 8192, PERSISTENT|DIRECT_IO, &map);
+    fail_unless(res == 0);
+    fail_unless(!map.is_direct && map.drop_cache);
+    fail_unless(bitmap_getbit((&map), 0) == 0); // Bit 4096*8 of the file
+    fail_unless(bitmap_getbit((&map), 1) == 1);
+    bitmap_close(&map);
+    close(fd);
+    unlink("/tmp/persist_direct_io");
+}
+END_TEST
+
+START_TEST(prefetch_bitmap) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/shared_prefetch", 8*4096, 1, SHARED, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 4*4096*8 + 3);
+    fail_unless(bitmap_prefetch(&map) == 0);
+    fail_unless(bitmap_getbit((&map), 4*4096*8 + 3) == 1);
+    bitmap_close(&map);
+    unlink("/tmp/shared_prefetch");
+
+    // A no-op for the other modes
+    res = bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_prefetch(&map) == 0);
+    bitmap_close(&map);
+}
+END_TEST
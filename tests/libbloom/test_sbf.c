@@ -311,3 +311,37 @@ START_TEST(sbf_fp_prob)
 }
 END_TEST
 
+
+START_TEST(test_sbf_compress_partial_failure)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e4;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Fill the first layer, leaving the new one sparse
+    char buf[100];
+    for (int i=0;i<10010;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+
+    // The newest layer compresses, then the second one fails
+    bloom_bitmap *failing = sbf.filters[1]->map;
+    failing->mode = PERSISTENT;
+    res = sbf_compress(&sbf);
+    failing->mode = ANONYMOUS;
+    fail_unless(res == -EINVAL);
+
+    // The compressed layer was restored
+    fail_unless(sbf.filters[0]->map->packed == NULL);
+    for (int i=0;i<10010;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST